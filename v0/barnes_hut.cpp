@@ -0,0 +1,341 @@
+#ifndef BARNES_HUT_CPP
+#define BARNES_HUT_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define BARNES_HUT_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "octree.cpp"
+
+// class ----------------------------------------------------------------------------------------------
+
+// O(N log N) tree code. Bodies are sorted into an octree, every cell stores its mass, center of
+// mass and traceless quadrupole tensor, and the tree is walked once per small group of bodies,
+// accepting a cell as a whole when it is smaller than theta times its distance to the group.
+// Between two evaluations of every body the tree is kept and only its moments are refreshed, so
+// the substeps of block time steps do not rebuild it.
+class BarnesHutSolver : public ForceSolver {
+    public:
+        // opening angle, smaller is more accurate and slower
+        float theta = 0.5f;
+        // cells with at most this many bodies are not split further
+        unsigned int leaf_size = 16;
+        // bodies of a cell this small share one tree walk and interaction list
+        unsigned int group_size = 64;
+        // include the quadrupole term of accepted cells, monopole only when false
+        bool quadrupole = true;
+        SimdLevel simd_level;
+
+        Octree tree;
+
+    private:
+        // per worker scratch for evaluateGroup
+        struct InteractionLists {
+            std::vector<uint32_t> stack;
+            // sources seen by the group, particles and cell monopoles alike
+            AlignedArray<float> sx, sy, sz, sm;
+            size_t sources = 0;
+            // accepted cells whose quadrupole is added on top of their monopole
+            AlignedArray<float> cx, cy, cz, quad[6];
+            size_t cells = 0;
+            // the evaluated bodies of the group, their tree order index and their accelerations
+            AlignedArray<float> gx, gy, gz, gax, gay, gaz;
+            std::vector<uint32_t> group_order;
+
+            // The source and cell lists start small and double when full, a group sees a few
+            // thousand entries however large the tree is. A worker keeps its lists from group to
+            // group, so they stop growing after the first few.
+            void reset(size_t group_padded) {
+                AlignedArray<float>* group_arrays[] = {&gx, &gy, &gz, &gax, &gay, &gaz};
+                for (AlignedArray<float>* array : group_arrays) {
+                    array->resize(group_padded);
+                    std::memset((void*)array->data(), 0, group_padded * sizeof(float));
+                }
+                group_order.resize(group_padded);
+                stack.clear();
+                sources = 0;
+                cells = 0;
+            }
+            void addSource(float x, float y, float z, float mass) {
+                if (sources == sx.size()) {
+                    AlignedArray<float>* source_arrays[] = {&sx, &sy, &sz, &sm};
+                    for (AlignedArray<float>* array : source_arrays)
+                        array->resize(std::max<size_t>(1024, 2 * sources));
+                }
+                sx[sources] = x;
+                sy[sources] = y;
+                sz[sources] = z;
+                sm[sources] = mass;
+                sources++;
+            }
+            void addCell(const Octree::Node& cell) {
+                if (cells == cx.size()) {
+                    AlignedArray<float>* cell_arrays[] = {&cx, &cy, &cz, &quad[0], &quad[1], &quad[2], &quad[3], &quad[4], &quad[5]};
+                    for (AlignedArray<float>* array : cell_arrays)
+                        array->resize(std::max<size_t>(256, 2 * cells));
+                }
+                cx[cells] = cell.com.x;
+                cy[cells] = cell.com.y;
+                cz[cells] = cell.com.z;
+                for (int e = 0; e < 6; e++)
+                    quad[e][cells] = cell.quad[e];
+                cells++;
+            }
+            // zero mass entries up to the next multiple of BODY_PADDING, returns the padded count
+            size_t padSources() {
+                size_t padded = (sources + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+                for (size_t k = sources; k < padded; k++)
+                    addSource(0.0f, 0.0f, 0.0f, 0.0f);
+                sources = padded;
+                return padded;
+            }
+        };
+        std::vector<InteractionLists> worker_lists;
+        // the largest cells holding at most group_size bodies, found when the tree is built
+        std::vector<uint32_t> groups;
+        // 1 for the bodies to evaluate when only some are active, and the groups holding any of them
+        std::vector<uint8_t> active_mask;
+        std::vector<uint32_t> active_groups;
+
+    public:
+        BarnesHutSolver(float G = 1.0f, float softening = 0.05f, float theta = 0.5f, unsigned int leaf_size = 16) {
+            this->G = G;
+            this->softening = softening;
+            this->theta = theta;
+            this->leaf_size = leaf_size;
+            simd_level = detectSimdLevel();
+        }
+
+        const char* name() override { return "barnes-hut"; }
+
+        // builds a fresh tree and evaluates every body
+        void computeAccelerations(BodyStore* bodies) override {
+            bodies->clearAccelerations();
+            if (bodies->size() == 0)
+                return;
+            build(bodies);
+            evaluate(bodies, groups, nullptr);
+        }
+
+        // Block time step integrators evaluate every body once all of them are synchronized and
+        // subsets in between, so the tree is built at the full evaluations and reused by the
+        // substeps: their positions only update the moments of its cells. Only groups with active
+        // bodies are walked and only their active bodies go through the kernels.
+        void computeActiveAccelerations(BodyStore* bodies, const std::vector<uint32_t>& active) override {
+            if (active.size() == bodies->size() || tree.order.size() != bodies->size()) {
+                computeAccelerations(bodies);
+                return;
+            }
+            tree.refresh(bodies);
+            active_mask.assign(bodies->size(), 0);
+            for (uint32_t i : active)
+                active_mask[i] = 1;
+
+            const std::vector<Octree::Node>& nodes = tree.nodes;
+            active_groups.clear();
+            for (uint32_t c : groups) {
+                bool any = false;
+                for (uint32_t k = nodes[c].body_begin; k < nodes[c].body_begin + nodes[c].body_count && !any; k++)
+                    any = active_mask[tree.order[k]] != 0;
+                if (any)
+                    active_groups.push_back(c);
+            }
+            evaluate(bodies, active_groups, active_mask.data());
+        }
+
+    private:
+        void build(BodyStore* bodies) {
+            tree.leaf_size = leaf_size;
+            tree.build(bodies);
+            const std::vector<Octree::Node>& nodes = tree.nodes;
+
+            // groups are the largest cells holding at most group_size bodies
+            groups.clear();
+            std::vector<uint32_t> stack = {0};
+            while (!stack.empty()) {
+                uint32_t c = stack.back();
+                stack.pop_back();
+                if (nodes[c].child_count == 0 || nodes[c].body_count <= group_size) {
+                    groups.push_back(c);
+                    continue;
+                }
+                for (uint32_t child = nodes[c].first_child; child < nodes[c].first_child + nodes[c].child_count; child++)
+                    stack.push_back(child);
+            }
+        }
+
+        // the bodies of the given groups, all of them when active is nullptr
+        void evaluate(BodyStore* bodies, const std::vector<uint32_t>& walked, const uint8_t* active) {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            worker_lists.resize(workerCount());
+            parallelFor(walked.size(), [&](size_t begin, size_t end, unsigned int worker) {
+                for (size_t g = begin; g < end; g++)
+                    evaluateGroup(bodies, walked[g], active, kernels, &worker_lists[worker]);
+            }, 8);
+        }
+
+        // Bodies of one group cell share a single walk: cells that are far enough from the whole
+        // group go into the cell list, everything else is opened down to particles. Particles and
+        // cell monopoles then run through the SIMD direct kernel, the quadrupoles through their own.
+        // With an active mask only the active bodies of the group are evaluated.
+        void evaluateGroup(BodyStore* bodies, uint32_t group_cell, const uint8_t* active, GravityKernels kernels, InteractionLists* lists) const {
+            const std::vector<Octree::Node>& nodes = tree.nodes;
+            const AlignedArray<float>& tree_x = tree.tree_x;
+            const AlignedArray<float>& tree_y = tree.tree_y;
+            const AlignedArray<float>& tree_z = tree.tree_z;
+            const AlignedArray<float>& tree_m = tree.tree_m;
+            const Octree::Node& group = nodes[group_cell];
+            size_t padded = (group.body_count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+            lists->reset(padded);
+
+            // the walk is for the whole group, so the radius covers inactive bodies as well
+            uint32_t count = 0;
+            float group_radius = 0.0f;
+            for (uint32_t t = group.body_begin; t < group.body_begin + group.body_count; t++) {
+                group_radius = std::fmax(group_radius, glm::length(glm::vec3(tree_x[t], tree_y[t], tree_z[t]) - group.com));
+                if (active != nullptr && active[tree.order[t]] == 0)
+                    continue;
+                lists->group_order[count] = t;
+                lists->gx[count] = tree_x[t];
+                lists->gy[count] = tree_y[t];
+                lists->gz[count] = tree_z[t];
+                count++;
+            }
+            padded = (count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+
+            lists->stack.push_back(0);
+            while (!lists->stack.empty()) {
+                uint32_t c = lists->stack.back();
+                lists->stack.pop_back();
+                const Octree::Node& cell = nodes[c];
+
+                // bmax criterion, the whole group has to be outside bmax / theta
+                float distance = glm::length(cell.com - group.com);
+                if (distance > cell.bmax / theta + group_radius) {
+                    lists->addSource(cell.com.x, cell.com.y, cell.com.z, cell.mass);
+                    if (quadrupole)
+                        lists->addCell(cell);
+                } else if (cell.child_count == 0) {
+                    for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++)
+                        lists->addSource(tree_x[k], tree_y[k], tree_z[k], tree_m[k]);
+                } else {
+                    for (uint32_t child = cell.first_child; child < cell.first_child + cell.child_count; child++)
+                        lists->stack.push_back(child);
+                }
+            }
+            size_t sources = lists->padSources();
+
+            float eps2 = softening * softening;
+            kernels.tiled(lists->gx.data(), lists->gy.data(), lists->gz.data(), 0, padded,
+                          lists->sx.data(), lists->sy.data(), lists->sz.data(), lists->sm.data(), sources,
+                          eps2, lists->gax.data(), lists->gay.data(), lists->gaz.data());
+            const float* quad[6] = {lists->quad[0].data(), lists->quad[1].data(), lists->quad[2].data(),
+                                    lists->quad[3].data(), lists->quad[4].data(), lists->quad[5].data()};
+            kernels.quadrupoles(lists->gx.data(), lists->gy.data(), lists->gz.data(), 0, padded,
+                                lists->cx.data(), lists->cy.data(), lists->cz.data(), quad, lists->cells,
+                                eps2, lists->gax.data(), lists->gay.data(), lists->gaz.data());
+
+            for (uint32_t k = 0; k < count; k++) {
+                uint32_t i = tree.order[lists->group_order[k]];
+                bodies->acc_x[i] = G * lists->gax[k];
+                bodies->acc_y[i] = G * lists->gay[k];
+                bodies->acc_z[i] = G * lists->gaz[k];
+            }
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef BARNES_HUT_MAIN_CPP
+#include <chrono>
+#include <random>
+
+double relativeError(BodyStore* bodies, const std::vector<glm::vec3>& reference) {
+    double sum = 0.0;
+    for (size_t i = 0; i < bodies->size(); i++)
+        sum += glm::length(bodies->getAcceleration(i) - reference[i]) / glm::length(reference[i]);
+    return sum / bodies->size();
+}
+
+int main() {
+    const size_t n = 20000;
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    BodyStore bodies;
+    for (size_t i = 0; i < n; i++)
+        bodies.addBody(glm::vec3(normal(rng), normal(rng), normal(rng)), glm::vec3(0.0f), 1.0f / n);
+
+    DirectSolver direct = DirectSolver(1.0f, 0.01f);
+    direct.computeAccelerations(&bodies);
+    std::vector<glm::vec3> reference(n);
+    for (size_t i = 0; i < n; i++)
+        reference[i] = bodies.getAcceleration(i);
+
+    BarnesHutSolver tree = BarnesHutSolver(1.0f, 0.01f);
+    double last_error = 0.0;
+    float thetas[] = {0.3f, 0.5f, 0.8f};
+    for (float theta : thetas) {
+        tree.theta = theta;
+        tree.quadrupole = false;
+        tree.computeAccelerations(&bodies);
+        double monopole_error = relativeError(&bodies, reference);
+
+        tree.quadrupole = true;
+        auto start = std::chrono::steady_clock::now();
+        tree.computeAccelerations(&bodies);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double error = relativeError(&bodies, reference);
+
+        std::cout << "theta " << theta << ": " << ms << " ms, " << tree.tree.nodes.size() << " nodes, mean relative error "
+                  << error << " (monopole only " << monopole_error << ")" << std::endl;
+        if (error > monopole_error || error < last_error || error > 1e-2) {
+            std::cerr << "unexpected tree code accuracy" << std::endl;
+            return FAILURE;
+        }
+        last_error = error;
+    }
+
+    // substeps keep the tree: after a drift a subset is evaluated on refreshed cells, as accurately
+    // as with a fresh tree
+    tree.theta = 0.5f;
+    tree.computeAccelerations(&bodies);
+    std::vector<uint32_t> built_order = tree.tree.order;
+    for (size_t i = 0; i < n; i++)
+        bodies.setVelocity(i, 0.5f * glm::vec3(normal(rng), normal(rng), normal(rng)));
+    bodies.drift(0.1f);
+    std::vector<uint32_t> subset;
+    for (uint32_t i = 0; i < n; i += 5)
+        subset.push_back(i);
+    direct.computeAccelerations(&bodies);
+    for (size_t i = 0; i < n; i++)
+        reference[i] = bodies.getAcceleration(i);
+    tree.computeActiveAccelerations(&bodies, subset);
+    bool rebuilt = tree.tree.order != built_order;
+    double refreshed_error = 0.0;
+    for (uint32_t i : subset)
+        refreshed_error += glm::length(bodies.getAcceleration(i) - reference[i]) / glm::length(reference[i]) / subset.size();
+    tree.computeAccelerations(&bodies);
+    double rebuilt_error = relativeError(&bodies, reference);
+    std::cout << "after a drift: mean relative error " << refreshed_error << " on the refreshed tree, " << rebuilt_error
+              << " on a new one" << std::endl;
+    if (rebuilt || !(refreshed_error < 2.0 * rebuilt_error)) {
+        std::cerr << "refreshed tree is off" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
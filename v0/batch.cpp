@@ -0,0 +1,187 @@
+#ifndef MAIN_CPP
+#define MAIN_CPP
+
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "simulation.cpp"
+#include "scenario.cpp"
+
+// Headless runner for compute nodes and CI: loads a scenario, integrates it and streams the state
+// of the bodies as text, without a window, a GL context or any GLFW/glad code linked in.
+//
+// usage: orbit_sim_batch scenario [--steps N | --time T] [--step dt] [--solver name]
+//                                 [--integrator name] [--output path] [--every K] [--ephemeris interval]
+//
+// Every K steps (and after the last one) a block of "step time id x y z vx vy vz" lines goes to the
+// output, stdout unless a path is given. Progress, the throughput in body-steps per second and the
+// share of bodies active per force evaluation, below 100% only with block time steps, are reported
+// on stderr so they never mix with the data. Test particles of the scenario are integrated along with
+// the bodies, on Kepler orbits where the scenario allows it, and count towards the throughput, but
+// are not written out. With --ephemeris the trajectories are also fitted into Chebyshev segments of
+// the given length as they are integrated, and the size of the result is reported at the end.
+
+void printUsage() {
+    std::cerr << "usage: orbit_sim_batch scenario [--steps N | --time T] [--step dt] [--solver name] [--integrator name] [--output path] [--every K] [--ephemeris interval]" << std::endl;
+}
+
+void writeState(std::ostream& out, const BodyStore& bodies, uint64_t step, double time) {
+    char line[256];
+    for (size_t i = 0; i < bodies.size(); i++) {
+        int length = std::snprintf(line, sizeof(line), "%llu %.9g %llu %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                                   (unsigned long long)step, time, (unsigned long long)bodies.ids[i],
+                                   bodies.pos_x[i], bodies.pos_y[i], bodies.pos_z[i],
+                                   bodies.vel_x[i], bodies.vel_y[i], bodies.vel_z[i]);
+        out.write(line, length);
+    }
+    out.flush();
+}
+
+int main(int argc, char** argv) {
+    int error = SUCCESS;
+    std::string error_log = "";
+
+    if (argc < 2 || argv[1][0] == '-') {
+        printUsage();
+        return FAILURE;
+    }
+    Scenario scenario;
+    loadScenarioFile(argv[1], &scenario, &error, &error_log);
+    if (error != SUCCESS) {
+        std::cerr << error_log << std::endl;
+        return error;
+    }
+
+    std::string output_path = "";
+    uint64_t every = 0;
+    double ephemeris_interval = 0.0;
+    for (int a = 2; a < argc; a++) {
+        std::string option = argv[a];
+        if (a + 1 >= argc) {
+            printUsage();
+            return FAILURE;
+        }
+        std::string value = argv[++a];
+        if (option == "--steps") {
+            scenario.steps = std::strtoull(value.c_str(), nullptr, 10);
+            scenario.time = 0.0;
+        } else if (option == "--time") {
+            scenario.time = std::atof(value.c_str());
+            scenario.steps = 0;
+        } else if (option == "--step") {
+            scenario.step = (float)std::atof(value.c_str());
+        } else if (option == "--solver") {
+            scenario.solver = value;
+        } else if (option == "--integrator") {
+            scenario.integrator = value;
+        } else if (option == "--output") {
+            output_path = value;
+        } else if (option == "--every") {
+            every = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option == "--ephemeris") {
+            ephemeris_interval = std::atof(value.c_str());
+        } else {
+            printUsage();
+            return FAILURE;
+        }
+    }
+
+    uint64_t steps = scenario.steps;
+    if (steps == 0 && scenario.time > 0.0)
+        steps = (uint64_t)std::ceil(scenario.time / scenario.step - 1e-9);
+    if (steps == 0 || !(scenario.step > 0.0f) || scenario.bodies.size() == 0) {
+        std::cerr << "nothing to run, the scenario needs bodies, a step and a number of steps or a time" << std::endl;
+        return FAILURE;
+    }
+
+    std::unique_ptr<ForceSolver> solver = createSolver(scenario.solver, scenario.bodies.size(), scenario.G, scenario.softening);
+    if (solver == nullptr) {
+        std::cerr << "unknown solver: " << scenario.solver << std::endl;
+        return FAILURE;
+    }
+
+    std::unique_ptr<Integrator> integrator = createIntegrator(scenario.integrator);
+    if (integrator == nullptr) {
+        std::cerr << "unknown integrator: " << scenario.integrator << std::endl;
+        return FAILURE;
+    }
+
+    std::ofstream file;
+    if (output_path != "") {
+        file.open(output_path);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open output: " << output_path << std::endl;
+            return FAILURE;
+        }
+    }
+    std::ostream& out = output_path != "" ? file : std::cout;
+
+    Simulation simulation = Simulation(solver.get());
+    simulation.integrator = integrator.get();
+    simulation.bodies = scenario.bodies;
+    simulation.test_particles.particles = scenario.particles;
+    simulation.test_particles.kepler_threshold = scenario.kepler_threshold;
+    Collisions collisions;
+    collisions.G = scenario.G;
+    if (parseCollisionResponse(scenario.collisions, &collisions.response))
+        simulation.collisions = &collisions;
+    Ephemeris ephemeris = Ephemeris(ephemeris_interval > 0.0 ? ephemeris_interval : 1.0);
+    if (ephemeris_interval > 0.0)
+        simulation.ephemeris = &ephemeris;
+    size_t n = simulation.bodies.size();
+    // bodies and test particles moved per step, for the throughput
+    size_t moved = n + simulation.test_particles.size();
+    std::cerr << n << " bodies, " << scenario.particles.size() << " test particles, " << steps << " steps of " << scenario.step << " with the " << solver->name() << " solver and the "
+              << integrator->name() << " integrator on " << workerCount() << " workers" << std::endl;
+
+    out << "# step time id x y z vx vy vz\n";
+    if (every > 0)
+        writeState(out, simulation.bodies, 0, 0.0);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point last_report = start;
+    double stepping_seconds = 0.0;
+    double time = 0.0;
+    double active_sum = 0.0;
+    for (uint64_t s = 1; s <= steps; s++) {
+        Clock::time_point before = Clock::now();
+        simulation.step(scenario.step);
+        Clock::time_point after = Clock::now();
+        stepping_seconds += std::chrono::duration<double>(after - before).count();
+        time = s * (double)scenario.step;
+        active_sum += integrator->activeFraction();
+
+        if ((every > 0 && s % every == 0) || s == steps)
+            writeState(out, simulation.bodies, s, time);
+        if (std::chrono::duration<double>(after - last_report).count() > 1.0) {
+            std::cerr << "step " << s << "/" << steps << ", " << moved * s / stepping_seconds << " body-steps/s, "
+                      << integrator->activeFraction() * 100.0 << "% of the bodies active per force evaluation" << std::endl;
+            last_report = after;
+        }
+    }
+    double total_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cerr << "simulated " << time << " in " << total_seconds << " s: " << moved * steps / stepping_seconds
+              << " body-steps/s integrating, " << moved * steps / total_seconds << " including output, "
+              << active_sum / steps * 100.0 << "% of the bodies active per force evaluation on average" << std::endl;
+    if (simulation.collisions != nullptr)
+        std::cerr << collisions.merges << " merges, " << collisions.bounces << " bounces, " << collisions.fragmentations << " fragmentations, "
+                  << simulation.bodies.size() << " bodies left" << std::endl;
+    if (simulation.ephemeris != nullptr)
+        std::cerr << "ephemeris of " << ephemeris.segments() << " segments from " << ephemeris.startTime() << " to " << ephemeris.endTime()
+                  << ", " << ephemeris.bytes() << " bytes" << std::endl;
+    return SUCCESS;
+}
+
+#endif
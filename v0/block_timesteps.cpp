@@ -0,0 +1,277 @@
+#ifndef BLOCK_TIMESTEPS_CPP
+#define BLOCK_TIMESTEPS_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define BLOCK_TIMESTEPS_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+
+// finest level supported, steps are at least dt / 2^BLOCK_MAX_LEVEL and times within a step are
+// counted in ticks of that size
+#define BLOCK_MAX_LEVEL 24
+
+// class ----------------------------------------------------------------------------------------------
+
+// Kick-drift-kick leapfrog with individual, hierarchical time steps (Aarseth 1985, Makino 1991). The
+// step dt handed to step() is split into power-of-two levels: a body on level k takes steps of
+// dt / 2^k, aligned to multiples of its own length, so the bodies sharing a time form blocks. All
+// bodies drift together to the next time some of them are due, then only those due are kicked and
+// get their forces evaluated through ForceSolver::computeActiveAccelerations. A tight binary thus
+// costs its own many force evaluations instead of forcing them on every body.
+//
+// Each body picks its level from Aarseth's lowest order criterion dt_i = eta |a| / |da/dt|, with the
+// jerk differenced from its last two force evaluations, and with softening also from the
+// acceleration criterion dt_i = sqrt(2 eta softening / |a|). Levels may deepen at any time but only
+// rise by one, and only where the longer step starts on its own grid. At the end of step() every
+// body is synchronized again, so snapshots and output see one consistent time.
+class BlockTimestepIntegrator : public Integrator {
+    public:
+        // accuracy parameter of the step criteria
+        float eta = 0.02f;
+        // the finest level used, at most BLOCK_MAX_LEVEL
+        int max_level = 16;
+
+    private:
+        bool started = false;
+        // per body in store order: its level, its acceleration at the last evaluation and the one
+        // before, with the time between them, and the tick it is due next within the step
+        std::vector<uint8_t> levels;
+        std::vector<glm::vec3> acc, previous_acc;
+        std::vector<float> acc_gap;
+        std::vector<uint32_t> next_tick;
+        std::vector<uint32_t> active;
+        double active_fraction = 1.0;
+        uint32_t substep_count = 0;
+
+    public:
+        const char* name() override { return "block"; }
+
+        void reset() override { started = false; }
+
+        // bodies evaluated per substep as a fraction of all bodies, averaged over the last step
+        double activeFraction() override { return active_fraction; }
+
+        // substeps, that is force evaluations, taken by the last step
+        uint32_t substeps() const { return substep_count; }
+
+        int level(size_t i) const { return levels[i]; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            size_t n = bodies->size();
+            if (n == 0)
+                return;
+            int top = max_level < BLOCK_MAX_LEVEL ? max_level : BLOCK_MAX_LEVEL;
+            const uint32_t block = 1u << top;
+            const double tick_length = (double)dt / block;
+            if (!started || levels.size() != n)
+                start(bodies, solver, dt, top);
+
+            // all bodies are synchronized at the start, each opens its step with half a kick
+            parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t ticks = block >> levels[i];
+                    kick(bodies, i, acc[i], 0.5 * ticks * tick_length);
+                    next_tick[i] = ticks;
+                }
+            }, 1024);
+
+            uint32_t tick = 0;
+            uint64_t evaluated = 0;
+            substep_count = 0;
+            while (tick < block) {
+                uint32_t next = block;
+                for (size_t i = 0; i < n; i++)
+                    next = next_tick[i] < next ? next_tick[i] : next;
+                float drift_time = (float)((next - tick) * tick_length);
+                parallelFor(bodies->paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                    bodies->drift(drift_time, begin * BODY_PADDING, end * BODY_PADDING);
+                }, 64);
+                tick = next;
+
+                active.clear();
+                for (size_t i = 0; i < n; i++)
+                    if (next_tick[i] == tick)
+                        active.push_back((uint32_t)i);
+                solver->computeActiveAccelerations(bodies, active);
+                evaluated += active.size();
+                substep_count++;
+
+                // close the step of every active body, choose its next level and open the next one
+                parallelFor(active.size(), [&](size_t begin, size_t end, unsigned int) {
+                    for (size_t k = begin; k < end; k++) {
+                        uint32_t i = active[k];
+                        glm::vec3 a = bodies->getAcceleration(i);
+                        double length = (block >> levels[i]) * tick_length;
+                        kick(bodies, i, a, 0.5 * length);
+                        previous_acc[i] = acc[i];
+                        acc[i] = a;
+                        acc_gap[i] = (float)length;
+                        levels[i] = (uint8_t)chooseLevel(*bodies, solver->softening, i, dt, top, tick);
+                        if (tick < block) {
+                            uint32_t ticks = block >> levels[i];
+                            kick(bodies, i, a, 0.5 * ticks * tick_length);
+                            next_tick[i] = tick + ticks;
+                        }
+                    }
+                }, 256);
+            }
+            active_fraction = (double)evaluated / ((double)substep_count * n);
+        }
+
+    private:
+        void start(BodyStore* bodies, ForceSolver* solver, float dt, int top) {
+            size_t n = bodies->size();
+            solver->computeAccelerations(bodies);
+            levels.assign(n, 0);
+            acc.resize(n);
+            previous_acc.resize(n);
+            acc_gap.assign(n, 0.0f);
+            next_tick.assign(n, 0);
+            for (size_t i = 0; i < n; i++) {
+                acc[i] = bodies->getAcceleration(i);
+                previous_acc[i] = acc[i];
+                levels[i] = (uint8_t)chooseLevel(*bodies, solver->softening, i, dt, top, -1);
+            }
+            started = true;
+        }
+
+        static void kick(BodyStore* bodies, size_t i, glm::vec3 a, double dt) {
+            bodies->setVelocity(i, bodies->getVelocity(i) + a * (float)dt);
+        }
+
+        // level for the next step of body i starting at tick, any level for tick -1
+        int chooseLevel(const BodyStore& bodies, float softening, size_t i, float dt, int top, int64_t tick) const {
+            double a = glm::length(acc[i]);
+            double wanted = dt;
+            if (a > 0.0) {
+                double timescale;
+                double jerk = acc_gap[i] > 0.0f ? glm::length(acc[i] - previous_acc[i]) / acc_gap[i] : 0.0;
+                if (acc_gap[i] > 0.0f)
+                    timescale = jerk > 0.0 ? a / jerk : dt / eta;
+                else
+                    timescale = glm::length(bodies.getVelocity(i)) / a;
+                wanted = eta * timescale;
+                if (softening > 0.0f)
+                    wanted = std::fmin(wanted, std::sqrt(2.0 * eta * softening / a));
+            }
+            int level = 0;
+            while (level < top && dt / (double)(1u << level) > wanted)
+                level++;
+            if (tick < 0)
+                return level;
+
+            int old = levels[i];
+            if (level < old) {
+                uint32_t longer = (1u << top) >> (old - 1);
+                level = tick % longer == 0 ? old - 1 : old;
+            }
+            return level;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef BLOCK_TIMESTEPS_MAIN_CPP
+#include <chrono>
+#include <random>
+
+#include "barnes_hut.cpp"
+
+double totalEnergy(const BodyStore& bodies, double G, double softening) {
+    double energy = 0.0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        glm::dvec3 v = glm::dvec3(bodies.getVelocity(i));
+        energy += 0.5 * bodies.mass[i] * glm::dot(v, v);
+        for (size_t j = i + 1; j < bodies.size(); j++) {
+            glm::dvec3 d = glm::dvec3(bodies.getPosition(i) - bodies.getPosition(j));
+            energy -= G * bodies.mass[i] * bodies.mass[j] / std::sqrt(glm::dot(d, d) + softening * softening);
+        }
+    }
+    return energy;
+}
+
+int main() {
+    std::mt19937 rng(11);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    // a subset evaluates exactly as in the full evaluation
+    BodyStore cloud;
+    for (size_t i = 0; i < 5000; i++)
+        cloud.addBody(glm::vec3(normal(rng), normal(rng), normal(rng)), glm::vec3(0.0f), 1.0f / 5000);
+    std::vector<uint32_t> subset;
+    for (uint32_t i = 0; i < 5000; i += 7)
+        subset.push_back(i);
+    DirectSolver direct = DirectSolver(1.0f, 0.01f);
+    BarnesHutSolver tree = BarnesHutSolver(1.0f, 0.01f);
+    ForceSolver* solvers[] = {&direct, &tree};
+    for (ForceSolver* solver : solvers) {
+        solver->computeAccelerations(&cloud);
+        std::vector<glm::vec3> full(cloud.size());
+        for (size_t i = 0; i < cloud.size(); i++)
+            full[i] = cloud.getAcceleration(i);
+        cloud.clearAccelerations();
+        solver->computeActiveAccelerations(&cloud, subset);
+        double worst = 0.0;
+        for (uint32_t i : subset)
+            worst = std::fmax(worst, glm::length(cloud.getAcceleration(i) - full[i]) / glm::length(full[i]));
+        if (worst > 1e-5) {
+            std::cerr << solver->name() << " active subset differs from the full evaluation by " << worst << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // a cluster with one tight binary, the binary needs about 500 times shorter steps
+    const float softening = 0.001f;
+    BodyStore bodies;
+    for (size_t i = 0; i < 1000; i++)
+        bodies.addBody(glm::vec3(normal(rng), normal(rng), normal(rng)), 0.4f * glm::vec3(normal(rng), normal(rng), normal(rng)), 1.0f / 1000);
+    float binary_speed = std::sqrt(0.02f / 0.01f) * 0.5f;
+    bodies.addBody(glm::vec3(4.005f, 0.0f, 0.0f), glm::vec3(0.0f, binary_speed, 0.0f), 0.01f);
+    bodies.addBody(glm::vec3(3.995f, 0.0f, 0.0f), glm::vec3(0.0f, -binary_speed, 0.0f), 0.01f);
+
+    const float dt = 1.0f / 32.0f;
+    const int steps = 16;
+    for (ForceSolver* solver : solvers) {
+        solver->softening = softening;
+        BodyStore run = bodies;
+        BlockTimestepIntegrator integrator;
+        double start_energy = totalEnergy(run, 1.0, softening);
+        double fraction = 0.0;
+        uint32_t substeps = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++) {
+            integrator.step(&run, solver, dt);
+            fraction += integrator.activeFraction() / steps;
+            substeps = std::max(substeps, integrator.substeps());
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double energy_error = std::fabs(totalEnergy(run, 1.0, softening) / start_energy - 1.0);
+        glm::vec3 separation = run.getPosition(1000) - run.getPosition(1001);
+        std::cout << solver->name() << ": " << ms << " ms, up to " << substeps << " substeps per step, binary on level "
+                  << integrator.level(1000) << ", field body on level " << integrator.level(0) << ", active fraction "
+                  << fraction << ", energy error " << energy_error << ", binary separation " << glm::length(separation) << std::endl;
+        if (fraction > 0.05 || integrator.level(1000) < integrator.level(0) + 4) {
+            std::cerr << "the binary did not get steps of its own" << std::endl;
+            return FAILURE;
+        }
+        if (energy_error > 1e-3 || std::fabs(glm::length(separation) - 0.01f) > 0.002f) {
+            std::cerr << "block time steps did not keep the binary together" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
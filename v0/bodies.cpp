@@ -0,0 +1,402 @@
+#ifndef BODIES_CPP
+#define BODIES_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define BODIES_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#ifndef FAILURE
+#define FAILURE 1
+#define SUCCESS 0
+#endif
+
+// alignment of every hot array, one cache line / one AVX-512 register
+#define BODY_ALIGNMENT 64
+// arrays are padded to a multiple of this many floats with zero mass bodies,
+// so kernels can always load full vectors without a scalar tail
+#define BODY_PADDING 16
+
+// helpers ------------------------------------------------------------------------------------------
+
+template <typename T>
+struct ArrayView {
+    T* data;
+    size_t size;
+
+    T& operator[](size_t i) const { return data[i]; }
+    T* begin() const { return data; }
+    T* end() const { return data + size; }
+};
+
+// growable array whose storage is aligned to BODY_ALIGNMENT, only meant for trivially copyable T
+template <typename T>
+class AlignedArray {
+    private:
+        T* items = nullptr;
+        void* block = nullptr;
+        size_t count = 0;
+        size_t capacity = 0;
+
+    public:
+        AlignedArray() {}
+        AlignedArray(const AlignedArray& other) {
+            reserve(other.count);
+            count = other.count;
+            if (count > 0)
+                std::memcpy(items, other.items, count * sizeof(T));
+        }
+        AlignedArray& operator=(const AlignedArray& other) {
+            if (this != &other) {
+                count = 0;
+                reserve(other.count);
+                count = other.count;
+                if (count > 0)
+                    std::memcpy(items, other.items, count * sizeof(T));
+            }
+            return *this;
+        }
+        ~AlignedArray() {
+            std::free(block);
+        }
+
+        void reserve(size_t new_capacity) {
+            if (new_capacity <= capacity)
+                return;
+            // over-allocate and align by hand, aligned_alloc is missing on MinGW
+            void* new_block = std::malloc(new_capacity * sizeof(T) + BODY_ALIGNMENT);
+            T* new_items = (T*)(((uintptr_t)new_block + BODY_ALIGNMENT - 1) & ~(uintptr_t)(BODY_ALIGNMENT - 1));
+            if (count > 0)
+                std::memcpy(new_items, items, count * sizeof(T));
+            std::free(block);
+            block = new_block;
+            items = new_items;
+            capacity = new_capacity;
+        }
+
+        // new elements are zero filled
+        void resize(size_t new_count) {
+            if (new_count > capacity)
+                reserve(new_count > capacity * 2 ? new_count : capacity * 2);
+            if (new_count > count)
+                std::memset((void*)(items + count), 0, (new_count - count) * sizeof(T));
+            count = new_count;
+        }
+
+        T& operator[](size_t i) { return items[i]; }
+        const T& operator[](size_t i) const { return items[i]; }
+        T* data() { return items; }
+        const T* data() const { return items; }
+        size_t size() const { return count; }
+        ArrayView<T> view() { return {items, count}; }
+        ArrayView<const T> view() const { return {items, count}; }
+};
+
+// class --------------------------------------------------------------------------------------------
+
+// Structure-of-arrays storage for every simulated body. Each component is its own
+// aligned, zero padded float array, so force kernels can stream over them with SIMD
+// loads and the renderer can hand pos_x/pos_y/pos_z to glBufferSubData as they are.
+//
+// The arrays stay dense as bodies come and go: a removed body is replaced by the last one.
+// Callers hold on to bodies by handle instead of index, through a slot map. The low 32 bits of a
+// handle name a slot of the handle table, which knows the current index of the body, and the high
+// 32 bits the generation of that slot. A slot is reused once its body is gone, but with the next
+// generation, so handles to removed bodies never resolve again. Adding, removing and looking up
+// are all constant time without hashing.
+class BodyStore {
+    public:
+        typedef uint64_t BodyID;
+        static const size_t NO_INDEX = (size_t)-1;
+        static const BodyID NO_BODY = ~(BodyID)0;
+
+        AlignedArray<float> pos_x, pos_y, pos_z;
+        AlignedArray<float> vel_x, vel_y, vel_z;
+        AlignedArray<float> acc_x, acc_y, acc_z;
+        AlignedArray<float> mass;
+        // physical radius for collisions, 0 for point masses that never touch anything
+        AlignedArray<float> radius;
+
+        // index -> handle
+        std::vector<BodyID> ids;
+
+    private:
+        class Slot {
+            public:
+                // index of the body, FREE_SLOT while the slot waits for reuse
+                uint32_t index;
+                uint32_t generation;
+        };
+        static const uint32_t FREE_SLOT = ~(uint32_t)0;
+
+        size_t count = 0;
+        // handle table and the slots in it free for reuse
+        std::vector<Slot> slots;
+        std::vector<uint32_t> free_slots;
+
+        void resizeArrays(size_t padded) {
+            AlignedArray<float>* arrays[] = {&pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z, &acc_x, &acc_y, &acc_z, &mass, &radius};
+            for (AlignedArray<float>* array : arrays)
+                array->resize(padded);
+        }
+
+    public:
+        BodyStore() {}
+
+        // number of real bodies
+        size_t size() const { return count; }
+        // length of every array, a multiple of BODY_PADDING, the padding bodies have zero mass
+        size_t paddedSize() const { return pos_x.size(); }
+
+        void reserve(size_t n) {
+            size_t padded = (n + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+            AlignedArray<float>* arrays[] = {&pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z, &acc_x, &acc_y, &acc_z, &mass, &radius};
+            for (AlignedArray<float>* array : arrays)
+                array->reserve(padded);
+            ids.reserve(n);
+            slots.reserve(n);
+        }
+
+        static uint32_t slotOf(BodyID id) { return (uint32_t)id; }
+        static uint32_t generationOf(BodyID id) { return (uint32_t)(id >> 32); }
+
+        BodyID addBody(glm::vec3 pos, glm::vec3 vel = glm::vec3(0.0f), float body_mass = 1.0f, float body_radius = 0.0f) {
+            size_t i = count;
+            if (i + 1 > paddedSize())
+                resizeArrays(paddedSize() + BODY_PADDING);
+            count++;
+
+            setPosition(i, pos);
+            setVelocity(i, vel);
+            mass[i] = body_mass;
+            radius[i] = body_radius;
+
+            uint32_t slot = (uint32_t)slots.size();
+            if (free_slots.empty()) {
+                slots.push_back({0, 0});
+            } else {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            slots[slot].index = (uint32_t)i;
+            BodyID id = ((BodyID)slots[slot].generation << 32) | slot;
+            ids.push_back(id);
+            return id;
+        }
+
+        // Moves the last body into the slot of the removed one, so every other index stays put but
+        // the last. The freed slot turns into zero mass padding and whole blocks of padding are
+        // given back. Returns false for an unknown or stale handle.
+        bool removeBody(BodyID id) {
+            size_t i = indexOf(id);
+            if (i == NO_INDEX)
+                return false;
+            size_t last = count - 1;
+            AlignedArray<float>* arrays[] = {&pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z, &acc_x, &acc_y, &acc_z, &mass, &radius};
+            for (AlignedArray<float>* array : arrays) {
+                (*array)[i] = (*array)[last];
+                (*array)[last] = 0.0f;
+            }
+            Slot& freed = slots[slotOf(id)];
+            freed.index = FREE_SLOT;
+            freed.generation++;
+            free_slots.push_back(slotOf(id));
+            ids[i] = ids[last];
+            ids.pop_back();
+            if (i != last)
+                slots[slotOf(ids[i])].index = (uint32_t)i;
+            count--;
+
+            size_t padded = (count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+            if (padded < paddedSize())
+                resizeArrays(padded);
+            return true;
+        }
+
+        // index of the body behind a handle, NO_INDEX once it is removed
+        size_t indexOf(BodyID id) const {
+            uint32_t slot = slotOf(id);
+            if (slot >= slots.size() || slots[slot].generation != generationOf(id) || slots[slot].index == FREE_SLOT)
+                return NO_INDEX;
+            return slots[slot].index;
+        }
+
+        glm::vec3 getPosition(size_t i) const { return glm::vec3(pos_x[i], pos_y[i], pos_z[i]); }
+        glm::vec3 getVelocity(size_t i) const { return glm::vec3(vel_x[i], vel_y[i], vel_z[i]); }
+        glm::vec3 getAcceleration(size_t i) const { return glm::vec3(acc_x[i], acc_y[i], acc_z[i]); }
+
+        void setPosition(size_t i, glm::vec3 pos) {
+            pos_x[i] = pos.x;
+            pos_y[i] = pos.y;
+            pos_z[i] = pos.z;
+        }
+        void setVelocity(size_t i, glm::vec3 vel) {
+            vel_x[i] = vel.x;
+            vel_y[i] = vel.y;
+            vel_z[i] = vel.z;
+        }
+
+        // contiguous views over the padded arrays for kernels and buffer uploads
+        ArrayView<float> positionsX() { return pos_x.view(); }
+        ArrayView<float> positionsY() { return pos_y.view(); }
+        ArrayView<float> positionsZ() { return pos_z.view(); }
+        ArrayView<float> velocitiesX() { return vel_x.view(); }
+        ArrayView<float> velocitiesY() { return vel_y.view(); }
+        ArrayView<float> velocitiesZ() { return vel_z.view(); }
+        ArrayView<float> accelerationsX() { return acc_x.view(); }
+        ArrayView<float> accelerationsY() { return acc_y.view(); }
+        ArrayView<float> accelerationsZ() { return acc_z.view(); }
+        ArrayView<float> masses() { return mass.view(); }
+        ArrayView<float> radii() { return radius.view(); }
+
+        void clearAccelerations() {
+            size_t n = paddedSize();
+            std::memset((void*)acc_x.data(), 0, n * sizeof(float));
+            std::memset((void*)acc_y.data(), 0, n * sizeof(float));
+            std::memset((void*)acc_z.data(), 0, n * sizeof(float));
+        }
+
+        // v += a * dt over the whole padded range
+        void kick(float dt) {
+            kick(dt, 0, paddedSize());
+        }
+
+        // v += a * dt for [begin, end), so a step can be split across threads
+        void kick(float dt, size_t begin, size_t end) {
+            float* __restrict vx = vel_x.data();
+            float* __restrict vy = vel_y.data();
+            float* __restrict vz = vel_z.data();
+            const float* __restrict ax = acc_x.data();
+            const float* __restrict ay = acc_y.data();
+            const float* __restrict az = acc_z.data();
+            for (size_t i = begin; i < end; i++) {
+                vx[i] += ax[i] * dt;
+                vy[i] += ay[i] * dt;
+                vz[i] += az[i] * dt;
+            }
+        }
+
+        // x += v * dt over the whole padded range
+        void drift(float dt) {
+            drift(dt, 0, paddedSize());
+        }
+
+        // x += v * dt for [begin, end)
+        void drift(float dt, size_t begin, size_t end) {
+            float* __restrict px = pos_x.data();
+            float* __restrict py = pos_y.data();
+            float* __restrict pz = pos_z.data();
+            const float* __restrict vx = vel_x.data();
+            const float* __restrict vy = vel_y.data();
+            const float* __restrict vz = vel_z.data();
+            for (size_t i = begin; i < end; i++) {
+                px[i] += vx[i] * dt;
+                py[i] += vy[i] * dt;
+                pz[i] += vz[i] * dt;
+            }
+        }
+};
+
+// test ---------------------------------------------------------------------------------------------
+#ifdef BODIES_MAIN_CPP
+int main() {
+    BodyStore bodies;
+    for (int i = 0; i < 37; i++)
+        bodies.addBody(glm::vec3((float)i, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 2.0f);
+
+    if (bodies.size() != 37 || bodies.paddedSize() % BODY_PADDING != 0 || bodies.paddedSize() < 37) {
+        std::cerr << "wrong size after adding bodies" << std::endl;
+        return FAILURE;
+    }
+    if ((uintptr_t)bodies.pos_x.data() % BODY_ALIGNMENT != 0 || (uintptr_t)bodies.mass.data() % BODY_ALIGNMENT != 0) {
+        std::cerr << "arrays are not aligned" << std::endl;
+        return FAILURE;
+    }
+    for (size_t i = bodies.size(); i < bodies.paddedSize(); i++) {
+        if (bodies.mass[i] != 0.0f) {
+            std::cerr << "padding bodies must have zero mass" << std::endl;
+            return FAILURE;
+        }
+    }
+    if (bodies.indexOf(bodies.ids[20]) != 20 || bodies.indexOf(1000) != BodyStore::NO_INDEX) {
+        std::cerr << "id lookup failed" << std::endl;
+        return FAILURE;
+    }
+
+    // removal moves the last body into the hole and keeps the padding clean
+    BodyStore removal;
+    for (int i = 0; i < 17; i++)
+        removal.addBody(glm::vec3((float)i, 0.0f, 0.0f), glm::vec3(0.0f), 1.0f, 0.5f);
+    BodyStore::BodyID moved = removal.ids[16];
+    if (!removal.removeBody(removal.ids[4]) || removal.removeBody(1000) || removal.size() != 16 || removal.paddedSize() != 16) {
+        std::cerr << "removal gave the wrong size" << std::endl;
+        return FAILURE;
+    }
+    if (removal.indexOf(moved) != 4 || removal.pos_x[4] != 16.0f || removal.radius[4] != 0.5f || removal.indexOf(4) != BodyStore::NO_INDEX) {
+        std::cerr << "removal did not move the last body into the hole" << std::endl;
+        return FAILURE;
+    }
+    removal.removeBody(moved);
+    if (removal.mass[15] != 0.0f || removal.pos_x[15] != 0.0f || removal.indexOf(removal.ids[4]) != 4) {
+        std::cerr << "removal left a dirty padding slot" << std::endl;
+        return FAILURE;
+    }
+    // a reused slot hands out a new generation, the old handle stays dead
+    BodyStore::BodyID reused = removal.addBody(glm::vec3(0.0f));
+    if (BodyStore::slotOf(reused) != BodyStore::slotOf(moved) || reused == moved || removal.indexOf(moved) != BodyStore::NO_INDEX
+        || removal.indexOf(reused) != removal.size() - 1) {
+        std::cerr << "slot reuse did not bump the generation" << std::endl;
+        return FAILURE;
+    }
+
+    // churn: thousands of merges and spawns keep the arrays dense and every live handle valid
+    BodyStore churn;
+    std::vector<BodyStore::BodyID> live;
+    uint32_t state = 12345;
+    for (int round = 0; round < 20000; round++) {
+        state = state * 1664525u + 1013904223u;
+        if (live.size() < 100 || (state >> 16) % 2 == 0) {
+            live.push_back(churn.addBody(glm::vec3((float)round, 0.0f, 0.0f)));
+        } else {
+            size_t k = (state >> 8) % live.size();
+            churn.removeBody(live[k]);
+            live[k] = live.back();
+            live.pop_back();
+        }
+    }
+    if (churn.size() != live.size() || churn.paddedSize() - churn.size() >= BODY_PADDING) {
+        std::cerr << "churn left the store with the wrong size" << std::endl;
+        return FAILURE;
+    }
+    for (BodyStore::BodyID id : live) {
+        size_t i = churn.indexOf(id);
+        if (i == BodyStore::NO_INDEX || churn.ids[i] != id) {
+            std::cerr << "churn lost a live handle" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    bodies.clearAccelerations();
+    bodies.acc_x[3] = 1.0f;
+    bodies.kick(0.5f);
+    bodies.drift(2.0f);
+    glm::vec3 pos = bodies.getPosition(3);
+    if (pos.x != 4.0f || pos.y != 2.0f) {
+        std::cerr << "kick/drift gave wrong position" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,555 @@
+#ifndef COLLISIONS_CPP
+#define COLLISIONS_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define COLLISIONS_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <tuple>
+
+#include <glm/glm.hpp>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+
+// what happens to two bodies that touch
+enum CollisionResponse {
+    // one body of the summed mass and volume at the center of mass
+    COLLISION_MERGE,
+    // an impulse along the line of centers, scaled by the restitution
+    COLLISION_BOUNCE,
+    // equal fragments flying apart when the impact is fast enough, a merge otherwise
+    COLLISION_FRAGMENT
+};
+
+// helpers --------------------------------------------------------------------------------------------
+
+bool parseCollisionResponse(const std::string& name, CollisionResponse* response) {
+    if (name == "merge")
+        *response = COLLISION_MERGE;
+    else if (name == "bounce")
+        *response = COLLISION_BOUNCE;
+    else if (name == "fragment")
+        *response = COLLISION_FRAGMENT;
+    else
+        return false;
+    return true;
+}
+
+// two bodies, by index at the start of the step, that touch at fraction t of it
+class CollisionPair {
+    public:
+        uint32_t a;
+        uint32_t b;
+        float t;
+};
+
+// Earliest fraction of the step in [0, 1] at which two spheres touch whose separation moves
+// linearly from d0 to d1, 0 if they already overlap and -1 if they never get within r.
+float sweptContact(glm::vec3 d0, glm::vec3 d1, float r) {
+    double x0 = d0.x, y0 = d0.y, z0 = d0.z;
+    double dx = (double)d1.x - x0, dy = (double)d1.y - y0, dz = (double)d1.z - z0;
+    double c = x0 * x0 + y0 * y0 + z0 * z0 - (double)r * r;
+    if (c <= 0.0)
+        return 0.0f;
+    double a = dx * dx + dy * dy + dz * dz;
+    double half_b = x0 * dx + y0 * dy + z0 * dz;
+    // apart and not approaching
+    if (half_b >= 0.0 || a == 0.0)
+        return -1.0f;
+    double discriminant = half_b * half_b - a * c;
+    if (discriminant < 0.0)
+        return -1.0f;
+    double t = (-half_b - std::sqrt(discriminant)) / a;
+    return t <= 1.0 ? (float)t : -1.0f;
+}
+
+// spatial hash of integer cell coordinates (Teschner et al. 2003)
+inline uint32_t cellHash(int32_t x, int32_t y, int32_t z) {
+    return ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u);
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Finds and resolves contacts between bodies with a radius, once per step. begin() remembers the
+// positions before the step and resolve() sweeps every sphere from there to where the integrator
+// left it, so fast bodies cannot tunnel through each other between two steps.
+//
+// The broad phase is a uniform grid hashed into a table of twice as many buckets as entries and
+// rebuilt every step with a counting sort. Each body goes into every cell its swept box covers and
+// the cell size follows the mean swept box, so a body lands in a handful of cells and finding the
+// candidates stays linear in the number of bodies. Bodies far larger than the mean are kept out of
+// the grid and tested against everything instead, there are few of them. A pair sharing several
+// cells is only reported from the first one, the cell of the low corner of the overlap of their
+// boxes. The narrow phase solves for the first time of contact along the two linear paths.
+//
+// Contacts are resolved in the order they happen and a body takes part in at most one per step,
+// the integrator has to be reset after resolve() reports any.
+class Collisions {
+    public:
+        float G = 1.0f;
+        CollisionResponse response = COLLISION_MERGE;
+        // share of the approach speed kept by a bounce, 1 for elastic ones
+        float restitution = 0.5f;
+        // impacts faster than this many mutual escape speeds break up instead of merging
+        float fragment_speed = 2.0f;
+        int fragment_count = 8;
+        // impacts that would leave lighter fragments merge instead
+        float min_fragment_mass = 0.0f;
+
+        uint64_t merges = 0;
+        uint64_t bounces = 0;
+        uint64_t fragmentations = 0;
+        // pairs handed to the narrow phase by the last broad phase
+        size_t candidates = 0;
+
+    private:
+        class GridEntry {
+            public:
+                uint32_t body;
+                int32_t x, y, z;
+        };
+
+        // positions at begin(), by index
+        std::vector<glm::vec3> start;
+        // swept box of every body and its lowest cell
+        std::vector<glm::vec3> box_min, box_max;
+        std::vector<glm::ivec3> cell_min;
+        std::vector<uint32_t> colliders, large;
+        std::vector<GridEntry> entries, sorted;
+        std::vector<uint32_t> bucket_start;
+        // contacts and candidate counts per worker
+        std::vector<std::vector<CollisionPair>> found;
+        std::vector<size_t> found_candidates;
+        std::vector<CollisionPair> contacts;
+        std::vector<uint8_t> consumed;
+
+        // bodies spanning more cells than this along an axis are tested outside the grid
+        static const int MAX_CELL_SPAN = 8;
+
+        void test(const BodyStore& bodies, uint32_t a, uint32_t b, std::vector<CollisionPair>* out) {
+            glm::vec3 lo = glm::max(box_min[a], box_min[b]), hi = glm::min(box_max[a], box_max[b]);
+            if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z)
+                return;
+            glm::vec3 d0 = start[a] - start[b];
+            glm::vec3 d1 = bodies.getPosition(a) - bodies.getPosition(b);
+            float t = sweptContact(d0, d1, bodies.radius[a] + bodies.radius[b]);
+            if (t >= 0.0f)
+                out->push_back({std::min(a, b), std::max(a, b), t});
+        }
+
+        void merge(BodyStore* bodies, size_t i, size_t j) {
+            if (bodies->mass[j] > bodies->mass[i])
+                std::swap(i, j);
+            float mi = bodies->mass[i], mj = bodies->mass[j], total = mi + mj;
+            float w = total > 0.0f ? mj / total : 0.5f;
+            float ri = bodies->radius[i], rj = bodies->radius[j];
+            bodies->setPosition(i, bodies->getPosition(i) * (1.0f - w) + bodies->getPosition(j) * w);
+            bodies->setVelocity(i, bodies->getVelocity(i) * (1.0f - w) + bodies->getVelocity(j) * w);
+            bodies->mass[i] = total;
+            bodies->radius[i] = std::cbrt(ri * ri * ri + rj * rj * rj);
+            bodies->removeBody(bodies->ids[j]);
+            merges++;
+        }
+
+        // contact at fraction t of a step of dt, pa and pb the positions at contact
+        void bounce(BodyStore* bodies, size_t i, size_t j, glm::vec3 pa, glm::vec3 pb, float t, float dt) {
+            float mi = bodies->mass[i], mj = bodies->mass[j];
+            float wi = mi > 0.0f ? 1.0f / mi : 0.0f, wj = mj > 0.0f ? 1.0f / mj : 0.0f;
+            if (wi + wj == 0.0f)
+                wi = wj = 1.0f;
+            // infinitely heavy against massless, only the massless one moves
+            if (mi > 0.0f && mj == 0.0f)
+                wi = 0.0f, wj = 1.0f;
+            else if (mj > 0.0f && mi == 0.0f)
+                wi = 1.0f, wj = 0.0f;
+
+            glm::vec3 normal = pa - pb;
+            float length = glm::length(normal);
+            normal = length > 0.0f ? normal / length : glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::vec3 vi = bodies->getVelocity(i), vj = bodies->getVelocity(j);
+            float approach = glm::dot(vi - vj, normal);
+            if (approach < 0.0f) {
+                float impulse = -(1.0f + restitution) * approach / (wi + wj);
+                vi += normal * (impulse * wi);
+                vj -= normal * (impulse * wj);
+            }
+            glm::vec3 xi = pa + vi * ((1.0f - t) * dt), xj = pb + vj * ((1.0f - t) * dt);
+
+            // bodies that started the step overlapping are pushed apart to touch
+            float contact = bodies->radius[i] + bodies->radius[j];
+            float distance = glm::length(xi - xj);
+            if (distance < contact) {
+                glm::vec3 apart = distance > 0.0f ? (xi - xj) / distance : normal;
+                float overlap = contact - distance;
+                xi += apart * (overlap * wi / (wi + wj));
+                xj -= apart * (overlap * wj / (wi + wj));
+            }
+            bodies->setVelocity(i, vi);
+            bodies->setVelocity(j, vj);
+            bodies->setPosition(i, xi);
+            bodies->setPosition(j, xj);
+            bounces++;
+        }
+
+        // Breaks both bodies into fragment_count equal ones if the impact is fast enough, merges
+        // them otherwise. The fragments start on a sphere around the center of mass, fly out
+        // radially and keep the kinetic energy of the impact in excess of the escape energy.
+        void fragment(BodyStore* bodies, size_t i, size_t j) {
+            float mi = bodies->mass[i], mj = bodies->mass[j], total = mi + mj;
+            float ri = bodies->radius[i], rj = bodies->radius[j];
+            int k = fragment_count;
+            float speed = glm::length(bodies->getVelocity(i) - bodies->getVelocity(j));
+            float escape = total > 0.0f ? std::sqrt(2.0f * G * total / (ri + rj)) : 0.0f;
+            if (k < 2 || !(total > 0.0f) || speed <= fragment_speed * escape || total / k < min_fragment_mass) {
+                merge(bodies, i, j);
+                return;
+            }
+
+            glm::vec3 center = (bodies->getPosition(i) * mi + bodies->getPosition(j) * mj) / total;
+            glm::vec3 drift = (bodies->getVelocity(i) * mi + bodies->getVelocity(j) * mj) / total;
+            float merged_radius = std::cbrt(ri * ri * ri + rj * rj * rj);
+            float piece_radius = merged_radius / std::cbrt((float)k);
+            // far enough out that neighbouring fragments do not touch
+            float distance = std::max(merged_radius + piece_radius, 2.4f * piece_radius * std::sqrt(k / 12.566370614359172f));
+            float reduced = mi * mj / total;
+            float outward = std::sqrt(std::max(speed * speed - escape * escape, 0.0f) * reduced / total);
+
+            // directions on a Fibonacci sphere, less their mean so momentum is kept
+            std::vector<glm::vec3> directions(k);
+            glm::vec3 mean = glm::vec3(0.0f);
+            for (int f = 0; f < k; f++) {
+                float z = 1.0f - (2.0f * f + 1.0f) / k;
+                float s = std::sqrt(std::max(1.0f - z * z, 0.0f));
+                float phi = 2.399963229728653f * f;
+                directions[f] = glm::vec3(s * std::cos(phi), s * std::sin(phi), z);
+                mean += directions[f] / (float)k;
+            }
+            BodyStore::BodyID id_i = bodies->ids[i], id_j = bodies->ids[j];
+            bodies->removeBody(id_i);
+            bodies->removeBody(id_j);
+            for (int f = 0; f < k; f++) {
+                glm::vec3 direction = directions[f] - mean;
+                bodies->addBody(center + direction * distance, drift + direction * outward, total / k, piece_radius);
+            }
+            fragmentations++;
+        }
+
+    public:
+        Collisions() {}
+
+        // remembers where the bodies are before the step
+        void begin(const BodyStore& bodies) {
+            start.resize(bodies.size());
+            for (size_t i = 0; i < bodies.size(); i++)
+                start[i] = bodies.getPosition(i);
+        }
+
+        // Every pair of bodies with a radius whose spheres touch during the step, sorted by the time
+        // of contact. Bodies added since begin() are treated as if they had not moved.
+        const std::vector<CollisionPair>& findContacts(const BodyStore& bodies) {
+            size_t n = bodies.size();
+            for (size_t i = start.size(); i < n; i++)
+                start.push_back(bodies.getPosition(i));
+            start.resize(n);
+            contacts.clear();
+            candidates = 0;
+
+            box_min.resize(n);
+            box_max.resize(n);
+            cell_min.resize(n);
+            colliders.clear();
+            double extent = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                float r = bodies.radius[i];
+                if (!(r > 0.0f))
+                    continue;
+                glm::vec3 now = bodies.getPosition(i);
+                box_min[i] = glm::min(start[i], now) - glm::vec3(r);
+                box_max[i] = glm::max(start[i], now) + glm::vec3(r);
+                glm::vec3 size = box_max[i] - box_min[i];
+                extent += std::max(size.x, std::max(size.y, size.z));
+                colliders.push_back((uint32_t)i);
+            }
+            if (colliders.size() < 2)
+                return contacts;
+
+            // cells twice the mean swept box, a typical body covers one to eight of them
+            float cell = (float)(2.0 * extent / colliders.size());
+            float inverse = 1.0f / cell;
+            entries.clear();
+            large.clear();
+            for (uint32_t i : colliders) {
+                glm::ivec3 lo = glm::ivec3(glm::floor(box_min[i] * inverse));
+                glm::ivec3 hi = glm::ivec3(glm::floor(box_max[i] * inverse));
+                cell_min[i] = lo;
+                if (hi.x - lo.x >= MAX_CELL_SPAN || hi.y - lo.y >= MAX_CELL_SPAN || hi.z - lo.z >= MAX_CELL_SPAN) {
+                    large.push_back(i);
+                    continue;
+                }
+                for (int32_t x = lo.x; x <= hi.x; x++)
+                    for (int32_t y = lo.y; y <= hi.y; y++)
+                        for (int32_t z = lo.z; z <= hi.z; z++)
+                            entries.push_back({i, x, y, z});
+            }
+
+            // counting sort of the entries by bucket
+            size_t buckets = 1;
+            while (buckets < 2 * entries.size())
+                buckets *= 2;
+            uint32_t mask = (uint32_t)(buckets - 1);
+            bucket_start.assign(buckets + 1, 0);
+            for (const GridEntry& e : entries)
+                bucket_start[(cellHash(e.x, e.y, e.z) & mask) + 1]++;
+            for (size_t b = 0; b < buckets; b++)
+                bucket_start[b + 1] += bucket_start[b];
+            sorted.resize(entries.size());
+            for (const GridEntry& e : entries)
+                sorted[bucket_start[cellHash(e.x, e.y, e.z) & mask]++] = e;
+            // the scatter moved every start to the next bucket
+            for (size_t b = buckets; b > 0; b--)
+                bucket_start[b] = bucket_start[b - 1];
+            bucket_start[0] = 0;
+
+            found.resize(workerCount());
+            found_candidates.assign(workerCount(), 0);
+            for (std::vector<CollisionPair>& list : found)
+                list.clear();
+            parallelFor(buckets, [&](size_t begin, size_t end, unsigned int worker) {
+                std::vector<CollisionPair>* out = &found[worker];
+                size_t tested = 0;
+                for (size_t b = begin; b < end; b++) {
+                    for (uint32_t p = bucket_start[b]; p < bucket_start[b + 1]; p++) {
+                        const GridEntry& e = sorted[p];
+                        for (uint32_t q = p + 1; q < bucket_start[b + 1]; q++) {
+                            const GridEntry& f = sorted[q];
+                            // other cells hashed into the same bucket
+                            if (e.x != f.x || e.y != f.y || e.z != f.z || e.body == f.body)
+                                continue;
+                            glm::ivec3 first = glm::max(cell_min[e.body], cell_min[f.body]);
+                            if (first.x != e.x || first.y != e.y || first.z != e.z)
+                                continue;
+                            tested++;
+                            test(bodies, e.body, f.body, out);
+                        }
+                    }
+                }
+                found_candidates[worker] += tested;
+            }, 1024);
+
+            // the large bodies against everything, each pair of them once
+            std::vector<CollisionPair>* out = &found[0];
+            for (size_t l = 0; l < large.size(); l++) {
+                uint32_t a = large[l];
+                for (uint32_t b : colliders) {
+                    bool b_large = std::binary_search(large.begin(), large.end(), b);
+                    if (b == a || (b_large && b < a))
+                        continue;
+                    candidates++;
+                    test(bodies, a, b, out);
+                }
+            }
+
+            for (size_t w = 0; w < found.size(); w++) {
+                candidates += found_candidates[w];
+                contacts.insert(contacts.end(), found[w].begin(), found[w].end());
+            }
+            std::sort(contacts.begin(), contacts.end(), [](const CollisionPair& x, const CollisionPair& y) {
+                return std::tie(x.t, x.a, x.b) < std::tie(y.t, y.a, y.b);
+            });
+            return contacts;
+        }
+
+        // Resolves the contacts of a step of dt that ended at the current positions, earliest first.
+        // Returns how many were resolved, the bodies may have been added, removed and moved.
+        size_t resolve(BodyStore* bodies, float dt) {
+            findContacts(*bodies);
+            size_t n = bodies->size();
+            consumed.assign(n, 0);
+            // indices change as bodies get removed, so contacts are looked up by id
+            std::vector<BodyStore::BodyID> ids = std::vector<BodyStore::BodyID>(bodies->ids.begin(), bodies->ids.end());
+            size_t events = 0;
+            for (const CollisionPair& contact : contacts) {
+                if (consumed[contact.a] || consumed[contact.b])
+                    continue;
+                consumed[contact.a] = consumed[contact.b] = 1;
+                size_t i = bodies->indexOf(ids[contact.a]), j = bodies->indexOf(ids[contact.b]);
+                if (response == COLLISION_BOUNCE) {
+                    glm::vec3 pa = start[contact.a] + (bodies->getPosition(i) - start[contact.a]) * contact.t;
+                    glm::vec3 pb = start[contact.b] + (bodies->getPosition(j) - start[contact.b]) * contact.t;
+                    bounce(bodies, i, j, pa, pb, contact.t, dt);
+                } else if (response == COLLISION_FRAGMENT) {
+                    fragment(bodies, i, j);
+                } else {
+                    merge(bodies, i, j);
+                }
+                events++;
+            }
+            return events;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef COLLISIONS_MAIN_CPP
+
+// n bodies of random radius moving randomly in a box sized for a fixed density
+void randomCloud(BodyStore* bodies, size_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    float side = std::cbrt((float)n) * 4.0f;
+    std::uniform_real_distribution<float> place(0.0f, side), move(-1.0f, 1.0f), size(0.2f, 0.6f);
+    for (size_t i = 0; i < n; i++)
+        bodies->addBody(glm::vec3(place(rng), place(rng), place(rng)), glm::vec3(move(rng), move(rng), move(rng)), 1.0f, size(rng));
+}
+
+glm::vec3 totalMomentum(const BodyStore& bodies) {
+    glm::vec3 p = glm::vec3(0.0f);
+    for (size_t i = 0; i < bodies.size(); i++)
+        p += bodies.getVelocity(i) * bodies.mass[i];
+    return p;
+}
+
+float totalMass(const BodyStore& bodies) {
+    float m = 0.0f;
+    for (size_t i = 0; i < bodies.size(); i++)
+        m += bodies.mass[i];
+    return m;
+}
+
+int main() {
+    // the grid finds exactly the pairs a test of every pair finds
+    {
+        BodyStore bodies;
+        randomCloud(&bodies, 3000, 1);
+        // one big body the grid has to leave out
+        bodies.addBody(glm::vec3(20.0f), glm::vec3(0.0f), 100.0f, 12.0f);
+        Collisions collisions;
+        collisions.begin(bodies);
+        bodies.drift(1.5f);
+        std::vector<CollisionPair> grid = collisions.findContacts(bodies);
+
+        std::vector<glm::vec3> before(bodies.size());
+        for (size_t i = 0; i < bodies.size(); i++)
+            before[i] = bodies.getPosition(i) - bodies.getVelocity(i) * 1.5f;
+        std::vector<CollisionPair> brute;
+        for (uint32_t a = 0; a < bodies.size(); a++) {
+            for (uint32_t b = a + 1; b < bodies.size(); b++) {
+                float t = sweptContact(before[a] - before[b], bodies.getPosition(a) - bodies.getPosition(b), bodies.radius[a] + bodies.radius[b]);
+                if (t >= 0.0f)
+                    brute.push_back({a, b, t});
+            }
+        }
+        auto order = [](const CollisionPair& x, const CollisionPair& y) { return std::tie(x.a, x.b) < std::tie(y.a, y.b); };
+        std::sort(grid.begin(), grid.end(), order);
+        std::sort(brute.begin(), brute.end(), order);
+        bool same = grid.size() == brute.size();
+        for (size_t c = 0; same && c < grid.size(); c++)
+            same = grid[c].a == brute[c].a && grid[c].b == brute[c].b;
+        std::cout << grid.size() << " contacts from " << collisions.candidates << " candidates, " << brute.size() << " testing every pair" << std::endl;
+        if (!same || grid.size() == 0) {
+            std::cerr << "grid contacts differ from testing every pair" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // the broad phase grows linearly with the bodies at a fixed density
+    {
+        double per_body[2];
+        size_t sizes[2] = {20000, 320000};
+        for (int s = 0; s < 2; s++) {
+            BodyStore bodies;
+            randomCloud(&bodies, sizes[s], 2);
+            Collisions collisions;
+            collisions.begin(bodies);
+            bodies.drift(0.1f);
+            collisions.findContacts(bodies);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            const int rounds = 3;
+            for (int r = 0; r < rounds; r++)
+                collisions.findContacts(bodies);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            per_body[s] = seconds / rounds / sizes[s];
+            std::cout << sizes[s] << " bodies: " << per_body[s] * 1e9 << " ns per body, " << collisions.candidates << " candidates" << std::endl;
+        }
+        // sixteen times the bodies, well below sixteen times the cost per body
+        if (!(per_body[1] < 4.0 * per_body[0])) {
+            std::cerr << "broad phase does not scale linearly" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // head on impacts under each response
+    CollisionResponse responses[] = {COLLISION_MERGE, COLLISION_BOUNCE, COLLISION_FRAGMENT};
+    for (CollisionResponse response : responses) {
+        BodyStore bodies;
+        bodies.addBody(glm::vec3(-1.0f, 0.1f, 0.0f), glm::vec3(10.0f, 0.0f, 0.0f), 2.0f, 0.5f);
+        bodies.addBody(glm::vec3(1.0f, -0.1f, 0.0f), glm::vec3(-10.0f, 0.0f, 0.0f), 1.0f, 0.5f);
+        glm::vec3 momentum = totalMomentum(bodies);
+        Collisions collisions;
+        collisions.response = response;
+        collisions.restitution = 1.0f;
+        collisions.begin(bodies);
+        // a step long enough to pass straight through each other
+        bodies.drift(0.2f);
+        size_t events = collisions.resolve(&bodies, 0.2f);
+        float momentum_error = glm::length(totalMomentum(bodies) - momentum) / glm::length(momentum);
+        float mass_error = std::fabs(totalMass(bodies) - 3.0f);
+        std::cout << "response " << response << ": " << bodies.size() << " bodies, momentum error " << momentum_error << std::endl;
+        if (events != 1 || !(momentum_error < 1e-5f) || !(mass_error < 1e-5f)) {
+            std::cerr << "impact not resolved or did not keep momentum and mass" << std::endl;
+            return FAILURE;
+        }
+        if (response == COLLISION_MERGE && (bodies.size() != 1 || bodies.ids[0] != 0 || !(std::fabs(bodies.radius[0] - std::cbrt(0.25f)) < 1e-6f))) {
+            std::cerr << "merge did not keep the heavier body with the summed volume" << std::endl;
+            return FAILURE;
+        }
+        if (response == COLLISION_BOUNCE) {
+            // elastic, the bodies separate and keep their energy
+            float energy = 0.5f * 2.0f * glm::dot(bodies.getVelocity(0), bodies.getVelocity(0)) + 0.5f * glm::dot(bodies.getVelocity(1), bodies.getVelocity(1));
+            float distance = glm::length(bodies.getPosition(0) - bodies.getPosition(1));
+            if (bodies.size() != 2 || !(std::fabs(energy - 150.0f) < 1e-3f) || !(distance >= 1.0f) || !(bodies.getPosition(0).x < bodies.getPosition(1).x)) {
+                std::cerr << "bounce passed through or changed the energy" << std::endl;
+                return FAILURE;
+            }
+        }
+        if (response == COLLISION_FRAGMENT) {
+            // twenty units per second against an escape speed of about 2.4
+            Collisions check;
+            check.begin(bodies);
+            if (bodies.size() != 8 || collisions.fragmentations != 1 || check.findContacts(bodies).size() != 0) {
+                std::cerr << "fast impact did not break into separate fragments" << std::endl;
+                return FAILURE;
+            }
+        }
+    }
+
+    // a slow impact under the fragment response merges
+    {
+        BodyStore bodies;
+        bodies.addBody(glm::vec3(-0.6f, 0.0f, 0.0f), glm::vec3(0.5f, 0.0f, 0.0f), 1.0f, 0.5f);
+        bodies.addBody(glm::vec3(0.6f, 0.0f, 0.0f), glm::vec3(-0.5f, 0.0f, 0.0f), 1.0f, 0.5f);
+        Collisions collisions;
+        collisions.response = COLLISION_FRAGMENT;
+        collisions.begin(bodies);
+        bodies.drift(0.5f);
+        collisions.resolve(&bodies, 0.5f);
+        if (bodies.size() != 1 || collisions.merges != 1) {
+            std::cerr << "slow impact did not merge" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
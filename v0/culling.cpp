@@ -0,0 +1,361 @@
+#ifndef CULLING_CPP
+#define CULLING_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define CULLING_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "simd.cpp"
+#include "parallel.cpp"
+
+#ifndef FAILURE
+#define FAILURE 1
+#define SUCCESS 0
+#endif
+
+// most levels of detail a cull can sort into
+#define CULL_MAX_LEVELS 16
+// code of a body outside the frustum
+#define CULLED 255
+
+// classes --------------------------------------------------------------------------------------------
+
+// The six planes of a view frustum, a x + b y + c z + d >= 0 on the inside with (a, b, c) of unit
+// length, so the left side is a signed distance.
+class Frustum {
+    public:
+        // left, right, bottom, top, near, far
+        glm::vec4 planes[6];
+
+        // from the product of a projection and a view matrix (Gribb and Hartmann 2001), for clip
+        // space -w to w on every axis as OpenGL has it
+        static Frustum fromMatrix(const glm::mat4& proj_view) {
+            glm::vec4 rows[4];
+            for (int i = 0; i < 4; i++)
+                rows[i] = glm::vec4(proj_view[0][i], proj_view[1][i], proj_view[2][i], proj_view[3][i]);
+            Frustum frustum;
+            for (int axis = 0; axis < 3; axis++) {
+                frustum.planes[2 * axis] = rows[3] + rows[axis];
+                frustum.planes[2 * axis + 1] = rows[3] - rows[axis];
+            }
+            for (glm::vec4& plane : frustum.planes)
+                plane /= glm::length(glm::vec3(plane));
+            return frustum;
+        }
+
+        bool containsSphere(glm::vec3 center, float radius) const {
+            for (const glm::vec4& plane : planes) {
+                if (glm::dot(glm::vec3(plane), center) + plane.w <= -radius)
+                    return false;
+            }
+            return true;
+        }
+};
+
+// Bodies to cull, as structure of arrays: the positions at the two states the renderer blends
+// between and the radii, where bodies without one are drawn at default_radius.
+class CullInput {
+    public:
+        const float* x, * y, * z;
+        const float* prev_x, * prev_y, * prev_z;
+        const float* radius;
+        float blend = 1.0f;
+        float default_radius = 0.0f;
+};
+
+// everything a kernel needs besides the bodies, see FrustumCuller::cull
+class CullSetup {
+    public:
+        float planes[6][4];
+        glm::vec3 eye;
+        int levels;
+        // squared projected diameter scale and squared edge thresholds of the levels
+        float size_scale;
+        float thresholds[CULL_MAX_LEVELS];
+};
+
+// kernels per instruction set ------------------------------------------------------------------------
+
+namespace culling_scalar {
+    typedef float vfloat;
+    typedef bool vmask;
+    static const size_t WIDTH = 1;
+    inline vfloat vset1(float a) { return a; }
+    inline vfloat vload(const float* p) { return *p; }
+    inline void vstore(float* p, vfloat a) { *p = a; }
+    inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+    inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+    inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+    inline vmask vgreater(vfloat a, vfloat b) { return a > b; }
+    inline vmask vand(vmask a, vmask b) { return a && b; }
+    inline vfloat vselect(vmask mask, vfloat a, vfloat b) { return mask ? a : b; }
+    #include "culling_kernel.inl"
+}
+
+#ifdef SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace culling_sse {
+    typedef __m128 vfloat;
+    typedef __m128 vmask;
+    static const size_t WIDTH = 4;
+    inline vfloat vset1(float a) { return _mm_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+    inline vmask vgreater(vfloat a, vfloat b) { return _mm_cmpgt_ps(a, b); }
+    inline vmask vand(vmask a, vmask b) { return _mm_and_ps(a, b); }
+    inline vfloat vselect(vmask mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    #include "culling_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace culling_avx2 {
+    typedef __m256 vfloat;
+    typedef __m256 vmask;
+    static const size_t WIDTH = 8;
+    inline vfloat vset1(float a) { return _mm256_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm256_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+    inline vmask vgreater(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    inline vmask vand(vmask a, vmask b) { return _mm256_and_ps(a, b); }
+    inline vfloat vselect(vmask mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b, a, mask); }
+    #include "culling_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace culling_avx512 {
+    typedef __m512 vfloat;
+    typedef __mmask16 vmask;
+    static const size_t WIDTH = 16;
+    inline vfloat vset1(float a) { return _mm512_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm512_loadu_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm512_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+    inline vmask vgreater(vfloat a, vfloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    inline vmask vand(vmask a, vmask b) { return a & b; }
+    inline vfloat vselect(vmask mask, vfloat a, vfloat b) { return _mm512_mask_blend_ps(mask, b, a); }
+    #include "culling_kernel.inl"
+}
+#pragma GCC pop_options
+#endif
+
+typedef void (*CullKernel)(const CullInput&, const CullSetup&, size_t, size_t, uint8_t*);
+
+CullKernel selectCullKernel(SimdLevel level) {
+#ifdef SIMD_X86
+    switch (level) {
+    case SIMD_AVX512:
+        return culling_avx512::cullRange;
+    case SIMD_AVX2:
+        return culling_avx2::cullRange;
+    case SIMD_SSE:
+        return culling_sse::cullRange;
+    default:
+        break;
+    }
+#endif
+    return culling_scalar::cullRange;
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Drops the bodies outside the view frustum and sorts the rest by the level of detail their size
+// on screen calls for, before anything is packed or uploaded for them. The sphere of every body is
+// tested against the six planes a vector of bodies at a time, straight from the structure of
+// arrays, and the level follows sphereLevel in mesh.cpp. Blocks of bodies are spread over the job
+// system in two passes, one to test and count per block and one to scatter the visible bodies of
+// every block to their place, so the result does not depend on the scheduling.
+class FrustumCuller {
+    public:
+        // instruction set of the kernel, the widest the cpu has unless changed
+        SimdLevel simd_level = detectSimdLevel();
+        // bodies per block of work
+        size_t block = 4096;
+
+        // indices of the visible bodies of the last cull, grouped by level: level k holds
+        // level_count[k] of them from level_first[k] on
+        std::vector<uint32_t> visible;
+        uint32_t level_first[CULL_MAX_LEVELS] = {};
+        uint32_t level_count[CULL_MAX_LEVELS] = {};
+
+    private:
+        std::vector<uint8_t> codes;
+        // per block and level, counts of the first pass, then where the block writes
+        std::vector<uint32_t> block_counts;
+
+    public:
+        FrustumCuller() {}
+
+        // Culls count bodies against frustum and sorts the visible ones into levels seen from eye.
+        // pixel_scale is half the viewport height over the tangent of half the vertical field of
+        // view, so a sphere of radius r at distance d covers r / d * pixel_scale pixels.
+        void cull(const CullInput& input, size_t count, const Frustum& frustum, glm::vec3 eye, float pixel_scale,
+                  int levels = 1, float pixels_per_edge = 8.0f) {
+            CullSetup setup;
+            for (int p = 0; p < 6; p++)
+                for (int k = 0; k < 4; k++)
+                    setup.planes[p][k] = frustum.planes[p][k];
+            setup.eye = eye;
+            setup.levels = std::max(1, std::min(levels, CULL_MAX_LEVELS));
+            setup.size_scale = (1.1f * pixel_scale) * (1.1f * pixel_scale);
+            float edge = pixels_per_edge;
+            for (int k = 0; k + 1 < setup.levels; k++, edge *= 2.0f)
+                setup.thresholds[k] = edge * edge;
+
+            CullKernel kernel = selectCullKernel(simd_level);
+            size_t blocks = (count + block - 1) / block;
+            int n_levels = setup.levels;
+            codes.resize(count);
+            block_counts.assign(blocks * n_levels, 0);
+            parallelFor(blocks, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t b = begin; b < end; b++) {
+                    size_t first = b * block, last = std::min(count, first + block);
+                    kernel(input, setup, first, last, codes.data());
+                    uint32_t* counts = &block_counts[b * n_levels];
+                    for (size_t i = first; i < last; i++) {
+                        if (codes[i] != CULLED)
+                            counts[codes[i]]++;
+                    }
+                }
+            });
+
+            // level by level, block by block
+            uint32_t total = 0;
+            for (int level = 0; level < CULL_MAX_LEVELS; level++) {
+                level_first[level] = total;
+                level_count[level] = 0;
+                if (level >= n_levels)
+                    continue;
+                for (size_t b = 0; b < blocks; b++) {
+                    uint32_t n = block_counts[b * n_levels + level];
+                    block_counts[b * n_levels + level] = total;
+                    total += n;
+                    level_count[level] += n;
+                }
+            }
+            visible.resize(total);
+            parallelFor(blocks, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t b = begin; b < end; b++) {
+                    uint32_t* next = &block_counts[b * n_levels];
+                    size_t first = b * block, last = std::min(count, first + block);
+                    for (size_t i = first; i < last; i++) {
+                        if (codes[i] != CULLED)
+                            visible[next[codes[i]]++] = (uint32_t)i;
+                    }
+                }
+            });
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef CULLING_MAIN_CPP
+#include <chrono>
+#include <random>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "mesh.cpp"
+
+int main() {
+    // a disc galaxy seen from inside, most of it behind or beside the camera
+    const size_t n = 1000003;
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<float> x(n), y(n), z(n), px(n), py(n), pz(n), radius(n);
+    for (size_t i = 0; i < n; i++) {
+        float r = 200.0f * std::sqrt(uniform(rng)), phi = 6.2831853f * uniform(rng);
+        px[i] = r * std::cos(phi);
+        py[i] = 4.0f * (uniform(rng) - 0.5f);
+        pz[i] = r * std::sin(phi);
+        x[i] = px[i] + 0.2f * (uniform(rng) - 0.5f);
+        y[i] = py[i];
+        z[i] = pz[i] + 0.2f * (uniform(rng) - 0.5f);
+        // a few planets among point masses drawn at the default radius
+        radius[i] = i % 100 == 0 ? 0.5f + 2.0f * uniform(rng) : 0.0f;
+    }
+    CullInput input;
+    input.x = x.data(), input.y = y.data(), input.z = z.data();
+    input.prev_x = px.data(), input.prev_y = py.data(), input.prev_z = pz.data();
+    input.radius = radius.data();
+    input.blend = 0.25f;
+    input.default_radius = 0.1f;
+
+    glm::vec3 eye = glm::vec3(0.0f, 1.0f, 3.0f);
+    float fov = glm::radians(45.0f), height = 1080.0f;
+    glm::mat4 view = glm::lookAt(eye, eye + glm::vec3(0.3f, -0.1f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 proj = glm::perspective(fov, 1920.0f / height, 0.1f, 100.0f);
+    Frustum frustum = Frustum::fromMatrix(proj * view);
+    float pixel_scale = 0.5f * height / std::tan(0.5f * fov);
+    const int levels = 6;
+
+    // reference, one body at a time with the mesh helpers
+    std::vector<int> expected(n);
+    size_t expected_visible = 0;
+    for (size_t i = 0; i < n; i++) {
+        glm::vec3 p = glm::mix(glm::vec3(px[i], py[i], pz[i]), glm::vec3(x[i], y[i], z[i]), input.blend);
+        float r = radius[i] > 0.0f ? radius[i] : input.default_radius;
+        expected[i] = frustum.containsSphere(p, r) ? sphereLevel(projectedRadius(r, glm::length(p - eye), height, fov), levels) : CULLED;
+        expected_visible += expected[i] != CULLED;
+    }
+
+    SimdLevel best = detectSimdLevel();
+    for (int level = SIMD_SCALAR; level <= (int)best; level++) {
+        FrustumCuller culler;
+        culler.simd_level = (SimdLevel)level;
+        culler.cull(input, n, frustum, eye, pixel_scale, levels);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const int rounds = 5;
+        for (int r = 0; r < rounds; r++)
+            culler.cull(input, n, frustum, eye, pixel_scale, levels);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / rounds;
+
+        // grouped by level, ascending within a level, and agreeing with the reference up to
+        // bodies right on a plane or a level boundary
+        size_t disagree = 0, seen = 0;
+        bool ordered = true;
+        for (int l = 0; l < levels; l++) {
+            for (uint32_t k = culler.level_first[l]; k < culler.level_first[l] + culler.level_count[l]; k++) {
+                uint32_t i = culler.visible[k];
+                disagree += expected[i] != l;
+                ordered &= k == culler.level_first[l] || culler.visible[k - 1] < i;
+                seen++;
+            }
+        }
+        disagree += expected_visible > seen ? expected_visible - seen : seen - expected_visible;
+        std::cout << simdLevelName((SimdLevel)level) << ": " << culler.visible.size() << " of " << n << " bodies visible in "
+                  << ms << " ms, levels";
+        for (int l = 0; l < levels; l++)
+            std::cout << " " << culler.level_count[l];
+        std::cout << ", " << disagree << " disagree with the reference" << std::endl;
+        if (seen != culler.visible.size() || !ordered || disagree > n / 100000 || culler.visible.size() == 0 || culler.visible.size() > n / 2) {
+            std::cerr << simdLevelName((SimdLevel)level) << " culling disagrees with testing one body at a time" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
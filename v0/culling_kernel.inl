@@ -0,0 +1,65 @@
+// Frustum test and level of detail of WIDTH bodies at a time, included once per instruction set by
+// culling.cpp. The including namespace provides vfloat, vmask, WIDTH and the v* helpers below, and
+// the surrounding #pragma GCC target decides which instructions they compile to.
+//
+//   vset1, vload (unaligned), vstore (aligned), vadd, vsub, vmul,
+//   vgreater(a, b) = a > b, vand (both masks set), vselect(mask, a, b) = mask ? a : b
+
+// Writes the level of detail of every body in [begin, end) to codes, or CULLED if its sphere lies
+// wholly outside one of the planes. A short tail goes through zero padded copies, so the arrays
+// need no padding.
+static void cullRange(const CullInput& in, const CullSetup& setup, size_t begin, size_t end, uint8_t* codes) {
+    const vfloat zero = vset1(0.0f), one = vset1(1.0f), culled = vset1((float)CULLED);
+    const vfloat blend = vset1(in.blend), default_radius = vset1(in.default_radius);
+    const vfloat eye_x = vset1(setup.eye.x), eye_y = vset1(setup.eye.y), eye_z = vset1(setup.eye.z);
+    const vfloat size_scale = vset1(setup.size_scale);
+    vfloat planes[6][4];
+    for (int p = 0; p < 6; p++)
+        for (int k = 0; k < 4; k++)
+            planes[p][k] = vset1(setup.planes[p][k]);
+    vfloat thresholds[CULL_MAX_LEVELS];
+    for (int k = 0; k + 1 < setup.levels; k++)
+        thresholds[k] = vset1(setup.thresholds[k]);
+
+    alignas(64) float tail[7][WIDTH];
+    alignas(64) float result[WIDTH];
+    for (size_t i = begin; i < end; i += WIDTH) {
+        size_t lanes = end - i < WIDTH ? end - i : WIDTH;
+        const float* sources[7] = {in.x + i, in.y + i, in.z + i, in.prev_x + i, in.prev_y + i, in.prev_z + i, in.radius + i};
+        if (lanes < WIDTH) {
+            for (int a = 0; a < 7; a++) {
+                for (size_t l = 0; l < WIDTH; l++)
+                    tail[a][l] = l < lanes ? sources[a][l] : 0.0f;
+                sources[a] = tail[a];
+            }
+        }
+
+        // position between the two states, as the renderer draws it
+        vfloat px = vload(sources[3]), py = vload(sources[4]), pz = vload(sources[5]);
+        vfloat x = vadd(px, vmul(vsub(vload(sources[0]), px), blend));
+        vfloat y = vadd(py, vmul(vsub(vload(sources[1]), py), blend));
+        vfloat z = vadd(pz, vmul(vsub(vload(sources[2]), pz), blend));
+        vfloat r = vload(sources[6]);
+        r = vselect(vgreater(r, zero), r, default_radius);
+
+        // in front of every plane by more than minus the radius
+        vfloat reach = vsub(zero, r);
+        vmask inside = vgreater(vadd(vadd(vmul(planes[0][0], x), vmul(planes[0][1], y)), vadd(vmul(planes[0][2], z), planes[0][3])), reach);
+        for (int p = 1; p < 6; p++) {
+            vfloat distance = vadd(vadd(vmul(planes[p][0], x), vmul(planes[p][1], y)), vadd(vmul(planes[p][2], z), planes[p][3]));
+            inside = vand(inside, vgreater(distance, reach));
+        }
+
+        // one level per threshold the squared projected size passes, no square root or division
+        vfloat dx = vsub(x, eye_x), dy = vsub(y, eye_y), dz = vsub(z, eye_z);
+        vfloat distance2 = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz));
+        vfloat size2 = vmul(vmul(r, r), size_scale);
+        vfloat level = zero;
+        for (int k = 0; k + 1 < setup.levels; k++)
+            level = vadd(level, vselect(vgreater(size2, vmul(distance2, thresholds[k])), one, zero));
+
+        vstore(result, vselect(inside, level, culled));
+        for (size_t l = 0; l < lanes; l++)
+            codes[i + l] = (uint8_t)result[l];
+    }
+}
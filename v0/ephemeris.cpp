@@ -0,0 +1,498 @@
+#ifndef EPHEMERIS_CPP
+#define EPHEMERIS_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define EPHEMERIS_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "bodies.cpp"
+
+// helpers --------------------------------------------------------------------------------------------
+
+// Least squares solution of the rows x cols system a x = b for rhs right hand sides at once, by
+// Householder QR. a is column major and destroyed, b holds the rhs columns of rows values each and
+// gets the solutions in the first cols entries of every column.
+void leastSquares(std::vector<double>* a, size_t rows, size_t cols, std::vector<double>* b, size_t rhs) {
+    double* A = a->data();
+    double* B = b->data();
+    for (size_t k = 0; k < cols; k++) {
+        double* column = A + k * rows;
+        double norm = 0.0;
+        for (size_t i = k; i < rows; i++)
+            norm += column[i] * column[i];
+        norm = std::sqrt(norm);
+        if (norm == 0.0)
+            continue;
+        // reflect column k onto -sign(a_kk) |a_k| e_k, v = a_k - that, stored over the column
+        double alpha = column[k] > 0.0 ? -norm : norm;
+        column[k] -= alpha;
+        double vv = 0.0;
+        for (size_t i = k; i < rows; i++)
+            vv += column[i] * column[i];
+        auto reflect = [&](double* target) {
+            double dot = 0.0;
+            for (size_t i = k; i < rows; i++)
+                dot += column[i] * target[i];
+            double scale = 2.0 * dot / vv;
+            for (size_t i = k; i < rows; i++)
+                target[i] -= scale * column[i];
+        };
+        for (size_t j = k + 1; j < cols; j++)
+            reflect(A + j * rows);
+        for (size_t j = 0; j < rhs; j++)
+            reflect(B + j * rows);
+        column[k] = alpha;
+    }
+    // back substitution with the upper triangle
+    for (size_t j = 0; j < rhs; j++) {
+        double* x = B + j * rows;
+        for (size_t k = cols; k-- > 0;) {
+            double sum = x[k];
+            for (size_t i = k + 1; i < cols; i++)
+                sum -= A[i * rows + k] * x[i];
+            x[k] = A[k * rows + k] != 0.0 ? sum / A[k * rows + k] : 0.0;
+        }
+    }
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Trajectories of the bodies as piecewise Chebyshev series in time, the way the JPL DE ephemerides
+// store the planets. The recorded span is cut into segments of a fixed interval, and every body has
+// order + 1 coefficients per coordinate and segment, fitted by least squares to the positions and
+// velocities of the states recorded in and around the segment. Where a body is at any covered time
+// is then one segment lookup and a Clenshaw sum, with its velocity from the same recurrence, instead
+// of integrating there again.
+//
+// States go in through record() in increasing time, usually after every step; a segment is fitted as
+// soon as a state at or past its end arrives, and its raw states are dropped. Segments too sparse for
+// the full order, with fewer than (order + 1) / 2 states, are fitted at a lower one.
+//
+// Bodies are looked up by handle, so they may come and go while recording. When the handles change,
+// the pending states are remapped by handle the way Snapshot remaps its previous state. A body is
+// only fitted in the segments it was present for from start to end. Its history up to the last segment
+// closed before its removal stays available, and lookups in a segment it was missing from return false.
+// record() and the lookups may run on different threads.
+class Ephemeris {
+    public:
+        // length of a segment in simulated time
+        double interval;
+        // degree of the series
+        int order;
+
+    private:
+        // bodies of a run of segments, in the order of their coefficients
+        class Roster {
+            public:
+                std::vector<BodyStore::BodyID> ids;
+                std::unordered_map<BodyStore::BodyID, size_t> index;
+        };
+
+        mutable std::mutex mutex;
+        double start = 0.0;
+        // [body][axis][k] per segment, order + 1 values each, from segment_offset on
+        std::vector<double> coefficients;
+        std::vector<size_t> segment_offset;
+        std::vector<size_t> segment_roster;
+        std::vector<Roster> rosters;
+        size_t segment_count = 0;
+
+        // states not yet fitted: time, then x y z vx vy vz of every body in pending_ids, NaN for
+        // bodies that were not there yet
+        std::vector<double> pending;
+        std::vector<BodyStore::BodyID> pending_ids;
+        size_t pending_count = 0;
+        // fitting workspace
+        std::vector<double> design, solution;
+
+    public:
+        Ephemeris(double interval = 1.0, int order = 12) {
+            this->interval = interval;
+            this->order = order;
+        }
+
+        // drops everything recorded
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            coefficients.clear();
+            segment_offset.clear();
+            segment_roster.clear();
+            rosters.clear();
+            segment_count = 0;
+            pending.clear();
+            pending_ids.clear();
+            pending_count = 0;
+        }
+
+        // bodies being recorded
+        size_t size() const { return pending_ids.size(); }
+
+        size_t segments() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return segment_count;
+        }
+
+        // time span covered by fitted segments
+        double startTime() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return start;
+        }
+        double endTime() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return start + segment_count * interval;
+        }
+
+        // memory taken by the fitted coefficients
+        size_t bytes() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return coefficients.size() * sizeof(double);
+        }
+
+        // Adds the state of the bodies at time, later than the last one recorded. At the time of
+        // the last one it only takes in bodies added or removed since, as a step that changes them
+        // records the state before and after the change at the same time.
+        void record(double time, const BodyStore& bodies) {
+            size_t n = bodies.size();
+            size_t stride = 1 + 6 * n;
+            if (pending_count == 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                start = time;
+                pending_ids.assign(bodies.ids.begin(), bodies.ids.end());
+            } else {
+                bool changed = !std::equal(pending_ids.begin(), pending_ids.end(), bodies.ids.begin(), bodies.ids.end());
+                if (changed)
+                    remapPending(bodies);
+                double last = pending[(pending_count - 1) * stride];
+                if (time == last && changed)
+                    pending_count--;
+                else if (!(time > last))
+                    return;
+            }
+            pending.resize((pending_count + 1) * stride);
+            double* state = pending.data() + pending_count * stride;
+            state[0] = time;
+            for (size_t i = 0; i < n; i++) {
+                glm::vec3 p = bodies.getPosition(i), v = bodies.getVelocity(i);
+                for (int d = 0; d < 3; d++) {
+                    state[1 + 6 * i + d] = p[d];
+                    state[4 + 6 * i + d] = v[d];
+                }
+            }
+            pending_count++;
+
+            // a state past the end of the open segment closes it, a long step possibly several
+            while (pending_count > 1 && time >= start + (segment_count + 1) * interval)
+                fitSegment();
+        }
+
+        // Position, and velocity if asked for, of the body behind a handle at time. False outside
+        // the covered span and in segments the body was not present for throughout.
+        bool evaluate(BodyStore::BodyID body, double time, glm::dvec3* position, glm::dvec3* velocity = nullptr) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (segment_count == 0)
+                return false;
+            double offset = (time - start) / interval;
+            if (!(offset >= 0.0 && offset <= (double)segment_count))
+                return false;
+            size_t segment = std::min((size_t)offset, segment_count - 1);
+            const Roster& roster = rosters[segment_roster[segment]];
+            auto found = roster.index.find(body);
+            if (found == roster.index.end())
+                return false;
+            double tau = 2.0 * (offset - segment) - 1.0;
+            size_t stride = order + 1;
+            const double* c = coefficients.data() + segment_offset[segment] + found->second * 3 * stride;
+            // a body missing from some of the states of the segment has NaN coefficients
+            if (!std::isfinite(c[0]))
+                return false;
+            for (int d = 0; d < 3; d++, c += stride) {
+                // Clenshaw for the series and, differentiated, for its derivative in tau
+                double b1 = 0.0, b2 = 0.0, d1 = 0.0, d2 = 0.0;
+                for (int k = order; k >= 1; k--) {
+                    double b0 = c[k] + 2.0 * tau * b1 - b2;
+                    double d0 = 2.0 * b1 + 2.0 * tau * d1 - d2;
+                    b2 = b1, b1 = b0;
+                    d2 = d1, d1 = d0;
+                }
+                (*position)[d] = c[0] + tau * b1 - b2;
+                if (velocity != nullptr)
+                    (*velocity)[d] = (b1 + tau * d1 - d2) * 2.0 / interval;
+            }
+            return true;
+        }
+
+    private:
+        // Reorders the pending states to the handles of bodies. Bodies that are gone are dropped,
+        // new ones are NaN in the states before they arrived, which keeps them out of the fit of
+        // the open segment: the least squares solve treats every coordinate on its own.
+        void remapPending(const BodyStore& bodies) {
+            size_t old_n = pending_ids.size(), n = bodies.size();
+            size_t old_stride = 1 + 6 * old_n, stride = 1 + 6 * n;
+            std::unordered_map<BodyStore::BodyID, size_t> old_index;
+            for (size_t j = 0; j < old_n; j++)
+                old_index[pending_ids[j]] = j;
+            std::vector<double> remapped(pending_count * stride);
+            for (size_t s = 0; s < pending_count; s++) {
+                const double* from = pending.data() + s * old_stride;
+                double* to = remapped.data() + s * stride;
+                to[0] = from[0];
+                for (size_t i = 0; i < n; i++) {
+                    auto found = old_index.find(bodies.ids[i]);
+                    for (int k = 0; k < 6; k++)
+                        to[1 + 6 * i + k] = found != old_index.end() ? from[1 + 6 * found->second + k] : NAN;
+                }
+            }
+            pending.swap(remapped);
+            pending_ids.assign(bodies.ids.begin(), bodies.ids.end());
+        }
+
+        // fits the open segment to the pending states that reach into it, the last one before its
+        // start and the first one past its end included, and keeps those still needed for the next
+        void fitSegment() {
+            size_t n = pending_ids.size(), stride = 1 + 6 * n;
+            double segment_start = start + segment_count * interval, segment_end = segment_start + interval;
+            size_t first = 0, last = pending_count - 1;
+            for (size_t s = 0; s < pending_count; s++)
+                if (pending[s * stride] <= segment_start)
+                    first = s;
+            for (size_t s = pending_count; s-- > first;)
+                if (pending[s * stride] >= segment_end)
+                    last = s;
+            size_t samples = last - first + 1;
+            size_t rows = 2 * samples;
+            size_t cols = std::min((size_t)order + 1, rows);
+            size_t rhs = 3 * n;
+
+            // rows of T_k(tau) for the positions and of T_k'(tau) = k U_k-1(tau) for the velocities,
+            // these scaled to tau by interval / 2
+            design.assign(rows * cols, 0.0);
+            solution.assign(rows * rhs, 0.0);
+            for (size_t s = 0; s < samples; s++) {
+                const double* state = pending.data() + (first + s) * stride;
+                double tau = 2.0 * (state[0] - segment_start) / interval - 1.0;
+                double t0 = 1.0, t1 = tau, u0 = 1.0, u1 = 2.0 * tau;
+                for (size_t k = 0; k < cols; k++) {
+                    double t = k == 0 ? t0 : t1;
+                    double u = k == 0 ? 0.0 : u0;
+                    design[k * rows + 2 * s] = t;
+                    design[k * rows + 2 * s + 1] = k * u;
+                    if (k > 0) {
+                        double t2 = 2.0 * tau * t1 - t0, u2 = 2.0 * tau * u1 - u0;
+                        t0 = t1, t1 = t2;
+                        u0 = u1, u1 = u2;
+                    }
+                }
+                for (size_t i = 0; i < n; i++) {
+                    for (int d = 0; d < 3; d++) {
+                        solution[(3 * i + d) * rows + 2 * s] = state[1 + 6 * i + d];
+                        solution[(3 * i + d) * rows + 2 * s + 1] = state[4 + 6 * i + d] * 0.5 * interval;
+                    }
+                }
+            }
+            leastSquares(&design, rows, cols, &solution, rhs);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (rosters.empty() || rosters.back().ids != pending_ids) {
+                    rosters.emplace_back();
+                    rosters.back().ids = pending_ids;
+                    for (size_t i = 0; i < n; i++)
+                        rosters.back().index[pending_ids[i]] = i;
+                }
+                segment_roster.push_back(rosters.size() - 1);
+                size_t width = order + 1;
+                size_t offset = coefficients.size();
+                segment_offset.push_back(offset);
+                coefficients.resize(offset + n * 3 * width, 0.0);
+                double* c = coefficients.data() + offset;
+                for (size_t j = 0; j < rhs; j++)
+                    for (size_t k = 0; k < width; k++)
+                        c[j * width + k] = k < cols ? solution[j * rows + k] : 0.0;
+                segment_count++;
+            }
+
+            // the next segment starts from the last state at or before its start
+            size_t keep = 0;
+            for (size_t s = 0; s < pending_count; s++)
+                if (pending[s * stride] <= segment_end)
+                    keep = s;
+            pending.erase(pending.begin(), pending.begin() + keep * stride);
+            pending_count -= keep;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef EPHEMERIS_MAIN_CPP
+#include <chrono>
+#include <random>
+
+#include "kepler.cpp"
+
+int main() {
+    // a least squares line through three points
+    std::vector<double> a = {1.0, 1.0, 1.0, 0.0, 1.0, 2.0}, b = {1.0, 2.0, 4.0};
+    leastSquares(&a, 3, 2, &b, 1);
+    if (std::fabs(b[0] - 5.0 / 6.0) > 1e-12 || std::fabs(b[1] - 1.5) > 1e-12) {
+        std::cerr << "least squares fit is wrong: " << b[0] << " " << b[1] << std::endl;
+        return FAILURE;
+    }
+
+    // an eccentric orbit and a circular one recorded every 0.01 from the exact solution, then
+    // looked up at random times between the records
+    const double mu = 1.0;
+    glm::dvec3 start_pos[2] = {glm::dvec3(1.0, 0.0, 0.0), glm::dvec3(0.0, 2.0, 0.1)};
+    glm::dvec3 start_vel[2] = {glm::dvec3(0.0, 1.2, 0.0), glm::dvec3(-std::sqrt(0.5), 0.0, 0.0)};
+    auto exact = [&](size_t body, double t, glm::dvec3* p, glm::dvec3* v) {
+        *p = start_pos[body];
+        *v = start_vel[body];
+        keplerDrift(mu, p, v, t);
+    };
+    Ephemeris ephemeris = Ephemeris(0.5, 12);
+    BodyStore bodies;
+    bodies.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+    bodies.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+    const double dt = 0.01, duration = 40.0;
+    for (int s = 0; s <= (int)(duration / dt + 0.5); s++) {
+        for (size_t i = 0; i < 2; i++) {
+            glm::dvec3 p, v;
+            exact(i, s * dt, &p, &v);
+            bodies.setPosition(i, glm::vec3(p));
+            bodies.setVelocity(i, glm::vec3(v));
+        }
+        ephemeris.record(s * dt, bodies);
+    }
+    std::cout << ephemeris.segments() << " segments over " << ephemeris.startTime() << " to " << ephemeris.endTime()
+              << ", " << ephemeris.bytes() << " bytes" << std::endl;
+    if (ephemeris.segments() != 80 || std::fabs(ephemeris.endTime() - duration) > 1e-9) {
+        std::cerr << "ephemeris does not cover the recorded span" << std::endl;
+        return FAILURE;
+    }
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> uniform(0.0, duration);
+    double worst_pos = 0.0, worst_vel = 0.0;
+    for (int k = 0; k < 10000; k++) {
+        double t = uniform(rng);
+        for (size_t i = 0; i < 2; i++) {
+            glm::dvec3 p, v, expected_p, expected_v;
+            if (!ephemeris.evaluate(bodies.ids[i], t, &p, &v)) {
+                std::cerr << "no position at " << t << std::endl;
+                return FAILURE;
+            }
+            exact(i, t, &expected_p, &expected_v);
+            worst_pos = std::fmax(worst_pos, glm::length(p - expected_p));
+            worst_vel = std::fmax(worst_vel, glm::length(v - expected_v));
+        }
+    }
+    // the recorded states are floats, the fit cannot do better than their rounding
+    std::cout << "worst position error " << worst_pos << ", velocity error " << worst_vel << std::endl;
+    if (!(worst_pos < 1e-6) || !(worst_vel < 1e-5)) {
+        std::cerr << "ephemeris strays from the recorded orbits" << std::endl;
+        return FAILURE;
+    }
+    glm::dvec3 p;
+    if (ephemeris.evaluate(bodies.ids[0], -0.1, &p) || ephemeris.evaluate(bodies.ids[0], duration + 0.1, &p)
+        || ephemeris.evaluate(BodyStore::NO_BODY, 1.0, &p)) {
+        std::cerr << "lookup outside the ephemeris succeeded" << std::endl;
+        return FAILURE;
+    }
+
+    // steps longer than a segment still give usable, if lower order, segments
+    Ephemeris coarse = Ephemeris(0.5, 12);
+    for (int s = 0; s <= 20; s++) {
+        glm::dvec3 v;
+        exact(1, s * 0.7, &p, &v);
+        bodies.setPosition(1, glm::vec3(p));
+        bodies.setVelocity(1, glm::vec3(v));
+        coarse.record(s * 0.7, bodies);
+    }
+    glm::dvec3 expected_p, expected_v, q;
+    exact(1, 5.0, &expected_p, &expected_v);
+    coarse.evaluate(bodies.ids[1], 5.0, &q);
+    std::cout << coarse.segments() << " segments from steps of 0.7, error " << glm::length(q - expected_p) << std::endl;
+    if (coarse.segments() != 28 || !(glm::length(q - expected_p) < 1e-2)) {
+        std::cerr << "sparse states were not fitted" << std::endl;
+        return FAILURE;
+    }
+
+    // bodies removed and added while recording keep their handles, the first orbit is recorded
+    // throughout, the second one until t = 10 and the third one from t = 10 on
+    BodyStore changing;
+    BodyStore::BodyID kept = changing.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+    BodyStore::BodyID removed = changing.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+    BodyStore::BodyID added = BodyStore::NO_BODY;
+    Ephemeris moving = Ephemeris(0.5, 12);
+    for (int s = 0; s <= 2000; s++) {
+        if (s == 1000) {
+            changing.removeBody(removed);
+            added = changing.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+            // the state at the time of the change is recorded again with the new bodies
+            glm::dvec3 q0, v0;
+            exact(0, s * dt, &q0, &v0);
+            changing.setPosition(changing.indexOf(kept), glm::vec3(q0));
+            changing.setVelocity(changing.indexOf(kept), glm::vec3(v0));
+            exact(1, s * dt, &q0, &v0);
+            changing.setPosition(changing.indexOf(added), glm::vec3(q0));
+            changing.setVelocity(changing.indexOf(added), glm::vec3(v0));
+            moving.record(s * dt, changing);
+        }
+        BodyStore::BodyID moved[2] = {kept, s < 1000 ? removed : added};
+        for (size_t i = 0; i < 2; i++) {
+            glm::dvec3 q0, v0;
+            exact(i, s * dt, &q0, &v0);
+            changing.setPosition(changing.indexOf(moved[i]), glm::vec3(q0));
+            changing.setVelocity(changing.indexOf(moved[i]), glm::vec3(v0));
+        }
+        moving.record(s * dt, changing);
+    }
+    double worst_kept = 0.0;
+    for (double t = 0.013; t < 20.0; t += 0.1) {
+        exact(0, t, &expected_p, &expected_v);
+        if (!moving.evaluate(kept, t, &q)) {
+            std::cerr << "no position of the body recorded throughout at " << t << std::endl;
+            return FAILURE;
+        }
+        worst_kept = std::fmax(worst_kept, glm::length(q - expected_p));
+    }
+    glm::dvec3 before_p, after_p;
+    bool before = moving.evaluate(removed, 5.0, &before_p), after = moving.evaluate(added, 15.0, &after_p);
+    exact(1, 5.0, &expected_p, &expected_v);
+    double removed_error = glm::length(before_p - expected_p);
+    exact(1, 15.0, &expected_p, &expected_v);
+    double added_error = glm::length(after_p - expected_p);
+    std::cout << "with a body swapped at t = 10: worst error " << worst_kept << " for the one kept, " << removed_error
+              << " before the removal, " << added_error << " after the addition" << std::endl;
+    if (!(worst_kept < 1e-6) || !before || !after || !(removed_error < 1e-6) || !(added_error < 1e-6)
+        || moving.evaluate(removed, 15.0, &q) || moving.evaluate(added, 5.0, &q)) {
+        std::cerr << "ephemeris mixes up bodies that were removed or added" << std::endl;
+        return FAILURE;
+    }
+
+    // a lookup costs one segment search and a short Clenshaw sum per coordinate
+    const int lookups = 1000000;
+    glm::dvec3 sum = glm::dvec3(0.0);
+    auto begin = std::chrono::steady_clock::now();
+    for (int k = 0; k < lookups; k++) {
+        glm::dvec3 v;
+        ephemeris.evaluate(bodies.ids[k & 1], (k % 39989) * 1e-3, &p, &v);
+        sum += p + v;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / lookups;
+    std::cout << ns << " ns per position and velocity lookup (" << sum.x << ")" << std::endl;
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
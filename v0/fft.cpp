@@ -0,0 +1,119 @@
+#ifndef FFT_CPP
+#define FFT_CPP
+
+#include <cstdint>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "parallel.cpp"
+
+typedef std::complex<double> Complex;
+
+// class ----------------------------------------------------------------------------------------------
+
+// Iterative radix-2 Cooley-Tukey FFT of one power of two length. The twiddle factors and the
+// bit reversal permutation are computed once, transforms are in place and unnormalized, so a
+// forward and an inverse transform in a row scale the data by the length.
+class Fft {
+    public:
+        size_t length = 0;
+
+    private:
+        std::vector<Complex> twiddles;      // exp(-2 pi i k / length) for k < length / 2
+        std::vector<uint32_t> reversed;
+
+    public:
+        Fft(size_t length = 0) {
+            prepare(length);
+        }
+
+        void prepare(size_t length) {
+            this->length = length;
+            twiddles.resize(length / 2);
+            for (size_t k = 0; k < length / 2; k++) {
+                double angle = -2.0 * M_PI * (double)k / (double)length;
+                twiddles[k] = Complex(std::cos(angle), std::sin(angle));
+            }
+            reversed.resize(length);
+            int bits = 0;
+            while (((size_t)1 << bits) < length)
+                bits++;
+            for (size_t i = 0; i < length; i++) {
+                uint32_t r = 0;
+                for (int b = 0; b < bits; b++)
+                    if (i & ((size_t)1 << b))
+                        r |= 1u << (bits - 1 - b);
+                reversed[i] = r;
+            }
+        }
+
+        // line must hold length contiguous values
+        void transform(Complex* line, bool inverse) const {
+            for (size_t i = 0; i < length; i++)
+                if (i < reversed[i])
+                    std::swap(line[i], line[reversed[i]]);
+
+            // butterflies written out by hand, std::complex multiplication checks for infinities
+            double* data = reinterpret_cast<double*>(line);
+            double direction = inverse ? -1.0 : 1.0;
+            for (size_t span = 2; span <= length; span *= 2) {
+                size_t half = span / 2, step = length / span;
+                for (size_t start = 0; start < length; start += span) {
+                    for (size_t k = 0; k < half; k++) {
+                        double wr = twiddles[k * step].real(), wi = direction * twiddles[k * step].imag();
+                        double* u = data + 2 * (start + k);
+                        double* v = data + 2 * (start + k + half);
+                        double tr = v[0] * wr - v[1] * wi;
+                        double ti = v[0] * wi + v[1] * wr;
+                        v[0] = u[0] - tr;
+                        v[1] = u[1] - ti;
+                        u[0] += tr;
+                        u[1] += ti;
+                    }
+                }
+            }
+        }
+};
+
+// 3D transform of an n^3 grid stored as data[(x * n + y) * n + z], one 1D pass per axis with the
+// lines spread over the workers. Only the corner [0, used)^3 is read by a forward transform and
+// only that corner is valid after an inverse one, which is how zero padded convolutions use it:
+// lines that are all zeros, or whose results are thrown away, are skipped.
+void fft3d(const Fft& fft, Complex* data, bool inverse, size_t used) {
+    size_t n = fft.length;
+
+    // axis 0 is z, 1 is y, 2 is x; lines_a x lines_b lines are transformed along the axis
+    auto pass = [&](int axis, size_t lines_a, size_t lines_b) {
+        size_t stride = axis == 0 ? 1 : (axis == 1 ? n : n * n);
+        parallelFor(lines_a * lines_b, [&](size_t begin, size_t end, unsigned int) {
+            std::vector<Complex> line(stride == 1 ? 0 : n);
+            for (size_t l = begin; l < end; l++) {
+                size_t a = l / lines_b, b = l % lines_b;
+                // a and b are the two remaining coordinates, outer one first
+                size_t base = axis == 0 ? (a * n + b) * n : (axis == 1 ? a * n * n + b : a * n + b);
+                if (stride == 1) {
+                    fft.transform(data + base, inverse);
+                    continue;
+                }
+                for (size_t i = 0; i < n; i++)
+                    line[i] = data[base + i * stride];
+                fft.transform(line.data(), inverse);
+                for (size_t i = 0; i < n; i++)
+                    data[base + i * stride] = line[i];
+            }
+        }, 16);
+    };
+
+    if (!inverse) {
+        pass(0, used, used);    // z lines with x, y < used
+        pass(1, used, n);       // y lines with x < used, every z
+        pass(2, n, n);          // x lines, every y and z
+    } else {
+        pass(2, n, n);
+        pass(1, used, n);
+        pass(0, used, used);
+    }
+}
+
+#endif
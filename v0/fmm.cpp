@@ -0,0 +1,642 @@
+#ifndef FMM_CPP
+#define FMM_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define FMM_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <functional>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "octree.cpp"
+
+#define FMM_MAX_ORDER 10
+// (p+1)(p+2)(p+3)/6 terms at FMM_MAX_ORDER
+#define FMM_MAX_TERMS 286
+// partners of a cell expanded at once by M2L, one lane each
+#define FMM_LANES 4
+
+// class ----------------------------------------------------------------------------------------------
+
+// Fast multipole method with cartesian Taylor expansions of order p, in the style of Dehnen's
+// falcON. Multipoles are taken about each cell's center of mass, and a dual tree traversal pairs
+// cells off so the cost is O(N). Both cells of a well separated pair expand the other's multipole
+// with the same derivatives up to sign, so the far field forces between two cells are equal and
+// opposite, conserving momentum up to truncation of the expansion. Leaf pairs that cannot be
+// separated go through the SIMD direct kernel. The upward and downward passes run one tree level at
+// a time, the traversal one round of pairs at a time, and M2L and P2P one cell at a time, each
+// split across the job system.
+//
+// Expansions are stored scaled by factorials so that no operator needs binomial coefficients.
+// With D_n(R) the n-th derivative of 1/|R| and n! = n_x! n_y! n_z!:
+//     M_k(A)    = sum_j m_j (x_j - z_A)^k / k!
+//     L_n(B)   += -G sum_k (-1)^|k| D_{n+k}(z_B - z_A) M_k(A)
+//     phi(z+h)  = sum_n L_n h^n / n!
+// M2M and L2L are then plain convolutions with d^k / k! of the shift d.
+class FmmSolver : public ForceSolver {
+    public:
+        // cells are well separated when (r_A + r_B) < theta |z_A - z_B|
+        float theta = 0.8f;
+        // expansion order p, 1 to FMM_MAX_ORDER, error falls roughly like theta^(p+1)
+        unsigned int order = 6;
+        // big leaves and a high order trade M2L, the bulk of the cost, for vectorized P2P; with
+        // theta 0.8 this matches the tree code's accuracy at about two thirds of its time from
+        // 10^5 bodies on, see fmm_bench
+        unsigned int leaf_size = 256;
+        SimdLevel simd_level;
+
+        Octree tree;
+
+    private:
+        unsigned int table_order = 0;
+        int term_count = 0;
+        std::vector<glm::ivec3> exponents;
+        std::vector<int> index_of;
+        std::vector<double> sign;               // (-1)^|n|
+        // D_n = sum of up to three r_i * D_{n-e_i} and three D_{n-2e_i} terms, times 1/r^2. Only the
+        // terms present are listed, those of n in [recurrence_begin[n], recurrence_begin[n + 1]) with
+        // the factor r_i for i = recurrence_factor < 3 and 1 for recurrence_factor = 3.
+        std::vector<int> recurrence_begin, recurrence_index, recurrence_factor;
+        std::vector<double> recurrence_coefficient;
+        std::vector<int> derivative[3];         // index of n - e_i for L2P, -1 when negative
+        // M2L terms grouped by k: m2l_m[m2l_begin[k] + n] is the index of n + k. Terms are ordered by
+        // degree, so the n with |n + k| <= p are the first m2l_begin[k + 1] - m2l_begin[k] of them.
+        std::vector<int> m2l_begin, m2l_m;
+        // big = small + difference for M2M and L2L
+        std::vector<int> shift_big, shift_small, shift_difference;
+
+        std::vector<double> multipoles, locals;
+        std::vector<double> ax, ay, az;     // accelerations in tree order
+
+        // cells by depth, level l is level_cells[level_begin[l], level_begin[l + 1])
+        std::vector<uint32_t> level_cells, level_begin;
+
+        typedef std::pair<uint32_t, uint32_t> CellPair;
+        typedef struct {
+            std::vector<CellPair> next, separated, leaves;
+        } TraversalBlock;
+        // pairs the traversal has yet to look at, and what each block of them turned into
+        std::vector<CellPair> frontier;
+        std::vector<TraversalBlock> traversal_blocks;
+        // pairs found by the traversal, evaluated per cell afterwards: well separated ones by M2L,
+        // leaf pairs with the SIMD kernel
+        std::vector<CellPair> separated_pairs, leaf_pairs;
+
+    public:
+        FmmSolver(float G = 1.0f, float softening = 0.05f, unsigned int order = 6, float theta = 0.8f) {
+            this->G = G;
+            this->softening = softening;
+            this->order = order;
+            this->theta = theta;
+            simd_level = detectSimdLevel();
+        }
+
+        const char* name() override { return "fmm"; }
+
+        void computeAccelerations(BodyStore* bodies) override {
+            bodies->clearAccelerations();
+            size_t n = bodies->size();
+            if (n == 0)
+                return;
+
+            unsigned int p = order < 1 ? 1 : (order > FMM_MAX_ORDER ? FMM_MAX_ORDER : order);
+            if (p != table_order)
+                prepareTables(p);
+
+            tree.leaf_size = leaf_size;
+            tree.build(bodies);
+
+            size_t cells = tree.nodes.size();
+            multipoles.assign(cells * term_count, 0.0);
+            locals.assign(cells * term_count, 0.0);
+            ax.assign(n, 0.0);
+            ay.assign(n, 0.0);
+            az.assign(n, 0.0);
+
+            collectLevels();
+            upward();
+            traverse();
+            evaluateSeparatedPairs();
+            evaluateLeafPairs();
+            downward();
+
+            for (size_t k = 0; k < n; k++) {
+                uint32_t i = tree.order[k];
+                bodies->acc_x[i] = (float)ax[k];
+                bodies->acc_y[i] = (float)ay[k];
+                bodies->acc_z[i] = (float)az[k];
+            }
+        }
+
+    private:
+        int termIndex(glm::ivec3 e) const {
+            if (e.x < 0 || e.y < 0 || e.z < 0)
+                return -1;
+            int side = table_order + 1;
+            return index_of[(e.x * side + e.y) * side + e.z];
+        }
+
+        void prepareTables(unsigned int p) {
+            table_order = p;
+            int side = p + 1;
+            exponents.clear();
+            index_of.assign(side * side * side, -1);
+            // ordered by total degree so recurrences only look backwards
+            for (int s = 0; s <= (int)p; s++)
+                for (int a = s; a >= 0; a--)
+                    for (int b = s - a; b >= 0; b--) {
+                        int c = s - a - b;
+                        index_of[(a * side + b) * side + c] = (int)exponents.size();
+                        exponents.push_back(glm::ivec3(a, b, c));
+                    }
+            term_count = (int)exponents.size();
+
+            // from the Taylor recurrence of 1/|r| multiplied through by n!:
+            //     |n| r^2 D_n = -(2|n|-1) sum_i n_i r_i D_{n-e_i} - (|n|-1) sum_i n_i (n_i-1) D_{n-2e_i}
+            sign.assign(term_count, 1.0);
+            recurrence_begin.assign(1, 0);
+            recurrence_index.clear();
+            recurrence_factor.clear();
+            recurrence_coefficient.clear();
+            for (int i = 0; i < 3; i++)
+                derivative[i].assign(term_count, -1);
+            for (int t = 0; t < term_count; t++) {
+                glm::ivec3 e = exponents[t];
+                int degree = e.x + e.y + e.z;
+                sign[t] = degree % 2 ? -1.0 : 1.0;
+                for (int i = 0; i < 3; i++) {
+                    glm::ivec3 one = e, two = e;
+                    one[i] -= 1;
+                    two[i] -= 2;
+                    derivative[i][t] = termIndex(one);
+                    if (t > 0 && termIndex(one) >= 0) {
+                        recurrence_index.push_back(termIndex(one));
+                        recurrence_factor.push_back(i);
+                        recurrence_coefficient.push_back(-(2.0 * degree - 1.0) * e[i] / degree);
+                    }
+                    if (t > 0 && termIndex(two) >= 0) {
+                        recurrence_index.push_back(termIndex(two));
+                        recurrence_factor.push_back(3);
+                        recurrence_coefficient.push_back(-(degree - 1.0) * e[i] * (e[i] - 1) / degree);
+                    }
+                }
+                recurrence_begin.push_back((int)recurrence_index.size());
+            }
+
+            m2l_begin.assign(1, 0);
+            m2l_m.clear();
+            for (int k = 0; k < term_count; k++) {
+                glm::ivec3 ek = exponents[k];
+                for (int n = 0; n < term_count; n++) {
+                    glm::ivec3 en = exponents[n];
+                    if (en.x + en.y + en.z + ek.x + ek.y + ek.z <= (int)p)
+                        m2l_m.push_back(termIndex(en + ek));
+                }
+                m2l_begin.push_back((int)m2l_m.size());
+            }
+
+            shift_big.clear();
+            shift_small.clear();
+            shift_difference.clear();
+            for (int n = 0; n < term_count; n++) {
+                for (int k = 0; k < term_count; k++) {
+                    glm::ivec3 en = exponents[n], ek = exponents[k];
+                    // n is the big index here, k the small one
+                    if (ek.x <= en.x && ek.y <= en.y && ek.z <= en.z) {
+                        shift_big.push_back(n);
+                        shift_small.push_back(k);
+                        shift_difference.push_back(termIndex(en - ek));
+                    }
+                }
+            }
+        }
+
+        // out[t] = d^exponents[t] / exponents[t]!
+        void scaledPowers(glm::dvec3 d, double* out) const {
+            double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1], pz[FMM_MAX_ORDER + 1];
+            px[0] = py[0] = pz[0] = 1.0;
+            for (unsigned int i = 1; i <= table_order; i++) {
+                px[i] = px[i - 1] * d.x / i;
+                py[i] = py[i - 1] * d.y / i;
+                pz[i] = pz[i - 1] * d.z / i;
+            }
+            for (int t = 0; t < term_count; t++)
+                out[t] = px[exponents[t].x] * py[exponents[t].y] * pz[exponents[t].z];
+        }
+
+        void collectLevels() {
+            level_cells.assign(1, 0);
+            level_begin.assign(1, 0);
+            while (level_begin.back() < level_cells.size()) {
+                uint32_t begin = level_begin.back(), end = (uint32_t)level_cells.size();
+                level_begin.push_back(end);
+                for (uint32_t k = begin; k < end; k++) {
+                    const Octree::Node& cell = tree.nodes[level_cells[k]];
+                    for (uint32_t child = cell.first_child; child < cell.first_child + cell.child_count; child++)
+                        level_cells.push_back(child);
+                }
+            }
+        }
+
+        // fn(c) for every cell of level l, in parallel
+        void forLevel(size_t l, const std::function<void(uint32_t)>& fn) {
+            parallelFor(level_begin[l + 1] - level_begin[l], [&](size_t begin, size_t end, unsigned int) {
+                for (size_t k = begin; k < end; k++)
+                    fn(level_cells[level_begin[l] + k]);
+            }, 8);
+        }
+
+        // P2M at leaves, M2M everywhere else, one level at a time from the deepest up
+        void upward() {
+            for (size_t l = level_begin.size() - 1; l-- > 0;)
+                forLevel(l, [&](uint32_t c) { upwardCell(c); });
+        }
+
+        void upwardCell(uint32_t c) {
+            const Octree::Node& cell = tree.nodes[c];
+            double* m = &multipoles[(size_t)c * term_count];
+            double shifted[FMM_MAX_TERMS];
+            if (cell.child_count == 0) {
+                for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++) {
+                    glm::dvec3 d = glm::dvec3(tree.tree_x[k], tree.tree_y[k], tree.tree_z[k]) - glm::dvec3(cell.com);
+                    scaledPowers(d, shifted);
+                    for (int t = 0; t < term_count; t++)
+                        m[t] += tree.tree_m[k] * shifted[t];
+                }
+                return;
+            }
+            for (uint32_t child = cell.first_child; child < cell.first_child + cell.child_count; child++) {
+                const double* mc = &multipoles[(size_t)child * term_count];
+                scaledPowers(glm::dvec3(tree.nodes[child].com) - glm::dvec3(cell.com), shifted);
+                for (size_t s = 0; s < shift_big.size(); s++)
+                    m[shift_big[s]] += shifted[shift_difference[s]] * mc[shift_small[s]];
+            }
+        }
+
+        bool wellSeparated(const Octree::Node& a, const Octree::Node& b) const {
+            float distance = glm::length(a.com - b.com);
+            return a.radius + b.radius < theta * distance;
+        }
+
+        // Dual tree traversal, breadth first from the root paired with itself. Every round sorts the
+        // pending pairs in parallel into well separated ones, leaf pairs and the pairs of children to
+        // look at next. The pairs are split in fixed blocks whose results are joined in order, so the
+        // lists and with them the sums come out the same whichever thread took a block.
+        void traverse() {
+            const size_t block = 256;
+            separated_pairs.clear();
+            leaf_pairs.clear();
+            frontier.assign(1, CellPair(0, 0));
+            while (!frontier.empty()) {
+                size_t blocks = (frontier.size() + block - 1) / block;
+                if (traversal_blocks.size() < blocks)
+                    traversal_blocks.resize(blocks);
+                parallelFor(blocks, [&](size_t begin, size_t end, unsigned int) {
+                    for (size_t b = begin; b < end; b++) {
+                        TraversalBlock& out = traversal_blocks[b];
+                        out.next.clear();
+                        out.separated.clear();
+                        out.leaves.clear();
+                        size_t last = (b + 1) * block < frontier.size() ? (b + 1) * block : frontier.size();
+                        for (size_t k = b * block; k < last; k++)
+                            split(frontier[k], &out);
+                    }
+                });
+                frontier.clear();
+                for (size_t b = 0; b < blocks; b++) {
+                    const TraversalBlock& out = traversal_blocks[b];
+                    separated_pairs.insert(separated_pairs.end(), out.separated.begin(), out.separated.end());
+                    leaf_pairs.insert(leaf_pairs.end(), out.leaves.begin(), out.leaves.end());
+                    frontier.insert(frontier.end(), out.next.begin(), out.next.end());
+                }
+            }
+        }
+
+        void split(CellPair pair, TraversalBlock* out) const {
+            uint32_t a = pair.first, b = pair.second;
+            const Octree::Node& cell_a = tree.nodes[a];
+            const Octree::Node& cell_b = tree.nodes[b];
+            bool leaf_a = cell_a.child_count == 0, leaf_b = cell_b.child_count == 0;
+            if (a == b) {
+                if (leaf_a) {
+                    out->leaves.push_back(pair);
+                    return;
+                }
+                uint32_t first = cell_a.first_child, last = cell_a.first_child + cell_a.child_count;
+                for (uint32_t i = first; i < last; i++)
+                    for (uint32_t j = i; j < last; j++)
+                        out->next.push_back(CellPair(i, j));
+                return;
+            }
+            if (wellSeparated(cell_a, cell_b)) {
+                out->separated.push_back(pair);
+                return;
+            }
+            if (leaf_a && leaf_b) {
+                out->leaves.push_back(pair);
+                return;
+            }
+            // split the bigger cell
+            if (leaf_b || (!leaf_a && cell_a.radius >= cell_b.radius)) {
+                for (uint32_t child = cell_a.first_child; child < cell_a.first_child + cell_a.child_count; child++)
+                    out->next.push_back(CellPair(child, b));
+            } else {
+                for (uint32_t child = cell_b.first_child; child < cell_b.first_child + cell_b.child_count; child++)
+                    out->next.push_back(CellPair(a, child));
+            }
+        }
+
+        // The pairs as one list of partners per cell, those of c are partners[offsets[c], offsets[c + 1]).
+        // A pair of a cell with itself is listed once.
+        void partnerLists(const std::vector<CellPair>& pairs, std::vector<uint32_t>* offsets, std::vector<uint32_t>* partners) const {
+            size_t cells = tree.nodes.size();
+            offsets->assign(cells + 1, 0);
+            for (const CellPair& pair : pairs) {
+                (*offsets)[pair.first + 1]++;
+                if (pair.second != pair.first)
+                    (*offsets)[pair.second + 1]++;
+            }
+            for (size_t c = 0; c < cells; c++)
+                (*offsets)[c + 1] += (*offsets)[c];
+            partners->resize((*offsets)[cells]);
+            std::vector<uint32_t> fill(offsets->begin(), offsets->end() - 1);
+            for (const CellPair& pair : pairs) {
+                (*partners)[fill[pair.first]++] = pair.second;
+                if (pair.second != pair.first)
+                    (*partners)[fill[pair.second]++] = pair.first;
+            }
+        }
+
+        // M2L for every well separated pair, gathered per cell so cells are processed in parallel.
+        // Each side derives its own D_n(z_B - z_A), with the shift from the cell to its partner B:
+        //     L_n(A) += -G (-1)^|n| sum_k D_{n+k}(z_B - z_A) M_k(B)
+        // FMM_LANES partners go through the recurrence and the sum side by side, so the inner loops run
+        // over contiguous lanes and vectorize. Unused lanes get a unit shift and no multipole.
+        void evaluateSeparatedPairs() {
+            std::vector<uint32_t> offsets, partners;
+            partnerLists(separated_pairs, &offsets, &partners);
+            parallelFor(tree.nodes.size(), [&](size_t begin, size_t end, unsigned int) {
+                double d[FMM_MAX_TERMS * FMM_LANES], m[FMM_MAX_TERMS * FMM_LANES], sum[FMM_MAX_TERMS * FMM_LANES];
+                double r[4][FMM_LANES], inv_r2[FMM_LANES];
+                for (size_t a = begin; a < end; a++) {
+                    if (offsets[a + 1] == offsets[a])
+                        continue;
+                    for (int t = 0; t < term_count * FMM_LANES; t++)
+                        sum[t] = 0.0;
+                    glm::dvec3 center = glm::dvec3(tree.nodes[a].com);
+                    for (uint32_t first = offsets[a]; first < offsets[a + 1]; first += FMM_LANES) {
+                        for (int lane = 0; lane < FMM_LANES; lane++) {
+                            glm::dvec3 shift = glm::dvec3(1.0, 0.0, 0.0);
+                            if (first + lane < offsets[a + 1]) {
+                                uint32_t b = partners[first + lane];
+                                shift = glm::dvec3(tree.nodes[b].com) - center;
+                                const double* mb = &multipoles[(size_t)b * term_count];
+                                for (int k = 0; k < term_count; k++)
+                                    m[k * FMM_LANES + lane] = mb[k];
+                            } else {
+                                for (int k = 0; k < term_count; k++)
+                                    m[k * FMM_LANES + lane] = 0.0;
+                            }
+                            r[0][lane] = shift.x;
+                            r[1][lane] = shift.y;
+                            r[2][lane] = shift.z;
+                            r[3][lane] = 1.0;
+                            inv_r2[lane] = 1.0 / glm::dot(shift, shift);
+                            d[lane] = std::sqrt(inv_r2[lane]);
+                        }
+
+                        // D_n of 1/|r| by the recurrence, lane by lane
+                        for (int t = 1; t < term_count; t++) {
+                            double out[FMM_LANES] = {};
+                            for (int q = recurrence_begin[t]; q < recurrence_begin[t + 1]; q++) {
+                                double c = recurrence_coefficient[q];
+                                const double* factor = r[recurrence_factor[q]];
+                                const double* lower = &d[recurrence_index[q] * FMM_LANES];
+                                for (int lane = 0; lane < FMM_LANES; lane++)
+                                    out[lane] += c * factor[lane] * lower[lane];
+                            }
+                            for (int lane = 0; lane < FMM_LANES; lane++)
+                                d[t * FMM_LANES + lane] = out[lane] * inv_r2[lane];
+                        }
+
+                        for (int k = 0; k < term_count; k++) {
+                            const int* index = &m2l_m[m2l_begin[k]];
+                            int count = m2l_begin[k + 1] - m2l_begin[k];
+                            const double* mk = &m[k * FMM_LANES];
+                            for (int n = 0; n < count; n++) {
+                                const double* dn = &d[index[n] * FMM_LANES];
+                                double* sn = &sum[n * FMM_LANES];
+                                for (int lane = 0; lane < FMM_LANES; lane++)
+                                    sn[lane] += dn[lane] * mk[lane];
+                            }
+                        }
+                    }
+                    double* l = &locals[a * term_count];
+                    for (int n = 0; n < term_count; n++) {
+                        double total = 0.0;
+                        for (int lane = 0; lane < FMM_LANES; lane++)
+                            total += sum[n * FMM_LANES + lane];
+                        l[n] -= G * sign[n] * total;
+                    }
+                }
+            }, 16);
+        }
+
+        // P2P for every leaf pair the traversal could not separate. Each leaf gathers the bodies of
+        // all its partners and runs them through the direct kernel, so the pair is evaluated once
+        // per side. That costs twice the flops of a mutual update but vectorizes, and leaves own
+        // disjoint bodies so they can be processed in parallel.
+        void evaluateLeafPairs() {
+            size_t cells = tree.nodes.size();
+            std::vector<uint32_t> offsets, partners;
+            partnerLists(leaf_pairs, &offsets, &partners);
+
+            std::vector<uint32_t> leaves;
+            for (uint32_t c = 0; c < cells; c++)
+                if (offsets[c + 1] > offsets[c])
+                    leaves.push_back(c);
+
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            float eps2 = softening * softening;
+            parallelFor(leaves.size(), [&](size_t begin, size_t end, unsigned int) {
+                AlignedArray<float> tx, ty, tz, tax, tay, taz, sx, sy, sz, sm;
+                for (size_t l = begin; l < end; l++) {
+                    const Octree::Node& leaf = tree.nodes[leaves[l]];
+                    size_t padded = (leaf.body_count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+                    AlignedArray<float>* target_arrays[] = {&tx, &ty, &tz, &tax, &tay, &taz};
+                    for (AlignedArray<float>* array : target_arrays) {
+                        array->resize(0);
+                        array->resize(padded);
+                    }
+                    for (uint32_t k = 0; k < leaf.body_count; k++) {
+                        tx[k] = tree.tree_x[leaf.body_begin + k];
+                        ty[k] = tree.tree_y[leaf.body_begin + k];
+                        tz[k] = tree.tree_z[leaf.body_begin + k];
+                    }
+
+                    size_t sources = 0;
+                    for (uint32_t p = offsets[leaves[l]]; p < offsets[leaves[l] + 1]; p++)
+                        sources += tree.nodes[partners[p]].body_count;
+                    size_t sources_padded = (sources + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+                    AlignedArray<float>* source_arrays[] = {&sx, &sy, &sz, &sm};
+                    for (AlignedArray<float>* array : source_arrays) {
+                        array->resize(0);
+                        array->resize(sources_padded);
+                    }
+                    size_t s = 0;
+                    for (uint32_t p = offsets[leaves[l]]; p < offsets[leaves[l] + 1]; p++) {
+                        const Octree::Node& partner = tree.nodes[partners[p]];
+                        for (uint32_t k = partner.body_begin; k < partner.body_begin + partner.body_count; k++, s++) {
+                            sx[s] = tree.tree_x[k];
+                            sy[s] = tree.tree_y[k];
+                            sz[s] = tree.tree_z[k];
+                            sm[s] = tree.tree_m[k];
+                        }
+                    }
+
+                    kernels.tiled(tx.data(), ty.data(), tz.data(), 0, padded, sx.data(), sy.data(), sz.data(), sm.data(),
+                                  sources_padded, eps2, tax.data(), tay.data(), taz.data());
+                    for (uint32_t k = 0; k < leaf.body_count; k++) {
+                        ax[leaf.body_begin + k] += G * tax[k];
+                        ay[leaf.body_begin + k] += G * tay[k];
+                        az[leaf.body_begin + k] += G * taz[k];
+                    }
+                }
+            }, 4);
+        }
+
+        // L2L into children, L2P at leaves, one level at a time from the root down:
+        //     a = -grad phi, grad_i phi = sum_n L_n h^(n - e_i) / (n - e_i)!
+        void downward() {
+            for (size_t l = 0; l + 1 < level_begin.size(); l++)
+                forLevel(l, [&](uint32_t c) { downwardCell(c); });
+        }
+
+        void downwardCell(uint32_t c) {
+            const Octree::Node& cell = tree.nodes[c];
+            const double* l = &locals[(size_t)c * term_count];
+            double h_powers[FMM_MAX_TERMS];
+            if (cell.child_count == 0) {
+                for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++) {
+                    glm::dvec3 h = glm::dvec3(tree.tree_x[k], tree.tree_y[k], tree.tree_z[k]) - glm::dvec3(cell.com);
+                    scaledPowers(h, h_powers);
+                    glm::dvec3 grad = glm::dvec3(0.0);
+                    for (int t = 1; t < term_count; t++) {
+                        for (int i = 0; i < 3; i++) {
+                            int lower = derivative[i][t];
+                            if (lower >= 0)
+                                grad[i] += l[t] * h_powers[lower];
+                        }
+                    }
+                    ax[k] -= grad.x;
+                    ay[k] -= grad.y;
+                    az[k] -= grad.z;
+                }
+                return;
+            }
+            for (uint32_t child = cell.first_child; child < cell.first_child + cell.child_count; child++) {
+                double* lc = &locals[(size_t)child * term_count];
+                scaledPowers(glm::dvec3(tree.nodes[child].com) - glm::dvec3(cell.com), h_powers);
+                for (size_t s = 0; s < shift_big.size(); s++)
+                    lc[shift_small[s]] += h_powers[shift_difference[s]] * l[shift_big[s]];
+            }
+        }
+};
+
+// benchmark ------------------------------------------------------------------------------------------
+#ifdef FMM_MAIN_CPP
+#include <chrono>
+#include <random>
+#include "barnes_hut.cpp"
+
+// mean relative error over the first samples bodies against a double precision direct sum
+double sampledError(BodyStore* bodies, size_t samples, float softening) {
+    double sum = 0.0;
+    for (size_t i = 0; i < samples; i++) {
+        glm::dvec3 reference = glm::dvec3(0.0);
+        for (size_t j = 0; j < bodies->size(); j++) {
+            glm::dvec3 d = glm::dvec3(bodies->getPosition(j)) - glm::dvec3(bodies->getPosition(i));
+            double r2 = glm::dot(d, d) + (double)softening * softening;
+            if (r2 > 0.0)
+                reference += (double)bodies->mass[j] * d / (r2 * std::sqrt(r2));
+        }
+        sum += glm::length(glm::dvec3(bodies->getAcceleration(i)) - reference) / glm::length(reference);
+    }
+    return sum / samples;
+}
+
+double timeSolver(ForceSolver* solver, BodyStore* bodies) {
+    auto start = std::chrono::steady_clock::now();
+    solver->computeAccelerations(bodies);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// usage: fmm_bench [max bodies] [order]
+int main(int argc, char** argv) {
+    size_t max_n = argc > 1 ? (size_t)std::atol(argv[1]) : 131072;
+    unsigned int order = argc > 2 ? (unsigned int)std::atoi(argv[2]) : 6;
+    const float softening = 0.001f;
+    const size_t samples = 128;
+
+    BarnesHutSolver tree = BarnesHutSolver(1.0f, softening, 0.5f);
+    FmmSolver fmm = FmmSolver(1.0f, softening, order);
+
+    std::cout << "workers: " << workerCount() << ", fmm order " << order << std::endl;
+    std::cout << "bodies\ttree ms\ttree err\tfmm ms\tfmm err\tfmm momentum" << std::endl;
+
+    size_t crossover = 0;
+    for (size_t n = 1024; n <= max_n; n *= 2) {
+        // Plummer sphere
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        BodyStore bodies;
+        bodies.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            double radius = 1.0 / std::sqrt(std::pow(uniform(rng) * 0.99 + 0.001, -2.0 / 3.0) - 1.0);
+            double cos_t = 2.0 * uniform(rng) - 1.0, phi = 6.283185307179586 * uniform(rng);
+            double sin_t = std::sqrt(1.0 - cos_t * cos_t);
+            bodies.addBody(glm::vec3(radius * sin_t * std::cos(phi), radius * sin_t * std::sin(phi), radius * cos_t), glm::vec3(0.0f), 1.0f / n);
+        }
+
+        double tree_ms = timeSolver(&tree, &bodies);
+        double tree_error = sampledError(&bodies, samples, softening);
+        double fmm_ms = timeSolver(&fmm, &bodies);
+        double fmm_error = sampledError(&bodies, samples, softening);
+
+        glm::dvec3 momentum = glm::dvec3(0.0);
+        double scale = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            momentum += (double)bodies.mass[i] * glm::dvec3(bodies.getAcceleration(i));
+            scale += bodies.mass[i] * glm::length(bodies.getAcceleration(i));
+        }
+        double momentum_error = glm::length(momentum) / scale;
+
+        std::cout << n << "\t" << tree_ms << "\t" << tree_error << "\t" << fmm_ms << "\t" << fmm_error << "\t" << momentum_error << std::endl;
+        // the smallest size from which fmm stays ahead, in time and in accuracy
+        if (fmm_ms >= tree_ms || fmm_error > tree_error)
+            crossover = 0;
+        else if (crossover == 0)
+            crossover = n;
+        if (fmm_error > 1e-2 || momentum_error > 1e-4) {
+            std::cerr << "fmm forces are off" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    if (crossover != 0)
+        std::cout << "fmm is faster and as accurate as the tree code from " << crossover << " bodies" << std::endl;
+    else
+        std::cout << "fmm did not overtake the tree code up to " << max_n << " bodies" << std::endl;
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
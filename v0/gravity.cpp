@@ -0,0 +1,408 @@
+#ifndef GRAVITY_CPP
+#define GRAVITY_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define GRAVITY_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "simd.cpp"
+
+#ifdef SIMD_X86
+#define GRAVITY_X86
+#endif
+
+// kernels per instruction set ------------------------------------------------------------------------
+
+// squared distances below this count as coincident, r2^-3/2 of anything smaller overflows a float
+#define GRAVITY_MIN_R2 1e-24f
+
+namespace gravity_scalar {
+    typedef float vfloat;
+    static const size_t WIDTH = 1;
+    inline vfloat vzero() { return 0.0f; }
+    inline vfloat vset1(float a) { return a; }
+    inline vfloat vload(const float* p) { return *p; }
+    inline void vstore(float* p, vfloat a) { *p = a; }
+    inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+    inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+    inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+    inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+    inline vfloat vrsqrt(vfloat r2) { return r2 > GRAVITY_MIN_R2 ? 1.0f / std::sqrt(r2) : 0.0f; }
+    inline vfloat vrsqrt3(vfloat r2) { return r2 > GRAVITY_MIN_R2 ? 1.0f / (r2 * std::sqrt(r2)) : 0.0f; }
+    inline float vhsum(vfloat a) { return a; }
+    #include "gravity_kernel.inl"
+}
+
+#ifdef GRAVITY_X86
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace gravity_sse {
+    typedef __m128 vfloat;
+    static const size_t WIDTH = 4;
+    inline vfloat vzero() { return _mm_setzero_ps(); }
+    inline vfloat vset1(float a) { return _mm_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm_load_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+    inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    inline vfloat vrsqrt(vfloat r2) {
+        // estimate plus one Newton step, masked to zero for coincident bodies
+        vfloat y = _mm_rsqrt_ps(r2);
+        y = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r2), _mm_mul_ps(y, y))));
+        return _mm_and_ps(y, _mm_cmpgt_ps(r2, _mm_set1_ps(GRAVITY_MIN_R2)));
+    }
+    inline vfloat vrsqrt3(vfloat r2) {
+        vfloat y = vrsqrt(r2);
+        return _mm_mul_ps(y, _mm_mul_ps(y, y));
+    }
+    inline float vhsum(vfloat a) {
+        vfloat shuf = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+        vfloat sums = _mm_add_ps(a, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+    }
+    #include "gravity_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace gravity_avx2 {
+    typedef __m256 vfloat;
+    static const size_t WIDTH = 8;
+    inline vfloat vzero() { return _mm256_setzero_ps(); }
+    inline vfloat vset1(float a) { return _mm256_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm256_load_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm256_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+    inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+    inline vfloat vrsqrt(vfloat r2) {
+        vfloat y = _mm256_rsqrt_ps(r2);
+        vfloat half_r2 = _mm256_mul_ps(_mm256_set1_ps(0.5f), r2);
+        y = _mm256_mul_ps(y, _mm256_fnmadd_ps(half_r2, _mm256_mul_ps(y, y), _mm256_set1_ps(1.5f)));
+        return _mm256_and_ps(y, _mm256_cmp_ps(r2, _mm256_set1_ps(GRAVITY_MIN_R2), _CMP_GT_OQ));
+    }
+    inline vfloat vrsqrt3(vfloat r2) {
+        vfloat y = vrsqrt(r2);
+        return _mm256_mul_ps(y, _mm256_mul_ps(y, y));
+    }
+    inline float vhsum(vfloat a) {
+        __m128 sums = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        __m128 shuf = _mm_movehdup_ps(sums);
+        sums = _mm_add_ps(sums, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+    }
+    #include "gravity_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace gravity_avx512 {
+    typedef __m512 vfloat;
+    static const size_t WIDTH = 16;
+    inline vfloat vzero() { return _mm512_setzero_ps(); }
+    inline vfloat vset1(float a) { return _mm512_set1_ps(a); }
+    inline vfloat vload(const float* p) { return _mm512_load_ps(p); }
+    inline void vstore(float* p, vfloat a) { _mm512_store_ps(p, a); }
+    inline vfloat vadd(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+    inline vfloat vsub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+    inline vfloat vmul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+    inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+    inline vfloat vrsqrt(vfloat r2) {
+        vfloat y = _mm512_rsqrt14_ps(r2);
+        vfloat half_r2 = _mm512_mul_ps(_mm512_set1_ps(0.5f), r2);
+        y = _mm512_mul_ps(y, _mm512_fnmadd_ps(half_r2, _mm512_mul_ps(y, y), _mm512_set1_ps(1.5f)));
+        return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(r2, _mm512_set1_ps(GRAVITY_MIN_R2), _CMP_GT_OQ), y);
+    }
+    inline vfloat vrsqrt3(vfloat r2) {
+        vfloat y = vrsqrt(r2);
+        return _mm512_mul_ps(y, _mm512_mul_ps(y, y));
+    }
+    inline float vhsum(vfloat a) { return _mm512_reduce_add_ps(a); }
+    #include "gravity_kernel.inl"
+}
+#pragma GCC pop_options
+#endif
+
+typedef void (*TiledKernel)(const float*, const float*, const float*, size_t, size_t,
+                            const float*, const float*, const float*, const float*, size_t,
+                            float, float*, float*, float*);
+typedef void (*PairKernel)(const float*, const float*, const float*, const float*,
+                           size_t, size_t, size_t, size_t, float, float*, float*, float*);
+typedef void (*QuadrupoleKernel)(const float*, const float*, const float*, size_t, size_t,
+                                 const float*, const float*, const float*, const float* const*, size_t,
+                                 float, float*, float*, float*);
+typedef void (*JerkKernel)(const float* const*, size_t, size_t, const float* const*, size_t, float, float* const*);
+typedef void (*HermitePredictKernel)(const double*, const double*, const double*, const double*, const int32_t*, int32_t, double,
+                                     size_t, size_t, float*, float*);
+typedef void (*HermiteCorrectKernel)(double*, double*, double*, double*, const float*, const float*, const double*, double,
+                                     size_t, size_t, float*, float*);
+
+typedef struct {
+    TiledKernel tiled;
+    PairKernel pairs;
+    QuadrupoleKernel quadrupoles;
+    JerkKernel jerk;
+    HermitePredictKernel predict;
+    HermiteCorrectKernel correct;
+} GravityKernels;
+
+GravityKernels selectGravityKernels(SimdLevel level) {
+    GravityKernels kernels = {gravity_scalar::accumulateTiled, gravity_scalar::accumulatePairs, gravity_scalar::accumulateQuadrupoles,
+                              gravity_scalar::accumulateJerk, gravity_scalar::predictHermite, gravity_scalar::correctHermite};
+#ifdef GRAVITY_X86
+    switch (level) {
+    case SIMD_AVX512:
+        kernels = {gravity_avx512::accumulateTiled, gravity_avx512::accumulatePairs, gravity_avx512::accumulateQuadrupoles,
+                   gravity_avx512::accumulateJerk, gravity_avx512::predictHermite, gravity_avx512::correctHermite};
+        break;
+    case SIMD_AVX2:
+        kernels = {gravity_avx2::accumulateTiled, gravity_avx2::accumulatePairs, gravity_avx2::accumulateQuadrupoles,
+                   gravity_avx2::accumulateJerk, gravity_avx2::predictHermite, gravity_avx2::correctHermite};
+        break;
+    case SIMD_SSE:
+        kernels = {gravity_sse::accumulateTiled, gravity_sse::accumulatePairs, gravity_sse::accumulateQuadrupoles,
+                   gravity_sse::accumulateJerk, gravity_sse::predictHermite, gravity_sse::correctHermite};
+        break;
+    default:
+        break;
+    }
+#endif
+    return kernels;
+}
+
+// classes --------------------------------------------------------------------------------------------
+
+// Common interface of every gravity backend. computeAccelerations overwrites acc_x/y/z of
+// the store with the gravitational acceleration of each body, using Plummer softening:
+//     a_i = G * sum_j m_j (x_j - x_i) / (|x_j - x_i|^2 + softening^2)^(3/2)
+class ForceSolver {
+    public:
+        float G = 1.0f;
+        float softening = 0.05f;
+
+        virtual ~ForceSolver() {}
+        virtual const char* name() = 0;
+        virtual void computeAccelerations(BodyStore* bodies) = 0;
+
+        // Accelerations of only the bodies listed in active, for integrators that give bodies steps
+        // of their own. What the store holds for the others is unspecified afterwards. Solvers that
+        // cannot evaluate a subset for less than everyone fall back to computeAccelerations.
+        virtual void computeActiveAccelerations(BodyStore* bodies, const std::vector<uint32_t>&) {
+            computeAccelerations(bodies);
+        }
+};
+
+// O(N^2) direct summation, vectorized with the widest instruction set the cpu supports
+class DirectSolver : public ForceSolver {
+    private:
+        // per worker scratch accumulators for the third law path, 3 arrays per worker
+        std::vector<AlignedArray<float>> thread_acc;
+        // active bodies gathered into contiguous targets, with their accelerations
+        AlignedArray<float> active_x, active_y, active_z, active_ax, active_ay, active_az;
+
+    public:
+        SimdLevel simd_level;
+        // visit each pair once and apply the force to both bodies, halves the flops but needs
+        // per-thread accumulators that are reduced afterwards
+        bool newton_third_law = false;
+
+        DirectSolver(float G = 1.0f, float softening = 0.05f) {
+            this->G = G;
+            this->softening = softening;
+            simd_level = detectSimdLevel();
+        }
+
+        const char* name() override { return "direct"; }
+
+        void computeAccelerations(BodyStore* bodies) override {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            if (newton_third_law)
+                accumulateSymmetric(bodies, kernels.pairs);
+            else
+                accumulateTiledParallel(bodies, kernels.tiled);
+
+            size_t n = bodies->paddedSize();
+            float* ax = bodies->acc_x.data();
+            float* ay = bodies->acc_y.data();
+            float* az = bodies->acc_z.data();
+            for (size_t i = 0; i < n; i++) {
+                ax[i] *= G;
+                ay[i] *= G;
+                az[i] *= G;
+            }
+        }
+
+        // the active bodies are packed into aligned target arrays and run through the tiled kernel
+        // against every body, so a small active set costs only its share of the full sum
+        void computeActiveAccelerations(BodyStore* bodies, const std::vector<uint32_t>& active) override {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            size_t count = active.size();
+            size_t padded = (count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+            AlignedArray<float>* arrays[] = {&active_x, &active_y, &active_z, &active_ax, &active_ay, &active_az};
+            for (AlignedArray<float>* array : arrays) {
+                array->resize(padded);
+                std::memset((void*)array->data(), 0, padded * sizeof(float));
+            }
+            for (size_t k = 0; k < count; k++) {
+                active_x[k] = bodies->pos_x[active[k]];
+                active_y[k] = bodies->pos_y[active[k]];
+                active_z[k] = bodies->pos_z[active[k]];
+            }
+
+            size_t n = bodies->paddedSize();
+            float eps2 = softening * softening;
+            parallelFor(padded / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                kernels.tiled(active_x.data(), active_y.data(), active_z.data(), begin * BODY_PADDING, end * BODY_PADDING,
+                              bodies->pos_x.data(), bodies->pos_y.data(), bodies->pos_z.data(), bodies->mass.data(), n,
+                              eps2, active_ax.data(), active_ay.data(), active_az.data());
+            }, 1);
+
+            for (size_t k = 0; k < count; k++) {
+                bodies->acc_x[active[k]] = G * active_ax[k];
+                bodies->acc_y[active[k]] = G * active_ay[k];
+                bodies->acc_z[active[k]] = G * active_az[k];
+            }
+        }
+
+    private:
+        void accumulateTiledParallel(BodyStore* bodies, TiledKernel tiled) {
+            bodies->clearAccelerations();
+            size_t n = bodies->paddedSize();
+            float eps2 = softening * softening;
+            // hand out work in whole padding units so every range stays register aligned
+            parallelFor(n / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                tiled(bodies->pos_x.data(), bodies->pos_y.data(), bodies->pos_z.data(), begin * BODY_PADDING, end * BODY_PADDING,
+                      bodies->pos_x.data(), bodies->pos_y.data(), bodies->pos_z.data(), bodies->mass.data(), n,
+                      eps2, bodies->acc_x.data(), bodies->acc_y.data(), bodies->acc_z.data());
+            }, 4);
+        }
+
+        void accumulateSymmetric(BodyStore* bodies, PairKernel pairs) {
+            const size_t block = 512;
+            size_t n = bodies->paddedSize();
+            size_t real = bodies->size();
+            size_t blocks = (n + block - 1) / block;
+            float eps2 = softening * softening;
+
+            unsigned int workers = workerCount();
+            if (thread_acc.size() != 3 * (size_t)workers)
+                thread_acc.resize(3 * (size_t)workers);
+            for (AlignedArray<float>& acc : thread_acc) {
+                acc.resize(n);
+                std::memset((void*)acc.data(), 0, n * sizeof(float));
+            }
+
+            std::vector<std::pair<size_t, size_t>> block_pairs;
+            for (size_t bi = 0; bi < blocks; bi++)
+                for (size_t bj = bi; bj < blocks; bj++)
+                    block_pairs.push_back({bi, bj});
+
+            parallelFor(block_pairs.size(), [&](size_t begin, size_t end, unsigned int worker) {
+                float* ax = thread_acc[3 * worker].data();
+                float* ay = thread_acc[3 * worker + 1].data();
+                float* az = thread_acc[3 * worker + 2].data();
+                for (size_t p = begin; p < end; p++) {
+                    size_t i_begin = block_pairs[p].first * block;
+                    size_t i_end = i_begin + block < real ? i_begin + block : real;
+                    size_t j_begin = block_pairs[p].second * block;
+                    size_t j_end = j_begin + block < n ? j_begin + block : n;
+                    pairs(bodies->pos_x.data(), bodies->pos_y.data(), bodies->pos_z.data(), bodies->mass.data(),
+                          i_begin, i_end, j_begin, j_end, eps2, ax, ay, az);
+                }
+            });
+
+            // reduce the per worker accumulators into the store
+            parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    float sx = 0.0f, sy = 0.0f, sz = 0.0f;
+                    for (unsigned int w = 0; w < workers; w++) {
+                        sx += thread_acc[3 * w][i];
+                        sy += thread_acc[3 * w + 1][i];
+                        sz += thread_acc[3 * w + 2][i];
+                    }
+                    bodies->acc_x[i] = sx;
+                    bodies->acc_y[i] = sy;
+                    bodies->acc_z[i] = sz;
+                }
+            }, 4096);
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef GRAVITY_MAIN_CPP
+#include <chrono>
+#include <random>
+
+int main() {
+    const size_t n = 2000;
+    const float softening = 0.01f;
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+    BodyStore bodies;
+    for (size_t i = 0; i < n; i++)
+        bodies.addBody(glm::vec3(uniform(rng), uniform(rng), uniform(rng)), glm::vec3(0.0f), 0.5f + 0.5f * uniform(rng));
+
+    // double precision reference
+    std::vector<glm::dvec3> reference(n, glm::dvec3(0.0));
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            glm::dvec3 d = glm::dvec3(bodies.getPosition(j)) - glm::dvec3(bodies.getPosition(i));
+            double r2 = glm::dot(d, d) + (double)softening * softening;
+            reference[i] += (double)bodies.mass[j] * d / (r2 * std::sqrt(r2));
+        }
+    }
+
+    SimdLevel best = detectSimdLevel();
+    std::cout << "detected simd level: " << simdLevelName(best) << std::endl;
+    for (int level = SIMD_SCALAR; level <= (int)best; level++) {
+        for (int third_law = 0; third_law < 2; third_law++) {
+            DirectSolver solver = DirectSolver(1.0f, softening);
+            solver.simd_level = (SimdLevel)level;
+            solver.newton_third_law = third_law;
+
+            auto start = std::chrono::steady_clock::now();
+            solver.computeAccelerations(&bodies);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            double max_error = 0.0;
+            glm::dvec3 momentum = glm::dvec3(0.0);
+            for (size_t i = 0; i < n; i++) {
+                glm::dvec3 a = glm::dvec3(bodies.getAcceleration(i));
+                max_error = std::fmax(max_error, glm::length(a - reference[i]) / glm::length(reference[i]));
+                momentum += (double)bodies.mass[i] * a;
+            }
+            std::cout << simdLevelName((SimdLevel)level) << (third_law ? " +third law" : "") << ": "
+                      << ms << " ms, max relative error " << max_error << std::endl;
+            if (max_error > 1e-3) {
+                std::cerr << "accelerations do not match the reference" << std::endl;
+                return FAILURE;
+            }
+            if (third_law && glm::length(momentum) > 1e-2) {
+                std::cerr << "third law path does not conserve momentum: " << glm::length(momentum) << std::endl;
+                return FAILURE;
+            }
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,251 @@
+// Pairwise gravity kernels, included once per instruction set by gravity.cpp.
+// The including namespace provides vfloat, WIDTH and the v* helpers below, and
+// the surrounding #pragma GCC target decides which instructions they compile to.
+//
+//   vzero, vset1, vload, vstore, vadd, vsub, vmul, vfmadd(a, b, c) = a * b + c,
+//   vrsqrt(r2) = r2^-1/2 and vrsqrt3(r2) = r2^-3/2 (both 0 where r2 <= GRAVITY_MIN_R2), vhsum
+
+// i-bodies held in registers at once, WIDTH bodies per register
+#define GRAVITY_I_TILE 2
+// j-bodies streamed per pass, 4 floats each so 1024 of them use 16KB of L1
+#define GRAVITY_J_BLOCK 1024
+
+// Accumulates the (unscaled by G) acceleration of targets [i_begin, i_end) at tx/ty/tz from the sources
+// [0, n) at px/py/pz with masses m. Targets and sources may be the same arrays. i_begin, i_end and n
+// must be multiples of WIDTH, the accumulators are added to, not overwritten.
+static void accumulateTiled(const float* tx, const float* ty, const float* tz, size_t i_begin, size_t i_end,
+                            const float* px, const float* py, const float* pz, const float* m, size_t n,
+                            float eps2, float* ax, float* ay, float* az) {
+    const vfloat v_eps2 = vset1(eps2);
+
+    for (size_t j_begin = 0; j_begin < n; j_begin += GRAVITY_J_BLOCK) {
+        size_t j_end = j_begin + GRAVITY_J_BLOCK < n ? j_begin + GRAVITY_J_BLOCK : n;
+
+        size_t i = i_begin;
+        for (; i + GRAVITY_I_TILE * WIDTH <= i_end; i += GRAVITY_I_TILE * WIDTH) {
+            vfloat xi[GRAVITY_I_TILE], yi[GRAVITY_I_TILE], zi[GRAVITY_I_TILE];
+            vfloat sx[GRAVITY_I_TILE], sy[GRAVITY_I_TILE], sz[GRAVITY_I_TILE];
+            for (int t = 0; t < GRAVITY_I_TILE; t++) {
+                xi[t] = vload(tx + i + t * WIDTH);
+                yi[t] = vload(ty + i + t * WIDTH);
+                zi[t] = vload(tz + i + t * WIDTH);
+                sx[t] = vload(ax + i + t * WIDTH);
+                sy[t] = vload(ay + i + t * WIDTH);
+                sz[t] = vload(az + i + t * WIDTH);
+            }
+            for (size_t j = j_begin; j < j_end; j++) {
+                vfloat xj = vset1(px[j]), yj = vset1(py[j]), zj = vset1(pz[j]), mj = vset1(m[j]);
+                for (int t = 0; t < GRAVITY_I_TILE; t++) {
+                    vfloat dx = vsub(xj, xi[t]);
+                    vfloat dy = vsub(yj, yi[t]);
+                    vfloat dz = vsub(zj, zi[t]);
+                    vfloat r2 = vfmadd(dx, dx, vfmadd(dy, dy, vfmadd(dz, dz, v_eps2)));
+                    vfloat s = vmul(mj, vrsqrt3(r2));
+                    sx[t] = vfmadd(dx, s, sx[t]);
+                    sy[t] = vfmadd(dy, s, sy[t]);
+                    sz[t] = vfmadd(dz, s, sz[t]);
+                }
+            }
+            for (int t = 0; t < GRAVITY_I_TILE; t++) {
+                vstore(ax + i + t * WIDTH, sx[t]);
+                vstore(ay + i + t * WIDTH, sy[t]);
+                vstore(az + i + t * WIDTH, sz[t]);
+            }
+        }
+        // leftover single register
+        for (; i < i_end; i += WIDTH) {
+            vfloat xi = vload(tx + i), yi = vload(ty + i), zi = vload(tz + i);
+            vfloat sx = vload(ax + i), sy = vload(ay + i), sz = vload(az + i);
+            for (size_t j = j_begin; j < j_end; j++) {
+                vfloat dx = vsub(vset1(px[j]), xi);
+                vfloat dy = vsub(vset1(py[j]), yi);
+                vfloat dz = vsub(vset1(pz[j]), zi);
+                vfloat r2 = vfmadd(dx, dx, vfmadd(dy, dy, vfmadd(dz, dz, v_eps2)));
+                vfloat s = vmul(vset1(m[j]), vrsqrt3(r2));
+                sx = vfmadd(dx, s, sx);
+                sy = vfmadd(dy, s, sy);
+                sz = vfmadd(dz, s, sz);
+            }
+            vstore(ax + i, sx);
+            vstore(ay + i, sy);
+            vstore(az + i, sz);
+        }
+    }
+}
+
+// Newton's third law variant: visits every pair (i, j) with i in [i_begin, i_end), j in [j_begin, j_end)
+// and j > i once, adding to both bodies. j_begin and j_end must be multiples of WIDTH.
+static void accumulatePairs(const float* px, const float* py, const float* pz, const float* m,
+                            size_t i_begin, size_t i_end, size_t j_begin, size_t j_end,
+                            float eps2, float* ax, float* ay, float* az) {
+    const vfloat v_eps2 = vset1(eps2);
+
+    for (size_t i = i_begin; i < i_end; i++) {
+        size_t j = j_begin > i + 1 ? j_begin : i + 1;
+        if (j >= j_end)
+            continue;
+        float xi = px[i], yi = py[i], zi = pz[i], mi = m[i];
+        float six = 0.0f, siy = 0.0f, siz = 0.0f;
+
+        // scalar lead-in up to the next register boundary
+        for (; j < j_end && j % WIDTH != 0; j++) {
+            float dx = px[j] - xi, dy = py[j] - yi, dz = pz[j] - zi;
+            float r2 = dx * dx + dy * dy + dz * dz + eps2;
+            float s = r2 > GRAVITY_MIN_R2 ? 1.0f / (r2 * std::sqrt(r2)) : 0.0f;
+            six += m[j] * s * dx;
+            siy += m[j] * s * dy;
+            siz += m[j] * s * dz;
+            ax[j] -= mi * s * dx;
+            ay[j] -= mi * s * dy;
+            az[j] -= mi * s * dz;
+        }
+
+        vfloat v_xi = vset1(xi), v_yi = vset1(yi), v_zi = vset1(zi), v_mi = vset1(mi);
+        vfloat sx = vzero(), sy = vzero(), sz = vzero();
+        for (; j < j_end; j += WIDTH) {
+            vfloat dx = vsub(vload(px + j), v_xi);
+            vfloat dy = vsub(vload(py + j), v_yi);
+            vfloat dz = vsub(vload(pz + j), v_zi);
+            vfloat r2 = vfmadd(dx, dx, vfmadd(dy, dy, vfmadd(dz, dz, v_eps2)));
+            vfloat s = vrsqrt3(r2);
+            vfloat sj = vmul(vload(m + j), s);
+            sx = vfmadd(dx, sj, sx);
+            sy = vfmadd(dy, sj, sy);
+            sz = vfmadd(dz, sj, sz);
+            vfloat si = vmul(v_mi, s);
+            vstore(ax + j, vsub(vload(ax + j), vmul(dx, si)));
+            vstore(ay + j, vsub(vload(ay + j), vmul(dy, si)));
+            vstore(az + j, vsub(vload(az + j), vmul(dz, si)));
+        }
+        ax[i] += six + vhsum(sx);
+        ay[i] += siy + vhsum(sy);
+        az[i] += siz + vhsum(sz);
+    }
+}
+
+// Quadrupole part of the field of n cells at cx/cy/cz with traceless tensors quad[0..5] (xx xy xz yy yz zz)
+// on targets [i_begin, i_end), r measured from the cell and softened like the monopole:
+//     a += Q r / r^5 - 5/2 (r^T Q r) r / r^7
+static void accumulateQuadrupoles(const float* tx, const float* ty, const float* tz, size_t i_begin, size_t i_end,
+                                  const float* cx, const float* cy, const float* cz, const float* const* quad, size_t n,
+                                  float eps2, float* ax, float* ay, float* az) {
+    const vfloat v_eps2 = vset1(eps2);
+    const vfloat v_five_halves = vset1(2.5f);
+
+    for (size_t i = i_begin; i < i_end; i += WIDTH) {
+        vfloat xi = vload(tx + i), yi = vload(ty + i), zi = vload(tz + i);
+        vfloat sx = vload(ax + i), sy = vload(ay + i), sz = vload(az + i);
+        for (size_t c = 0; c < n; c++) {
+            vfloat rx = vsub(xi, vset1(cx[c]));
+            vfloat ry = vsub(yi, vset1(cy[c]));
+            vfloat rz = vsub(zi, vset1(cz[c]));
+            vfloat q0 = vset1(quad[0][c]), q1 = vset1(quad[1][c]), q2 = vset1(quad[2][c]);
+            vfloat q3 = vset1(quad[3][c]), q4 = vset1(quad[4][c]), q5 = vset1(quad[5][c]);
+
+            vfloat inv = vrsqrt(vfmadd(rx, rx, vfmadd(ry, ry, vfmadd(rz, rz, v_eps2))));
+            vfloat inv2 = vmul(inv, inv);
+            vfloat inv5 = vmul(inv, vmul(inv2, inv2));
+            vfloat qx = vfmadd(q0, rx, vfmadd(q1, ry, vmul(q2, rz)));
+            vfloat qy = vfmadd(q1, rx, vfmadd(q3, ry, vmul(q4, rz)));
+            vfloat qz = vfmadd(q2, rx, vfmadd(q4, ry, vmul(q5, rz)));
+            vfloat rqr = vmul(vmul(v_five_halves, vfmadd(rx, qx, vfmadd(ry, qy, vmul(rz, qz)))), vmul(inv5, inv2));
+            sx = vfmadd(inv5, qx, vsub(sx, vmul(rqr, rx)));
+            sy = vfmadd(inv5, qy, vsub(sy, vmul(rqr, ry)));
+            sz = vfmadd(inv5, qz, vsub(sz, vmul(rqr, rz)));
+        }
+        vstore(ax + i, sx);
+        vstore(ay + i, sy);
+        vstore(az + i, sz);
+    }
+}
+
+// Acceleration and jerk of targets [i_begin, i_end) in one pass over the sources [0, n), for Hermite
+// integration. targets holds the arrays x y z vx vy vz, sources the same plus m, out ax ay az jx jy jz.
+// With r and v of the source relative to the target and r^2 softened:
+//     a += m r / r^3,    j += m (v / r^3 - 3 (r . v) r / r^5)
+// i_begin and i_end must be multiples of WIDTH, the accumulators are added to, not overwritten.
+static void accumulateJerk(const float* const* targets, size_t i_begin, size_t i_end,
+                           const float* const* sources, size_t n, float eps2, float* const* out) {
+    const vfloat v_eps2 = vset1(eps2);
+    const vfloat v_three = vset1(3.0f);
+    const float* px = sources[0];
+    const float* py = sources[1];
+    const float* pz = sources[2];
+    const float* pvx = sources[3];
+    const float* pvy = sources[4];
+    const float* pvz = sources[5];
+    const float* m = sources[6];
+
+    for (size_t i = i_begin; i < i_end; i += WIDTH) {
+        vfloat xi = vload(targets[0] + i), yi = vload(targets[1] + i), zi = vload(targets[2] + i);
+        vfloat vxi = vload(targets[3] + i), vyi = vload(targets[4] + i), vzi = vload(targets[5] + i);
+        vfloat ax = vload(out[0] + i), ay = vload(out[1] + i), az = vload(out[2] + i);
+        vfloat jx = vload(out[3] + i), jy = vload(out[4] + i), jz = vload(out[5] + i);
+        for (size_t j = 0; j < n; j++) {
+            vfloat dx = vsub(vset1(px[j]), xi);
+            vfloat dy = vsub(vset1(py[j]), yi);
+            vfloat dz = vsub(vset1(pz[j]), zi);
+            vfloat dvx = vsub(vset1(pvx[j]), vxi);
+            vfloat dvy = vsub(vset1(pvy[j]), vyi);
+            vfloat dvz = vsub(vset1(pvz[j]), vzi);
+            vfloat inv = vrsqrt(vfmadd(dx, dx, vfmadd(dy, dy, vfmadd(dz, dz, v_eps2))));
+            vfloat inv2 = vmul(inv, inv);
+            vfloat s = vmul(vset1(m[j]), vmul(inv, inv2));
+            vfloat rv = vmul(v_three, vmul(inv2, vfmadd(dx, dvx, vfmadd(dy, dvy, vmul(dz, dvz)))));
+            ax = vfmadd(dx, s, ax);
+            ay = vfmadd(dy, s, ay);
+            az = vfmadd(dz, s, az);
+            jx = vfmadd(vsub(dvx, vmul(rv, dx)), s, jx);
+            jy = vfmadd(vsub(dvy, vmul(rv, dy)), s, jy);
+            jz = vfmadd(vsub(dvz, vmul(rv, dz)), s, jz);
+        }
+        vstore(out[0] + i, ax);
+        vstore(out[1] + i, ay);
+        vstore(out[2] + i, az);
+        vstore(out[3] + i, jx);
+        vstore(out[4] + i, jy);
+        vstore(out[5] + i, jz);
+    }
+}
+
+// The Hermite predictor and corrector below work in double precision on one axis at a time. They are
+// plain loops over __restrict arrays rather than v* helper code; the compiler vectorizes them for the
+// instruction set of the including namespace.
+
+// Hermite predictor for bodies [begin, end) along one axis: the Taylor series of position x, velocity
+// v, acceleration a and jerk j from each body's own tick to tick, written as floats to out_x and out_v.
+static void predictHermite(const double* __restrict x, const double* __restrict v, const double* __restrict a,
+                           const double* __restrict j, const int32_t* __restrict own_tick, int32_t tick, double tick_length,
+                           size_t begin, size_t end, float* __restrict out_x, float* __restrict out_v) {
+    for (size_t i = begin; i < end; i++) {
+        double s = (double)(tick - own_tick[i]) * tick_length;
+        double half = 0.5 * s;
+        out_x[i] = (float)(x[i] + s * (v[i] + half * (a[i] + s * (1.0 / 3.0) * j[i])));
+        out_v[i] = (float)(v[i] + s * (a[i] + half * j[i]));
+    }
+}
+
+// Hermite corrector for bodies [begin, end) along one axis at the end of their steps of length h. The
+// state x v a j at the start of the step is replaced by the corrected one, using the new acceleration
+// a1 and jerk j1, unscaled by G. The implied a2 + h a3 and a3 at the end of the step go to snap and
+// crackle for the choice of the next step.
+static void correctHermite(double* __restrict x, double* __restrict v, double* __restrict a, double* __restrict j,
+                           const float* __restrict a1, const float* __restrict j1, const double* __restrict h, double G,
+                           size_t begin, size_t end, float* __restrict snap, float* __restrict crackle) {
+    for (size_t i = begin; i < end; i++) {
+        double hi = h[i], h2 = hi * hi, h3 = h2 * hi;
+        double a0 = a[i], j0 = j[i];
+        double an = G * (double)a1[i], jn = G * (double)j1[i];
+        double a2 = (-6.0 * (a0 - an) - hi * (4.0 * j0 + 2.0 * jn)) / h2;
+        double a3 = (12.0 * (a0 - an) + 6.0 * hi * (j0 + jn)) / h3;
+        // the prediction from the old state, done again in double
+        double predicted_x = x[i] + hi * (v[i] + 0.5 * hi * (a0 + hi * (1.0 / 3.0) * j0));
+        double predicted_v = v[i] + hi * (a0 + 0.5 * hi * j0);
+        x[i] = predicted_x + h2 * h2 * (a2 * (1.0 / 24.0) + hi * a3 * (1.0 / 120.0));
+        v[i] = predicted_v + h3 * (a2 * (1.0 / 6.0) + hi * a3 * (1.0 / 24.0));
+        a[i] = an;
+        j[i] = jn;
+        snap[i] = (float)(a2 + hi * a3);
+        crackle[i] = (float)a3;
+    }
+}
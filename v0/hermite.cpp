@@ -0,0 +1,389 @@
+#ifndef HERMITE_CPP
+#define HERMITE_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define HERMITE_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+#include "block_timesteps.cpp"
+
+// class ----------------------------------------------------------------------------------------------
+
+// Fourth order Hermite predictor-corrector (Makino & Aarseth 1992) with individual block time steps,
+// the usual scheme for collisional systems. Every body is predicted to the current time from its
+// own last state by its Taylor series in acceleration and jerk, the bodies due get acceleration and
+// jerk from one pass of the vectorized pairwise kernel against all predicted bodies, and their state
+// is corrected with the higher derivatives the two evaluations imply:
+//     a2 = (-6 (a0 - a1) - h (4 j0 + 2 j1)) / h^2,    a3 = (12 (a0 - a1) + 6 h (j0 + j1)) / h^3
+// Steps are powers of two below the step given to step(), chosen by Aarseth's criterion
+//     dt = sqrt(eta (|a| |a2| + |j|^2) / (|j| |a3| + |a2|^2))
+// and aligned as in BlockTimestepIntegrator, so all bodies are synchronized when step() returns.
+//
+// The jerk needs the relative velocities, which only direct summation provides, so the forces are
+// always summed directly and the solver only contributes G and the softening. The corrected state
+// is kept in double precision, the store holds the predicted or corrected positions the kernel and
+// the rest of the program read.
+class HermiteIntegrator : public Integrator {
+    public:
+        // accuracy parameter of Aarseth's criterion
+        float eta = 0.01f;
+        // the first steps, before a2 and a3 are known, use eta_start |a| / |j|
+        float eta_start = 0.01f;
+        // the finest level used, at most BLOCK_MAX_LEVEL
+        int max_level = 16;
+        SimdLevel simd_level;
+
+    private:
+        bool started = false;
+        // state at the own time of each body, padded like the store
+        AlignedArray<double> x, y, z, vx, vy, vz, ax, ay, az, jx, jy, jz;
+        // own time in ticks within the current step, with the level and the tick the body is due
+        AlignedArray<int32_t> own_tick;
+        std::vector<uint8_t> levels;
+        std::vector<int32_t> next_tick;
+        std::vector<uint32_t> active;
+        // the active bodies packed for the kernel: predicted x y z vx vy vz, then a and jerk
+        AlignedArray<float> packed[12];
+        // state x y z vx vy vz ax ay az jx jy jz and step length of the active bodies, for the corrector
+        AlignedArray<double> gathered[12];
+        AlignedArray<double> step_length;
+        double active_fraction = 1.0;
+        uint32_t substep_count = 0;
+
+    public:
+        HermiteIntegrator() {
+            simd_level = detectSimdLevel();
+        }
+
+        const char* name() override { return "hermite"; }
+
+        void reset() override { started = false; }
+
+        double activeFraction() override { return active_fraction; }
+
+        uint32_t substeps() const { return substep_count; }
+
+        int level(size_t i) const { return levels[i]; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            size_t n = bodies->size();
+            if (n == 0)
+                return;
+            int top = max_level < BLOCK_MAX_LEVEL ? max_level : BLOCK_MAX_LEVEL;
+            const int32_t block = 1 << top;
+            const double tick_length = (double)dt / block;
+            if (!started || levels.size() != n)
+                start(bodies, solver, dt, top);
+
+            for (size_t i = 0; i < n; i++)
+                next_tick[i] = block >> levels[i];
+            std::memset((void*)own_tick.data(), 0, own_tick.size() * sizeof(int32_t));
+
+            int32_t tick = 0;
+            uint64_t evaluated = 0;
+            substep_count = 0;
+            while (tick < block) {
+                int32_t next = block;
+                for (size_t i = 0; i < n; i++)
+                    next = next_tick[i] < next ? next_tick[i] : next;
+                tick = next;
+                predict(bodies, tick, tick_length);
+
+                active.clear();
+                for (size_t i = 0; i < n; i++)
+                    if (next_tick[i] == tick)
+                        active.push_back((uint32_t)i);
+                evaluate(bodies, solver);
+                evaluated += active.size();
+                substep_count++;
+
+                parallelFor(active.size(), [&](size_t begin, size_t end, unsigned int) {
+                    correct(bodies, begin, end, block, tick_length, (double)solver->G);
+                    for (size_t k = begin; k < end; k++) {
+                        uint32_t i = active[k];
+                        own_tick[i] = tick;
+                        levels[i] = (uint8_t)chooseLevel(k, dt, top, tick);
+                        next_tick[i] = tick + (block >> levels[i]);
+                    }
+                }, 64);
+            }
+            active_fraction = (double)evaluated / ((double)substep_count * n);
+        }
+
+    private:
+        void start(BodyStore* bodies, ForceSolver* solver, float dt, int top) {
+            size_t n = bodies->size();
+            size_t padded = bodies->paddedSize();
+            AlignedArray<double>* arrays[] = {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &jx, &jy, &jz};
+            for (AlignedArray<double>* array : arrays) {
+                array->resize(padded);
+                std::memset((void*)array->data(), 0, padded * sizeof(double));
+            }
+            own_tick.resize(padded);
+            levels.assign(n, 0);
+            next_tick.assign(n, 0);
+            for (size_t i = 0; i < n; i++) {
+                x[i] = bodies->pos_x[i];
+                y[i] = bodies->pos_y[i];
+                z[i] = bodies->pos_z[i];
+                vx[i] = bodies->vel_x[i];
+                vy[i] = bodies->vel_y[i];
+                vz[i] = bodies->vel_z[i];
+            }
+
+            active.resize(n);
+            for (size_t i = 0; i < n; i++)
+                active[i] = (uint32_t)i;
+            evaluate(bodies, solver);
+            for (size_t i = 0; i < n; i++) {
+                ax[i] = (double)solver->G * packed[6][i];
+                ay[i] = (double)solver->G * packed[7][i];
+                az[i] = (double)solver->G * packed[8][i];
+                jx[i] = (double)solver->G * packed[9][i];
+                jy[i] = (double)solver->G * packed[10][i];
+                jz[i] = (double)solver->G * packed[11][i];
+                double a = std::sqrt(ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+                double j = std::sqrt(jx[i] * jx[i] + jy[i] * jy[i] + jz[i] * jz[i]);
+                levels[i] = (uint8_t)quantize(j > 0.0 ? eta_start * a / j : dt, dt, top);
+            }
+            started = true;
+        }
+
+        // Taylor series of every body from its own time to tick, written to the store by the predictor
+        // kernel of the selected instruction set, split across the job system
+        void predict(BodyStore* bodies, int32_t tick, double tick_length) {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            parallelFor(bodies->paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                begin *= BODY_PADDING;
+                end *= BODY_PADDING;
+                kernels.predict(x.data(), vx.data(), ax.data(), jx.data(), own_tick.data(), tick, tick_length, begin, end,
+                                bodies->pos_x.data(), bodies->vel_x.data());
+                kernels.predict(y.data(), vy.data(), ay.data(), jy.data(), own_tick.data(), tick, tick_length, begin, end,
+                                bodies->pos_y.data(), bodies->vel_y.data());
+                kernels.predict(z.data(), vz.data(), az.data(), jz.data(), own_tick.data(), tick, tick_length, begin, end,
+                                bodies->pos_z.data(), bodies->vel_z.data());
+            }, 64);
+        }
+
+        // acceleration and jerk, unscaled by G, of the active bodies into packed[6..11]
+        void evaluate(BodyStore* bodies, ForceSolver* solver) {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            size_t count = active.size();
+            size_t padded = (count + BODY_PADDING - 1) / BODY_PADDING * BODY_PADDING;
+            for (AlignedArray<float>& array : packed) {
+                array.resize(padded);
+                std::memset((void*)array.data(), 0, padded * sizeof(float));
+            }
+            for (AlignedArray<double>& array : gathered)
+                array.resize(padded);
+            step_length.resize(padded);
+            for (size_t k = 0; k < count; k++) {
+                uint32_t i = active[k];
+                packed[0][k] = bodies->pos_x[i];
+                packed[1][k] = bodies->pos_y[i];
+                packed[2][k] = bodies->pos_z[i];
+                packed[3][k] = bodies->vel_x[i];
+                packed[4][k] = bodies->vel_y[i];
+                packed[5][k] = bodies->vel_z[i];
+            }
+
+            const float* targets[6] = {packed[0].data(), packed[1].data(), packed[2].data(),
+                                       packed[3].data(), packed[4].data(), packed[5].data()};
+            const float* sources[7] = {bodies->pos_x.data(), bodies->pos_y.data(), bodies->pos_z.data(),
+                                       bodies->vel_x.data(), bodies->vel_y.data(), bodies->vel_z.data(), bodies->mass.data()};
+            float* out[6] = {packed[6].data(), packed[7].data(), packed[8].data(),
+                             packed[9].data(), packed[10].data(), packed[11].data()};
+            float eps2 = solver->softening * solver->softening;
+            parallelFor(padded / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                kernels.jerk(targets, begin * BODY_PADDING, end * BODY_PADDING, sources, bodies->paddedSize(), eps2, out);
+            }, 1);
+        }
+
+        // Hermite correctors for the active bodies [begin, end) at the end of their steps: their state is
+        // gathered into contiguous arrays, corrected by the kernel of the selected instruction set and
+        // scattered back
+        void correct(BodyStore* bodies, size_t begin, size_t end, int32_t block, double tick_length, double G) {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            AlignedArray<double>* state[12] = {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &jx, &jy, &jz};
+            for (size_t k = begin; k < end; k++) {
+                uint32_t i = active[k];
+                for (int c = 0; c < 12; c++)
+                    gathered[c][k] = (*state[c])[i];
+                step_length[k] = (block >> levels[i]) * tick_length;
+            }
+            // snap and crackle are kept for chooseLevel in the packed slots of the kernel input, done with by now
+            for (int d = 0; d < 3; d++)
+                kernels.correct(gathered[d].data(), gathered[3 + d].data(), gathered[6 + d].data(), gathered[9 + d].data(),
+                                packed[6 + d].data(), packed[9 + d].data(), step_length.data(), G, begin, end,
+                                packed[d].data(), packed[3 + d].data());
+            for (size_t k = begin; k < end; k++) {
+                uint32_t i = active[k];
+                for (int c = 0; c < 12; c++)
+                    (*state[c])[i] = gathered[c][k];
+                bodies->setPosition(i, glm::vec3(x[i], y[i], z[i]));
+                bodies->setVelocity(i, glm::vec3(vx[i], vy[i], vz[i]));
+            }
+        }
+
+        // level for the next step of the k-th active body, from Aarseth's criterion at the end of
+        // the step it just finished
+        int chooseLevel(size_t k, float dt, int top, int32_t tick) const {
+            uint32_t i = active[k];
+            double a = std::sqrt(ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+            double j = std::sqrt(jx[i] * jx[i] + jy[i] * jy[i] + jz[i] * jz[i]);
+            double snap = glm::length(glm::vec3(packed[0][k], packed[1][k], packed[2][k]));
+            double crackle = glm::length(glm::vec3(packed[3][k], packed[4][k], packed[5][k]));
+            double denominator = j * crackle + snap * snap;
+            double wanted = denominator > 0.0 ? std::sqrt(eta * (a * snap + j * j) / denominator) : dt;
+            int level = quantize(wanted, dt, top);
+
+            // a step may only grow by one level, and only where the longer step starts on its own grid
+            int old = levels[i];
+            if (level < old) {
+                int32_t longer = (1 << top) >> (old - 1);
+                level = tick % longer == 0 ? old - 1 : old;
+            }
+            return level;
+        }
+
+        static int quantize(double wanted, float dt, int top) {
+            int level = 0;
+            while (level < top && dt / (double)(1u << level) > wanted)
+                level++;
+            return level;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef HERMITE_MAIN_CPP
+#include <chrono>
+#include <random>
+
+double totalEnergy(const BodyStore& bodies, double G, double softening) {
+    double energy = 0.0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        glm::dvec3 v = glm::dvec3(bodies.getVelocity(i));
+        energy += 0.5 * bodies.mass[i] * glm::dot(v, v);
+        for (size_t j = i + 1; j < bodies.size(); j++) {
+            glm::dvec3 d = glm::dvec3(bodies.getPosition(i) - bodies.getPosition(j));
+            energy -= G * bodies.mass[i] * bodies.mass[j] / std::sqrt(glm::dot(d, d) + softening * softening);
+        }
+    }
+    return energy;
+}
+
+int main() {
+    std::mt19937 rng(5);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    // acceleration and jerk of every kernel against a double precision sum
+    const size_t n = 200;
+    const float eps = 0.01f;
+    BodyStore cloud;
+    for (size_t i = 0; i < n; i++)
+        cloud.addBody(glm::vec3(normal(rng), normal(rng), normal(rng)), glm::vec3(normal(rng), normal(rng), normal(rng)), 1.0f / n);
+    std::vector<glm::dvec3> reference_acc(n, glm::dvec3(0.0)), reference_jerk(n, glm::dvec3(0.0));
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            glm::dvec3 r = glm::dvec3(cloud.getPosition(j) - cloud.getPosition(i));
+            glm::dvec3 v = glm::dvec3(cloud.getVelocity(j) - cloud.getVelocity(i));
+            double r2 = glm::dot(r, r) + (double)eps * eps;
+            double inv3 = 1.0 / (r2 * std::sqrt(r2));
+            reference_acc[i] += cloud.mass[j] * inv3 * r;
+            reference_jerk[i] += cloud.mass[j] * inv3 * (v - 3.0 * glm::dot(r, v) / r2 * r);
+        }
+    }
+    SimdLevel levels[] = {SIMD_SCALAR, SIMD_SSE, SIMD_AVX2, SIMD_AVX512};
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        size_t padded = cloud.paddedSize();
+        std::vector<AlignedArray<float>> out(6);
+        for (AlignedArray<float>& array : out)
+            array.resize(padded);
+        const float* targets[6] = {cloud.pos_x.data(), cloud.pos_y.data(), cloud.pos_z.data(),
+                                   cloud.vel_x.data(), cloud.vel_y.data(), cloud.vel_z.data()};
+        const float* sources[7] = {cloud.pos_x.data(), cloud.pos_y.data(), cloud.pos_z.data(),
+                                   cloud.vel_x.data(), cloud.vel_y.data(), cloud.vel_z.data(), cloud.mass.data()};
+        float* accumulators[6] = {out[0].data(), out[1].data(), out[2].data(), out[3].data(), out[4].data(), out[5].data()};
+        selectGravityKernels(level).jerk(targets, 0, padded, sources, padded, eps * eps, accumulators);
+        double worst = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            glm::dvec3 a = glm::dvec3(out[0][i], out[1][i], out[2][i]), j = glm::dvec3(out[3][i], out[4][i], out[5][i]);
+            worst = std::fmax(worst, glm::length(a - reference_acc[i]) / glm::length(reference_acc[i]));
+            worst = std::fmax(worst, glm::length(j - reference_jerk[i]) / glm::length(reference_jerk[i]));
+        }
+        std::cout << simdLevelName(level) << " jerk kernel: max relative error " << worst << std::endl;
+        if (worst > 1e-4) {
+            std::cerr << simdLevelName(level) << " acceleration or jerk is off" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // an orbit of eccentricity 0.9 against the exact solution, the steps follow the pericenter passes
+    DirectSolver unsoftened = DirectSolver(1.0f, 0.0f);
+    BodyStore orbit;
+    orbit.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    orbit.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, std::sqrt(1.9f), 0.0f), 1e-7f);
+    HermiteIntegrator hermite;
+    double start_energy = totalEnergy(orbit, 1.0, 0.0);
+    const double period = 6.283185307179586 * std::pow(10.0, 1.5);
+    uint32_t evaluations = 0;
+    for (int s = 0; s < 64; s++) {
+        hermite.step(&orbit, &unsoftened, (float)(period / 16.0));
+        evaluations += hermite.substeps();
+    }
+    glm::dvec3 r = glm::dvec3(1.0, 0.0, 0.0), v = glm::dvec3(0.0, std::sqrt(1.9f), 0.0);
+    keplerDrift(1.0 + 1e-7, &r, &v, 4.0 * period);
+    glm::dvec3 relative = glm::dvec3(orbit.getPosition(1) - orbit.getPosition(0));
+    double energy_error = std::fabs(totalEnergy(orbit, 1.0, 0.0) / start_energy - 1.0);
+    std::cout << "eccentric orbit: " << evaluations << " force evaluations for 4 periods, energy error " << energy_error
+              << ", position error " << glm::length(relative - r) << std::endl;
+    if (energy_error > 2e-5 || glm::length(relative - r) > 5e-3) {
+        std::cerr << "hermite does not follow the eccentric orbit" << std::endl;
+        return FAILURE;
+    }
+
+    // a cluster with a tight binary
+    const float softening = 0.001f;
+    BodyStore bodies;
+    for (size_t i = 0; i < 1000; i++)
+        bodies.addBody(glm::vec3(normal(rng), normal(rng), normal(rng)), 0.4f * glm::vec3(normal(rng), normal(rng), normal(rng)), 1.0f / 1000);
+    float binary_speed = std::sqrt(0.02f / 0.01f) * 0.5f;
+    bodies.addBody(glm::vec3(4.005f, 0.0f, 0.0f), glm::vec3(0.0f, binary_speed, 0.0f), 0.01f);
+    bodies.addBody(glm::vec3(3.995f, 0.0f, 0.0f), glm::vec3(0.0f, -binary_speed, 0.0f), 0.01f);
+    DirectSolver solver = DirectSolver(1.0f, softening);
+    HermiteIntegrator cluster;
+    start_energy = totalEnergy(bodies, 1.0, softening);
+    double fraction = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    const int steps = 16;
+    for (int s = 0; s < steps; s++) {
+        cluster.step(&bodies, &solver, 1.0f / 32.0f);
+        fraction += cluster.activeFraction() / steps;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    energy_error = std::fabs(totalEnergy(bodies, 1.0, softening) / start_energy - 1.0);
+    std::cout << "cluster: " << ms << " ms, binary on level " << cluster.level(1000) << ", field body on level "
+              << cluster.level(0) << ", active fraction " << fraction << ", energy error " << energy_error << std::endl;
+    if (energy_error > 1e-5 || fraction > 0.05) {
+        std::cerr << "hermite block steps lost energy or kept too many bodies active" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef IAS15_CPP
+#define IAS15_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define IAS15_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <cstring>
+#include <functional>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+
+// coefficients ---------------------------------------------------------------------------------------
+
+// Gauss-Radau spacings on [0, 1], the start of the step and the 7 roots of P7 + P8 mapped there
+constexpr double RADAU_SPACINGS[8] = {0.0, 0.0562625605369221464656521910318, 0.180240691736892364987579942780,
+                                      0.352624717113169637373907769648, 0.547153626330555383001448554766,
+                                      0.734210177215410531523210605558, 0.885320946839095768090359771030,
+                                      0.977520613561287501891174488626};
+
+// The acceleration over a step is a polynomial in the step fraction t, kept both in powers and in
+// the Newton basis of the spacings:
+//     a(t) = a0 + sum_k b_k t^(k+1) = a0 + sum_j g_j N_j(t),    N_j(t) = t (t - h_1) ... (t - h_j)
+// so b_k = sum_j c[j][k] g_j and g_k = sum_j d[j][k] b_j, with c the powers of N_j and d its inverse.
+typedef struct {
+    double c[7][7];
+    double d[7][7];
+} RadauCoefficients;
+
+constexpr RadauCoefficients radauCoefficients() {
+    RadauCoefficients table = {};
+    for (int j = 0; j < 7; j++) {
+        double poly[8] = {0.0, 1.0};
+        for (int i = 1; i <= j; i++) {
+            for (int p = 7; p > 0; p--)
+                poly[p] = poly[p - 1] - RADAU_SPACINGS[i] * poly[p];
+            poly[0] = -RADAU_SPACINGS[i] * poly[0];
+        }
+        for (int k = 0; k <= j; k++)
+            table.c[j][k] = poly[k + 1];
+    }
+    // c is unit lower triangular, its inverse by forward substitution
+    for (int k = 0; k < 7; k++) {
+        table.d[k][k] = 1.0;
+        for (int j = k + 1; j < 7; j++) {
+            double sum = 0.0;
+            for (int m = k; m < j; m++)
+                sum += table.c[j][m] * table.d[m][k];
+            table.d[j][k] = -sum;
+        }
+    }
+    return table;
+}
+
+constexpr RadauCoefficients RADAU = radauCoefficients();
+
+// class ----------------------------------------------------------------------------------------------
+
+// 15th order implicit Gauss-Radau integrator with adaptive steps, after Everhart 1985 and IAS15 of
+// Rein & Spiegel 2015. Each internal step iterates the acceleration polynomial through the 7
+// substeps until it stops changing, then sizes the next step so the last coefficient stays at
+// epsilon times the acceleration, which keeps the error per step near roundoff. The polynomial of
+// the previous step extrapolated to the next one seeds the iteration, so accepted steps typically
+// converge in two passes.
+//
+// Meant for small systems that need ephemeris quality or pass through close encounters: state and
+// forces are kept in double precision, the positions with compensated summation, and the substep
+// forces are summed directly with the G and softening of the solver, whatever its method.
+// step(dt) takes as many internal steps as needed to land exactly on dt. The state and coefficient
+// buffers are sized to the body count once and reused from step to step.
+class Ias15Integrator : public Integrator {
+    public:
+        // bound on b7 relative to the acceleration, sets the size of the internal steps
+        double epsilon = 1e-9;
+        // a step whose successor would shrink below this fraction is redone with the smaller step
+        double safety = 0.25;
+        // internal steps taken and rejected, and force evaluations, since the start
+        uint64_t steps_taken = 0;
+        uint64_t steps_rejected = 0;
+        uint64_t evaluations = 0;
+
+    private:
+        bool started = false;
+        // the internal step planned next
+        double next_step = 0.0;
+        // three components per body, state at the start of the step with its compensation terms
+        AlignedArray<double> x0, v0, a0, compensation_x, compensation_v, at;
+        // one component per body, the positions forces are evaluated at and the masses
+        AlignedArray<double> predicted_position[3], masses;
+        // coefficients of the polynomial, and the prediction they started from
+        AlignedArray<double> b[7], g[7], e[7];
+        bool predicted = false;
+        // per worker maxima for the convergence and step size norms
+        std::vector<double> worker_max;
+
+    public:
+        const char* name() override { return "ias15"; }
+
+        void reset() override { started = false; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            if (bodies->size() == 0)
+                return;
+            if (!started || x0.size() != 3 * bodies->size())
+                start(bodies, dt);
+            double remaining = dt;
+            while (remaining > 0.0) {
+                double h = next_step < remaining ? next_step : remaining;
+                // landing on the end of dt may cut the planned step short, the prediction follows
+                if (h != next_step)
+                    rescalePrediction(h / next_step);
+                if (!attempt(bodies, solver, h)) {
+                    steps_rejected++;
+                    continue;
+                }
+                remaining -= h;
+                steps_taken++;
+            }
+            storeState(bodies);
+        }
+
+    private:
+        void start(BodyStore* bodies, float dt) {
+            size_t count = 3 * bodies->size();
+            AlignedArray<double>* arrays[] = {&x0, &v0, &a0, &compensation_x, &compensation_v, &at};
+            for (AlignedArray<double>* array : arrays)
+                array->resize(count);
+            for (int d = 0; d < 3; d++)
+                predicted_position[d].resize(bodies->size());
+            masses.resize(bodies->size());
+            for (int k = 0; k < 7; k++) {
+                b[k].resize(count);
+                g[k].resize(count);
+                e[k].resize(count);
+            }
+            for (size_t i = 0; i < bodies->size(); i++) {
+                glm::vec3 p = bodies->getPosition(i), v = bodies->getVelocity(i);
+                for (int d = 0; d < 3; d++) {
+                    x0[3 * i + d] = p[d];
+                    v0[3 * i + d] = v[d];
+                }
+            }
+            fill(&compensation_x, 0.0);
+            fill(&compensation_v, 0.0);
+            for (int k = 0; k < 7; k++) {
+                fill(&b[k], 0.0);
+                fill(&e[k], 0.0);
+            }
+            worker_max.resize(workerCount());
+            predicted = false;
+            next_step = dt;
+            started = true;
+        }
+
+        static void fill(AlignedArray<double>* array, double value) {
+            for (size_t i = 0; i < array->size(); i++)
+                (*array)[i] = value;
+        }
+
+        // one internal step of length h, false if it had to be rejected for a smaller one
+        bool attempt(BodyStore* bodies, ForceSolver* solver, double h) {
+            size_t count = x0.size();
+            evaluate(bodies, solver, 0.0, h);
+            std::memcpy((void*)a0.data(), at.data(), count * sizeof(double));
+            fromPowers();
+
+            // iterate the polynomial until the last coefficient stops changing, or stalls at the
+            // roundoff of the double precision forces from evaluate()
+            double change = 2.0, last_change = 3.0;
+            for (int iteration = 0; iteration < 12; iteration++) {
+                if (change < 1e-16 || (iteration > 2 && change >= last_change))
+                    break;
+                last_change = change;
+                double largest_change = 0.0, largest_acc = 0.0;
+                for (int n = 1; n <= 7; n++) {
+                    evaluate(bodies, solver, RADAU_SPACINGS[n], h);
+                    bool last = n == 7;
+                    parallelReduce(count, [&](size_t begin, size_t end, double* maxima) {
+                        for (size_t i = begin; i < end; i++) {
+                            // divided differences of the new accelerations against the basis so far
+                            double value = (at[i] - a0[i]) / RADAU_SPACINGS[n];
+                            for (int j = 0; j < n - 1; j++)
+                                value = (value - g[j][i]) / (RADAU_SPACINGS[n] - RADAU_SPACINGS[j + 1]);
+                            double delta = value - g[n - 1][i];
+                            g[n - 1][i] = value;
+                            for (int k = 0; k < n; k++)
+                                b[k][i] += RADAU.c[n - 1][k] * delta;
+                            if (last) {
+                                maxima[0] = std::fmax(maxima[0], std::fabs(RADAU.c[6][6] * delta));
+                                maxima[1] = std::fmax(maxima[1], std::fabs(at[i]));
+                            }
+                        }
+                    }, &largest_change, &largest_acc);
+                }
+                change = largest_acc > 0.0 ? largest_change / largest_acc : 0.0;
+            }
+
+            // the size of b7 against the acceleration sets the next step
+            double largest_b = 0.0, largest_acc = 0.0;
+            parallelReduce(count, [&](size_t begin, size_t end, double* maxima) {
+                for (size_t i = begin; i < end; i++) {
+                    maxima[0] = std::fmax(maxima[0], std::fabs(b[6][i]));
+                    maxima[1] = std::fmax(maxima[1], std::fabs(a0[i]));
+                }
+            }, &largest_b, &largest_acc);
+            double error = largest_acc > 0.0 ? largest_b / largest_acc : 0.0;
+            double new_step = error > 0.0 ? h * std::pow(epsilon / error, 1.0 / 7.0) : h / safety;
+            if (new_step < safety * h) {
+                // too big, start over from the same state with the polynomial scaled down
+                rescalePrediction(new_step / h);
+                next_step = new_step;
+                return false;
+            }
+            if (new_step > h / safety)
+                new_step = h / safety;
+
+            // advance to the end of the step, h_k are the integrals of t^(k+1) once and twice
+            parallelFor(count, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    double dx = b[6][i] / 72.0 + b[5][i] / 56.0 + b[4][i] / 42.0 + b[3][i] / 30.0 + b[2][i] / 20.0
+                                + b[1][i] / 12.0 + b[0][i] / 6.0 + a0[i] / 2.0;
+                    double dv = b[6][i] / 8.0 + b[5][i] / 7.0 + b[4][i] / 6.0 + b[3][i] / 5.0 + b[2][i] / 4.0
+                                + b[1][i] / 3.0 + b[0][i] / 2.0 + a0[i];
+                    addCompensated(&x0[i], &compensation_x[i], h * v0[i] + h * h * dx);
+                    addCompensated(&v0[i], &compensation_v[i], h * dv);
+                }
+            }, 256);
+            predictNext(new_step / h);
+            next_step = new_step;
+            return true;
+        }
+
+        // Accelerations at fraction t of a step of length h, by direct summation in double precision
+        // with the solver's G and softening. The ratio of b7 to the acceleration that steers the step
+        // comes out of seven divided differences of the substep forces, which magnify the noise of a
+        // float kernel about ten thousand times, beyond any useful tolerance.
+        void evaluate(BodyStore* bodies, ForceSolver* solver, double t, double h) {
+            size_t n = bodies->size();
+            for (size_t i = 0; i < n; i++) {
+                for (int d = 0; d < 3; d++) {
+                    size_t k = 3 * i + d;
+                    double dx = t * t * h * h * (a0[k] / 2.0 + t * (b[0][k] / 6.0 + t * (b[1][k] / 12.0
+                                + t * (b[2][k] / 20.0 + t * (b[3][k] / 30.0 + t * (b[4][k] / 42.0 + t * (b[5][k] / 56.0
+                                + t * b[6][k] / 72.0)))))));
+                    predicted_position[d][i] = x0[k] + t * h * v0[k] + (t == 0.0 ? 0.0 : dx);
+                }
+                masses[i] = bodies->mass[i];
+            }
+            const double G = solver->G;
+            const double eps2 = (double)solver->softening * solver->softening;
+            const double* px = predicted_position[0].data();
+            const double* py = predicted_position[1].data();
+            const double* pz = predicted_position[2].data();
+            const double* m = masses.data();
+            parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    double sx = 0.0, sy = 0.0, sz = 0.0;
+                    for (size_t j = 0; j < n; j++) {
+                        double dx = px[j] - px[i], dy = py[j] - py[i], dz = pz[j] - pz[i];
+                        double r2 = dx * dx + dy * dy + dz * dz + eps2;
+                        double s = r2 > 0.0 ? m[j] / (r2 * std::sqrt(r2)) : 0.0;
+                        sx += s * dx;
+                        sy += s * dy;
+                        sz += s * dz;
+                    }
+                    at[3 * i] = G * sx;
+                    at[3 * i + 1] = G * sy;
+                    at[3 * i + 2] = G * sz;
+                }
+            }, 16);
+            evaluations++;
+        }
+
+        // g from b at the start of a step
+        void fromPowers() {
+            parallelFor(x0.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    for (int k = 0; k < 7; k++) {
+                        double sum = 0.0;
+                        for (int j = k; j < 7; j++)
+                            sum += RADAU.d[j][k] * b[j][i];
+                        g[k][i] = sum;
+                    }
+                }
+            }, 256);
+        }
+
+        // The polynomial of the finished step continued over the next one, q times as long:
+        //     b'_(m-1) = q^m sum_(j >= m-1) binom(j + 1, m) b_j
+        // plus how far the last prediction was off, which the new one likely repeats.
+        void predictNext(double q) {
+            static const double binomial[8][8] = {
+                {1}, {1, 1}, {1, 2, 1}, {1, 3, 3, 1}, {1, 4, 6, 4, 1}, {1, 5, 10, 10, 5, 1},
+                {1, 6, 15, 20, 15, 6, 1}, {1, 7, 21, 35, 35, 21, 7, 1}};
+            parallelFor(x0.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    double shifted[7];
+                    double qm = 1.0;
+                    for (int m = 1; m <= 7; m++) {
+                        qm *= q;
+                        double sum = 0.0;
+                        for (int j = m - 1; j < 7; j++)
+                            sum += binomial[j + 1][m] * b[j][i];
+                        shifted[m - 1] = qm * sum;
+                    }
+                    for (int k = 0; k < 7; k++) {
+                        double miss = predicted ? b[k][i] - e[k][i] : 0.0;
+                        e[k][i] = shifted[k];
+                        b[k][i] = shifted[k] + miss;
+                    }
+                }
+            }, 256);
+            predicted = true;
+        }
+
+        // the same polynomial over a step q times as long from the same start
+        void rescalePrediction(double q) {
+            parallelFor(x0.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    double qk = 1.0;
+                    for (int k = 0; k < 7; k++) {
+                        qk *= q;
+                        b[k][i] *= qk;
+                        e[k][i] *= qk;
+                    }
+                }
+            }, 256);
+        }
+
+        static void addCompensated(double* sum, double* compensation, double value) {
+            double y = value - *compensation;
+            double t = *sum + y;
+            *compensation = (t - *sum) - y;
+            *sum = t;
+        }
+
+        // fn(begin, end, maxima) over pieces of [0, count), two running maxima per worker reduced
+        // into first and second
+        void parallelReduce(size_t count, const std::function<void(size_t, size_t, double*)>& fn, double* first, double* second) {
+            worker_max.assign(2 * workerCount(), 0.0);
+            parallelFor(count, [&](size_t begin, size_t end, unsigned int worker) {
+                fn(begin, end, &worker_max[2 * worker]);
+            }, 256);
+            for (size_t w = 0; w < worker_max.size(); w += 2) {
+                *first = std::fmax(*first, worker_max[w]);
+                *second = std::fmax(*second, worker_max[w + 1]);
+            }
+        }
+
+        void storeState(BodyStore* bodies) const {
+            for (size_t i = 0; i < bodies->size(); i++) {
+                bodies->setPosition(i, glm::vec3(x0[3 * i], x0[3 * i + 1], x0[3 * i + 2]));
+                bodies->setVelocity(i, glm::vec3(v0[3 * i], v0[3 * i + 1], v0[3 * i + 2]));
+            }
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef IAS15_MAIN_CPP
+#include <chrono>
+
+double totalEnergy(const BodyStore& bodies, double G, double softening) {
+    double energy = 0.0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        glm::dvec3 v = glm::dvec3(bodies.getVelocity(i));
+        energy += 0.5 * bodies.mass[i] * glm::dot(v, v);
+        for (size_t j = i + 1; j < bodies.size(); j++) {
+            glm::dvec3 d = glm::dvec3(bodies.getPosition(i) - bodies.getPosition(j));
+            energy -= G * bodies.mass[i] * bodies.mass[j] / std::sqrt(glm::dot(d, d) + softening * softening);
+        }
+    }
+    return energy;
+}
+
+int main() {
+    // the two bases of the polynomial convert into each other
+    double worst = 0.0;
+    for (int j = 0; j < 7; j++) {
+        for (int k = 0; k < 7; k++) {
+            double sum = 0.0;
+            for (int m = 0; m < 7; m++)
+                sum += RADAU.c[j][m] * RADAU.d[m][k];
+            worst = std::fmax(worst, std::fabs(sum - (j == k ? 1.0 : 0.0)));
+        }
+    }
+    if (worst > 1e-12) {
+        std::cerr << "gauss-radau coefficient tables do not invert each other, off by " << worst << std::endl;
+        return FAILURE;
+    }
+
+    // an orbit of eccentricity 0.9 against the exact solution, the steps follow the pericenter passes
+    DirectSolver unsoftened = DirectSolver(1.0f, 0.0f);
+    BodyStore orbit;
+    orbit.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    orbit.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, std::sqrt(1.9f), 0.0f), 1e-7f);
+    Ias15Integrator ias15;
+    double start_energy = totalEnergy(orbit, 1.0, 0.0);
+    const double period = 6.283185307179586 * std::pow(10.0, 1.5);
+    auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < 64; s++)
+        ias15.step(&orbit, &unsoftened, (float)(period / 16.0));
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    glm::dvec3 r = glm::dvec3(1.0, 0.0, 0.0), v = glm::dvec3(0.0, std::sqrt(1.9f), 0.0);
+    keplerDrift(1.0 + 1e-7, &r, &v, 64.0 * (double)(float)(period / 16.0));
+    glm::dvec3 relative = glm::dvec3(orbit.getPosition(1) - orbit.getPosition(0));
+    double energy_error = std::fabs(totalEnergy(orbit, 1.0, 0.0) / start_energy - 1.0);
+    std::cout << "eccentric orbit: " << ms << " ms, " << ias15.steps_taken << " steps, " << ias15.steps_rejected
+              << " rejected, " << ias15.evaluations << " force evaluations for 4 periods, energy error " << energy_error
+              << ", position error " << glm::length(relative - r) << std::endl;
+    if (!(energy_error < 2e-6) || !(glm::length(relative - r) < 1e-6)) {
+        std::cerr << "ias15 does not follow the eccentric orbit" << std::endl;
+        return FAILURE;
+    }
+
+    // a close encounter, a light body passes a planet well inside its Hill sphere, then everything
+    // runs backwards and has to come back to the start
+    BodyStore encounter;
+    encounter.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    encounter.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1e-3f);
+    encounter.addBody(glm::vec3(1.02f, -0.2f, 0.0f), glm::vec3(0.02f, 1.1f, 0.0f), 1e-9f);
+    BodyStore initial = encounter;
+    Ias15Integrator close;
+    double closest = 1.0;
+    for (int s = 0; s < 400; s++) {
+        close.step(&encounter, &unsoftened, 0.005f);
+        closest = std::fmin(closest, glm::length(encounter.getPosition(2) - encounter.getPosition(1)));
+    }
+    uint64_t forward_steps = close.steps_taken;
+    for (size_t i = 0; i < encounter.size(); i++)
+        encounter.setVelocity(i, -encounter.getVelocity(i));
+    close.reset();
+    for (int s = 0; s < 400; s++)
+        close.step(&encounter, &unsoftened, 0.005f);
+    double returned = glm::length(encounter.getPosition(2) - initial.getPosition(2));
+    std::cout << "close encounter: closest approach " << closest << ", " << forward_steps << " steps forward, "
+              << close.steps_rejected << " rejected, returned within " << returned << std::endl;
+    if (closest > 0.01 || !(returned < 1e-5)) {
+        std::cerr << "ias15 did not retrace the close encounter" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
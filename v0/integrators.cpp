@@ -0,0 +1,518 @@
+#ifndef INTEGRATORS_CPP
+#define INTEGRATORS_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define INTEGRATORS_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <atomic>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "kepler.cpp"
+
+// coefficients ---------------------------------------------------------------------------------------
+
+#define SPLITTING_MAX_KICKS 8
+
+// One step of a drift-kick splitting scheme as a compile-time table: drift[0] kick[0] drift[1]
+// kick[1] ... kick[kicks - 1] drift[kicks], each coefficient a fraction of the step. The drift
+// coefficients sum to one and so do the kick ones.
+typedef struct {
+    const char* name;
+    int order;
+    int kicks;
+    double drift[SPLITTING_MAX_KICKS + 1];
+    double kick[SPLITTING_MAX_KICKS];
+} SplittingScheme;
+
+// Symmetric composition of drift-kick-drift leapfrogs of lengths weights[0..n) (Yoshida 1990): two
+// neighbouring half drifts merge into one, so n leapfrogs cost n kicks and n + 1 drifts.
+template <int n>
+constexpr SplittingScheme composeLeapfrogs(const char* name, int order, const double (&weights)[n]) {
+    SplittingScheme scheme = {name, order, n, {}, {}};
+    for (int i = 0; i < n; i++) {
+        scheme.kick[i] = weights[i];
+        scheme.drift[i] += 0.5 * weights[i];
+        scheme.drift[i + 1] += 0.5 * weights[i];
+    }
+    return scheme;
+}
+
+// x1 = 1 / (2 - 2^(1/3)), x0 = 1 - 2 x1, the triple jump of Forest & Ruth 1990 and Yoshida 1990
+constexpr double FOREST_RUTH_WEIGHTS[3] = {1.3512071919596578, -1.7024143839193153, 1.3512071919596578};
+// solution A of Yoshida 1990 for the sixth order, w0 = 1 - 2 (w1 + w2 + w3)
+constexpr double YOSHIDA6_WEIGHTS[7] = {0.784513610477560, 0.235573213359357, -1.17767998417887, 1.3151863206839063,
+                                        -1.17767998417887, 0.235573213359357, 0.784513610477560};
+
+// kick-drift-kick, the closing kick and the opening one of the next step see the same positions
+constexpr SplittingScheme LEAPFROG_KDK = {"leapfrog-kdk", 2, 2, {0.0, 1.0, 0.0}, {0.5, 0.5}};
+constexpr SplittingScheme LEAPFROG_DKD = {"leapfrog-dkd", 2, 1, {0.5, 0.5}, {1.0}};
+constexpr SplittingScheme FOREST_RUTH = composeLeapfrogs("forest-ruth", 4, FOREST_RUTH_WEIGHTS);
+constexpr SplittingScheme YOSHIDA6 = composeLeapfrogs("yoshida6", 6, YOSHIDA6_WEIGHTS);
+
+static_assert(FOREST_RUTH.kicks == 3 && YOSHIDA6.kicks == 7, "composition lost a stage");
+
+// classes --------------------------------------------------------------------------------------------
+
+// Advances a BodyStore by one step, asking the solver for the accelerations as often as the scheme
+// needs them. Integrators may keep the accelerations of the last step for the next one, reset()
+// tells them that the bodies were changed behind their back.
+class Integrator {
+    public:
+        virtual ~Integrator() {}
+        virtual const char* name() = 0;
+        virtual void step(BodyStore* bodies, ForceSolver* solver, float dt) = 0;
+        virtual void reset() {}
+        // fraction of the bodies whose forces were evaluated per evaluation during the last step
+        virtual double activeFraction() { return 1.0; }
+};
+
+// Drift-kick splitting of the full Hamiltonian, of the order of its coefficient table. Symplectic
+// and time reversible, so the energy error stays bounded instead of drifting over long runs.
+// Costs one force evaluation per kick, except that a scheme opening and closing with a kick reuses
+// the accelerations of the previous step for the first one.
+class SplittingIntegrator : public Integrator {
+    private:
+        const SplittingScheme* scheme;
+        // accelerations in the store belong to the current positions
+        bool forces_current = false;
+
+    public:
+        SplittingIntegrator(const SplittingScheme& scheme = LEAPFROG_KDK) {
+            this->scheme = &scheme;
+        }
+
+        const char* name() override { return scheme->name; }
+
+        void reset() override { forces_current = false; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            for (int s = 0; s <= scheme->kicks; s++) {
+                if (scheme->drift[s] != 0.0) {
+                    drift(bodies, (float)(scheme->drift[s] * dt));
+                    forces_current = false;
+                }
+                if (s == scheme->kicks)
+                    break;
+                if (!forces_current)
+                    solver->computeAccelerations(bodies);
+                forces_current = true;
+                kick(bodies, (float)(scheme->kick[s] * dt));
+            }
+        }
+
+    private:
+        // the padded range in whole padding units, so every piece stays register aligned
+        static void kick(BodyStore* bodies, float dt) {
+            parallelFor(bodies->paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                bodies->kick(dt, begin * BODY_PADDING, end * BODY_PADDING);
+            }, 64);
+        }
+
+        static void drift(BodyStore* bodies, float dt) {
+            parallelFor(bodies->paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                bodies->drift(dt, begin * BODY_PADDING, end * BODY_PADDING);
+            }, 64);
+        }
+};
+
+// Wisdom-Holman mapping for systems dominated by one central mass, in democratic heliocentric
+// coordinates (Duncan, Levison & Lee 1998): heliocentric positions, barycentric velocities. The
+// Hamiltonian splits into the Kepler orbits around the central mass, solved exactly, the mutual
+// attraction of the other bodies as kicks and a linear drift of the central mass, arranged as
+//     kick(dt/2) jump(dt/2) kepler(dt) jump(dt/2) kick(dt/2)
+// The error scales with the ratio of the perturbations to the central force instead of the step,
+// so planetary systems take steps of a good fraction of the innermost period. One force evaluation
+// per step, the closing kick is reused by the next one. The most massive body is the central one.
+class WisdomHolmanIntegrator : public Integrator {
+    // switches to this mapping on the interaction accelerations it evaluated itself
+    friend class KeplerIntegrator;
+
+    private:
+        bool forces_current = false;
+        size_t central = 0;
+        // democratic heliocentric state, the central slot holds the barycenter instead
+        std::vector<glm::dvec3> positions, velocities;
+
+    public:
+        const char* name() override { return "wisdom-holman"; }
+
+        void reset() override { forces_current = false; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            size_t n = bodies->size();
+            if (n < 2) {
+                bodies->drift(dt);
+                return;
+            }
+            size_t heaviest = 0;
+            for (size_t i = 1; i < n; i++)
+                if (bodies->mass[i] > bodies->mass[heaviest])
+                    heaviest = i;
+            if (heaviest != central) {
+                central = heaviest;
+                forces_current = false;
+            }
+
+            if (!forces_current)
+                interactionAccelerations(bodies, solver);
+            toDemocraticHeliocentric(*bodies);
+            kickInteraction(*bodies, 0.5 * dt);
+            jump(*bodies, 0.5 * dt);
+
+            double mu = (double)solver->G * bodies->mass[central];
+            parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    if (i == central)
+                        continue;
+                    if (!keplerDrift(mu, &positions[i], &velocities[i], dt))
+                        positions[i] += velocities[i] * (double)dt;
+                }
+            }, 16);
+            jump(*bodies, 0.5 * dt);
+            // the barycenter moves in a straight line
+            positions[central] += velocities[central] * (double)dt;
+
+            fromDemocraticHeliocentric(bodies);
+            interactionAccelerations(bodies, solver);
+            kickInteraction(*bodies, 0.5 * dt);
+            fromDemocraticHeliocentric(bodies);
+            forces_current = true;
+        }
+
+    private:
+        void toDemocraticHeliocentric(const BodyStore& bodies) {
+            size_t n = bodies.size();
+            positions.resize(n);
+            velocities.resize(n);
+            double total_mass = 0.0;
+            glm::dvec3 center = glm::dvec3(0.0), momentum = glm::dvec3(0.0);
+            for (size_t i = 0; i < n; i++) {
+                total_mass += bodies.mass[i];
+                center += (double)bodies.mass[i] * glm::dvec3(bodies.getPosition(i));
+                momentum += (double)bodies.mass[i] * glm::dvec3(bodies.getVelocity(i));
+            }
+            glm::dvec3 center_velocity = momentum / total_mass;
+            glm::dvec3 central_position = glm::dvec3(bodies.getPosition(central));
+            for (size_t i = 0; i < n; i++) {
+                positions[i] = glm::dvec3(bodies.getPosition(i)) - central_position;
+                velocities[i] = glm::dvec3(bodies.getVelocity(i)) - center_velocity;
+            }
+            positions[central] = center / total_mass;
+            velocities[central] = center_velocity;
+        }
+
+        void fromDemocraticHeliocentric(BodyStore* bodies) const {
+            size_t n = bodies->size();
+            double total_mass = 0.0;
+            glm::dvec3 offset = glm::dvec3(0.0), momentum = glm::dvec3(0.0);
+            for (size_t i = 0; i < n; i++) {
+                total_mass += bodies->mass[i];
+                if (i == central)
+                    continue;
+                offset += (double)bodies->mass[i] * positions[i];
+                momentum += (double)bodies->mass[i] * velocities[i];
+            }
+            glm::dvec3 central_position = positions[central] - offset / total_mass;
+            for (size_t i = 0; i < n; i++) {
+                if (i == central)
+                    continue;
+                bodies->setPosition(i, glm::vec3(positions[i] + central_position));
+                bodies->setVelocity(i, glm::vec3(velocities[i] + velocities[central]));
+            }
+            bodies->setPosition(central, glm::vec3(central_position));
+            bodies->setVelocity(central, glm::vec3(velocities[central] - momentum / (double)bodies->mass[central]));
+        }
+
+        // the central mass moves with the total heliocentric momentum, which shifts everyone else
+        void jump(const BodyStore& bodies, double dt) {
+            glm::dvec3 momentum = glm::dvec3(0.0);
+            for (size_t i = 0; i < bodies.size(); i++)
+                if (i != central)
+                    momentum += (double)bodies.mass[i] * velocities[i];
+            glm::dvec3 shift = momentum * (dt / bodies.mass[central]);
+            for (size_t i = 0; i < bodies.size(); i++)
+                if (i != central)
+                    positions[i] += shift;
+        }
+
+        void kickInteraction(const BodyStore& bodies, double dt) {
+            for (size_t i = 0; i < bodies.size(); i++)
+                if (i != central)
+                    velocities[i] += glm::dvec3(bodies.getAcceleration(i)) * dt;
+        }
+
+        // Accelerations of the bodies without the pull of the central mass. The solver computes the
+        // full field and the softened central term is taken out again, exactly for direct summation
+        // and to within the approximation of the far field for the others.
+        void interactionAccelerations(BodyStore* bodies, ForceSolver* solver) const {
+            solver->computeAccelerations(bodies);
+            glm::dvec3 center = glm::dvec3(bodies->getPosition(central));
+            double gm = (double)solver->G * bodies->mass[central];
+            double eps2 = (double)solver->softening * solver->softening;
+            parallelFor(bodies->size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    if (i == central)
+                        continue;
+                    glm::dvec3 d = center - glm::dvec3(bodies->getPosition(i));
+                    double r2 = glm::dot(d, d) + eps2;
+                    glm::dvec3 a = glm::dvec3(bodies->getAcceleration(i)) - gm * d / (r2 * std::sqrt(r2));
+                    bodies->acc_x[i] = (float)a.x;
+                    bodies->acc_y[i] = (float)a.y;
+                    bodies->acc_z[i] = (float)a.z;
+                }
+            }, 256);
+        }
+};
+
+// Closed form two body steps for systems where everything but the central mass is a small
+// perturbation, with the Wisdom-Holman mapping to fall back on. Every step first measures, from the
+// force evaluation the fallback would start with, how far the acceleration of each body relative to
+// the central mass strays from its two body value. If no body strays by more than threshold, all of them move on
+// their Kepler orbits around the central mass with mu = G (M + m), solved together by
+// keplerDriftBatch, and the central mass follows such that the barycenter moves in a straight
+// line. Otherwise the step is left to Wisdom-Holman. A step of any length thus costs one force
+// evaluation and one Kepler solve per body for as long as the system stays unperturbed.
+class KeplerIntegrator : public Integrator {
+    public:
+        // largest relative perturbation still stepped in closed form
+        double threshold = 1e-3;
+        // steps taken in closed form and by the fallback since the start
+        uint64_t analytic_steps = 0;
+        uint64_t numerical_steps = 0;
+
+    private:
+        WisdomHolmanIntegrator fallback;
+        double last_perturbation = 0.0;
+        // heliocentric state and gravitational parameter of each body but the central one
+        std::vector<double> state[6];
+        std::vector<double> mu;
+        std::vector<double> worker_max;
+
+    public:
+        const char* name() override { return "kepler"; }
+
+        void reset() override { fallback.reset(); }
+
+        // largest relative perturbation found by the last step
+        double perturbation() const { return last_perturbation; }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            size_t n = bodies->size();
+            if (n < 2) {
+                bodies->drift(dt);
+                return;
+            }
+            size_t central = 0;
+            for (size_t i = 1; i < n; i++)
+                if (bodies->mass[i] > bodies->mass[central])
+                    central = i;
+
+            last_perturbation = measurePerturbation(bodies, solver, central);
+            if (last_perturbation > threshold || !stepAnalytic(bodies, solver->G, central, dt)) {
+                fallback.step(bodies, solver, dt);
+                numerical_steps++;
+                return;
+            }
+            analytic_steps++;
+        }
+
+    private:
+        // The accelerations of the interactions, as the fallback kicks with, against the part of the
+        // acceleration of the central mass the two body orbit leaves out: any difference bends the
+        // orbit away from its conic. Leaves the fallback with its forces for the current positions.
+        double measurePerturbation(BodyStore* bodies, ForceSolver* solver, size_t central) {
+            fallback.central = central;
+            fallback.interactionAccelerations(bodies, solver);
+            fallback.forces_current = true;
+            glm::dvec3 center = glm::dvec3(bodies->getPosition(central));
+            glm::dvec3 center_acc = glm::dvec3(bodies->getAcceleration(central));
+            double G = solver->G, central_mass = bodies->mass[central];
+            worker_max.assign(workerCount(), 0.0);
+            parallelFor(bodies->size(), [&](size_t begin, size_t end, unsigned int worker) {
+                double largest = worker_max[worker];
+                for (size_t i = begin; i < end; i++) {
+                    if (i == central)
+                        continue;
+                    glm::dvec3 d = glm::dvec3(bodies->getPosition(i)) - center;
+                    double r2 = glm::dot(d, d), r3 = r2 * std::sqrt(r2);
+                    glm::dvec3 indirect = center_acc - G * bodies->mass[i] * d / r3;
+                    glm::dvec3 perturbation = glm::dvec3(bodies->getAcceleration(i)) - indirect;
+                    largest = std::fmax(largest, glm::length(perturbation) * r2 / (G * (central_mass + bodies->mass[i])));
+                }
+                worker_max[worker] = largest;
+            }, 256);
+            double largest = 0.0;
+            for (double value : worker_max)
+                largest = std::fmax(largest, value);
+            // coincident bodies give nan, which must not pass for unperturbed
+            return largest == largest ? largest : INFINITY;
+        }
+
+        // false, with the bodies untouched, if some orbit could not be solved
+        bool stepAnalytic(BodyStore* bodies, double G, size_t central, float dt) {
+            size_t n = bodies->size(), count = n - 1;
+            for (std::vector<double>& array : state)
+                array.resize(count);
+            mu.resize(count);
+            double total_mass = 0.0;
+            glm::dvec3 center = glm::dvec3(0.0), momentum = glm::dvec3(0.0);
+            glm::dvec3 central_position = glm::dvec3(bodies->getPosition(central));
+            glm::dvec3 central_velocity = glm::dvec3(bodies->getVelocity(central));
+            for (size_t i = 0, k = 0; i < n; i++) {
+                glm::dvec3 x = glm::dvec3(bodies->getPosition(i)), v = glm::dvec3(bodies->getVelocity(i));
+                total_mass += bodies->mass[i];
+                center += (double)bodies->mass[i] * x;
+                momentum += (double)bodies->mass[i] * v;
+                if (i == central)
+                    continue;
+                for (int d = 0; d < 3; d++) {
+                    state[d][k] = x[d] - central_position[d];
+                    state[3 + d][k] = v[d] - central_velocity[d];
+                }
+                mu[k] = G * ((double)bodies->mass[central] + bodies->mass[i]);
+                k++;
+            }
+
+            std::atomic<size_t> failed{0};
+            parallelFor(count, [&](size_t begin, size_t end, unsigned int) {
+                double* pieces[6];
+                for (int d = 0; d < 6; d++)
+                    pieces[d] = state[d].data() + begin;
+                failed += keplerDriftBatch(mu.data() + begin, pieces, end - begin, dt);
+            }, 256);
+            if (failed > 0)
+                return false;
+
+            // the central mass goes where it keeps the barycenter on its straight line
+            glm::dvec3 offset = glm::dvec3(0.0), relative_momentum = glm::dvec3(0.0);
+            for (size_t i = 0, k = 0; i < n; i++) {
+                if (i == central)
+                    continue;
+                offset += (double)bodies->mass[i] * glm::dvec3(state[0][k], state[1][k], state[2][k]);
+                relative_momentum += (double)bodies->mass[i] * glm::dvec3(state[3][k], state[4][k], state[5][k]);
+                k++;
+            }
+            glm::dvec3 velocity = momentum / total_mass;
+            central_position = center / total_mass + velocity * (double)dt - offset / total_mass;
+            central_velocity = velocity - relative_momentum / total_mass;
+            for (size_t i = 0, k = 0; i < n; i++) {
+                if (i == central)
+                    continue;
+                bodies->setPosition(i, glm::vec3(central_position + glm::dvec3(state[0][k], state[1][k], state[2][k])));
+                bodies->setVelocity(i, glm::vec3(central_velocity + glm::dvec3(state[3][k], state[4][k], state[5][k])));
+                k++;
+            }
+            bodies->setPosition(central, glm::vec3(central_position));
+            bodies->setVelocity(central, glm::vec3(central_velocity));
+            return true;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef INTEGRATORS_MAIN_CPP
+
+double totalEnergy(const BodyStore& bodies, double G) {
+    double energy = 0.0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        glm::dvec3 v = glm::dvec3(bodies.getVelocity(i));
+        energy += 0.5 * bodies.mass[i] * glm::dot(v, v);
+        for (size_t j = i + 1; j < bodies.size(); j++)
+            energy -= G * bodies.mass[i] * bodies.mass[j] / glm::length(glm::dvec3(bodies.getPosition(i) - bodies.getPosition(j)));
+    }
+    return energy;
+}
+
+// a star with two well separated planets, the inner one on an eccentric orbit with a period of 9
+void addPlanetarySystem(BodyStore* bodies) {
+    bodies->addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    bodies->addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.1f, 0.0f), 1e-3f);
+    bodies->addBody(glm::vec3(-4.0f, 0.0f, 0.1f), glm::vec3(0.0f, -0.5f, 0.0f), 3e-4f);
+}
+
+// largest relative energy error over the run
+double energyError(Integrator* integrator, float dt, double duration) {
+    BodyStore bodies;
+    addPlanetarySystem(&bodies);
+    DirectSolver solver = DirectSolver(1.0f, 0.0f);
+    double start = totalEnergy(bodies, 1.0);
+    double worst = 0.0;
+    int steps = (int)(duration / dt + 0.5);
+    for (int s = 0; s < steps; s++) {
+        integrator->step(&bodies, &solver, dt);
+        worst = std::fmax(worst, std::fabs(totalEnergy(bodies, 1.0) / start - 1.0));
+    }
+    return worst;
+}
+
+int main() {
+    const double duration = 20.0 * 6.283185307179586;
+    SplittingIntegrator kdk = SplittingIntegrator(LEAPFROG_KDK), dkd = SplittingIntegrator(LEAPFROG_DKD);
+    SplittingIntegrator forest_ruth = SplittingIntegrator(FOREST_RUTH), yoshida6 = SplittingIntegrator(YOSHIDA6);
+    WisdomHolmanIntegrator wisdom_holman;
+    Integrator* integrators[] = {&kdk, &dkd, &forest_ruth, &yoshida6, &wisdom_holman};
+    // orders show in the error as the step halves, down to the roundoff of the float state, while
+    // the wisdom-holman error is set by the planet masses rather than the step
+    const double steps[] = {0.2, 0.1};
+    double errors[5][2] = {};
+    for (int k = 0; k < 5; k++) {
+        for (int s = 0; s < 2; s++) {
+            integrators[k]->reset();
+            errors[k][s] = energyError(integrators[k], (float)steps[s], duration);
+        }
+        std::cout << integrators[k]->name() << ": energy error " << errors[k][0] << " at dt " << steps[0] << ", "
+                  << errors[k][1] << " at dt " << steps[1] << std::endl;
+    }
+    if (errors[0][0] / errors[0][1] < 3.0 || errors[1][0] / errors[1][1] < 3.0 || errors[2][0] / errors[2][1] < 10.0) {
+        std::cerr << "integrators do not converge at their order" << std::endl;
+        return FAILURE;
+    }
+    if (!(errors[3][0] < errors[2][0] && errors[2][0] < errors[0][0])) {
+        std::cerr << "higher orders are not more accurate" << std::endl;
+        return FAILURE;
+    }
+    if (errors[4][0] > 0.01 * errors[0][0]) {
+        std::cerr << "wisdom-holman is no better than leapfrog on a planetary system" << std::endl;
+        return FAILURE;
+    }
+
+    // a lone planet crosses a thousand orbits in a single closed form step, landing where the two
+    // body solution puts it, while the planetary system is perturbed enough to go to wisdom-holman
+    KeplerIntegrator kepler;
+    BodyStore pair;
+    pair.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    pair.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.1f, 0.0f), 1e-6f);
+    DirectSolver solver = DirectSolver(1.0f, 0.0f);
+    glm::dvec3 relative = glm::dvec3(pair.getPosition(1) - pair.getPosition(0));
+    glm::dvec3 relative_velocity = glm::dvec3(pair.getVelocity(1) - pair.getVelocity(0));
+    const float long_step = 6283.1853f;
+    keplerDrift(1.0 + (double)1e-6f, &relative, &relative_velocity, long_step);
+    kepler.step(&pair, &solver, long_step);
+    double miss = glm::length(glm::dvec3(pair.getPosition(1) - pair.getPosition(0)) - relative);
+    std::cout << kepler.name() << ": " << miss << " off the two body solution after " << long_step << " time units in "
+              << kepler.analytic_steps << " step" << std::endl;
+    if (kepler.analytic_steps != 1 || !(miss < 1e-5)) {
+        std::cerr << "kepler step does not follow the two body orbit" << std::endl;
+        return FAILURE;
+    }
+    double kepler_error = energyError(&kepler, (float)steps[0], duration);
+    std::cout << kepler.name() << ": energy error " << kepler_error << " on the planetary system at perturbation "
+              << kepler.perturbation() << ", " << kepler.numerical_steps << " steps by the fallback" << std::endl;
+    if (kepler.numerical_steps == 0 || !(kepler_error < 2.0 * errors[4][0] + 1e-6)) {
+        std::cerr << "kepler integrator does not fall back on a perturbed system" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
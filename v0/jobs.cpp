@@ -0,0 +1,342 @@
+#ifndef JOBS_CPP
+#define JOBS_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define JOBS_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+
+#ifndef FAILURE
+#define FAILURE 1
+#define SUCCESS 0
+#endif
+
+// class ----------------------------------------------------------------------------------------------
+
+// Work stealing job system. Every worker thread owns a deque, it pushes and pops its own jobs at
+// the back and steals from the front of the others when it runs dry. Threads outside the pool push
+// into one shared queue that the workers steal from as well. A thread waiting on a job keeps
+// running queued jobs instead of blocking, so nested parallel loops and task graphs cannot deadlock.
+class JobSystem {
+    public:
+        // One unit of work. Jobs form task graphs through addDependency and become runnable once
+        // submitted and all of their prerequisites have finished. The memory of a job belongs to the
+        // caller and has to outlive it, TaskGraph keeps it for a whole graph.
+        class Job {
+            public:
+                std::function<void()> work;
+
+                Job() {}
+                Job(std::function<void()> work) : work(work) {}
+
+                bool finished() const { return done.load(std::memory_order_acquire); }
+
+            private:
+                // unfinished prerequisites, plus one until the job is submitted
+                std::atomic<int> blockers{1};
+                std::atomic<bool> done{false};
+                std::vector<Job*> dependents;
+
+                friend class JobSystem;
+        };
+
+    private:
+        typedef struct {
+            std::mutex mutex;
+            std::deque<Job*> jobs;
+        } Queue;
+
+        std::vector<std::thread> threads;
+        // one per worker, the last one takes jobs from threads outside the pool
+        std::unique_ptr<Queue[]> queues;
+        unsigned int queue_count = 0;
+        std::atomic<int> queued{0};
+        bool stopping = false;
+
+        // signalled whenever a job is queued or finishes
+        std::mutex mutex;
+        std::condition_variable changed;
+
+        typedef struct {
+            const JobSystem* system;
+            unsigned int queue;
+        } ThreadSlot;
+        static ThreadSlot& currentThread() {
+            static thread_local ThreadSlot slot = {nullptr, 0};
+            return slot;
+        }
+
+    public:
+        JobSystem(unsigned int thread_count) {
+            queue_count = thread_count + 1;
+            queues.reset(new Queue[queue_count]);
+            threads.reserve(thread_count);
+            for (unsigned int t = 0; t < thread_count; t++)
+                threads.emplace_back(&JobSystem::workerLoop, this, t);
+        }
+
+        ~JobSystem() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            for (std::thread& thread : threads)
+                thread.join();
+        }
+
+        JobSystem(const JobSystem&) = delete;
+        JobSystem& operator=(const JobSystem&) = delete;
+
+        // worker threads plus the calling thread, the most jobs that run at once
+        unsigned int slotCount() const { return (unsigned int)threads.size() + 1; }
+
+        // job does not start before prerequisite has finished, only valid before either is submitted
+        static void addDependency(Job* job, Job* prerequisite) {
+            prerequisite->dependents.push_back(job);
+            job->blockers.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void submit(Job* job) {
+            if (job->blockers.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                push(job);
+        }
+
+        // returns once job has finished, running other queued jobs meanwhile when help is set
+        void wait(const Job* job, bool help = true) {
+            while (!job->finished()) {
+                if (help) {
+                    Job* other = take();
+                    if (other != nullptr) {
+                        execute(other);
+                        continue;
+                    }
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return job->finished() || (help && queued.load() > 0); });
+            }
+        }
+
+        // Calls fn(begin, end, slot) on pieces of [0, count) of at least grain items. Each slot in
+        // [0, slotCount()) is one job that keeps claiming pieces until none are left, so uneven
+        // pieces balance out and callers can keep scratch data per slot. Slot 0 runs on the caller.
+        void parallelFor(size_t count, const std::function<void(size_t, size_t, unsigned int)>& fn, size_t grain = 1) {
+            if (count == 0)
+                return;
+            unsigned int slots = slotCount();
+            // about eight pieces per slot unless grain asks for bigger ones
+            size_t piece = count / (8 * (size_t)slots);
+            if (piece < grain)
+                piece = grain;
+            if (piece == 0)
+                piece = 1;
+            size_t pieces = (count + piece - 1) / piece;
+            if (pieces < slots)
+                slots = (unsigned int)pieces;
+            if (slots <= 1) {
+                fn(0, count, 0);
+                return;
+            }
+
+            std::atomic<size_t> next{0};
+            auto drain = [&](unsigned int slot) {
+                while (true) {
+                    size_t begin = next.fetch_add(piece);
+                    if (begin >= count)
+                        return;
+                    fn(begin, begin + piece < count ? begin + piece : count, slot);
+                }
+            };
+            std::unique_ptr<Job[]> helpers(new Job[slots - 1]);
+            for (unsigned int s = 1; s < slots; s++) {
+                helpers[s - 1].work = [&drain, s]() { drain(s); };
+                submit(&helpers[s - 1]);
+            }
+            drain(0);
+            for (unsigned int s = 1; s < slots; s++)
+                wait(&helpers[s - 1]);
+        }
+
+    private:
+        // queue of the calling thread, the shared one for threads outside the pool
+        unsigned int ownQueue() const {
+            const ThreadSlot& slot = currentThread();
+            return slot.system == this ? slot.queue : queue_count - 1;
+        }
+
+        void push(Job* job) {
+            Queue& queue = queues[ownQueue()];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.jobs.push_back(job);
+            }
+            queued.fetch_add(1);
+            notify();
+        }
+
+        // newest job of the own queue, else the oldest job of the next non-empty one
+        Job* take() {
+            unsigned int own = ownQueue();
+            for (unsigned int k = 0; k < queue_count; k++) {
+                Queue& queue = queues[(own + k) % queue_count];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.jobs.empty())
+                    continue;
+                Job* job;
+                if (k == 0) {
+                    job = queue.jobs.back();
+                    queue.jobs.pop_back();
+                } else {
+                    job = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                queued.fetch_sub(1);
+                return job;
+            }
+            return nullptr;
+        }
+
+        void execute(Job* job) {
+            if (job->work)
+                job->work();
+            for (Job* dependent : job->dependents)
+                submit(dependent);
+            // last touch of the job, a waiter may free it right after
+            job->done.store(true, std::memory_order_release);
+            notify();
+        }
+
+        void notify() {
+            // taking the lock orders this against a waiter between its check and its sleep
+            { std::lock_guard<std::mutex> lock(mutex); }
+            changed.notify_all();
+        }
+
+        void workerLoop(unsigned int index) {
+            currentThread() = {this, index};
+            while (true) {
+                Job* job = take();
+                if (job != nullptr) {
+                    execute(job);
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return stopping || queued.load() > 0; });
+                if (stopping && queued.load() == 0)
+                    return;
+            }
+        }
+};
+
+// Owns the jobs of one task graph. Build the graph with add, submit it once, and wait on the jobs
+// whose results are needed; the graph must not be destroyed before every job in it has finished,
+// so the job waited on last should depend on all the others.
+class TaskGraph {
+    public:
+        typedef JobSystem::Job Job;
+
+    private:
+        // a deque never moves its elements, the jobs are linked by pointer
+        std::deque<Job> jobs;
+
+    public:
+        Job* add(std::function<void()> work, std::initializer_list<Job*> after = {}) {
+            jobs.emplace_back(work);
+            Job* job = &jobs.back();
+            for (Job* prerequisite : after)
+                JobSystem::addDependency(job, prerequisite);
+            return job;
+        }
+
+        void submit(JobSystem* system) {
+            for (Job& job : jobs)
+                system->submit(&job);
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef JOBS_MAIN_CPP
+#include <chrono>
+
+int main() {
+    JobSystem jobs = JobSystem(3);
+
+    // parallel loop, every index visited exactly once and slots stay in range
+    const size_t n = 100000;
+    std::vector<int> visits(n, 0);
+    std::atomic<bool> bad_slot{false};
+    jobs.parallelFor(n, [&](size_t begin, size_t end, unsigned int slot) {
+        if (slot >= jobs.slotCount())
+            bad_slot = true;
+        for (size_t i = begin; i < end; i++)
+            visits[i]++;
+    }, 64);
+    for (size_t i = 0; i < n; i++) {
+        if (visits[i] != 1 || bad_slot) {
+            std::cerr << "parallelFor visited index " << i << " " << visits[i] << " times" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // diamond shaped graph with nested loops inside, the order of the stages is checked
+    for (int round = 0; round < 100; round++) {
+        std::atomic<int> stage{0};
+        std::atomic<bool> out_of_order{false};
+        std::atomic<long> sum{0};
+        TaskGraph graph;
+        TaskGraph::Job* first = graph.add([&]() { stage = 1; });
+        auto middle = [&]() {
+            if (stage.load() < 1)
+                out_of_order = true;
+            jobs.parallelFor(1000, [&](size_t begin, size_t end, unsigned int) {
+                long local = 0;
+                for (size_t i = begin; i < end; i++)
+                    local += (long)i;
+                sum += local;
+            }, 10);
+        };
+        TaskGraph::Job* left = graph.add(middle, {first});
+        TaskGraph::Job* right = graph.add(middle, {first});
+        TaskGraph::Job* last = graph.add([&]() {
+            if (sum.load() != 2 * 999 * 1000 / 2)
+                out_of_order = true;
+            stage = 2;
+        }, {left, right});
+        graph.submit(&jobs);
+        jobs.wait(last, round % 2 == 0);
+        if (out_of_order || stage != 2) {
+            std::cerr << "task graph ran out of order in round " << round << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // uneven work is stolen, a pool of 3 threads finishes 4 sleeping jobs in about one sleep
+    auto start = std::chrono::steady_clock::now();
+    jobs.parallelFor(4, [&](size_t, size_t, unsigned int) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "4 jobs of 50 ms on " << jobs.slotCount() << " slots: " << ms << " ms" << std::endl;
+    if (ms > 150.0) {
+        std::cerr << "jobs were not spread over the workers" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef KEPLER_CPP
+#define KEPLER_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define KEPLER_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "simd.cpp"
+
+#ifndef FAILURE
+#define FAILURE 1
+#define SUCCESS 0
+#endif
+
+// helpers --------------------------------------------------------------------------------------------
+
+// Stumpff functions c2(psi) = (1 - cos sqrt(psi)) / psi and c3(psi) = (sqrt(psi) - sin sqrt(psi)) / psi^1.5,
+// continued to negative psi with cosh and sinh. Near zero both closed forms cancel badly, there the
+// series sum_k (-psi)^k / (2k + 2)! and sum_k (-psi)^k / (2k + 3)! are summed instead.
+void stumpff(double psi, double* c2, double* c3) {
+    if (psi > 1.0) {
+        double s = std::sqrt(psi);
+        *c2 = (1.0 - std::cos(s)) / psi;
+        *c3 = (s - std::sin(s)) / (psi * s);
+    } else if (psi < -1.0) {
+        double s = std::sqrt(-psi);
+        *c2 = (1.0 - std::cosh(s)) / psi;
+        *c3 = (std::sinh(s) - s) / (-psi * s);
+    } else {
+        double term2 = 0.5, term3 = 1.0 / 6.0;
+        *c2 = term2;
+        *c3 = term3;
+        for (int k = 1; k < 12; k++) {
+            term2 *= -psi / ((2.0 * k + 1.0) * (2.0 * k + 2.0));
+            term3 *= -psi / ((2.0 * k + 2.0) * (2.0 * k + 3.0));
+            *c2 += term2;
+            *c3 += term3;
+        }
+    }
+}
+
+// First guess of the universal anomaly of a hyperbolic orbit after t (Vallado 2013, algorithm 8),
+// far closer than the elliptic guess once the body is well on its way out.
+inline double hyperbolicGuess(double sqrt_mu, double r0, double r_dot_v, double alpha, double t) {
+    double a = 1.0 / alpha;
+    double sign = t < 0.0 ? -1.0 : 1.0;
+    double argument = -2.0 * sqrt_mu * sqrt_mu * alpha * t / (r_dot_v + sign * std::sqrt(-sqrt_mu * sqrt_mu * a) * (1.0 - r0 * alpha));
+    if (!(argument > 0.0))
+        return sqrt_mu * t / r0;
+    return sign * std::sqrt(-a) * std::log(argument);
+}
+
+// Moves a body on its two body orbit around a fixed mass with gravitational parameter mu = G * M by
+// dt, for any kind of orbit. Solves Kepler's equation in the universal anomaly chi with the
+// Laguerre-Conway iteration, which converges from rough first guesses where Newton's method can
+// overshoot, then applies the f and g functions. Returns false if the iteration did not converge,
+// leaving the body where it was.
+bool keplerDrift(double mu, glm::dvec3* position, glm::dvec3* velocity, double dt) {
+    const int max_iterations = 50;
+    const double laguerre_n = 5.0;
+
+    glm::dvec3 r0 = *position, v0 = *velocity;
+    double r0_length = glm::length(r0);
+    if (r0_length == 0.0 || mu <= 0.0 || dt == 0.0)
+        return r0_length != 0.0 || dt == 0.0;
+    double sqrt_mu = std::sqrt(mu);
+    double sigma0 = glm::dot(r0, v0) / sqrt_mu;
+    // inverse semi-major axis, positive for bound orbits
+    double alpha = 2.0 / r0_length - glm::dot(v0, v0) / mu;
+
+    double t = dt;
+    double chi = 0.0;
+    if (alpha > 1e-12) {
+        // whole periods change nothing, stepping over the rest keeps chi small
+        double period = 6.283185307179586 / (sqrt_mu * alpha * std::sqrt(alpha));
+        t = std::fmod(dt, period);
+        chi = sqrt_mu * t * alpha;
+        if (std::fabs(t) < 0.1 * period)
+            chi = sqrt_mu * t / r0_length;
+    } else if (alpha < -1e-12) {
+        chi = hyperbolicGuess(sqrt_mu, r0_length, glm::dot(r0, v0), alpha, t);
+    } else {
+        chi = sqrt_mu * t / r0_length;
+    }
+
+    double c2 = 0.0, c3 = 0.0, psi = 0.0, r_length = r0_length;
+    bool converged = false;
+    for (int k = 0; k < max_iterations; k++) {
+        psi = chi * chi * alpha;
+        stumpff(psi, &c2, &c3);
+        double chi2 = chi * chi;
+        double f = r0_length * chi * (1.0 - psi * c3) + sigma0 * chi2 * c2 + chi2 * chi * c3 - sqrt_mu * t;
+        double df = chi2 * c2 + sigma0 * chi * (1.0 - psi * c3) + r0_length * (1.0 - psi * c2);
+        double ddf = sigma0 * (1.0 - psi * c2) + (1.0 - alpha * r0_length) * chi * (1.0 - psi * c3);
+        r_length = df;
+        double root = std::sqrt(std::fabs((laguerre_n - 1.0) * (laguerre_n - 1.0) * df * df - laguerre_n * (laguerre_n - 1.0) * f * ddf));
+        double delta = laguerre_n * f / (df + (df < 0.0 ? -root : root));
+        chi -= delta;
+        if (std::fabs(delta) <= 1e-13 * (std::fabs(chi) + 1e-300)) {
+            converged = true;
+            break;
+        }
+    }
+    if (!converged || !(r_length > 0.0))
+        return false;
+
+    // r and c2, c3 at the final chi
+    psi = chi * chi * alpha;
+    stumpff(psi, &c2, &c3);
+    double chi2 = chi * chi;
+    r_length = chi2 * c2 + sigma0 * chi * (1.0 - psi * c3) + r0_length * (1.0 - psi * c2);
+
+    double f = 1.0 - chi2 / r0_length * c2;
+    double g = t - chi2 * chi / sqrt_mu * c3;
+    double df = sqrt_mu / (r_length * r0_length) * chi * (psi * c3 - 1.0);
+    double dg = 1.0 - chi2 / r_length * c2;
+    *position = f * r0 + g * v0;
+    *velocity = df * r0 + dg * v0;
+    return true;
+}
+
+// kernels per instruction set ------------------------------------------------------------------------
+
+namespace kepler_scalar {
+    typedef double vdouble;
+    typedef bool vmask;
+    static const size_t WIDTH = 1;
+    inline vdouble vzero() { return 0.0; }
+    inline vdouble vset1(double a) { return a; }
+    inline vdouble vload(const double* p) { return *p; }
+    inline void vstore(double* p, vdouble a) { *p = a; }
+    inline vdouble vadd(vdouble a, vdouble b) { return a + b; }
+    inline vdouble vsub(vdouble a, vdouble b) { return a - b; }
+    inline vdouble vmul(vdouble a, vdouble b) { return a * b; }
+    inline vdouble vdiv(vdouble a, vdouble b) { return a / b; }
+    inline vdouble vsqrt(vdouble a) { return std::sqrt(a); }
+    inline vdouble vabs(vdouble a) { return std::fabs(a); }
+    inline vmask vgreater(vdouble a, vdouble b) { return a > b; }
+    inline vdouble vselect(vmask mask, vdouble a, vdouble b) { return mask ? a : b; }
+    inline vmask vor(vmask a, vmask b) { return a || b; }
+    inline bool vall(vmask mask) { return mask; }
+    inline bool vnone(vmask mask) { return !mask; }
+    #include "kepler_kernel.inl"
+}
+
+#ifdef SIMD_X86
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace kepler_sse {
+    typedef __m128d vdouble;
+    typedef __m128d vmask;
+    static const size_t WIDTH = 2;
+    inline vdouble vzero() { return _mm_setzero_pd(); }
+    inline vdouble vset1(double a) { return _mm_set1_pd(a); }
+    inline vdouble vload(const double* p) { return _mm_load_pd(p); }
+    inline void vstore(double* p, vdouble a) { _mm_store_pd(p, a); }
+    inline vdouble vadd(vdouble a, vdouble b) { return _mm_add_pd(a, b); }
+    inline vdouble vsub(vdouble a, vdouble b) { return _mm_sub_pd(a, b); }
+    inline vdouble vmul(vdouble a, vdouble b) { return _mm_mul_pd(a, b); }
+    inline vdouble vdiv(vdouble a, vdouble b) { return _mm_div_pd(a, b); }
+    inline vdouble vsqrt(vdouble a) { return _mm_sqrt_pd(a); }
+    inline vdouble vabs(vdouble a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+    inline vmask vgreater(vdouble a, vdouble b) { return _mm_cmpgt_pd(a, b); }
+    inline vdouble vselect(vmask mask, vdouble a, vdouble b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+    inline vmask vor(vmask a, vmask b) { return _mm_or_pd(a, b); }
+    inline bool vall(vmask mask) { return _mm_movemask_pd(mask) == 3; }
+    inline bool vnone(vmask mask) { return _mm_movemask_pd(mask) == 0; }
+    #include "kepler_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace kepler_avx2 {
+    typedef __m256d vdouble;
+    typedef __m256d vmask;
+    static const size_t WIDTH = 4;
+    inline vdouble vzero() { return _mm256_setzero_pd(); }
+    inline vdouble vset1(double a) { return _mm256_set1_pd(a); }
+    inline vdouble vload(const double* p) { return _mm256_load_pd(p); }
+    inline void vstore(double* p, vdouble a) { _mm256_store_pd(p, a); }
+    inline vdouble vadd(vdouble a, vdouble b) { return _mm256_add_pd(a, b); }
+    inline vdouble vsub(vdouble a, vdouble b) { return _mm256_sub_pd(a, b); }
+    inline vdouble vmul(vdouble a, vdouble b) { return _mm256_mul_pd(a, b); }
+    inline vdouble vdiv(vdouble a, vdouble b) { return _mm256_div_pd(a, b); }
+    inline vdouble vsqrt(vdouble a) { return _mm256_sqrt_pd(a); }
+    inline vdouble vabs(vdouble a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+    inline vmask vgreater(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    inline vdouble vselect(vmask mask, vdouble a, vdouble b) { return _mm256_blendv_pd(b, a, mask); }
+    inline vmask vor(vmask a, vmask b) { return _mm256_or_pd(a, b); }
+    inline bool vall(vmask mask) { return _mm256_movemask_pd(mask) == 15; }
+    inline bool vnone(vmask mask) { return _mm256_movemask_pd(mask) == 0; }
+    #include "kepler_kernel.inl"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace kepler_avx512 {
+    typedef __m512d vdouble;
+    typedef __mmask8 vmask;
+    static const size_t WIDTH = 8;
+    inline vdouble vzero() { return _mm512_setzero_pd(); }
+    inline vdouble vset1(double a) { return _mm512_set1_pd(a); }
+    inline vdouble vload(const double* p) { return _mm512_load_pd(p); }
+    inline void vstore(double* p, vdouble a) { _mm512_store_pd(p, a); }
+    inline vdouble vadd(vdouble a, vdouble b) { return _mm512_add_pd(a, b); }
+    inline vdouble vsub(vdouble a, vdouble b) { return _mm512_sub_pd(a, b); }
+    inline vdouble vmul(vdouble a, vdouble b) { return _mm512_mul_pd(a, b); }
+    inline vdouble vdiv(vdouble a, vdouble b) { return _mm512_div_pd(a, b); }
+    inline vdouble vsqrt(vdouble a) { return _mm512_sqrt_pd(a); }
+    inline vdouble vabs(vdouble a) { return _mm512_abs_pd(a); }
+    inline vmask vgreater(vdouble a, vdouble b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    inline vdouble vselect(vmask mask, vdouble a, vdouble b) { return _mm512_mask_blend_pd(mask, b, a); }
+    inline vmask vor(vmask a, vmask b) { return a | b; }
+    inline bool vall(vmask mask) { return mask == 0xFF; }
+    inline bool vnone(vmask mask) { return mask == 0; }
+    #include "kepler_kernel.inl"
+}
+#pragma GCC pop_options
+#endif
+
+typedef size_t (*KeplerBatchKernel)(const double*, double* const*, size_t, double, uint8_t*);
+
+KeplerBatchKernel selectKeplerKernel(SimdLevel level) {
+#ifdef SIMD_X86
+    switch (level) {
+    case SIMD_AVX512:
+        return kepler_avx512::driftBatch;
+    case SIMD_AVX2:
+        return kepler_avx2::driftBatch;
+    case SIMD_SSE:
+        return kepler_sse::driftBatch;
+    default:
+        break;
+    }
+#endif
+    return kepler_scalar::driftBatch;
+}
+
+// keplerDrift for count bodies at once, each around its own gravitational parameter mu[i], with the
+// state in separate arrays x y z vx vy vz, on the widest instruction set the cpu supports. Bodies
+// that do not converge, have r = 0 or mu <= 0 are left where they were and counted in the result,
+// and with failures set, failures[i] tells which: 1 for those, 0 for the bodies that moved.
+size_t keplerDriftBatch(const double* mu, double* const* state, size_t count, double dt, uint8_t* failures = nullptr) {
+    static const KeplerBatchKernel kernel = selectKeplerKernel(detectSimdLevel());
+    return kernel(mu, state, count, dt, failures);
+}
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef KEPLER_MAIN_CPP
+#include <chrono>
+
+int main() {
+    const double mu = 1.0;
+    // elliptic, nearly parabolic and hyperbolic orbits, all starting at pericenter on the x axis
+    const double speeds[] = {0.5, 1.2, 1.414, 1.4142, 1.5, 3.0};
+    for (double speed : speeds) {
+        glm::dvec3 r0 = glm::dvec3(1.0, 0.0, 0.0), v0 = glm::dvec3(0.0, speed, 0.0);
+        double energy = 0.5 * speed * speed - mu;
+        glm::dvec3 r = r0, v = v0;
+        // many small steps against one big one
+        const int steps = 1000;
+        const double total = 7.3;
+        bool ok = true;
+        for (int s = 0; s < steps; s++)
+            ok &= keplerDrift(mu, &r, &v, total / steps);
+        glm::dvec3 r_big = r0, v_big = v0;
+        ok &= keplerDrift(mu, &r_big, &v_big, total);
+        double energy_error = std::fabs(0.5 * glm::dot(v, v) - mu / glm::length(r) - energy);
+        double angular_error = glm::length(glm::cross(r, v) - glm::cross(r0, v0));
+        double mismatch = glm::length(r - r_big) / glm::length(r);
+        std::cout << "speed " << speed << ": energy error " << energy_error << ", angular momentum error "
+                  << angular_error << ", big step mismatch " << mismatch << std::endl;
+        if (!ok || energy_error > 1e-10 || angular_error > 1e-10 || mismatch > 1e-9) {
+            std::cerr << "kepler drift is off for speed " << speed << std::endl;
+            return FAILURE;
+        }
+
+        // backwards returns to the start
+        ok = keplerDrift(mu, &r, &v, -total);
+        if (!ok || glm::length(r - r0) > 1e-9) {
+            std::cerr << "kepler drift does not reverse for speed " << speed << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // a circular orbit comes back after one period
+    glm::dvec3 r = glm::dvec3(2.0, 0.0, 0.0), v = glm::dvec3(0.0, std::sqrt(mu / 2.0), 0.0);
+    keplerDrift(mu, &r, &v, 6.283185307179586 * std::sqrt(8.0 / mu));
+    if (glm::length(r - glm::dvec3(2.0, 0.0, 0.0)) > 1e-9) {
+        std::cerr << "circular orbit did not close" << std::endl;
+        return FAILURE;
+    }
+
+    // the trigonometry free stumpff functions against the closed forms
+    double worst = 0.0;
+    for (double psi = -400.0; psi < 400.0; psi += 0.37) {
+        double c2 = 0.0, c3 = 0.0, e2 = 0.0, e3 = 0.0;
+        kepler_scalar::stumpffVector(psi, &c2, &c3);
+        stumpff(psi, &e2, &e3);
+        worst = std::fmax(worst, std::fmax(std::fabs(c2 / e2 - 1.0), std::fabs(c3 / e3 - 1.0)));
+    }
+    std::cout << "reduced stumpff functions: max relative error " << worst << std::endl;
+    if (worst > 1e-11) {
+        std::cerr << "reduced stumpff functions are off" << std::endl;
+        return FAILURE;
+    }
+
+    // a batch of mixed orbits, and two that cannot move, agrees with one body at a time on every
+    // instruction set
+    const size_t count = 1001;
+    const double dt = 123.4;
+    std::vector<double> start[6], masses(count);
+    for (std::vector<double>& array : start)
+        array.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        double angle = 0.37 * i, speed = 0.3 + 2.5 * (i % 97) / 97.0;
+        start[0][i] = (1.0 + 0.01 * i) * std::cos(angle);
+        start[1][i] = (1.0 + 0.01 * i) * std::sin(angle);
+        start[2][i] = 0.1 * std::sin(3.0 * angle);
+        start[3][i] = -speed * std::sin(angle + 0.2);
+        start[4][i] = speed * std::cos(angle + 0.2);
+        start[5][i] = 0.05;
+        masses[i] = 1.0 + 0.001 * (i % 7);
+    }
+    start[0][5] = start[1][5] = start[2][5] = 0.0;
+    masses[9] = 0.0;
+    std::vector<glm::dvec3> expected(count);
+    for (size_t i = 0; i < count; i++) {
+        glm::dvec3 r = glm::dvec3(start[0][i], start[1][i], start[2][i]), v = glm::dvec3(start[3][i], start[4][i], start[5][i]);
+        keplerDrift(masses[i], &r, &v, dt);
+        expected[i] = r;
+    }
+    SimdLevel levels[] = {SIMD_SCALAR, SIMD_SSE, SIMD_AVX2, SIMD_AVX512};
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        std::vector<double> arrays[6] = {start[0], start[1], start[2], start[3], start[4], start[5]};
+        double* state[6] = {arrays[0].data(), arrays[1].data(), arrays[2].data(), arrays[3].data(), arrays[4].data(), arrays[5].data()};
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<uint8_t> failures(count, 2);
+        size_t failed = selectKeplerKernel(level)(masses.data(), state, count, dt, failures.data());
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        worst = 0.0;
+        for (size_t i = 0; i < count; i++) {
+            glm::dvec3 batch = glm::dvec3(arrays[0][i], arrays[1][i], arrays[2][i]);
+            worst = std::fmax(worst, glm::length(batch - expected[i]) / glm::length(expected[i]));
+        }
+        std::cout << simdLevelName(level) << ": " << count << " orbits in " << us << " us, " << failed
+                  << " left in place, max relative difference " << worst << std::endl;
+        bool flagged = true;
+        for (size_t i = 0; i < count; i++)
+            flagged &= failures[i] == (i == 5 || i == 9);
+        if (failed != 2 || !flagged || worst > 1e-8) {
+            std::cerr << simdLevelName(level) << " batch kepler drift disagrees with the single body solver" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
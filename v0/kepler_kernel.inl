@@ -0,0 +1,168 @@
+// Universal variable Kepler solver over many bodies at once, included once per instruction set by
+// kepler.cpp. The including namespace provides vdouble, vmask, WIDTH and the v* helpers below, and
+// the surrounding #pragma GCC target decides which instructions they compile to.
+//
+//   vzero, vset1, vload, vstore, vadd, vsub, vmul, vdiv, vsqrt, vabs,
+//   vgreater(a, b) = a > b, vselect(mask, a, b) = mask ? a : b, vor, vall and vnone (every or no
+//   lane set)
+
+// reductions of psi by 4 at most, enough for |psi| up to 1e37
+#define KEPLER_MAX_REDUCTIONS 64
+
+// Stumpff functions c2 and c3 of WIDTH arguments without trigonometric calls: psi is divided by 4
+// until it is below 0.1 everywhere, the series summed there and the result carried back up with
+//     c0(4x) = 2 c0(x)^2 - 1,   c1(4x) = c0(x) c1(x),   c2(4x) = c1(x)^2 / 2,   c3(4x) = (c3(x) + c1(x) c2(x)) / 4
+// which hold for negative arguments as well. Each lane doubles as often as it was reduced.
+static inline void stumpffVector(vdouble psi, vdouble* c2, vdouble* c3) {
+    vmask reduced[KEPLER_MAX_REDUCTIONS];
+    int reductions = 0;
+    vdouble x = psi;
+    const vdouble limit = vset1(0.1), quarter = vset1(0.25);
+    while (reductions < KEPLER_MAX_REDUCTIONS) {
+        vmask big = vgreater(vabs(x), limit);
+        if (vnone(big))
+            break;
+        x = vselect(big, vmul(x, quarter), x);
+        reduced[reductions++] = big;
+    }
+
+    // the series to x^5, whose next terms are below 1e-17 for |x| < 0.1
+    vdouble s2 = vsub(vset1(1.0 / 3628800.0), vmul(x, vset1(1.0 / 479001600.0)));
+    s2 = vsub(vset1(1.0 / 40320.0), vmul(x, s2));
+    s2 = vsub(vset1(1.0 / 720.0), vmul(x, s2));
+    s2 = vsub(vset1(1.0 / 24.0), vmul(x, s2));
+    s2 = vsub(vset1(1.0 / 2.0), vmul(x, s2));
+    vdouble s3 = vsub(vset1(1.0 / 39916800.0), vmul(x, vset1(1.0 / 6227020800.0)));
+    s3 = vsub(vset1(1.0 / 362880.0), vmul(x, s3));
+    s3 = vsub(vset1(1.0 / 5040.0), vmul(x, s3));
+    s3 = vsub(vset1(1.0 / 120.0), vmul(x, s3));
+    s3 = vsub(vset1(1.0 / 6.0), vmul(x, s3));
+    const vdouble one = vset1(1.0), half = vset1(0.5), two = vset1(2.0);
+    vdouble s0 = vsub(one, vmul(x, s2));
+    vdouble s1 = vsub(one, vmul(x, s3));
+
+    for (int k = 0; k < reductions; k++) {
+        vdouble next3 = vmul(quarter, vadd(s3, vmul(s1, s2)));
+        vdouble next2 = vmul(half, vmul(s1, s1));
+        vdouble next1 = vmul(s0, s1);
+        vdouble next0 = vsub(vmul(two, vmul(s0, s0)), one);
+        s3 = vselect(reduced[k], next3, s3);
+        s2 = vselect(reduced[k], next2, s2);
+        s1 = vselect(reduced[k], next1, s1);
+        s0 = vselect(reduced[k], next0, s0);
+    }
+    *c2 = s2;
+    *c3 = s3;
+}
+
+// keplerDriftBatch for this instruction set, WIDTH bodies per pass. The per body setup, with its
+// period reduction and first guess, and the final f and g functions run lane by lane, the
+// Laguerre-Conway iteration in between on whole registers until every lane has converged.
+static size_t driftBatch(const double* mu, double* const* state, size_t count, double dt, uint8_t* failures) {
+    const int max_iterations = 50;
+    const double laguerre_n = 5.0;
+    double* px = state[0], * py = state[1], * pz = state[2];
+    double* qx = state[3], * qy = state[4], * qz = state[5];
+    size_t failed = 0;
+    if (dt == 0.0) {
+        for (size_t i = 0; failures != nullptr && i < count; i++)
+            failures[i] = 0;
+        return 0;
+    }
+
+    for (size_t base = 0; base < count; base += WIDTH) {
+        size_t lanes = count - base < WIDTH ? count - base : WIDTH;
+        alignas(64) double r0[WIDTH], sigma0[WIDTH], alpha[WIDTH], sqrt_mu[WIDTH], t[WIDTH], chi[WIDTH];
+        bool valid[WIDTH];
+        for (size_t l = 0; l < WIDTH; l++) {
+            size_t i = base + l;
+            valid[l] = false;
+            double m = 1.0, x = 1.0, y = 0.0, z = 0.0, vx = 0.0, vy = 1.0, vz = 0.0;
+            if (l < lanes) {
+                x = px[i], y = py[i], z = pz[i], vx = qx[i], vy = qy[i], vz = qz[i];
+                valid[l] = mu[i] > 0.0 && x * x + y * y + z * z > 0.0;
+                m = mu[i];
+            }
+            // missing and invalid lanes solve a circular orbit to keep the arithmetic finite
+            if (!valid[l]) {
+                m = 1.0;
+                x = 1.0, y = 0.0, z = 0.0, vx = 0.0, vy = 1.0, vz = 0.0;
+            }
+            r0[l] = std::sqrt(x * x + y * y + z * z);
+            sqrt_mu[l] = std::sqrt(m);
+            sigma0[l] = (x * vx + y * vy + z * vz) / sqrt_mu[l];
+            alpha[l] = 2.0 / r0[l] - (vx * vx + vy * vy + vz * vz) / m;
+            t[l] = dt;
+            chi[l] = sqrt_mu[l] * dt / r0[l];
+            if (alpha[l] > 1e-12) {
+                // whole periods change nothing
+                double period = 6.283185307179586 / (sqrt_mu[l] * alpha[l] * std::sqrt(alpha[l]));
+                t[l] = std::fmod(dt, period);
+                chi[l] = std::fabs(t[l]) < 0.1 * period ? sqrt_mu[l] * t[l] / r0[l] : sqrt_mu[l] * t[l] * alpha[l];
+            } else if (alpha[l] < -1e-12) {
+                chi[l] = hyperbolicGuess(sqrt_mu[l], r0[l], x * vx + y * vy + z * vz, alpha[l], dt);
+            }
+        }
+
+        const vdouble v_r0 = vload(r0), v_sigma0 = vload(sigma0), v_alpha = vload(alpha);
+        const vdouble v_mu_t = vmul(vload(sqrt_mu), vload(t));
+        const vdouble one = vset1(1.0), n = vset1(laguerre_n);
+        const vdouble n1n1 = vset1((laguerre_n - 1.0) * (laguerre_n - 1.0)), nn1 = vset1(laguerre_n * (laguerre_n - 1.0));
+        const vdouble tolerance = vset1(1e-13), tiny = vset1(1e-300);
+        vdouble v_chi = vload(chi);
+        vmask done = vgreater(vzero(), vzero());
+        for (int k = 0; k < max_iterations; k++) {
+            vdouble chi2 = vmul(v_chi, v_chi);
+            vdouble psi = vmul(chi2, v_alpha);
+            vdouble c2, c3;
+            stumpffVector(psi, &c2, &c3);
+            vdouble one_psi_c3 = vsub(one, vmul(psi, c3));
+            vdouble one_psi_c2 = vsub(one, vmul(psi, c2));
+            vdouble f = vsub(vadd(vadd(vmul(vmul(v_r0, v_chi), one_psi_c3), vmul(vmul(v_sigma0, chi2), c2)), vmul(vmul(chi2, v_chi), c3)), v_mu_t);
+            vdouble df = vadd(vadd(vmul(chi2, c2), vmul(vmul(v_sigma0, v_chi), one_psi_c3)), vmul(v_r0, one_psi_c2));
+            vdouble ddf = vadd(vmul(v_sigma0, one_psi_c2), vmul(vmul(vsub(one, vmul(v_alpha, v_r0)), v_chi), one_psi_c3));
+            vdouble root = vsqrt(vabs(vsub(vmul(n1n1, vmul(df, df)), vmul(nn1, vmul(f, ddf)))));
+            vdouble denominator = vadd(df, vselect(vgreater(vzero(), df), vsub(vzero(), root), root));
+            vdouble delta = vselect(done, vzero(), vdiv(vmul(n, f), denominator));
+            v_chi = vsub(v_chi, delta);
+            done = vor(done, vgreater(vmul(tolerance, vadd(vabs(v_chi), tiny)), vabs(delta)));
+            // an exact hit leaves delta at 0, which the strict comparison misses
+            done = vor(done, vgreater(vset1(1e-300), vabs(delta)));
+            if (vall(done))
+                break;
+        }
+
+        // f and g functions at the final chi
+        alignas(64) double c2[WIDTH], c3[WIDTH], converged[WIDTH];
+        vdouble v_c2, v_c3;
+        stumpffVector(vmul(vmul(v_chi, v_chi), v_alpha), &v_c2, &v_c3);
+        vstore(chi, v_chi);
+        vstore(c2, v_c2);
+        vstore(c3, v_c3);
+        vstore(converged, vselect(done, one, vzero()));
+        for (size_t l = 0; l < lanes; l++) {
+            size_t i = base + l;
+            double chi2 = chi[l] * chi[l], psi = chi2 * alpha[l];
+            double r = chi2 * c2[l] + sigma0[l] * chi[l] * (1.0 - psi * c3[l]) + r0[l] * (1.0 - psi * c2[l]);
+            bool failure = !valid[l] || converged[l] == 0.0 || !(r > 0.0);
+            if (failures != nullptr)
+                failures[i] = failure;
+            if (failure) {
+                failed++;
+                continue;
+            }
+            double f = 1.0 - chi2 / r0[l] * c2[l];
+            double g = t[l] - chi2 * chi[l] / sqrt_mu[l] * c3[l];
+            double df = sqrt_mu[l] / (r * r0[l]) * chi[l] * (psi * c3[l] - 1.0);
+            double dg = 1.0 - chi2 / r * c2[l];
+            double x = px[i], y = py[i], z = pz[i], vx = qx[i], vy = qy[i], vz = qz[i];
+            px[i] = f * x + g * vx;
+            py[i] = f * y + g * vy;
+            pz[i] = f * z + g * vz;
+            qx[i] = df * x + dg * vx;
+            qy[i] = df * y + dg * vy;
+            qz[i] = df * z + dg * vz;
+        }
+    }
+    return failed;
+}
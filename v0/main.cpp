@@ -18,6 +18,11 @@
 #include "shader.cpp"
 #include "camera.cpp"
 #include "shader_source.h"
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "barnes_hut.cpp"
+#include "simulation.cpp"
 #include "models.cpp"
 
 typedef struct {
@@ -41,11 +46,40 @@ float delta_time = 0.0f;
 float last_frame = 0.0f;
 
 Camera camera = Camera(glm::vec3(0.0f, 1.0f, 3.0f));
-void processInput(GLFWwindow *window)
+
+// time warp and spawn keys act once per press
+bool warp_keys_down[2] = {false, false};
+bool spawn_key_down = false;
+// V switches between textured meshes and sphere impostors
+bool draw_spheres = false;
+bool sphere_key_down = false;
+void processInput(GLFWwindow *window, Simulation* simulation)
 {
     if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
     camera.processInput(window, delta_time);
+
+    // comma halves the time warp, period doubles it
+    int warp_keys[2] = {GLFW_KEY_COMMA, GLFW_KEY_PERIOD};
+    for (int k = 0; k < 2; k++) {
+        bool down = glfwGetKey(window, warp_keys[k]) == GLFW_PRESS;
+        if (down && !warp_keys_down[k]) {
+            float warp = simulation->time_warp.load() * (k == 0 ? 0.5f : 2.0f);
+            simulation->time_warp = std::fmin(std::fmax(warp, 1.0f / 64.0f), 65536.0f);
+        }
+        warp_keys_down[k] = down;
+    }
+
+    // B drops a body a few units in front of the camera
+    bool spawn_down = glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS;
+    if (spawn_down && !spawn_key_down)
+        simulation->spawn(camera.pos + camera.front * 3.0f, glm::vec3(0.0f), 0.1f);
+    spawn_key_down = spawn_down;
+
+    bool sphere_down = glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS;
+    if (sphere_down && !sphere_key_down)
+        draw_spheres = !draw_spheres;
+    sphere_key_down = sphere_down;
 }
 
 int main() {
@@ -97,7 +131,7 @@ int main() {
 
     // prepare textures
 
-    std::vector<glm::vec3> cube_positions = {
+    glm::vec3 cube_positions[] = {
         glm::vec3( 0.0f,  0.0f,  0.0f), 
         glm::vec3( 2.0f,  5.0f, -15.0f), 
         glm::vec3(-1.5f, -2.2f, -2.5f),  
@@ -110,6 +144,19 @@ int main() {
         glm::vec3(-1.3f,  1.0f, -1.5f)  
     };
 
+    // the bodies belong to the simulation thread once it is started
+    Simulation simulation;
+    for (glm::vec3 pos : cube_positions)
+        simulation.bodies.addBody(pos);
+
+    // the tree code wins over direct summation somewhere above a few thousand bodies
+    const size_t tree_solver_threshold = 8192;
+    DirectSolver direct_solver = DirectSolver(1.0f, 0.5f);
+    BarnesHutSolver tree_solver = BarnesHutSolver(1.0f, 0.5f);
+    simulation.solver = &direct_solver;
+    if (simulation.bodies.size() > tree_solver_threshold)
+        simulation.solver = &tree_solver;
+
     /*
     unsigned int indices[] = {
         0, 1, 3,   // first triangle
@@ -117,11 +164,41 @@ int main() {
     };
     */
 
-    BoxWrapper boxes = BoxWrapper(shader, cube_positions, &error, &error_log);
+    BodyMeshes meshes = BodyMeshes(shader, &error, &error_log);
+    if (error != SUCCESS) {
+        std::cerr << error_log << std::endl;
+        return error;
+    }
+
+    // one ray-cast square per body instead of a box, for large body counts
+    SphereShader sphere_shader = SphereShader(&error, &error_log);
+    if (error != SUCCESS) {
+        std::cerr << error_log << std::endl;
+        return error;
+    }
+    SphereImpostors spheres = SphereImpostors(sphere_shader);
+
+    // future paths of every body, integrated ahead on a thread of their own
+    OrbitLineShader line_shader = OrbitLineShader(&error, &error_log);
     if (error != SUCCESS) {
         std::cerr << error_log << std::endl;
         return error;
     }
+    OrbitLines orbit_lines = OrbitLines(line_shader);
+    // the same kind of solver as the simulation, but an instance of its own for the other thread
+    OrbitPredictor predictor = OrbitPredictor(simulation.solver->G, simulation.solver->softening);
+    BarnesHutSolver predictor_tree_solver = BarnesHutSolver(tree_solver.G, tree_solver.softening, tree_solver.theta);
+    if (simulation.solver == &tree_solver)
+        predictor.solver = &predictor_tree_solver;
+    predictor.step = simulation.fixed_step;
+    predictor.steps_per_vertex = 4;
+    // spawned bodies get their lines as soon as the predictor observes them
+    predictor.selectAll();
+    simulation.predictor = &predictor;
+    predictor.start();
+
+    // physics steps at its own pace from here on, frames only read its snapshots
+    simulation.start();
     
     // run window
     while(!glfwWindowShouldClose(window))
@@ -131,12 +208,51 @@ int main() {
         delta_time = current_frame - last_frame;
         last_frame = current_frame;
         
-        processInput(window);
+        processInput(window, &simulation);
+
+        // latest complete state of the simulation, unchanged until the next update
+        simulation.snapshots.update();
+        const Snapshot& snapshot = simulation.snapshots.readBuffer();
+        // draw between its last two steps, where the simulation stood one step ago
+        float blend = snapshot.blendAt(wallClockSeconds());
+
+        // The CPU side of the frame runs on the job system as a graph: the bodies out of view are
+        // culled and the rest binned by level, then the instances of the visible ones are packed.
+        // Forces and integration are not part of it, they run on the simulation thread.
+        bool spheres_frame = draw_spheres;
+        glm::mat4 view = camera.getView();
+        if (spheres_frame)
+            spheres.beginInstances(snapshot.size());
+        else
+            meshes.beginInstances(snapshot.size());
+        TaskGraph frame;
+        TaskGraph::Job* cull = frame.add([&]() {
+            if (spheres_frame)
+                spheres.cullInstances(snapshot, blend, view, camera.pos, width, height);
+            else
+                meshes.cullInstances(snapshot, blend, view, camera.pos, width, height);
+        });
+        TaskGraph::Job* pack = frame.add([&]() {
+            if (spheres_frame)
+                spheres.packInstances(snapshot, blend);
+            else
+                meshes.packInstances(snapshot, blend, current_frame);
+        }, {cull});
+        frame.submit(&defaultJobSystem());
 
         glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        boxes.runFrame(&camera, width, height);
+        // without helping, so the GL thread never picks up a force or integration block of the
+        // simulation thread from the shared queue and stalls the frame behind a slow step
+        defaultJobSystem().wait(pack, false);
+        if (spheres_frame)
+            spheres.runFrame(&camera, width, height);
+        else
+            meshes.runFrame(&camera, width, height);
+        predictor.lines.update();
+        orbit_lines.upload(predictor.lines.readBuffer());
+        orbit_lines.runFrame(&camera, width, height);
         //glDrawArrays(GL_TRIANGLES, 0, 36);
         //glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
@@ -144,8 +260,14 @@ int main() {
         glfwPollEvents();    
     }
 
-    boxes.clean();
+    simulation.stop();
+    predictor.stop();
+    meshes.clean();
     shader.clean();
+    spheres.clean();
+    sphere_shader.clean();
+    orbit_lines.clean();
+    line_shader.clean();
 
     glfwTerminate();
     return 0;
@@ -0,0 +1,272 @@
+#ifndef MESH_CPP
+#define MESH_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define MESH_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#ifndef FAILURE
+#define FAILURE 1
+#define SUCCESS 0
+#endif
+
+// classes --------------------------------------------------------------------------------------------
+
+// same layout as TriangleShader::Vertex
+class MeshVertex {
+    public:
+        glm::vec3 pos;
+        glm::vec2 tex_coord;
+};
+
+// indexed triangle list
+class Mesh {
+    public:
+        std::vector<MeshVertex> vertices;
+        std::vector<uint32_t> indices;
+
+        size_t triangles() const { return indices.size() / 3; }
+};
+
+// Every level of detail of the unit sphere in one vertex and one index array, so a renderer can
+// keep them in a single vertex and element buffer. The indices of each level already point at its
+// own vertices, level k is drawn from index first_index[k] on with index_count[k] indices.
+class SphereLods {
+    public:
+        Mesh mesh;
+        std::vector<uint32_t> first_index;
+        std::vector<uint32_t> index_count;
+
+        int levels() const { return (int)first_index.size(); }
+};
+
+// helpers --------------------------------------------------------------------------------------------
+
+// Unit icosphere: the icosahedron with every triangle split into four subdivisions times, the new
+// vertices pushed out onto the sphere. Level k has 20 * 4^k triangles. Texture coordinates are
+// longitude and latitude. Vertices on triangles straddling the date line are duplicated with their
+// longitude wrapped so the texture does not run backwards across the seam, and the poles, where
+// longitude means nothing, get a copy per triangle.
+Mesh icosphere(int subdivisions) {
+    const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+    std::vector<glm::vec3> positions = {
+        {-1.0f, t, 0.0f}, {1.0f, t, 0.0f}, {-1.0f, -t, 0.0f}, {1.0f, -t, 0.0f},
+        {0.0f, -1.0f, t}, {0.0f, 1.0f, t}, {0.0f, -1.0f, -t}, {0.0f, 1.0f, -t},
+        {t, 0.0f, -1.0f}, {t, 0.0f, 1.0f}, {-t, 0.0f, -1.0f}, {-t, 0.0f, 1.0f}
+    };
+    for (glm::vec3& p : positions)
+        p = glm::normalize(p);
+    std::vector<uint32_t> indices = {
+        0, 11, 5,   0, 5, 1,    0, 1, 7,    0, 7, 10,   0, 10, 11,
+        1, 5, 9,    5, 11, 4,   11, 10, 2,  10, 7, 6,   7, 1, 8,
+        3, 9, 4,    3, 4, 2,    3, 2, 6,    3, 6, 8,    3, 8, 9,
+        4, 9, 5,    2, 4, 11,   6, 2, 10,   8, 6, 7,    9, 8, 1
+    };
+
+    for (int level = 0; level < subdivisions; level++) {
+        // each edge is split once, shared by the two triangles on either side
+        std::unordered_map<uint64_t, uint32_t> midpoints;
+        auto midpoint = [&](uint32_t a, uint32_t b) {
+            uint64_t key = ((uint64_t)std::min(a, b) << 32) | std::max(a, b);
+            auto found = midpoints.find(key);
+            if (found != midpoints.end())
+                return found->second;
+            uint32_t index = (uint32_t)positions.size();
+            positions.push_back(glm::normalize(positions[a] + positions[b]));
+            midpoints[key] = index;
+            return index;
+        };
+        std::vector<uint32_t> finer;
+        finer.reserve(indices.size() * 4);
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+            uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            uint32_t split[12] = {a, ab, ca,  b, bc, ab,  c, ca, bc,  ab, bc, ca};
+            finer.insert(finer.end(), split, split + 12);
+        }
+        indices.swap(finer);
+    }
+
+    Mesh mesh;
+    mesh.vertices.resize(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+        glm::vec3 p = positions[i];
+        float u = 0.5f + std::atan2(p.z, p.x) / 6.2831853f;
+        float v = 0.5f + std::asin(std::max(-1.0f, std::min(1.0f, p.y))) / 3.1415927f;
+        mesh.vertices[i] = {p, glm::vec2(u, v)};
+    }
+    // a wrapped copy of each vertex on the low side of the seam, made once
+    std::map<uint32_t, uint32_t> wrapped;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        float u[3], w[3];
+        bool pole[3];
+        for (int k = 0; k < 3; k++) {
+            const MeshVertex& vertex = mesh.vertices[indices[i + k]];
+            u[k] = vertex.tex_coord.x;
+            w[k] = u[k] < 0.5f ? u[k] + 1.0f : u[k];
+            pole[k] = std::fabs(vertex.pos.y) > 0.999999f;
+        }
+        // wrapped if that makes the triangle narrower in longitude, the poles have none
+        float span = 0.0f, wrapped_span = 0.0f;
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                if (pole[j] || pole[k])
+                    continue;
+                span = std::max(span, u[j] - u[k]);
+                wrapped_span = std::max(wrapped_span, w[j] - w[k]);
+            }
+        }
+        if (wrapped_span < span) {
+            for (int k = 0; k < 3; k++) {
+                if (u[k] >= 0.5f || pole[k])
+                    continue;
+                uint32_t original = indices[i + k];
+                auto found = wrapped.find(original);
+                if (found == wrapped.end()) {
+                    MeshVertex copy = mesh.vertices[original];
+                    copy.tex_coord.x += 1.0f;
+                    found = wrapped.insert({original, (uint32_t)mesh.vertices.size()}).first;
+                    mesh.vertices.push_back(copy);
+                }
+                indices[i + k] = found->second;
+                u[k] += 1.0f;
+            }
+        }
+        // a pole gets a copy per triangle at the longitude of the other two corners
+        for (int k = 0; k < 3; k++) {
+            if (!pole[k])
+                continue;
+            MeshVertex copy = mesh.vertices[indices[i + k]];
+            copy.tex_coord.x = 0.5f * (u[(k + 1) % 3] + u[(k + 2) % 3]);
+            indices[i + k] = (uint32_t)mesh.vertices.size();
+            mesh.vertices.push_back(copy);
+        }
+    }
+    mesh.indices.swap(indices);
+    return mesh;
+}
+
+// icospheres of 0 to levels - 1 subdivisions, see SphereLods
+SphereLods buildSphereLods(int levels) {
+    SphereLods lods;
+    for (int level = 0; level < levels; level++) {
+        Mesh sphere = icosphere(level);
+        uint32_t base = (uint32_t)lods.mesh.vertices.size();
+        lods.first_index.push_back((uint32_t)lods.mesh.indices.size());
+        lods.index_count.push_back((uint32_t)sphere.indices.size());
+        lods.mesh.vertices.insert(lods.mesh.vertices.end(), sphere.vertices.begin(), sphere.vertices.end());
+        for (uint32_t index : sphere.indices)
+            lods.mesh.indices.push_back(base + index);
+    }
+    return lods;
+}
+
+// radius in pixels of a sphere seen from distance, for a perspective projection of vertical field
+// of view fov_y (radians) onto a viewport height pixels high
+float projectedRadius(float radius, float distance, float height, float fov_y) {
+    if (!(distance > radius))
+        return height;
+    return radius / (distance * std::tan(0.5f * fov_y)) * 0.5f * height;
+}
+
+// The coarsest level of an icosphere whose edges cover at most pixels_per_edge pixels at the given
+// projected radius. An edge of level k is about 1.1 / 2^k radii long, so every level doubles the
+// radius it serves and the triangles a body costs follow its area on screen, not its existence.
+int sphereLevel(float pixel_radius, int levels, float pixels_per_edge = 8.0f) {
+    int level = 0;
+    float edge = 1.1f * pixel_radius;
+    while (level + 1 < levels && edge > pixels_per_edge) {
+        edge *= 0.5f;
+        level++;
+    }
+    return level;
+}
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef MESH_MAIN_CPP
+
+int main() {
+    SphereLods lods = buildSphereLods(6);
+    const double pi = 3.141592653589793;
+    for (int level = 0; level < lods.levels(); level++) {
+        uint32_t first = lods.first_index[level], count = lods.index_count[level];
+        if (count != 60u << (2 * level)) {
+            std::cerr << "level " << level << " has " << count / 3 << " triangles" << std::endl;
+            return FAILURE;
+        }
+
+        // closed (every edge in two triangles, between the same positions), outward and on the sphere
+        std::map<std::pair<std::tuple<float, float, float>, std::tuple<float, float, float>>, int> edges;
+        double volume = 0.0;
+        float worst_radius = 0.0f;
+        for (uint32_t i = first; i < first + count; i += 3) {
+            glm::vec3 p[3];
+            for (int k = 0; k < 3; k++) {
+                p[k] = lods.mesh.vertices[lods.mesh.indices[i + k]].pos;
+                worst_radius = std::max(worst_radius, std::fabs(glm::length(p[k]) - 1.0f));
+            }
+            volume += glm::dot(p[0], glm::cross(p[1], p[2])) / 6.0;
+            for (int k = 0; k < 3; k++) {
+                glm::vec3 a = p[k], b = p[(k + 1) % 3];
+                auto ka = std::make_tuple(a.x, a.y, a.z), kb = std::make_tuple(b.x, b.y, b.z);
+                edges[ka < kb ? std::make_pair(ka, kb) : std::make_pair(kb, ka)]++;
+            }
+        }
+        bool closed = true;
+        for (const auto& edge : edges)
+            closed &= edge.second == 2;
+        std::cout << "level " << level << ": " << count / 3 << " triangles, volume " << volume << " of " << 4.0 / 3.0 * pi << std::endl;
+        if (!closed || !(worst_radius < 1e-6f) || !(volume > 0.6 * 4.0 / 3.0 * pi) || !(volume <= 4.0 / 3.0 * pi)) {
+            std::cerr << "level " << level << " is not a closed outward unit sphere" << std::endl;
+            return FAILURE;
+        }
+    }
+    // seam copies keep the triangles of the finer levels within a fraction of a turn of texture
+    for (size_t i = lods.first_index[2]; i < lods.mesh.indices.size(); i += 3) {
+        float u[3];
+        for (int k = 0; k < 3; k++)
+            u[k] = lods.mesh.vertices[lods.mesh.indices[i + k]].tex_coord.x;
+        if (std::max(u[0], std::max(u[1], u[2])) - std::min(u[0], std::min(u[1], u[2])) >= 0.25f) {
+            std::cerr << "triangle wraps around the texture seam" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // a thousand distant bodies cost less than one planet filling the view
+    float fov = glm::radians(45.0f);
+    int far_level = sphereLevel(projectedRadius(1.0f, 500.0f, 1080.0f, fov), lods.levels());
+    int near_level = sphereLevel(projectedRadius(1.0f, 3.0f, 1080.0f, fov), lods.levels());
+    size_t far_triangles = 1000 * (size_t)lods.index_count[far_level] / 3;
+    size_t near_triangles = lods.index_count[near_level] / 3;
+    std::cout << "far level " << far_level << ", near level " << near_level << ", 1000 far bodies " << far_triangles
+              << " triangles, one near body " << near_triangles << std::endl;
+    if (far_level != 0 || near_level != lods.levels() - 1 || far_triangles > 4 * near_triangles) {
+        std::cerr << "levels do not follow the size on screen" << std::endl;
+        return FAILURE;
+    }
+    for (float r = 1.0f; r < 1000.0f; r *= 1.5f) {
+        if (sphereLevel(r, lods.levels()) > sphereLevel(r * 1.5f, lods.levels())) {
+            std::cerr << "level is not monotonic in the projected radius" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
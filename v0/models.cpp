@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -12,10 +13,168 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include "shader.cpp"
 #include "camera.cpp"
 #include "shader_source.h"
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "snapshot.cpp"
+#include "prediction.cpp"
+#include "mesh.cpp"
+#include "culling.cpp"
+
+// Array buffer whose storage only ever grows, doubling when it is outgrown, so contents that change
+// size now and then, like the predicted paths as they lengthen, are written in place with
+// glBufferSubData instead of reallocated each time.
+class GrowableBuffer {
+    public:
+
+    unsigned int buffer = 0;
+    GLenum target = GL_ARRAY_BUFFER;
+    // bytes allocated and bytes holding data
+    size_t capacity = 0;
+    size_t size = 0;
+
+    GrowableBuffer(GLenum target = GL_ARRAY_BUFFER) : target(target) {
+        glGenBuffers(1, &buffer);
+    }
+
+    // leaves the buffer bound to target
+    void upload(const void* data, size_t bytes) {
+        glBindBuffer(target, buffer);
+        if (bytes > capacity) {
+            capacity = std::max(bytes, 2 * capacity);
+            glBufferData(target, capacity, nullptr, GL_DYNAMIC_DRAW);
+        }
+        if (bytes > 0)
+            glBufferSubData(target, 0, bytes, data);
+        size = bytes;
+    }
+
+    void clean() {
+        glDeleteBuffers(1, &buffer);
+    }
+};
+
+// Buffer for data rewritten every frame, split into three regions used in turn: while the GPU
+// still reads the region of the last frame or two, the CPU writes the next one, and a fence put
+// down after each draw tells when a region is free again. Where the context has buffer storage
+// (GL 4.4) the buffer is mapped once, persistent and coherent, and begin() hands out a pointer
+// straight into it, so the data is written once and there is no copy or driver call per frame.
+// Elsewhere begin() hands out a staging copy and end() orphans the buffer with glBufferData
+// before glBufferSubData, so the driver never waits for the GPU to let go of the old contents.
+class StreamBuffer {
+    public:
+
+    static const int REGIONS = 3;
+
+    unsigned int buffer = 0;
+    GLenum target = GL_ARRAY_BUFFER;
+    bool persistent = false;
+    // bytes per region, grown geometrically
+    size_t region_size = 0;
+    // region written by the last begin() and the bytes asked for
+    int region = REGIONS - 1;
+    size_t size = 0;
+    // times begin() found its region still in use by the GPU and waited
+    uint64_t stalls = 0;
+
+    StreamBuffer(GLenum target = GL_ARRAY_BUFFER) : target(target) {
+        persistent = GLAD_GL_VERSION_4_4 && glBufferStorage != nullptr;
+        glGenBuffers(1, &buffer);
+    }
+
+    // Room for bytes of data for the next draw. The pointer stays valid until end() and may be
+    // written from any thread, begin() and end() themselves belong to the GL thread.
+    void* begin(size_t bytes) {
+        size = bytes;
+        if (!persistent) {
+            staging.resize(bytes);
+            return staging.data();
+        }
+        if (bytes > region_size)
+            allocate(std::max(bytes, 2 * region_size));
+        region = (region + 1) % REGIONS;
+        wait(region);
+        return (char*)mapped + region * region_size;
+    }
+
+    // Makes the data written since begin() available to draws and returns its byte offset in the
+    // buffer, leaving the buffer bound to target.
+    size_t end() {
+        glBindBuffer(target, buffer);
+        if (persistent)
+            return region * region_size;
+        if (size > region_size)
+            region_size = std::max(size, 2 * region_size);
+        // orphan the storage the GPU may still read and fill a fresh one
+        glBufferData(target, region_size, nullptr, GL_STREAM_DRAW);
+        if (size > 0)
+            glBufferSubData(target, 0, size, staging.data());
+        return 0;
+    }
+
+    // after the last draw reading the data of this frame
+    void fence() {
+        if (!persistent)
+            return;
+        if (fences[region] != nullptr)
+            glDeleteSync(fences[region]);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    void clean() {
+        for (GLsync& sync : fences) {
+            if (sync != nullptr)
+                glDeleteSync(sync);
+            sync = nullptr;
+        }
+        if (mapped != nullptr) {
+            glBindBuffer(target, buffer);
+            glUnmapBuffer(target);
+            mapped = nullptr;
+        }
+        glDeleteBuffers(1, &buffer);
+    }
+
+    private:
+
+    void* mapped = nullptr;
+    GLsync fences[REGIONS] = {nullptr, nullptr, nullptr};
+    std::vector<char> staging;
+
+    // Storage made with glBufferStorage cannot be resized, so growing means a new buffer. The
+    // old one is deleted right away, GL keeps it alive for the draws still reading it.
+    void allocate(size_t new_region_size) {
+        clean();
+        glGenBuffers(1, &buffer);
+        region_size = new_region_size;
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBindBuffer(target, buffer);
+        glBufferStorage(target, REGIONS * region_size, nullptr, flags);
+        mapped = glMapBufferRange(target, 0, REGIONS * region_size, flags);
+        region = REGIONS - 1;
+    }
+
+    void wait(int r) {
+        if (fences[r] == nullptr)
+            return;
+        GLenum result = glClientWaitSync(fences[r], 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED) {
+            stalls++;
+            // flush once so the fence is sure to be signaled eventually, then block
+            GLbitfield flush = GL_SYNC_FLUSH_COMMANDS_BIT;
+            do {
+                result = glClientWaitSync(fences[r], flush, 1000000);
+                flush = 0;
+            } while (result == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fences[r]);
+        fences[r] = nullptr;
+    }
+};
 
 class TriangleShader {
     public:
@@ -25,10 +184,18 @@ class TriangleShader {
         glm::vec3 pos;
         glm::vec2 tex_coord;
     } Vertex;
+
+    // per body attributes, advanced once per instance
+    typedef struct {
+        glm::vec3 offset;
+        float scale;
+        // unit quaternion, x y z w
+        glm::vec4 orientation;
+        glm::vec4 color;
+    } Instance;
     #pragma pack(pop)
 
     typedef struct {
-        int model;
         int view;
         int proj;
         int textures[2];
@@ -46,7 +213,6 @@ class TriangleShader {
 
         useProgram();
     
-        u_IDs.model = glGetUniformLocation(shader_program, "u_model");
         u_IDs.view = glGetUniformLocation(shader_program, "u_view");
         u_IDs.proj = glGetUniformLocation(shader_program, "u_proj");
 
@@ -65,15 +231,24 @@ class TriangleShader {
         glEnableVertexAttribArray(1);
     }
 
+    // for the buffer bound to GL_ARRAY_BUFFER, holding one Instance per body from byte base on
+    void bindInstanceAttribPointers(size_t base = 0) {
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, offset)));
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, scale)));
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, orientation)));
+        glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, color)));
+        for (unsigned int a = 2; a <= 5; a++) {
+            glEnableVertexAttribArray(a);
+            glVertexAttribDivisor(a, 1);
+        }
+    }
+
     void setView(glm::mat4 matrix) {
         glUniformMatrix4fv(u_IDs.view, 1, GL_FALSE, glm::value_ptr(matrix));
     }
     void setProj(glm::mat4 matrix) {
         glUniformMatrix4fv(u_IDs.proj, 1, GL_FALSE, glm::value_ptr(matrix));
     }
-    void setModel(glm::mat4 matrix) {
-        glUniformMatrix4fv(u_IDs.model, 1, GL_FALSE, glm::value_ptr(matrix));
-    }
 
     void bindTexture(int slot, unsigned int texture_id) {
         glActiveTexture(GL_TEXTURE0 + slot);
@@ -85,70 +260,65 @@ class TriangleShader {
     }
 };
 
-// prepare buffers
-TriangleShader::Vertex vertices[] = {
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 0.0f}},
-    {{ 0.5f, -0.5f, -0.5f}, {1.0f, 0.0f}},
-    {{ 0.5f,  0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{ 0.5f,  0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{-0.5f,  0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 0.0f}},
-    
-    {{-0.5f, -0.5f,  0.5f}, {0.0f, 0.0f}},
-    {{ 0.5f, -0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 1.0f}},
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 1.0f}},
-    {{-0.5f,  0.5f,  0.5f}, {0.0f, 1.0f}},
-    {{-0.5f, -0.5f,  0.5f}, {0.0f, 0.0f}},
-    
-    {{-0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{-0.5f,  0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{-0.5f, -0.5f,  0.5f}, {0.0f, 0.0f}},
-    {{-0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{ 0.5f,  0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{ 0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{ 0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{ 0.5f, -0.5f,  0.5f}, {0.0f, 0.0f}},
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{ 0.5f, -0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{ 0.5f, -0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{ 0.5f, -0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{-0.5f, -0.5f,  0.5f}, {0.0f, 0.0f}},
-    {{-0.5f, -0.5f, -0.5f}, {0.0f, 1.0f}},
-    
-    {{-0.5f,  0.5f, -0.5f}, {0.0f, 1.0f}},
-    {{ 0.5f,  0.5f, -0.5f}, {1.0f, 1.0f}},
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{ 0.5f,  0.5f,  0.5f}, {1.0f, 0.0f}},
-    {{-0.5f,  0.5f,  0.5f}, {0.0f, 0.0f}},
-    {{-0.5f,  0.5f, -0.5f}, {0.0f, 1.0f}}
-};
+// the bodies of a snapshot as the renderers draw them, for FrustumCuller::cull
+CullInput cullInput(const Snapshot& snapshot, float blend, float point_radius) {
+    CullInput input;
+    input.x = snapshot.pos_x.data(), input.y = snapshot.pos_y.data(), input.z = snapshot.pos_z.data();
+    input.prev_x = snapshot.prev_x.data(), input.prev_y = snapshot.prev_y.data(), input.prev_z = snapshot.prev_z.data();
+    input.radius = snapshot.radius.data();
+    input.blend = blend;
+    input.default_radius = point_radius;
+    return input;
+}
 
-class BoxWrapper {
+// Every body in view as a textured icosphere. All levels of detail share one vertex and one
+// element buffer, and each body gets the level its size on screen calls for: a FrustumCuller drops
+// the bodies outside the view and bins the rest by level, and each level is one instanced draw, so
+// the vertices drawn follow the screen coverage of the bodies rather than their number.
+class BodyMeshes {
     public:
 
+    static const int LEVELS = 6;
+    static_assert(sizeof(MeshVertex) == sizeof(TriangleShader::Vertex), "mesh vertices are uploaded as TriangleShader vertices");
+
     TriangleShader shader;
-    std::vector<glm::vec3> cube_positions;
+    SphereLods lods;
+    // attributes of every visible body for this frame, handed out by beginInstances, counted by
+    // cullInstances, filled by packInstances and drawn by runFrame
+    TriangleShader::Instance* instances = nullptr;
+    size_t instance_count = 0;
+    // the instances of level k are level_count[k] from level_first[k] on
+    uint32_t level_first[LEVELS] = {}, level_count[LEVELS] = {};
+    // tint of every body
+    glm::vec4 color = glm::vec4(1.0f);
+    // drawn radius of bodies without a physical one
+    float point_radius = 0.5f;
+    // vertical field of view of the projection
+    float fov_y = glm::radians(45.0f);
+    // longest triangle edge on screen the chosen level may leave, in pixels
+    float pixels_per_edge = 8.0f;
 
-    unsigned int VBO, VAO;
+    FrustumCuller culler;
+
+    unsigned int VBO, EBO, VAO;
+    // rewritten every frame, the attribute pointers move to the region of the frame in runFrame
+    StreamBuffer instance_buffer;
     unsigned int textures[2];
 
-    BoxWrapper(TriangleShader &shader, std::vector<glm::vec3> cube_positions, int* error, std::string* error_log) : shader(shader) {
-        this->cube_positions = cube_positions;
+    BodyMeshes(TriangleShader &shader, int* error, std::string* error_log) : shader(shader) {
+        lods = buildSphereLods(LEVELS);
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
     
         glBindVertexArray(VAO);    
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, lods.mesh.vertices.size() * sizeof(MeshVertex), lods.mesh.vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, lods.mesh.indices.size() * sizeof(uint32_t), lods.mesh.indices.data(), GL_STATIC_DRAW);
         shader.bindAttribPointers();
+        shader.bindInstanceAttribPointers();
 
         processImages(error, error_log);
 
@@ -156,7 +326,7 @@ class BoxWrapper {
         glBindVertexArray(0);
 
         if (*error != SUCCESS) {
-            *error_log += "Failed to initialize BoxWrapper class: ^^^";
+            *error_log += "Failed to initialize BodyMeshes class: ^^^";
         }
     }
 
@@ -200,31 +370,350 @@ class BoxWrapper {
         //camera_pos.x = sin(glfwGetTime()) * radius;
         //camera_pos.y = 0;
         //camera_pos.z = cos(glfwGetTime()) * radius;
-        glm::mat4 proj = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.1f, 100.0f);
+        glm::mat4 proj = projection(width, height);
         glm::mat4 view = camera->getView();
 
         shader.setView(view);
         shader.setProj(proj);
 
-        for(unsigned int i = 0; i < cube_positions.size(); i++)
-        {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, cube_positions[i]);
-            float angle = 20.0f * i; 
-            model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-            if (i % 3 == 0) {
-                model = glm::rotate(model, (float)glfwGetTime() * glm::radians(50.0f), glm::vec3(0.5f, 1.0f, 0.0f));
+        // one instanced draw per level in use
+        size_t base = instance_buffer.end();
+        for (int level = 0; level < LEVELS; level++) {
+            if (level_count[level] == 0)
+                continue;
+            shader.bindInstanceAttribPointers(base + level_first[level] * sizeof(TriangleShader::Instance));
+            glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)lods.index_count[level], GL_UNSIGNED_INT,
+                                    (void*)(lods.first_index[level] * sizeof(uint32_t)), (GLsizei)level_count[level]);
+        }
+        instance_buffer.fence();
+        glBindVertexArray(0);
+        instances = nullptr;
+    }
+
+    // Room in the instance buffer for count bodies, on the GL thread before cullInstances. Waits
+    // only if the GPU is still reading the region from three frames ago.
+    void beginInstances(size_t count) {
+        instance_count = count;
+        instances = (TriangleShader::Instance*)instance_buffer.begin(count * sizeof(TriangleShader::Instance));
+    }
+
+    glm::mat4 projection(int width, int height) const {
+        return glm::perspective(fov_y, (float)width / (float)height, 0.1f, 100.0f);
+    }
+
+    // Picks the bodies of a snapshot, blended between its two states as in Snapshot::getPosition,
+    // that are in view on a viewport width by height pixels seen through view from eye, grouped by
+    // the level of detail they need. Neither this nor packInstances makes GL calls, so both can run
+    // as jobs on the job system while the GL thread is busy with something else.
+    void cullInstances(const Snapshot& snapshot, float blend, const glm::mat4& view, glm::vec3 eye, int width, int height) {
+        size_t count = std::min(instance_count, snapshot.size());
+        CullInput input = cullInput(snapshot, blend, point_radius);
+        Frustum frustum = Frustum::fromMatrix(projection(width, height) * view);
+        culler.cull(input, count, frustum, eye, 0.5f * height / std::tan(0.5f * fov_y), LEVELS, pixels_per_edge);
+        for (int level = 0; level < LEVELS; level++) {
+            level_first[level] = culler.level_first[level];
+            level_count[level] = culler.level_count[level];
+        }
+        instance_count = culler.visible.size();
+    }
+
+    // builds the instances of the bodies cullInstances picked, in its order, into the room from
+    // beginInstances
+    void packInstances(const Snapshot& snapshot, float blend, float time) {
+        const glm::vec3 tilt_axis = glm::normalize(glm::vec3(1.0f, 0.3f, 0.5f));
+        const glm::vec3 spin_axis = glm::normalize(glm::vec3(0.5f, 1.0f, 0.0f));
+        parallelFor(instance_count, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t k = begin; k < end; k++) {
+                size_t i = culler.visible[k];
+                // key the orientation off the slot of the handle so it survives reordering of the store
+                uint32_t slot = BodyStore::slotOf(snapshot.ids[i]);
+                glm::quat orientation = glm::angleAxis(glm::radians(20.0f * slot), tilt_axis);
+                if (slot % 3 == 0)
+                    orientation = orientation * glm::angleAxis(time * glm::radians(50.0f), spin_axis);
+                TriangleShader::Instance& instance = instances[k];
+                instance.offset = snapshot.getPosition(i, blend);
+                instance.scale = snapshot.radius[i] > 0.0f ? snapshot.radius[i] : point_radius;
+                instance.orientation = glm::vec4(orientation.x, orientation.y, orientation.z, orientation.w);
+                instance.color = color;
             }
-            shader.setModel(model);
-        
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        }, 256);
+    }
+
+    void clean() {
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &EBO);
+        instance_buffer.clean();
+    }
+};
+
+class OrbitLineShader {
+    public:
+
+    typedef struct {
+        int view;
+        int proj;
+        int color;
+    } UniformIDs;
+
+    unsigned int shader_program;
+    UniformIDs u_IDs;
+
+    OrbitLineShader(int* error, std::string* error_log) {
+        shader_program = createShaderProgram(orbit_line_vert_text, orbit_line_frag_text, error, error_log);
+        if (*error != SUCCESS) {
+            *error_log += "Error creating shader program for orbit line shader ^^^ \n";
+            return;
         }
+
+        u_IDs.view = glGetUniformLocation(shader_program, "u_view");
+        u_IDs.proj = glGetUniformLocation(shader_program, "u_proj");
+        u_IDs.color = glGetUniformLocation(shader_program, "u_color");
+    }
+
+    void useProgram() {
+        glUseProgram(shader_program);
+    }
+
+    void bindAttribPointers() {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        glEnableVertexAttribArray(0);
+    }
+
+    void setView(glm::mat4 matrix) {
+        glUniformMatrix4fv(u_IDs.view, 1, GL_FALSE, glm::value_ptr(matrix));
+    }
+    void setProj(glm::mat4 matrix) {
+        glUniformMatrix4fv(u_IDs.proj, 1, GL_FALSE, glm::value_ptr(matrix));
+    }
+    void setColor(glm::vec4 color) {
+        glUniform4fv(u_IDs.color, 1, glm::value_ptr(color));
+    }
+
+    void clean() {
+        glDeleteProgram(shader_program);
+    }
+};
+
+// Predicted paths from an OrbitPredictor, drawn as one line strip per body with a single
+// glMultiDrawArrays. The vertex buffer is only refilled when the predictor published new lines.
+class OrbitLines {
+    public:
+
+    OrbitLineShader shader;
+    glm::vec4 color = glm::vec4(0.9f, 0.8f, 0.3f, 1.0f);
+
+    unsigned int VAO;
+    // grows with the prediction, which lengthens a little each frame
+    GrowableBuffer vertices;
+    // version of the lines in the buffer
+    uint64_t uploaded = 0;
+    std::vector<int> firsts, counts;
+
+    OrbitLines(OrbitLineShader &shader) : shader(shader) {
+        glGenVertexArrays(1, &VAO);
+
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, vertices.buffer);
+        shader.bindAttribPointers();
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    // copies the lines into the vertex buffer unless they are there already
+    void upload(const PredictionLines& lines) {
+        if (lines.version == uploaded)
+            return;
+        vertices.upload(lines.vertices.data(), lines.vertices.size() * sizeof(glm::vec3));
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        firsts = lines.firsts;
+        counts = lines.counts;
+        uploaded = lines.version;
+    }
+
+    void runFrame(Camera* camera, int width, int height) {
+        if (counts.empty())
+            return;
+        shader.useProgram();
+        glBindVertexArray(VAO);
+
+        glm::mat4 proj = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.1f, 100.0f);
+        shader.setView(camera->getView());
+        shader.setProj(proj);
+        shader.setColor(color);
+
+        glMultiDrawArrays(GL_LINE_STRIP, firsts.data(), counts.data(), (GLsizei)counts.size());
+        glBindVertexArray(0);
+    }
+
+    void clean() {
+        glDeleteVertexArrays(1, &VAO);
+        vertices.clean();
+    }
+};
+
+// Ray-cast sphere impostors: each body is one square of four vertices facing the eye, and the
+// fragment shader intersects the view ray with the sphere, discards what misses, writes the depth
+// of the surface and lights it. A perfect sphere at any size for 4 vertices instead of the 36 of
+// a box, which is what makes millions of bodies drawable.
+class SphereShader {
+    public:
+
+    #pragma pack(push, 0)
+    // per body attributes, advanced once per instance
+    typedef struct {
+        glm::vec3 center;
+        float radius;
+        glm::vec4 color;
+    } Instance;
+    #pragma pack(pop)
+
+    typedef struct {
+        int view;
+        int proj;
+        int light;
+    } UniformIDs;
+
+    unsigned int shader_program;
+    UniformIDs u_IDs;
+
+    SphereShader(int* error, std::string* error_log) {
+        shader_program = createShaderProgram(sphere_vert_text, sphere_frag_text, error, error_log);
+        if (*error != SUCCESS) {
+            *error_log += "Error creating shader program for sphere shader ^^^ \n";
+            return;
+        }
+
+        u_IDs.view = glGetUniformLocation(shader_program, "u_view");
+        u_IDs.proj = glGetUniformLocation(shader_program, "u_proj");
+        u_IDs.light = glGetUniformLocation(shader_program, "u_light");
+    }
+
+    void useProgram() {
+        glUseProgram(shader_program);
+    }
+
+    // for the buffer of square corners bound to GL_ARRAY_BUFFER
+    void bindAttribPointers() {
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void*)0);
+        glEnableVertexAttribArray(0);
+    }
+
+    // for the buffer bound to GL_ARRAY_BUFFER, holding one Instance per body from byte base on
+    void bindInstanceAttribPointers(size_t base = 0) {
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, center)));
+        glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, radius)));
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base + offsetof(Instance, color)));
+        for (unsigned int a = 1; a <= 3; a++) {
+            glEnableVertexAttribArray(a);
+            glVertexAttribDivisor(a, 1);
+        }
+    }
+
+    void setView(glm::mat4 matrix) {
+        glUniformMatrix4fv(u_IDs.view, 1, GL_FALSE, glm::value_ptr(matrix));
+    }
+    void setProj(glm::mat4 matrix) {
+        glUniformMatrix4fv(u_IDs.proj, 1, GL_FALSE, glm::value_ptr(matrix));
+    }
+    // direction towards the light in view space
+    void setLight(glm::vec3 direction) {
+        glUniform3fv(u_IDs.light, 1, glm::value_ptr(glm::normalize(direction)));
+    }
+
+    void clean() {
+        glDeleteProgram(shader_program);
+    }
+};
+
+// Every body as a sphere impostor, with the same per-frame flow as BodyMeshes: beginInstances on
+// the GL thread, cullInstances and packInstances anywhere, runFrame on the GL thread.
+class SphereImpostors {
+    public:
+
+    SphereShader shader;
+    // drawn radius of bodies without a physical one
+    float point_radius = 0.1f;
+    glm::vec4 color = glm::vec4(0.9f, 0.85f, 0.7f, 1.0f);
+    // towards the light in world space
+    glm::vec3 light = glm::vec3(0.4f, 1.0f, 0.6f);
+
+    SphereShader::Instance* instances = nullptr;
+    size_t instance_count = 0;
+    // one level, only the bodies out of view are dropped
+    FrustumCuller culler;
+
+    unsigned int VBO, VAO;
+    StreamBuffer instance_buffer;
+
+    SphereImpostors(SphereShader &shader) : shader(shader) {
+        const glm::vec2 corners[4] = {{-1.0f, -1.0f}, {1.0f, -1.0f}, {-1.0f, 1.0f}, {1.0f, 1.0f}};
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        shader.bindAttribPointers();
+        shader.bindInstanceAttribPointers();
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    void beginInstances(size_t count) {
+        instance_count = count;
+        instances = (SphereShader::Instance*)instance_buffer.begin(count * sizeof(SphereShader::Instance));
+    }
+
+    glm::mat4 projection(int width, int height) const {
+        return glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.1f, 100.0f);
+    }
+
+    // no GL calls, see BodyMeshes::cullInstances
+    void cullInstances(const Snapshot& snapshot, float blend, const glm::mat4& view, glm::vec3 eye, int width, int height) {
+        size_t count = std::min(instance_count, snapshot.size());
+        Frustum frustum = Frustum::fromMatrix(projection(width, height) * view);
+        culler.cull(cullInput(snapshot, blend, point_radius), count, frustum, eye, 1.0f);
+        instance_count = culler.visible.size();
+    }
+
+    void packInstances(const Snapshot& snapshot, float blend) {
+        parallelFor(instance_count, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t k = begin; k < end; k++) {
+                size_t i = culler.visible[k];
+                SphereShader::Instance& instance = instances[k];
+                instance.center = snapshot.getPosition(i, blend);
+                instance.radius = snapshot.radius[i] > 0.0f ? snapshot.radius[i] : point_radius;
+                instance.color = color;
+            }
+        }, 1024);
+    }
+
+    void runFrame(Camera* camera, int width, int height) {
+        shader.useProgram();
+        glBindVertexArray(VAO);
+
+        glm::mat4 proj = projection(width, height);
+        glm::mat4 view = camera->getView();
+        shader.setView(view);
+        shader.setProj(proj);
+        shader.setLight(glm::mat3(view) * light);
+
+        size_t base = instance_buffer.end();
+        shader.bindInstanceAttribPointers(base);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)instance_count);
+        instance_buffer.fence();
+        glBindVertexArray(0);
+        instances = nullptr;
     }
 
     void clean() {
         glDeleteVertexArrays(1, &VAO);
         glDeleteBuffers(1, &VBO);
+        instance_buffer.clean();
     }
 };
 
-#endif
\ No newline at end of file
+#endif
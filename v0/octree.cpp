@@ -0,0 +1,209 @@
+#ifndef OCTREE_CPP
+#define OCTREE_CPP
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "bodies.cpp"
+
+#define OCTREE_MAX_DEPTH 32
+
+// class ----------------------------------------------------------------------------------------------
+
+// Octree over the bodies of a store, shared by the tree based solvers. Cells are stored flat with
+// contiguous children, and the bodies are reordered so every cell owns a contiguous range of the
+// tree_* arrays. Each cell carries its mass, center of mass and traceless quadrupole tensor.
+class Octree {
+    public:
+        typedef struct {
+            glm::vec3 center;       // geometric center of the cube
+            float half_size;
+            glm::vec3 com;          // center of mass
+            float mass;
+            float quad[6];          // Q = sum m (3 d d^T - |d|^2 I) about com, as xx xy xz yy yz zz
+            float bmax;             // distance from com to the farthest corner of the cube, or body after a refresh
+            float radius;           // distance from com to the farthest body, never above bmax
+            uint32_t first_child;   // children are contiguous, only non-empty octants are stored
+            uint32_t child_count;   // 0 for leaves
+            uint32_t body_begin;    // range in tree order
+            uint32_t body_count;
+        } Node;
+
+        // cells with at most this many bodies are not split further
+        unsigned int leaf_size = 16;
+
+        std::vector<Node> nodes;
+        // body indices and positions in tree order, cells read contiguous ranges of these
+        std::vector<uint32_t> order;
+        AlignedArray<float> tree_x, tree_y, tree_z, tree_m;
+
+    private:
+        std::vector<uint32_t> scratch;
+
+    public:
+        // sorts the bodies into a fresh tree and computes the moments of every cell
+        void build(BodyStore* bodies) {
+            size_t n = bodies->size();
+            glm::vec3 lo = bodies->getPosition(0), hi = lo;
+            for (size_t i = 1; i < n; i++) {
+                lo = glm::min(lo, bodies->getPosition(i));
+                hi = glm::max(hi, bodies->getPosition(i));
+            }
+            glm::vec3 extent = hi - lo;
+            float half = 0.5f * std::fmax(extent.x, std::fmax(extent.y, extent.z)) * 1.0001f + 1e-6f;
+
+            order.resize(n);
+            scratch.resize(n);
+            for (size_t i = 0; i < n; i++)
+                order[i] = (uint32_t)i;
+
+            nodes.clear();
+            nodes.push_back(Node());
+            buildNode(bodies, 0, 0, (uint32_t)n, 0.5f * (lo + hi), half, 0);
+
+            tree_x.resize(n);
+            tree_y.resize(n);
+            tree_z.resize(n);
+            tree_m.resize(n);
+            for (size_t k = 0; k < n; k++) {
+                tree_x[k] = bodies->pos_x[order[k]];
+                tree_y[k] = bodies->pos_y[order[k]];
+                tree_z[k] = bodies->pos_z[order[k]];
+                tree_m[k] = bodies->mass[order[k]];
+            }
+        }
+
+        // Recomputes the moments of every cell for the current positions of the same bodies, keeping
+        // the cells and the order of the bodies. Much cheaper than a build while the bodies have not
+        // moved far, but bodies may have left the cubes of their cells, so bmax covers the farthest
+        // body rather than the cube where that lies further out.
+        void refresh(BodyStore* bodies) {
+            for (size_t k = 0; k < order.size(); k++) {
+                tree_x[k] = bodies->pos_x[order[k]];
+                tree_y[k] = bodies->pos_y[order[k]];
+                tree_z[k] = bodies->pos_z[order[k]];
+                tree_m[k] = bodies->mass[order[k]];
+            }
+            // children are stored after their parents
+            for (size_t c = nodes.size(); c-- > 0;)
+                computeMoments(bodies, (uint32_t)c, false);
+        }
+
+    private:
+        void buildNode(BodyStore* bodies, uint32_t node, uint32_t begin, uint32_t end, glm::vec3 center, float half, int depth) {
+            nodes[node].center = center;
+            nodes[node].half_size = half;
+            nodes[node].body_begin = begin;
+            nodes[node].body_count = end - begin;
+            nodes[node].first_child = 0;
+            nodes[node].child_count = 0;
+
+            if (end - begin > leaf_size && depth < OCTREE_MAX_DEPTH) {
+                // counting sort of the range into octants
+                uint32_t counts[8] = {0};
+                auto octant = [&](uint32_t i) {
+                    return (bodies->pos_x[i] > center.x ? 1 : 0) | (bodies->pos_y[i] > center.y ? 2 : 0) | (bodies->pos_z[i] > center.z ? 4 : 0);
+                };
+                for (uint32_t k = begin; k < end; k++)
+                    counts[octant(order[k])]++;
+                uint32_t offsets[9];
+                offsets[0] = begin;
+                for (int c = 0; c < 8; c++)
+                    offsets[c + 1] = offsets[c] + counts[c];
+                uint32_t fill[8];
+                for (int c = 0; c < 8; c++)
+                    fill[c] = offsets[c];
+                for (uint32_t k = begin; k < end; k++)
+                    scratch[fill[octant(order[k])]++] = order[k];
+                for (uint32_t k = begin; k < end; k++)
+                    order[k] = scratch[k];
+
+                uint32_t first_child = (uint32_t)nodes.size();
+                uint32_t child_count = 0;
+                for (int c = 0; c < 8; c++)
+                    if (counts[c] > 0)
+                        child_count++;
+                nodes.resize(nodes.size() + child_count);
+                nodes[node].first_child = first_child;
+                nodes[node].child_count = child_count;
+
+                uint32_t child = first_child;
+                float quarter = 0.5f * half;
+                for (int c = 0; c < 8; c++) {
+                    if (counts[c] == 0)
+                        continue;
+                    glm::vec3 offset = glm::vec3(c & 1 ? quarter : -quarter, c & 2 ? quarter : -quarter, c & 4 ? quarter : -quarter);
+                    buildNode(bodies, child++, offsets[c], offsets[c + 1], center + offset, quarter, depth + 1);
+                }
+            }
+            computeMoments(bodies, node, true);
+        }
+
+        // contained is false when the bodies may lie outside the cube of the cell
+        void computeMoments(BodyStore* bodies, uint32_t node, bool contained) {
+            Node& cell = nodes[node];
+            double mass = 0.0;
+            glm::dvec3 weighted = glm::dvec3(0.0);
+            double q[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+
+            if (cell.child_count == 0) {
+                for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++) {
+                    double m = bodies->mass[order[k]];
+                    mass += m;
+                    weighted += m * glm::dvec3(bodies->getPosition(order[k]));
+                }
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                    mass += nodes[c].mass;
+                    weighted += (double)nodes[c].mass * glm::dvec3(nodes[c].com);
+                }
+            }
+            glm::dvec3 com = mass > 0.0 ? weighted / mass : glm::dvec3(cell.center);
+
+            // quadrupole about com, children are shifted with the parallel axis theorem
+            auto addPoint = [&](double m, glm::dvec3 d) {
+                double r2 = glm::dot(d, d);
+                q[0] += m * (3.0 * d.x * d.x - r2);
+                q[1] += m * 3.0 * d.x * d.y;
+                q[2] += m * 3.0 * d.x * d.z;
+                q[3] += m * (3.0 * d.y * d.y - r2);
+                q[4] += m * 3.0 * d.y * d.z;
+                q[5] += m * (3.0 * d.z * d.z - r2);
+            };
+            if (cell.child_count == 0) {
+                for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++)
+                    addPoint(bodies->mass[order[k]], glm::dvec3(bodies->getPosition(order[k])) - com);
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                    addPoint(nodes[c].mass, glm::dvec3(nodes[c].com) - com);
+                    for (int e = 0; e < 6; e++)
+                        q[e] += nodes[c].quad[e];
+                }
+            }
+
+            cell.mass = (float)mass;
+            cell.com = glm::vec3(com);
+            for (int e = 0; e < 6; e++)
+                cell.quad[e] = (float)q[e];
+            cell.bmax = glm::length(glm::abs(cell.com - cell.center) + glm::vec3(cell.half_size));
+            float radius = 0.0f;
+            if (cell.child_count == 0) {
+                for (uint32_t k = cell.body_begin; k < cell.body_begin + cell.body_count; k++)
+                    radius = std::fmax(radius, glm::length(bodies->getPosition(order[k]) - cell.com));
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++)
+                    radius = std::fmax(radius, nodes[c].radius + glm::length(nodes[c].com - cell.com));
+            }
+            if (contained) {
+                cell.radius = std::fmin(radius, cell.bmax);
+            } else {
+                cell.radius = radius;
+                cell.bmax = std::fmax(cell.bmax, radius);
+            }
+        }
+
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef PARALLEL_CPP
+#define PARALLEL_CPP
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <functional>
+
+#include "jobs.cpp"
+
+// helpers for splitting kernels across cores ------------------------------------------------------
+
+// Shared pool behind parallelFor, one thread per core besides the caller but at least one so a
+// submitted task graph makes progress while the submitting thread is busy with something else.
+JobSystem& defaultJobSystem() {
+    static JobSystem jobs = JobSystem(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+    return jobs;
+}
+
+// upper bound of the worker argument of parallelFor
+unsigned int workerCount() {
+    return defaultJobSystem().slotCount();
+}
+
+// Calls fn(begin, end, worker) on pieces of [0, count) of at least grain items on the shared pool.
+// worker is in [0, workerCount()) and no two calls of one loop run with the same worker at once,
+// so callers can keep per-thread scratch data indexed by it.
+void parallelFor(size_t count, const std::function<void(size_t, size_t, unsigned int)>& fn, size_t grain = 1) {
+    defaultJobSystem().parallelFor(count, fn, grain);
+}
+
+#endif
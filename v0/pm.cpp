@@ -0,0 +1,405 @@
+#ifndef PM_CPP
+#define PM_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define PM_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "fft.cpp"
+
+// empty mesh cells kept around the bodies, enough for the CIC and finite difference stencils
+#define PM_MARGIN 3
+// P3M pairs are cut off at this many split radii, where the short range force is 0.5% of Newton's
+#define PM_CUTOFF_SPLITS 5.0f
+// samples of the short range split factor, tabulated in (r / cutoff)^2
+#define PM_SPLIT_TABLE 1024
+
+// helpers --------------------------------------------------------------------------------------------
+
+// smallest mesh of at least requested cells per side that the radix-2 FFT and the margins allow
+unsigned int pmGridSize(unsigned int requested) {
+    unsigned int size = 16;
+    while (size < requested && size < (1u << 30))
+        size *= 2;
+    return size;
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Particle-mesh solver for large collisionless runs. Masses are spread over a cubic mesh with
+// cloud-in-cell weights, the potential is the mesh convolved with the Green's function of the
+// Laplacian by FFT, and the finite differenced field is interpolated back with the same weights.
+// Boundaries are isolated: the mesh is zero padded to twice its size so the periodic convolution
+// of the FFT does not wrap around (Hockney & Eastwood). The mesh is refitted to the bodies on
+// every call, so the resolution is the extent of the system over grid_size.
+//
+// The mesh cannot resolve anything below a couple of cells. With p3m the Green's function is
+// split at split_radius, the mesh keeps the long range part -G m erf(r / 2r_s) / r and pairs
+// closer than PM_CUTOFF_SPLITS r_s add the softened short range remainder directly.
+class PmSolver : public ForceSolver {
+    public:
+        // mesh cells per side, a power of two of at least 16, other values are rounded up to one on
+        // the next call. The FFT grid has twice as many, 64 uses 48MB.
+        unsigned int grid_size = 64;
+        // add the particle-particle short range correction
+        bool p3m = false;
+        // force split scale r_s in mesh cells
+        float split_radius = 1.25f;
+
+        // placement of the mesh on the last call, node (i, j, k) sits at origin + cell_size * (i, j, k)
+        glm::vec3 origin = glm::vec3(0.0f);
+        float cell_size = 0.0f;
+
+    private:
+        Fft fft;
+        // transform of the Green's function in mesh units, real since the kernel is even
+        std::vector<double> green;
+        unsigned int green_grid = 0;
+        bool green_p3m = false;
+        float green_split = 0.0f;
+
+        std::vector<Complex> work;
+        std::vector<double> potential;
+        std::vector<float> field_x, field_y, field_z;
+        std::vector<std::vector<double>> worker_mass;
+
+        // chaining mesh of the short range pass, bodies sorted by chain cell
+        std::vector<uint32_t> chain_begin, chain_bodies;
+        // erfc(r / 2r_s) + r / (r_s sqrt(pi)) exp(-r^2 / 4r_s^2) at r = cutoff sqrt(k / PM_SPLIT_TABLE)
+        float split_table[PM_SPLIT_TABLE + 2];
+
+    public:
+        PmSolver(float G = 1.0f, float softening = 0.05f, unsigned int grid_size = 64, bool p3m = false) {
+            this->G = G;
+            this->softening = softening;
+            this->grid_size = pmGridSize(grid_size);
+            this->p3m = p3m;
+        }
+
+        const char* name() override { return p3m ? "p3m" : "pm"; }
+
+        void computeAccelerations(BodyStore* bodies) override {
+            bodies->clearAccelerations();
+            if (bodies->size() == 0)
+                return;
+            grid_size = pmGridSize(grid_size);
+            if (green_grid != grid_size || green_p3m != p3m || green_split != split_radius)
+                prepareGreen();
+
+            placeMesh(bodies);
+            assignMass(bodies);
+            solvePotential();
+            differentiate();
+            interpolate(bodies);
+            if (p3m)
+                addShortRange(bodies);
+        }
+
+    private:
+        size_t meshIndex(size_t x, size_t y, size_t z) const {
+            return (x * grid_size + y) * grid_size + z;
+        }
+
+        void prepareGreen() {
+            size_t n = 2 * (size_t)grid_size;
+            fft.prepare(n);
+            work.assign(n * n * n, Complex(0.0, 0.0));
+            double rs = split_radius;
+            for (size_t x = 0; x < n; x++)
+                for (size_t y = 0; y < n; y++)
+                    for (size_t z = 0; z < n; z++) {
+                        // distances wrap so the kernel is even on the periodic grid
+                        double dx = (double)std::min(x, n - x), dy = (double)std::min(y, n - y), dz = (double)std::min(z, n - z);
+                        double r = std::sqrt(dx * dx + dy * dy + dz * dz);
+                        double g;
+                        if (p3m)
+                            g = r > 0.0 ? std::erf(r / (2.0 * rs)) / r : 1.0 / (std::sqrt(M_PI) * rs);
+                        else
+                            g = r > 0.0 ? 1.0 / r : 1.0;
+                        work[(x * n + y) * n + z] = Complex(g, 0.0);
+                    }
+            fft3d(fft, work.data(), false, n);
+            green.resize(work.size());
+            for (size_t i = 0; i < work.size(); i++)
+                green[i] = work[i].real();
+
+            for (int k = 0; k <= PM_SPLIT_TABLE + 1; k++) {
+                double r = PM_CUTOFF_SPLITS * rs * std::sqrt((double)k / PM_SPLIT_TABLE);
+                split_table[k] = (float)(std::erfc(r / (2.0 * rs)) + r / (rs * std::sqrt(M_PI)) * std::exp(-r * r / (4.0 * rs * rs)));
+            }
+
+            green_grid = grid_size;
+            green_p3m = p3m;
+            green_split = split_radius;
+        }
+
+        // cube around the bodies with PM_MARGIN free cells on every side
+        void placeMesh(BodyStore* bodies) {
+            glm::vec3 lo = bodies->getPosition(0), hi = lo;
+            for (size_t i = 1; i < bodies->size(); i++) {
+                lo = glm::min(lo, bodies->getPosition(i));
+                hi = glm::max(hi, bodies->getPosition(i));
+            }
+            glm::vec3 extent = hi - lo;
+            float span = std::fmax(extent.x, std::fmax(extent.y, extent.z));
+            cell_size = std::fmax(span, 1e-6f) / (float)(grid_size - 2 * PM_MARGIN - 1);
+            glm::vec3 center = 0.5f * (lo + hi);
+            origin = center - glm::vec3(0.5f * cell_size * (grid_size - 1));
+        }
+
+        // cloud-in-cell: the mass goes to the 8 nodes around the body, weighted by overlap
+        template <typename F>
+        void cloudInCell(glm::vec3 position, F&& node) const {
+            glm::vec3 u = (position - origin) / cell_size;
+            glm::vec3 base = glm::floor(u);
+            glm::vec3 f = u - base;
+            size_t x = (size_t)base.x, y = (size_t)base.y, z = (size_t)base.z;
+            for (int c = 0; c < 8; c++) {
+                float w = (c & 1 ? f.x : 1.0f - f.x) * (c & 2 ? f.y : 1.0f - f.y) * (c & 4 ? f.z : 1.0f - f.z);
+                node(meshIndex(x + (c & 1), y + (c & 2 ? 1 : 0), z + (c & 4 ? 1 : 0)), w);
+            }
+        }
+
+        // every worker spreads its share into a private mesh, the meshes are summed into the FFT grid
+        void assignMass(BodyStore* bodies) {
+            size_t cells = (size_t)grid_size * grid_size * grid_size;
+            unsigned int workers = workerCount();
+            worker_mass.resize(workers);
+            for (std::vector<double>& mesh : worker_mass)
+                mesh.assign(cells, 0.0);
+
+            parallelFor(bodies->size(), [&](size_t begin, size_t end, unsigned int worker) {
+                std::vector<double>& mesh = worker_mass[worker];
+                for (size_t i = begin; i < end; i++) {
+                    double m = bodies->mass[i];
+                    cloudInCell(bodies->getPosition(i), [&](size_t index, float w) { mesh[index] += m * w; });
+                }
+            }, 1024);
+
+            size_t n = 2 * (size_t)grid_size;
+            std::fill(work.begin(), work.end(), Complex(0.0, 0.0));
+            parallelFor(grid_size, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t x = begin; x < end; x++)
+                    for (size_t y = 0; y < grid_size; y++)
+                        for (size_t z = 0; z < grid_size; z++) {
+                            double sum = 0.0;
+                            for (const std::vector<double>& mesh : worker_mass)
+                                sum += mesh[meshIndex(x, y, z)];
+                            work[(x * n + y) * n + z] = Complex(sum, 0.0);
+                        }
+            });
+        }
+
+        // phi = -G / cell_size * (mass * green), the green's function being in mesh units
+        void solvePotential() {
+            size_t n = 2 * (size_t)grid_size;
+            fft3d(fft, work.data(), false, grid_size);
+            double scale = -(double)G / ((double)cell_size * (double)(n * n * n));
+            parallelFor(work.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++)
+                    work[i] *= green[i] * scale;
+            }, 4096);
+            fft3d(fft, work.data(), true, grid_size);
+
+            potential.resize((size_t)grid_size * grid_size * grid_size);
+            for (size_t x = 0; x < grid_size; x++)
+                for (size_t y = 0; y < grid_size; y++)
+                    for (size_t z = 0; z < grid_size; z++)
+                        potential[meshIndex(x, y, z)] = work[(x * n + y) * n + z].real();
+        }
+
+        // field = -grad phi by fourth order central differences, zero on the two outermost layers
+        void differentiate() {
+            size_t cells = (size_t)grid_size * grid_size * grid_size;
+            field_x.assign(cells, 0.0f);
+            field_y.assign(cells, 0.0f);
+            field_z.assign(cells, 0.0f);
+            double inv = 1.0 / (12.0 * cell_size);
+            size_t sx = (size_t)grid_size * grid_size, sy = grid_size, sz = 1;
+            auto difference = [&](size_t i, size_t stride) {
+                return -(8.0 * (potential[i + stride] - potential[i - stride]) - (potential[i + 2 * stride] - potential[i - 2 * stride])) * inv;
+            };
+            parallelFor(grid_size - 4, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t x = begin + 2; x < end + 2; x++)
+                    for (size_t y = 2; y < grid_size - 2; y++)
+                        for (size_t z = 2; z < grid_size - 2; z++) {
+                            size_t i = meshIndex(x, y, z);
+                            field_x[i] = (float)difference(i, sx);
+                            field_y[i] = (float)difference(i, sy);
+                            field_z[i] = (float)difference(i, sz);
+                        }
+            });
+        }
+
+        void interpolate(BodyStore* bodies) {
+            parallelFor(bodies->size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    glm::vec3 a = glm::vec3(0.0f);
+                    cloudInCell(bodies->getPosition(i), [&](size_t index, float w) {
+                        a += w * glm::vec3(field_x[index], field_y[index], field_z[index]);
+                    });
+                    bodies->acc_x[i] = a.x;
+                    bodies->acc_y[i] = a.y;
+                    bodies->acc_z[i] = a.z;
+                }
+            }, 1024);
+        }
+
+        // Short range P3M part, what the erf split took out of the mesh for pairs within the cutoff:
+        //     a += G m d / |d|^3 (erfc(r / 2r_s) + r / (r_s sqrt(pi)) exp(-r^2 / 4r_s^2)),  softened like the direct solver
+        void addShortRange(BodyStore* bodies) {
+            float rs = split_radius * cell_size;
+            float cutoff = PM_CUTOFF_SPLITS * rs;
+            // chain cells at least one cutoff wide, so neighbours within it are in the 27 around a body
+            float mesh_span = cell_size * (grid_size - 1);
+            int side = std::max(1, (int)(mesh_span / cutoff));
+            float chain_size = mesh_span / side;
+            auto chainCoordinate = [&](float p, float o) {
+                int c = (int)((p - o) / chain_size);
+                return c < 0 ? 0 : (c >= side ? side - 1 : c);
+            };
+            auto chainCell = [&](size_t i) {
+                return (chainCoordinate(bodies->pos_x[i], origin.x) * side + chainCoordinate(bodies->pos_y[i], origin.y)) * side
+                     + chainCoordinate(bodies->pos_z[i], origin.z);
+            };
+
+            size_t n = bodies->size();
+            size_t chain_cells = (size_t)side * side * side;
+            chain_begin.assign(chain_cells + 1, 0);
+            chain_bodies.resize(n);
+            for (size_t i = 0; i < n; i++)
+                chain_begin[chainCell(i) + 1]++;
+            for (size_t c = 0; c < chain_cells; c++)
+                chain_begin[c + 1] += chain_begin[c];
+            std::vector<uint32_t> fill(chain_begin.begin(), chain_begin.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                chain_bodies[fill[chainCell(i)]++] = (uint32_t)i;
+
+            float eps2 = softening * softening;
+            float cutoff2 = cutoff * cutoff;
+            float table_scale = PM_SPLIT_TABLE / cutoff2;
+            parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    glm::vec3 p = bodies->getPosition(i);
+                    int cx = chainCoordinate(p.x, origin.x), cy = chainCoordinate(p.y, origin.y), cz = chainCoordinate(p.z, origin.z);
+                    glm::vec3 a = glm::vec3(0.0f);
+                    for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, side - 1); x++)
+                        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, side - 1); y++)
+                            for (int z = std::max(cz - 1, 0); z <= std::min(cz + 1, side - 1); z++) {
+                                size_t c = ((size_t)x * side + y) * side + z;
+                                for (uint32_t k = chain_begin[c]; k < chain_begin[c + 1]; k++) {
+                                    uint32_t j = chain_bodies[k];
+                                    glm::vec3 d = bodies->getPosition(j) - p;
+                                    float r2 = glm::dot(d, d);
+                                    if (j == i || r2 >= cutoff2)
+                                        continue;
+                                    float u = r2 * table_scale;
+                                    int s = (int)u;
+                                    float split = split_table[s] + (u - s) * (split_table[s + 1] - split_table[s]);
+                                    float soft2 = r2 + eps2;
+                                    a += (bodies->mass[j] * split / (soft2 * std::sqrt(soft2))) * d;
+                                }
+                            }
+                    bodies->acc_x[i] += G * a.x;
+                    bodies->acc_y[i] += G * a.y;
+                    bodies->acc_z[i] += G * a.z;
+                }
+            }, 256);
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef PM_MAIN_CPP
+#include <chrono>
+#include <random>
+
+// mean relative error of the accelerations of bodies against reference
+double meanError(BodyStore* bodies, const std::vector<glm::vec3>& reference) {
+    double sum = 0.0;
+    for (size_t i = 0; i < bodies->size(); i++)
+        sum += glm::length(bodies->getAcceleration(i) - reference[i]) / glm::length(reference[i]);
+    return sum / bodies->size();
+}
+
+int main() {
+    const size_t n = 32768;
+    const float softening = 0.01f;
+    // homogeneous sphere with a denser clump off center
+    std::mt19937 rng(99);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    BodyStore bodies;
+    while (bodies.size() < n) {
+        glm::vec3 p = glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+        if (glm::length(p) > 1.0f)
+            continue;
+        if (bodies.size() % 8 == 0)
+            p = glm::vec3(0.4f, 0.2f, 0.0f) + 0.1f * p;
+        bodies.addBody(p, glm::vec3(0.0f), 1.0f / n);
+    }
+
+    DirectSolver direct = DirectSolver(1.0f, softening);
+    direct.computeAccelerations(&bodies);
+    std::vector<glm::vec3> reference(n);
+    for (size_t i = 0; i < n; i++)
+        reference[i] = bodies.getAcceleration(i);
+
+    PmSolver pm = PmSolver(1.0f, softening, 64);
+    double errors[2];
+    for (int with_p3m = 0; with_p3m < 2; with_p3m++) {
+        pm.p3m = with_p3m;
+        auto start = std::chrono::steady_clock::now();
+        pm.computeAccelerations(&bodies);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        errors[with_p3m] = meanError(&bodies, reference);
+
+        glm::dvec3 momentum = glm::dvec3(0.0);
+        double scale = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            momentum += (double)bodies.mass[i] * glm::dvec3(bodies.getAcceleration(i));
+            scale += bodies.mass[i] * glm::length(bodies.getAcceleration(i));
+        }
+        std::cout << pm.name() << ": " << ms << " ms (first call includes the green's function), mean relative error "
+                  << errors[with_p3m] << ", net force " << glm::length(momentum) / scale << std::endl;
+        if (glm::length(momentum) / scale > 1e-3) {
+            std::cerr << "mesh forces do not cancel" << std::endl;
+            return FAILURE;
+        }
+    }
+    if (errors[1] > 2e-2 || errors[1] > 0.5 * errors[0]) {
+        std::cerr << "short range correction does not improve the mesh forces" << std::endl;
+        return FAILURE;
+    }
+
+    // sizes the FFT cannot take are rounded up to the next one it can, not used as they are
+    PmSolver odd = PmSolver(1.0f, softening, 48);
+    PmSolver empty = PmSolver(1.0f, softening, 0);
+    pm.p3m = false;
+    pm.computeAccelerations(&bodies);
+    std::vector<glm::vec3> expected(n);
+    for (size_t i = 0; i < n; i++)
+        expected[i] = bodies.getAcceleration(i);
+    odd.computeAccelerations(&bodies);
+    double odd_error = meanError(&bodies, expected);
+    empty.grid_size = 5;
+    empty.computeAccelerations(&bodies);
+    std::cout << "grid sizes 48 and 5 run as " << odd.grid_size << " and " << empty.grid_size << ", 48 off the 64 mesh by " << odd_error << std::endl;
+    if (odd.grid_size != 64 || empty.grid_size != 16 || !(odd_error < 1e-6) || !(meanError(&bodies, reference) < 0.5)) {
+        std::cerr << "mesh sizes that are no power of two are not rounded up" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,520 @@
+#ifndef PREDICTION_CPP
+#define PREDICTION_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define PREDICTION_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include "bodies.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+#include "snapshot.cpp"
+
+// classes --------------------------------------------------------------------------------------------
+
+// Predicted paths of the selected bodies as line strips, ready for glMultiDrawArrays: strip k is
+// counts[k] vertices from firsts[k] and belongs to ids[k]. Every strip starts at the body as last
+// seen and runs to the end of the prediction.
+class PredictionLines {
+    public:
+        std::vector<glm::vec3> vertices;
+        std::vector<int> firsts, counts;
+        std::vector<BodyStore::BodyID> ids;
+        // simulated time of the first vertex of every strip
+        double time = 0.0;
+        // bumped on every publish, for the renderer to skip uploads of lines it already has
+        uint64_t version = 0;
+};
+
+// A change of velocity a body is planned to get at some time
+class Maneuver {
+    public:
+        BodyStore::BodyID body;
+        double time;
+        glm::vec3 delta_v;
+};
+
+// class ----------------------------------------------------------------------------------------------
+
+// Future paths of bodies, integrated ahead of the simulation on a thread of its own. The predictor
+// keeps the state of all bodies at every step of its prediction. Each observe() of the real state
+// is compared with the prediction at that time: while every body is within tolerance of where it
+// was predicted to be, the steps already passed are dropped and the rest is kept, so only the few
+// steps that the horizon moved on have to be integrated. A body that strays further, as after a
+// close encounter that went differently or a maneuver that was not planned, restarts the prediction
+// from the observed state. A planned maneuver throws away only the steps after its time and the
+// prediction continues from there with the maneuver applied.
+//
+// The prediction uses a solver of its own and kick-drift-kick leapfrog, for the massive bodies only. The
+// lines of the selected bodies are published after every round of work through a TripleBuffer, so
+// the renderer picks up the latest ones without waiting. start() runs the rounds on a thread that
+// sleeps while the prediction is complete and nothing new was observed; update() runs one round on
+// the calling thread instead.
+class OrbitPredictor {
+    public:
+        // direct summation unless set to another solver before start(), never the simulation's
+        // own, solvers keep scratch data and the two run on different threads
+        DirectSolver direct;
+        ForceSolver* solver = &direct;
+        // prediction step, in simulated time
+        float step = 0.01f;
+        // how far past the last observation the prediction reaches
+        double horizon = 10.0;
+        // distance a body may stray from its prediction before that is redone
+        float tolerance = 0.01f;
+        // steps integrated per round at most, so new observations are picked up in between
+        size_t max_steps_per_update = 1024;
+        // one line vertex per this many steps
+        size_t steps_per_vertex = 1;
+        TripleBuffer<PredictionLines> lines;
+
+        // steps integrated and predictions started over, since construction
+        std::atomic<uint64_t> steps_computed{0};
+        std::atomic<uint64_t> restarts{0};
+
+    private:
+        // state of every body at one time, x y z vx vy vz each
+        class State {
+            public:
+                // before any observation, so no maneuver counts as past
+                double time = -INFINITY;
+                std::vector<float> values;
+        };
+
+        // inputs, shared with the observing thread
+        std::mutex mutex;
+        std::condition_variable changed;
+        State observed;
+        std::vector<float> observed_mass;
+        std::vector<BodyStore::BodyID> observed_ids;
+        bool observation_fresh = false;
+        std::vector<BodyStore::BodyID> selected;
+        bool select_all = false;
+        std::vector<Maneuver> maneuvers;
+        // steps after this time have to be redone, infinity while nothing needs it
+        double invalid_from = INFINITY;
+        bool selection_changed = false;
+
+        // owned by the predicting thread
+        State current;
+        bool have_current = false;
+        std::vector<BodyStore::BodyID> ids;
+        // index in ids, and so in work and the states, of every observed handle
+        std::unordered_map<BodyStore::BodyID, size_t> index_of;
+        std::deque<State> predicted;
+        // the bodies in the order of ids, its own handles are unrelated to theirs
+        BodyStore work;
+        // work holds the last predicted state
+        bool work_current = false;
+        SplittingIntegrator integrator;
+        std::vector<Maneuver> plan;
+        std::vector<BodyStore::BodyID> drawn;
+        bool draw_all = false;
+        uint64_t version = 0;
+
+        std::thread thread;
+        std::atomic<bool> stop_requested{false};
+
+    public:
+        OrbitPredictor(float G = 1.0f, float softening = 0.05f) : direct(G, softening) {}
+
+        ~OrbitPredictor() {
+            stop();
+        }
+
+        // the bodies whose lines are published
+        void select(const std::vector<BodyStore::BodyID>& bodies) {
+            std::lock_guard<std::mutex> lock(mutex);
+            selected = bodies;
+            select_all = false;
+            selection_changed = true;
+            changed.notify_one();
+        }
+
+        // lines for every observed body, bodies added later included
+        void selectAll() {
+            std::lock_guard<std::mutex> lock(mutex);
+            selected.clear();
+            select_all = true;
+            selection_changed = true;
+            changed.notify_one();
+        }
+
+        // Records the real state of the massive bodies at time, from any thread. Only the latest one
+        // counts, states observed faster than the predictor keeps up are skipped.
+        void observe(const BodyStore& bodies, double time) {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t n = bodies.size();
+            observed.time = time;
+            observed.values.resize(6 * n);
+            observed_mass.resize(n);
+            observed_ids.assign(bodies.ids.begin(), bodies.ids.begin() + n);
+            for (size_t i = 0; i < n; i++) {
+                glm::vec3 p = bodies.getPosition(i), v = bodies.getVelocity(i);
+                for (int d = 0; d < 3; d++) {
+                    observed.values[6 * i + d] = p[d];
+                    observed.values[6 * i + 3 + d] = v[d];
+                }
+                observed_mass[i] = bodies.mass[i];
+            }
+            observation_fresh = true;
+            changed.notify_one();
+        }
+
+        // plans a change of velocity of body at time, the prediction is redone from there on
+        void addManeuver(BodyStore::BodyID body, double time, glm::vec3 delta_v) {
+            std::lock_guard<std::mutex> lock(mutex);
+            Maneuver maneuver = {body, time, delta_v};
+            maneuvers.insert(std::upper_bound(maneuvers.begin(), maneuvers.end(), maneuver,
+                [](const Maneuver& a, const Maneuver& b) { return a.time < b.time; }), maneuver);
+            invalid_from = std::min(invalid_from, time);
+            changed.notify_one();
+        }
+
+        // simulated time the prediction reaches
+        double predictedUntil() const { return predicted.empty() ? 0.0 : predicted.back().time; }
+
+        void start() {
+            if (thread.joinable())
+                return;
+            stop_requested = false;
+            thread = std::thread(&OrbitPredictor::run, this);
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop_requested = true;
+                changed.notify_one();
+            }
+            if (thread.joinable())
+                thread.join();
+        }
+
+        bool running() const { return thread.joinable(); }
+
+        // One round of work: takes in the latest observation and maneuvers, keeps what is still
+        // valid of the prediction, extends it by up to max_steps_per_update steps and publishes the
+        // lines if anything changed. False once the prediction reaches the horizon and nothing was
+        // left to do.
+        bool update() {
+            bool fresh = false, redraw = false;
+            double invalid = INFINITY;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (observation_fresh) {
+                    current = observed;
+                    fresh = true;
+                    observation_fresh = false;
+                    have_current = true;
+                    if (ids != observed_ids || work.size() != observed_mass.size()) {
+                        ids = observed_ids;
+                        index_of.clear();
+                        work = BodyStore();
+                        for (size_t i = 0; i < ids.size(); i++) {
+                            index_of[ids[i]] = i;
+                            work.addBody(glm::vec3(0.0f), glm::vec3(0.0f), observed_mass[i]);
+                        }
+                        predicted.clear();
+                    }
+                }
+                // maneuvers in the past have happened or will not
+                while (!maneuvers.empty() && maneuvers.front().time <= current.time)
+                    maneuvers.erase(maneuvers.begin());
+                plan = maneuvers;
+                invalid = invalid_from;
+                invalid_from = INFINITY;
+                if (selection_changed) {
+                    drawn = selected;
+                    draw_all = select_all;
+                    selection_changed = false;
+                    redraw = true;
+                }
+            }
+            if (!have_current)
+                return false;
+
+            if (fresh) {
+                redraw = true;
+                if (!follows(current)) {
+                    predicted.clear();
+                    predicted.push_back(current);
+                    work_current = false;
+                    restarts++;
+                } else {
+                    // the step at or before the observation stays as the start of the rest
+                    while (predicted.size() > 1 && predicted[1].time <= current.time)
+                        predicted.pop_front();
+                }
+            }
+            if (invalid < INFINITY) {
+                while (predicted.size() > 1 && predicted.back().time >= invalid)
+                    predicted.pop_back();
+                work_current = false;
+                redraw = true;
+            }
+
+            size_t budget = max_steps_per_update;
+            while (budget > 0 && predicted.back().time < current.time + horizon) {
+                extend();
+                budget--;
+                redraw = true;
+            }
+            if (redraw)
+                publish();
+            return redraw;
+        }
+
+    private:
+        // index of the body behind a handle of the observed store, NO_INDEX if it is not there
+        size_t indexOf(BodyStore::BodyID id) const {
+            auto found = index_of.find(id);
+            return found == index_of.end() ? BodyStore::NO_INDEX : found->second;
+        }
+
+        // whether the observation lies within the prediction and tolerance of it
+        bool follows(const State& state) const {
+            if (predicted.empty() || state.time < predicted.front().time || state.time > predicted.back().time)
+                return false;
+            size_t k = 0;
+            while (k + 1 < predicted.size() && predicted[k + 1].time < state.time)
+                k++;
+            const State& a = predicted[k];
+            const State& b = k + 1 < predicted.size() ? predicted[k + 1] : a;
+            double span = b.time - a.time;
+            float blend = span > 0.0 ? (float)((state.time - a.time) / span) : 0.0f;
+            float tolerance2 = tolerance * tolerance;
+            for (size_t i = 0; i < ids.size(); i++) {
+                float distance2 = 0.0f;
+                for (int d = 0; d < 3; d++) {
+                    float expected = a.values[6 * i + d] + blend * (b.values[6 * i + d] - a.values[6 * i + d]);
+                    float miss = state.values[6 * i + d] - expected;
+                    distance2 += miss * miss;
+                }
+                if (!(distance2 <= tolerance2))
+                    return false;
+            }
+            return true;
+        }
+
+        // one step past the end of the prediction, with the maneuvers that fall into it
+        void extend() {
+            const State& last = predicted.back();
+            if (!work_current) {
+                for (size_t i = 0; i < ids.size(); i++) {
+                    const float* v = &last.values[6 * i];
+                    work.setPosition(i, glm::vec3(v[0], v[1], v[2]));
+                    work.setVelocity(i, glm::vec3(v[3], v[4], v[5]));
+                }
+                integrator.reset();
+                work_current = true;
+            }
+            double start = last.time, end = start + step;
+            integrator.step(&work, solver, step);
+            for (const Maneuver& maneuver : plan) {
+                if (maneuver.time <= start || maneuver.time > end)
+                    continue;
+                size_t i = indexOf(maneuver.body);
+                if (i != BodyStore::NO_INDEX)
+                    work.setVelocity(i, work.getVelocity(i) + maneuver.delta_v);
+            }
+            State next;
+            next.time = end;
+            next.values.resize(6 * ids.size());
+            for (size_t i = 0; i < ids.size(); i++) {
+                glm::vec3 p = work.getPosition(i), v = work.getVelocity(i);
+                for (int d = 0; d < 3; d++) {
+                    next.values[6 * i + d] = p[d];
+                    next.values[6 * i + 3 + d] = v[d];
+                }
+            }
+            predicted.push_back(std::move(next));
+            steps_computed++;
+        }
+
+        void publish() {
+            PredictionLines& out = lines.writeBuffer();
+            out.vertices.clear();
+            out.firsts.clear();
+            out.counts.clear();
+            out.ids.clear();
+            out.time = current.time;
+            out.version = ++version;
+            for (BodyStore::BodyID id : draw_all ? ids : drawn) {
+                size_t i = indexOf(id);
+                if (i == BodyStore::NO_INDEX)
+                    continue;
+                out.firsts.push_back((int)out.vertices.size());
+                out.ids.push_back(id);
+                out.vertices.push_back(glm::vec3(current.values[6 * i], current.values[6 * i + 1], current.values[6 * i + 2]));
+                for (size_t k = 0; k < predicted.size(); k += steps_per_vertex) {
+                    if (predicted[k].time <= current.time)
+                        continue;
+                    const float* v = &predicted[k].values[6 * i];
+                    out.vertices.push_back(glm::vec3(v[0], v[1], v[2]));
+                }
+                out.counts.push_back((int)out.vertices.size() - out.firsts.back());
+            }
+            lines.publish();
+        }
+
+        void run() {
+            while (!stop_requested.load()) {
+                if (update())
+                    continue;
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() {
+                    return stop_requested.load() || observation_fresh || selection_changed || invalid_from < INFINITY;
+                });
+            }
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef PREDICTION_MAIN_CPP
+#include <chrono>
+
+int main() {
+    // a sun and a planet on a circular orbit of period 2 pi, simulated with the predictor's scheme
+    BodyStore bodies;
+    bodies.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    BodyStore::BodyID planet = bodies.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1e-6f);
+    DirectSolver solver = DirectSolver(1.0f, 0.0f);
+    SplittingIntegrator leapfrog;
+    const float dt = 0.01f;
+
+    OrbitPredictor predictor = OrbitPredictor(1.0f, 0.0f);
+    predictor.step = dt;
+    predictor.horizon = 6.283185307179586;
+    predictor.select({planet});
+    predictor.observe(bodies, 0.0);
+    while (predictor.update()) {}
+    predictor.lines.update();
+    const PredictionLines& first = predictor.lines.readBuffer();
+    glm::vec3 end = first.vertices.back();
+    std::cout << "prediction of one orbit: " << predictor.steps_computed.load() << " steps, " << first.counts[0]
+              << " vertices, ends " << glm::length(end - glm::vec3(1.0f, 0.0f, 0.0f)) << " from the start" << std::endl;
+    if (first.counts.size() != 1 || first.counts[0] != 630 || glm::length(end - glm::vec3(1.0f, 0.0f, 0.0f)) > 0.01f) {
+        std::cerr << "prediction does not close the orbit" << std::endl;
+        return FAILURE;
+    }
+
+    // the simulation follows the prediction, so only the horizon moving on costs steps
+    for (int s = 0; s < 100; s++)
+        leapfrog.step(&bodies, &solver, dt);
+    uint64_t before = predictor.steps_computed.load();
+    predictor.observe(bodies, 100 * dt);
+    while (predictor.update()) {}
+    uint64_t extended = predictor.steps_computed.load() - before;
+    std::cout << "after 100 steps of the simulation: " << extended << " steps extended, " << predictor.restarts.load() << " restarts" << std::endl;
+    if (extended != 100 || predictor.restarts.load() != 1) {
+        std::cerr << "valid prefix of the prediction was not reused" << std::endl;
+        return FAILURE;
+    }
+
+    // a planned burn redoes only the part of the prediction after it
+    before = predictor.steps_computed.load();
+    const double burn = 4.0;
+    predictor.addManeuver(planet, burn, -0.2f * glm::vec3(-std::sin(burn), std::cos(burn), 0.0f));
+    while (predictor.update()) {}
+    extended = predictor.steps_computed.load() - before;
+    predictor.lines.update();
+    const PredictionLines& burned = predictor.lines.readBuffer();
+    float perihelion = 1.0f;
+    for (int k = 0; k < burned.counts[0]; k++)
+        perihelion = std::fmin(perihelion, glm::length(burned.vertices[burned.firsts[0] + k]));
+    std::cout << "retrograde burn at t = " << burn << ": " << extended << " steps redone, closest approach now " << perihelion << std::endl;
+    if (extended < 325 || extended > 330 || !(perihelion < 0.6f)) {
+        std::cerr << "maneuver did not redo the prediction from its time on" << std::endl;
+        return FAILURE;
+    }
+
+    // a kick the prediction does not know about starts it over from the observed state
+    bodies.setVelocity(1, bodies.getVelocity(1) + glm::vec3(0.0f, 0.0f, 0.3f));
+    for (int s = 0; s < 10; s++)
+        leapfrog.step(&bodies, &solver, dt);
+    predictor.observe(bodies, 110 * dt);
+    while (predictor.update()) {}
+    std::cout << "after an unplanned kick: " << predictor.restarts.load() << " restarts" << std::endl;
+    if (predictor.restarts.load() != 2) {
+        std::cerr << "divergence from the prediction went unnoticed" << std::endl;
+        return FAILURE;
+    }
+
+    // handles of a store that has had bodies removed no longer match their indices
+    BodyStore shuffled;
+    shuffled.addBody(glm::vec3(50.0f, 0.0f, 0.0f), glm::vec3(0.0f), 1e-9f);
+    shuffled.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    BodyStore::BodyID moved = shuffled.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1e-6f);
+    shuffled.removeBody(shuffled.ids[0]);
+    OrbitPredictor reordered = OrbitPredictor(1.0f, 0.0f);
+    reordered.step = dt;
+    reordered.horizon = 6.283185307179586;
+    reordered.select({moved});
+    reordered.addManeuver(moved, burn, -0.2f * glm::vec3(-std::sin(burn), std::cos(burn), 0.0f));
+    reordered.observe(shuffled, 0.0);
+    while (reordered.update()) {}
+    reordered.lines.update();
+    const PredictionLines& moved_lines = reordered.lines.readBuffer();
+    perihelion = 1.0f;
+    for (int k = 0; moved_lines.counts.size() == 1 && k < moved_lines.counts[0]; k++)
+        perihelion = std::fmin(perihelion, glm::length(moved_lines.vertices[moved_lines.firsts[0] + k]));
+    std::cout << "after a removal: " << moved_lines.counts.size() << " lines, closest approach " << perihelion << std::endl;
+    if (moved_lines.counts.size() != 1 || moved_lines.ids[0] != moved || moved_lines.vertices[0] != glm::vec3(1.0f, 0.0f, 0.0f)
+        || !(perihelion < 0.6f)) {
+        std::cerr << "line or maneuver went to the wrong body after a removal" << std::endl;
+        return FAILURE;
+    }
+
+    // every body once all are selected, a body added later as well
+    OrbitPredictor everything = OrbitPredictor(1.0f, 0.0f);
+    everything.step = dt;
+    everything.horizon = 1.0;
+    everything.selectAll();
+    everything.observe(shuffled, 0.0);
+    while (everything.update()) {}
+    shuffled.addBody(glm::vec3(0.0f, 3.0f, 0.0f), glm::vec3(-1.0f / std::sqrt(3.0f), 0.0f, 0.0f), 1e-6f);
+    everything.observe(shuffled, 0.0);
+    while (everything.update()) {}
+    everything.lines.update();
+    std::cout << "all selected: " << everything.lines.readBuffer().counts.size() << " lines for " << shuffled.size() << " bodies" << std::endl;
+    if (everything.lines.readBuffer().counts.size() != shuffled.size()) {
+        std::cerr << "a body added after selecting all has no line" << std::endl;
+        return FAILURE;
+    }
+
+    // on its own thread, the predictor picks up observations and publishes lines by itself
+    OrbitPredictor background = OrbitPredictor(1.0f, 0.0f);
+    background.select({planet});
+    background.start();
+    background.observe(bodies, 0.0);
+    bool published = false;
+    for (int k = 0; k < 500 && !published; k++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        published = background.lines.update() && background.lines.readBuffer().counts.size() == 1;
+    }
+    background.stop();
+    if (!published || background.running()) {
+        std::cerr << "background predictor did not publish lines" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef REGULARIZATION_CPP
+#define REGULARIZATION_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define REGULARIZATION_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+
+#include <glm/glm.hpp>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+
+// helpers --------------------------------------------------------------------------------------------
+
+// Relative orbit of a pair in Kustaanheimo-Stiefel variables. The separation x is written as
+// x = L(u) u with a 4-vector u and r = |u|^2, and time is replaced by the fictitious time s with
+// dt = r ds. In these variables the Kepler problem becomes the harmonic oscillator
+//     u'' = h/2 u + r/2 L(u)^T P,   h' = 2 u' . L(u)^T P,   t' = r
+// with h the two body energy per reduced mass and P the perturbing relative acceleration, free of
+// the 1/r^2 singularity: a pericenter passage takes as many steps in s as any other part of the orbit.
+class KsOrbit {
+    public:
+        double u[4];
+        double du[4];
+        double h;
+        double mu;
+        // physical time since the orbit was set up
+        double t;
+};
+
+// L(u)^T p for a 3-vector p with a zero fourth component
+inline void ksTransposed(const double u[4], glm::dvec3 p, double out[4]) {
+    out[0] = u[0] * p.x + u[1] * p.y + u[2] * p.z;
+    out[1] = -u[1] * p.x + u[0] * p.y + u[3] * p.z;
+    out[2] = -u[2] * p.x - u[3] * p.y + u[0] * p.z;
+    out[3] = u[3] * p.x - u[2] * p.y + u[1] * p.z;
+}
+
+inline glm::dvec3 ksPosition(const double u[4]) {
+    return glm::dvec3(u[0] * u[0] - u[1] * u[1] - u[2] * u[2] + u[3] * u[3],
+                      2.0 * (u[0] * u[1] - u[2] * u[3]),
+                      2.0 * (u[0] * u[2] + u[1] * u[3]));
+}
+
+// KS state of the relative position x and velocity v under the gravitational parameter mu
+KsOrbit ksFromCartesian(glm::dvec3 x, glm::dvec3 v, double mu) {
+    KsOrbit orbit;
+    double r = glm::length(x);
+    // of the circle of u giving x, the member with the larger of u1 and u2 keeps the division safe
+    if (x.x >= 0.0) {
+        orbit.u[0] = std::sqrt(0.5 * (r + x.x));
+        orbit.u[1] = x.y / (2.0 * orbit.u[0]);
+        orbit.u[2] = x.z / (2.0 * orbit.u[0]);
+        orbit.u[3] = 0.0;
+    } else {
+        orbit.u[1] = std::sqrt(0.5 * (r - x.x));
+        orbit.u[0] = x.y / (2.0 * orbit.u[1]);
+        orbit.u[3] = x.z / (2.0 * orbit.u[1]);
+        orbit.u[2] = 0.0;
+    }
+    ksTransposed(orbit.u, v, orbit.du);
+    for (int k = 0; k < 4; k++)
+        orbit.du[k] *= 0.5;
+    orbit.mu = mu;
+    orbit.h = 0.5 * glm::dot(v, v) - mu / r;
+    orbit.t = 0.0;
+    return orbit;
+}
+
+void ksToCartesian(const KsOrbit& orbit, glm::dvec3* x, glm::dvec3* v) {
+    const double* u = orbit.u;
+    const double* du = orbit.du;
+    double r = u[0] * u[0] + u[1] * u[1] + u[2] * u[2] + u[3] * u[3];
+    *x = ksPosition(u);
+    *v = 2.0 / r * glm::dvec3(u[0] * du[0] - u[1] * du[1] - u[2] * du[2] + u[3] * du[3],
+                              u[1] * du[0] + u[0] * du[1] - u[3] * du[2] - u[2] * du[3],
+                              u[2] * du[0] + u[3] * du[1] + u[0] * du[2] + u[1] * du[3]);
+}
+
+// Advances orbit by dt in physical time with classical Runge-Kutta steps in s, about steps_per_orbit
+// of them per period of the oscillator whatever the eccentricity, under the tidal field of the rest
+// of the system, P = tidal x. The last steps are cut to land on dt. Returns the steps taken.
+size_t ksAdvance(KsOrbit* orbit, const glm::dmat3& tidal, double dt, int steps_per_orbit) {
+    const size_t max_steps = 10000000;
+    // y = u, u', h, t
+    double y[10];
+    for (int k = 0; k < 4; k++) {
+        y[k] = orbit->u[k];
+        y[4 + k] = orbit->du[k];
+    }
+    y[8] = orbit->h;
+    y[9] = orbit->t;
+    double start = orbit->t, mu = orbit->mu;
+    auto derivative = [&](const double* state, double* out) {
+        double r = state[0] * state[0] + state[1] * state[1] + state[2] * state[2] + state[3] * state[3];
+        double lp[4];
+        ksTransposed(state, tidal * ksPosition(state), lp);
+        for (int k = 0; k < 4; k++) {
+            out[k] = state[4 + k];
+            out[4 + k] = 0.5 * state[8] * state[k] + 0.5 * r * lp[k];
+        }
+        out[8] = 2.0 * (state[4] * lp[0] + state[5] * lp[1] + state[6] * lp[2] + state[7] * lp[3]);
+        out[9] = r;
+    };
+
+    size_t steps = 0;
+    double k1[10], k2[10], k3[10], k4[10], trial[10];
+    while (steps < max_steps) {
+        double remaining = start + dt - y[9];
+        if (std::fabs(remaining) <= 1e-14 * std::fabs(dt) || remaining == 0.0)
+            break;
+        double r = y[0] * y[0] + y[1] * y[1] + y[2] * y[2] + y[3] * y[3];
+        // oscillator frequency of bound orbits, for unbound ones the rate at which r changes
+        double omega = y[8] < 0.0 ? std::sqrt(-0.5 * y[8]) : std::sqrt(0.5 * y[8] + 0.25 * mu / r);
+        double ds = std::copysign(6.283185307179586 / (steps_per_orbit * omega), remaining);
+        if (r * std::fabs(ds) >= std::fabs(remaining))
+            ds = remaining / r;
+
+        derivative(y, k1);
+        for (int k = 0; k < 10; k++)
+            trial[k] = y[k] + 0.5 * ds * k1[k];
+        derivative(trial, k2);
+        for (int k = 0; k < 10; k++)
+            trial[k] = y[k] + 0.5 * ds * k2[k];
+        derivative(trial, k3);
+        for (int k = 0; k < 10; k++)
+            trial[k] = y[k] + ds * k3[k];
+        derivative(trial, k4);
+        for (int k = 0; k < 10; k++)
+            y[k] += ds / 6.0 * (k1[k] + 2.0 * k2[k] + 2.0 * k3[k] + k4[k]);
+        steps++;
+    }
+    for (int k = 0; k < 4; k++) {
+        orbit->u[k] = y[k];
+        orbit->du[k] = y[4 + k];
+    }
+    orbit->h = y[8];
+    orbit->t = y[9];
+    return steps;
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Close encounters and hard binaries taken out of the main integration. A pair whose two body
+// dynamical time sqrt(r^3 / G (m1 + m2)) falls below encounter_steps steps is replaced, for the
+// base integrator and the solver, by a single body of their combined mass at their center of mass,
+// and its relative orbit is carried in KS variables with ksAdvance, under the tidal field of the
+// rest of the system at the start of each step. After the step the pair is split up again at the
+// new center of mass. Once its separation grows past release_factor times the radius at which it
+// was taken in, it goes back to the base integrator as two bodies. The whole system keeps the step
+// set for it while the pair takes hundreds of sub-steps a step if it has to, at no cost to anyone
+// else.
+//
+// Pairs are found by sweeping the bodies sorted along x and taken greedily, closest relative to
+// their capture radius first, each body in one pair at most. A third body falling into a pair only
+// shows as the tidal field, chains of more than two bodies are not regularized. The internal motion
+// of a pair is unsoftened, which is the point. Between steps the relative orbit is kept in double
+// precision and only taken from the store again if something else moved the bodies.
+class KsIntegrator : public Integrator {
+    public:
+        // pairs with a dynamical time below this many steps are regularized
+        float encounter_steps = 8.0f;
+        // and released again once this much farther apart
+        float release_factor = 2.0f;
+        int steps_per_orbit = 128;
+        // pairs taken in and Runge-Kutta steps spent on them, since the start
+        uint64_t pairs_formed = 0;
+        uint64_t ks_steps = 0;
+
+    private:
+        class Pair {
+            public:
+                BodyStore::BodyID a, b;
+                double mass_a, mass_b;
+                // relative position and velocity of a from b as of the end of the last step, and
+                // where that put the bodies in the store
+                glm::dvec3 x, v;
+                glm::vec3 stored_a, stored_b, stored_va, stored_vb;
+                double capture_radius;
+                glm::dmat3 tidal;
+                KsOrbit orbit;
+        };
+
+        SplittingIntegrator leapfrog;
+        Integrator* base;
+        std::vector<Pair> pairs;
+        // the bodies the base integrator sees: the single bodies, then a body per pair
+        BodyStore reduced;
+        std::vector<size_t> singles;
+        bool layout_current = false;
+
+    public:
+        KsIntegrator(Integrator* base = nullptr) {
+            this->base = base != nullptr ? base : &leapfrog;
+        }
+
+        const char* name() override { return "ks"; }
+
+        void reset() override {
+            pairs.clear();
+            layout_current = false;
+            base->reset();
+        }
+
+        double activeFraction() override { return base->activeFraction(); }
+
+        size_t pairCount() const { return pairs.size(); }
+
+        void step(BodyStore* bodies, ForceSolver* solver, float dt) override {
+            double G = solver->G;
+            // pairs whose bodies were removed are gone
+            for (size_t p = pairs.size(); p-- > 0;) {
+                if (bodies->indexOf(pairs[p].a) == BodyStore::NO_INDEX || bodies->indexOf(pairs[p].b) == BodyStore::NO_INDEX) {
+                    pairs.erase(pairs.begin() + p);
+                    layout_current = false;
+                }
+            }
+            if (findPairs(*bodies, G, dt))
+                layout_current = false;
+            if (!layout_current || reduced.size() != bodies->size() - pairs.size())
+                buildLayout(*bodies);
+
+            // the base integrator sees every pair as one body
+            for (size_t k = 0; k < singles.size(); k++) {
+                reduced.setPosition(k, bodies->getPosition(singles[k]));
+                reduced.setVelocity(k, bodies->getVelocity(singles[k]));
+            }
+            for (size_t p = 0; p < pairs.size(); p++) {
+                Pair& pair = pairs[p];
+                size_t ia = bodies->indexOf(pair.a), ib = bodies->indexOf(pair.b);
+                glm::vec3 pa = bodies->getPosition(ia), pb = bodies->getPosition(ib);
+                glm::dvec3 va = glm::dvec3(bodies->getVelocity(ia)), vb = glm::dvec3(bodies->getVelocity(ib));
+                double total = pair.mass_a + pair.mass_b;
+                if (pa != pair.stored_a || pb != pair.stored_b || glm::vec3(va) != pair.stored_va || glm::vec3(vb) != pair.stored_vb) {
+                    pair.x = glm::dvec3(pa) - glm::dvec3(pb);
+                    pair.v = va - vb;
+                }
+                glm::dvec3 center = (pair.mass_a * glm::dvec3(pa) + pair.mass_b * glm::dvec3(pb)) / total;
+                reduced.setPosition(singles.size() + p, glm::vec3(center));
+                reduced.setVelocity(singles.size() + p, glm::vec3((pair.mass_a * va + pair.mass_b * vb) / total));
+            }
+
+            // tidal fields at the start of the step, then everything moves
+            parallelFor(pairs.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t p = begin; p < end; p++)
+                    pairs[p].tidal = tidalTensor(singles.size() + p, G);
+            }, 1);
+            base->step(&reduced, solver, dt);
+            std::vector<size_t> substeps(pairs.size());
+            parallelFor(pairs.size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t p = begin; p < end; p++) {
+                    Pair& pair = pairs[p];
+                    pair.orbit = ksFromCartesian(pair.x, pair.v, G * (pair.mass_a + pair.mass_b));
+                    substeps[p] = ksAdvance(&pair.orbit, pair.tidal, dt, steps_per_orbit);
+                    ksToCartesian(pair.orbit, &pair.x, &pair.v);
+                }
+            }, 1);
+            for (size_t count : substeps)
+                ks_steps += count;
+
+            for (size_t k = 0; k < singles.size(); k++) {
+                bodies->setPosition(singles[k], reduced.getPosition(k));
+                bodies->setVelocity(singles[k], reduced.getVelocity(k));
+            }
+            for (size_t p = pairs.size(); p-- > 0;) {
+                Pair& pair = pairs[p];
+                double total = pair.mass_a + pair.mass_b;
+                glm::dvec3 center = glm::dvec3(reduced.getPosition(singles.size() + p));
+                glm::dvec3 velocity = glm::dvec3(reduced.getVelocity(singles.size() + p));
+                size_t ia = bodies->indexOf(pair.a), ib = bodies->indexOf(pair.b);
+                pair.stored_a = glm::vec3(center + pair.mass_b / total * pair.x);
+                pair.stored_b = glm::vec3(center - pair.mass_a / total * pair.x);
+                bodies->setPosition(ia, pair.stored_a);
+                bodies->setPosition(ib, pair.stored_b);
+                pair.stored_va = glm::vec3(velocity + pair.mass_b / total * pair.v);
+                pair.stored_vb = glm::vec3(velocity - pair.mass_a / total * pair.v);
+                bodies->setVelocity(ia, pair.stored_va);
+                bodies->setVelocity(ib, pair.stored_vb);
+                if (glm::length(pair.x) > release_factor * pair.capture_radius) {
+                    pairs.erase(pairs.begin() + p);
+                    layout_current = false;
+                }
+            }
+        }
+
+    private:
+        // radius below which a pair of this mass has a dynamical time under encounter_steps steps
+        double captureRadius(double G, double mass, float dt) const {
+            double time = encounter_steps * (double)dt;
+            return std::cbrt(G * mass * time * time);
+        }
+
+        // takes in the pairs of unpaired bodies close enough, true if there were any
+        bool findPairs(const BodyStore& bodies, double G, float dt) {
+            size_t n = bodies.size();
+            std::vector<uint8_t> paired = pairedFlags(bodies);
+            std::vector<size_t> order;
+            order.reserve(n);
+            float heaviest = 0.0f;
+            for (size_t i = 0; i < n; i++) {
+                if (!paired[i] && bodies.mass[i] > 0.0f) {
+                    order.push_back(i);
+                    heaviest = std::max(heaviest, bodies.mass[i]);
+                }
+            }
+            double reach = captureRadius(G, 2.0 * heaviest, dt);
+            std::sort(order.begin(), order.end(), [&](size_t i, size_t j) { return bodies.pos_x[i] < bodies.pos_x[j]; });
+
+            // (separation / capture radius, i, j) of every pair inside its capture radius
+            std::vector<std::tuple<double, size_t, size_t>> candidates;
+            for (size_t k = 0; k < order.size(); k++) {
+                size_t i = order[k];
+                glm::dvec3 pi = glm::dvec3(bodies.getPosition(i));
+                for (size_t l = k + 1; l < order.size(); l++) {
+                    size_t j = order[l];
+                    if (bodies.pos_x[j] - pi.x > reach)
+                        break;
+                    double r = glm::length(glm::dvec3(bodies.getPosition(j)) - pi);
+                    double capture = captureRadius(G, (double)bodies.mass[i] + bodies.mass[j], dt);
+                    if (r < capture)
+                        candidates.push_back(std::make_tuple(r / capture, i, j));
+                }
+            }
+            std::sort(candidates.begin(), candidates.end());
+            bool formed = false;
+            for (const std::tuple<double, size_t, size_t>& candidate : candidates) {
+                size_t i = std::get<1>(candidate), j = std::get<2>(candidate);
+                if (paired[i] || paired[j])
+                    continue;
+                paired[i] = paired[j] = 1;
+                Pair pair;
+                pair.a = bodies.ids[i];
+                pair.b = bodies.ids[j];
+                pair.mass_a = bodies.mass[i];
+                pair.mass_b = bodies.mass[j];
+                pair.x = glm::dvec3(bodies.getPosition(i)) - glm::dvec3(bodies.getPosition(j));
+                pair.v = glm::dvec3(bodies.getVelocity(i)) - glm::dvec3(bodies.getVelocity(j));
+                pair.stored_a = bodies.getPosition(i);
+                pair.stored_b = bodies.getPosition(j);
+                pair.stored_va = bodies.getVelocity(i);
+                pair.stored_vb = bodies.getVelocity(j);
+                pair.capture_radius = captureRadius(G, pair.mass_a + pair.mass_b, dt);
+                pairs.push_back(pair);
+                pairs_formed++;
+                formed = true;
+            }
+            return formed;
+        }
+
+        // per body of the store, whether it belongs to a pair
+        std::vector<uint8_t> pairedFlags(const BodyStore& bodies) const {
+            std::vector<uint8_t> paired(bodies.size(), 0);
+            for (const Pair& pair : pairs) {
+                size_t ia = bodies.indexOf(pair.a), ib = bodies.indexOf(pair.b);
+                if (ia < paired.size() && ib < paired.size())
+                    paired[ia] = paired[ib] = 1;
+            }
+            return paired;
+        }
+
+        void buildLayout(const BodyStore& bodies) {
+            size_t n = bodies.size();
+            std::vector<uint8_t> paired = pairedFlags(bodies);
+            reduced = BodyStore();
+            reduced.reserve(n);
+            singles.clear();
+            for (size_t i = 0; i < n; i++) {
+                if (paired[i])
+                    continue;
+                singles.push_back(i);
+                reduced.addBody(bodies.getPosition(i), bodies.getVelocity(i), bodies.mass[i]);
+            }
+            for (const Pair& pair : pairs)
+                reduced.addBody(glm::vec3(0.0f), glm::vec3(0.0f), (float)(pair.mass_a + pair.mass_b));
+            base->reset();
+            layout_current = true;
+        }
+
+        // gradient of the acceleration from every other body of the reduced store at body k
+        glm::dmat3 tidalTensor(size_t k, double G) const {
+            glm::dmat3 tidal = glm::dmat3(0.0);
+            glm::dvec3 center = glm::dvec3(reduced.getPosition(k));
+            for (size_t j = 0; j < reduced.size(); j++) {
+                if (j == k || reduced.mass[j] == 0.0f)
+                    continue;
+                glm::dvec3 d = glm::dvec3(reduced.getPosition(j)) - center;
+                double r2 = glm::dot(d, d);
+                double scale = G * reduced.mass[j] / (r2 * r2 * std::sqrt(r2));
+                tidal += scale * (3.0 * glm::outerProduct(d, d) - r2 * glm::dmat3(1.0));
+            }
+            return tidal;
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef REGULARIZATION_MAIN_CPP
+#include <chrono>
+
+#include "kepler.cpp"
+#include "scenario.cpp"
+
+double systemEnergy(const BodyStore& bodies, double G) {
+    double energy = 0.0;
+    for (size_t i = 0; i < bodies.size(); i++) {
+        glm::dvec3 v = glm::dvec3(bodies.getVelocity(i));
+        energy += 0.5 * bodies.mass[i] * glm::dot(v, v);
+        for (size_t j = i + 1; j < bodies.size(); j++)
+            energy -= G * bodies.mass[i] * bodies.mass[j] / glm::length(glm::dvec3(bodies.getPosition(i)) - glm::dvec3(bodies.getPosition(j)));
+    }
+    return energy;
+}
+
+int main() {
+    // the regularized orbit matches the exact two body solution at any eccentricity, for the same
+    // number of steps per period
+    const double eccentricities[] = {0.0, 0.9, 0.999};
+    for (double e : eccentricities) {
+        glm::dvec3 x = glm::dvec3(1.0, 0.0, 0.0), v = glm::dvec3(0.0, std::sqrt(1.0 + e), 0.0);
+        double period = 6.283185307179586 * std::pow(1.0 / (1.0 - e), 1.5);
+        KsOrbit orbit = ksFromCartesian(x, v, 1.0);
+        glm::dvec3 check_x, check_v;
+        ksToCartesian(orbit, &check_x, &check_v);
+        if (glm::length(check_x - x) > 1e-14 || glm::length(check_v - v) > 1e-14) {
+            std::cerr << "KS transformation does not invert" << std::endl;
+            return FAILURE;
+        }
+        size_t steps = ksAdvance(&orbit, glm::dmat3(0.0), 10.3 * period, 128);
+        glm::dvec3 expected_x = x, expected_v = v;
+        keplerDrift(1.0, &expected_x, &expected_v, 10.3 * period);
+        glm::dvec3 got_x, got_v;
+        ksToCartesian(orbit, &got_x, &got_v);
+        double miss = glm::length(got_x - expected_x) / glm::length(expected_x);
+        std::cout << "e = " << e << ": " << steps << " steps for 10.3 orbits, relative position error " << miss << std::endl;
+        if (!(miss < 1e-5) || steps > 1400) {
+            std::cerr << "regularized orbit strays from the two body solution" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // a hard binary in a small cluster: the leapfrog alone cannot resolve its orbit with the step
+    // of the cluster, the regularized pair keeps the energy
+    Scenario scenario;
+    scenario.G = 1.0f;
+    scenario.addPlummer(30, 1.0f, 1.0f, 11);
+    float m = 1.0f / 30.0f, separation = 2e-3f;
+    float speed = std::sqrt(2.0f * m / separation);
+    scenario.bodies.addBody(glm::vec3(0.5f, 0.0f, 0.0f), glm::vec3(0.0f, 0.5f * speed, 0.0f), m);
+    scenario.bodies.addBody(glm::vec3(0.5f + separation, 0.0f, 0.0f), glm::vec3(0.0f, -0.5f * speed, 0.0f), m);
+    const float dt = 1e-3f;
+    const int steps = 2000;
+    double errors[2];
+    KsIntegrator ks;
+    SplittingIntegrator plain;
+    Integrator* integrators[2] = {&plain, &ks};
+    for (int k = 0; k < 2; k++) {
+        BodyStore bodies = scenario.bodies;
+        DirectSolver solver = DirectSolver(1.0f, 0.0f);
+        double start = systemEnergy(bodies, 1.0);
+        auto begin = std::chrono::steady_clock::now();
+        for (int s = 0; s < steps; s++)
+            integrators[k]->step(&bodies, &solver, dt);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        errors[k] = std::fabs(systemEnergy(bodies, 1.0) / start - 1.0);
+        std::cout << integrators[k]->name() << ": energy error " << errors[k] << " after " << steps << " steps in " << ms << " ms" << std::endl;
+    }
+    std::cout << ks.pairs_formed << " pairs regularized, " << ks.ks_steps << " KS steps, " << ks.pairCount() << " still bound" << std::endl;
+    if (ks.pairs_formed == 0 || !(errors[1] < 1e-3) || !(errors[1] < 0.01 * errors[0])) {
+        std::cerr << "regularization does not carry the binary" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
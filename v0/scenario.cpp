@@ -0,0 +1,358 @@
+#ifndef SCENARIO_CPP
+#define SCENARIO_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define SCENARIO_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bodies.cpp"
+#include "gravity.cpp"
+#include "barnes_hut.cpp"
+#include "fmm.cpp"
+#include "pm.cpp"
+#include "integrators.cpp"
+#include "block_timesteps.cpp"
+#include "hermite.cpp"
+#include "ias15.cpp"
+#include "regularization.cpp"
+#include "collisions.cpp"
+
+// class ----------------------------------------------------------------------------------------------
+
+// Initial conditions and run settings read from a plain text file, one statement per line and
+// everything after a # ignored:
+//
+//     G 1                        gravitational constant
+//     softening 0.05             Plummer softening length
+//     solver auto                direct, tree, fmm, pm, p3m or auto (by body count)
+//     integrator leapfrog        leapfrog-kdk (or leapfrog), leapfrog-dkd, forest-ruth, yoshida6,
+//                                wisdom-holman for systems around one dominant mass, block for
+//                                individual power-of-two steps below the given one, hermite for
+//                                the same with the 4th order Hermite scheme on direct forces,
+//                                ias15 for adaptive 15th order steps on double precision forces,
+//                                kepler for closed form orbits while the perturbations stay small
+//                                or ks for leapfrog with close pairs regularized
+//     step 0.001                 fixed time step
+//     steps 10000                default run length, in steps ...
+//     time 10                    ... or in simulated time
+//     body x y z [vx vy vz [m [r]]]
+//                                one body, at rest with mass 1 and no radius unless given
+//     plummer n [a [m [seed]]]   n bodies of total mass m in a Plummer sphere of scale radius a,
+//                                in virial equilibrium, centered on the origin
+//     particle x y z [vx vy vz]  one massless test particle, moved by the bodies only
+//     ring n inner outer [seed]  n test particles on circular orbits around the first body, in
+//                                its xy plane between the two radii
+//     kepler 0.001               perturbation below which test particles follow Kepler orbits
+//     density 1000               gives every body without a radius the one of a sphere of its mass
+//     collisions merge           what bodies with a radius do when they touch: merge, bounce,
+//                                fragment or none
+class Scenario {
+    public:
+        float G = 1.0f;
+        float softening = 0.05f;
+        std::string solver = "auto";
+        std::string integrator = "leapfrog";
+        float step = 1.0f / 240.0f;
+        // run length, at most one of them is non-zero
+        uint64_t steps = 0;
+        double time = 0.0;
+
+        BodyStore bodies;
+        // massless, see TestParticles
+        BodyStore particles;
+        float kepler_threshold = 0.0f;
+        // collision response by name, see parseCollisionResponse
+        std::string collisions = "none";
+        float density = 0.0f;
+
+        // Adds n test particles spread evenly in area between inner and outer, on circular orbits
+        // around the first body in its xy plane. The orbits ignore every other body, so they are
+        // only circular where the first one dominates.
+        void addRing(size_t n, float inner, float outer, uint32_t seed) {
+            std::mt19937 rng(seed);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            glm::vec3 center = bodies.getPosition(0), drift = bodies.getVelocity(0);
+            double mu = (double)G * bodies.mass[0];
+            particles.reserve(particles.size() + n);
+            for (size_t i = 0; i < n; i++) {
+                double r = std::sqrt(inner * inner + (outer * outer - inner * inner) * uniform(rng));
+                double phi = 6.283185307179586 * uniform(rng);
+                double speed = std::sqrt(mu / r);
+                glm::vec3 offset = glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.0);
+                glm::vec3 velocity = glm::vec3(-speed * std::sin(phi), speed * std::cos(phi), 0.0);
+                particles.addBody(center + offset, drift + velocity, 0.0f);
+            }
+        }
+
+        // adds n bodies in a Plummer sphere with isotropic velocities (Aarseth, Henon & Wielen 1974)
+        void addPlummer(size_t n, float scale, float total_mass, uint32_t seed) {
+            std::mt19937 rng(seed);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            auto direction = [&](double length) {
+                double cos_t = 2.0 * uniform(rng) - 1.0, phi = 6.283185307179586 * uniform(rng);
+                double sin_t = std::sqrt(1.0 - cos_t * cos_t);
+                return glm::vec3(length * sin_t * std::cos(phi), length * sin_t * std::sin(phi), length * cos_t);
+            };
+            bodies.reserve(bodies.size() + n);
+            for (size_t i = 0; i < n; i++) {
+                // radius from the inverted mass profile, cut at 99% of the mass
+                double r = 1.0 / std::sqrt(std::pow(uniform(rng) * 0.99 + 1e-6, -2.0 / 3.0) - 1.0);
+                // speed in units of the escape speed by rejection from q^2 (1 - q^2)^3.5
+                double q = 0.0;
+                while (true) {
+                    q = uniform(rng);
+                    if (0.1 * uniform(rng) < q * q * std::pow(1.0 - q * q, 3.5))
+                        break;
+                }
+                double escape = std::sqrt(2.0) * std::pow(1.0 + r * r, -0.25);
+                double velocity_scale = std::sqrt(G * total_mass / scale);
+                bodies.addBody(direction(r * scale), direction(q * escape * velocity_scale), total_mass / n);
+            }
+        }
+};
+
+// helpers --------------------------------------------------------------------------------------------
+
+void loadScenario(std::istream& in, Scenario* scenario, int* error, std::string* error_log) {
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword))
+            continue;
+
+        bool ok = true;
+        if (keyword == "G") {
+            ok = (bool)(words >> scenario->G);
+        } else if (keyword == "softening") {
+            ok = (bool)(words >> scenario->softening);
+        } else if (keyword == "solver") {
+            ok = (bool)(words >> scenario->solver);
+        } else if (keyword == "integrator") {
+            ok = (bool)(words >> scenario->integrator);
+        } else if (keyword == "step") {
+            ok = (bool)(words >> scenario->step) && scenario->step > 0.0f;
+        } else if (keyword == "steps") {
+            ok = (bool)(words >> scenario->steps);
+            scenario->time = 0.0;
+        } else if (keyword == "time") {
+            ok = (bool)(words >> scenario->time);
+            scenario->steps = 0;
+        } else if (keyword == "body") {
+            float v[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+            int read = 0;
+            while (read < 8 && words >> v[read])
+                read++;
+            ok = (read == 3 || read == 6 || read == 7 || read == 8) && v[7] >= 0.0f;
+            if (ok)
+                scenario->bodies.addBody(glm::vec3(v[0], v[1], v[2]), glm::vec3(v[3], v[4], v[5]), v[6], v[7]);
+        } else if (keyword == "plummer") {
+            size_t n = 0;
+            float scale = 1.0f, mass = 1.0f;
+            uint32_t seed = 1;
+            ok = (bool)(words >> n);
+            if (ok && words >> scale && words >> mass)
+                words >> seed;
+            if (ok)
+                scenario->addPlummer(n, scale, mass, seed);
+        } else if (keyword == "particle") {
+            float v[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+            int read = 0;
+            while (read < 6 && words >> v[read])
+                read++;
+            ok = read == 3 || read == 6;
+            if (ok)
+                scenario->particles.addBody(glm::vec3(v[0], v[1], v[2]), glm::vec3(v[3], v[4], v[5]), 0.0f);
+        } else if (keyword == "kepler") {
+            ok = (bool)(words >> scenario->kepler_threshold) && scenario->kepler_threshold >= 0.0f;
+        } else if (keyword == "density") {
+            ok = (bool)(words >> scenario->density) && scenario->density > 0.0f;
+        } else if (keyword == "collisions") {
+            CollisionResponse response;
+            ok = (bool)(words >> scenario->collisions) && (scenario->collisions == "none" || parseCollisionResponse(scenario->collisions, &response));
+        } else if (keyword == "ring") {
+            size_t n = 0;
+            float inner = 0.0f, outer = 0.0f;
+            uint32_t seed = 1;
+            ok = (bool)(words >> n >> inner >> outer) && inner > 0.0f && outer >= inner && scenario->bodies.size() > 0;
+            if (ok) {
+                words >> seed;
+                scenario->addRing(n, inner, outer, seed);
+            }
+        } else {
+            *error_log += "scenario line " + std::to_string(line_number) + ": unknown statement '" + keyword + "'\n";
+            *error = FAILURE;
+            return;
+        }
+        if (!ok) {
+            *error_log += "scenario line " + std::to_string(line_number) + ": bad arguments to '" + keyword + "'\n";
+            *error = FAILURE;
+            return;
+        }
+    }
+
+    if (scenario->density > 0.0f) {
+        BodyStore& bodies = scenario->bodies;
+        for (size_t i = 0; i < bodies.size(); i++) {
+            if (bodies.radius[i] == 0.0f)
+                bodies.radius[i] = std::cbrt(3.0f * bodies.mass[i] / (12.566370614359172f * scenario->density));
+        }
+    }
+}
+
+void loadScenarioFile(std::string filepath, Scenario* scenario, int* error, std::string* error_log) {
+    std::ifstream file(filepath);
+    if (!file.is_open()) {
+        *error_log += "Failed to open scenario: " + filepath + "\n";
+        *error = FAILURE;
+        return;
+    }
+    loadScenario(file, scenario, error, error_log);
+}
+
+// Solver by name as in a scenario file, nullptr for unknown names. auto picks direct summation for
+// small systems and the tree code above the size where it wins.
+std::unique_ptr<ForceSolver> createSolver(std::string name, size_t body_count, float G, float softening) {
+    const size_t tree_solver_threshold = 8192;
+    if (name == "auto")
+        name = body_count > tree_solver_threshold ? "tree" : "direct";
+    if (name == "direct")
+        return std::unique_ptr<ForceSolver>(new DirectSolver(G, softening));
+    if (name == "tree")
+        return std::unique_ptr<ForceSolver>(new BarnesHutSolver(G, softening));
+    if (name == "fmm")
+        return std::unique_ptr<ForceSolver>(new FmmSolver(G, softening));
+    if (name == "pm")
+        return std::unique_ptr<ForceSolver>(new PmSolver(G, softening));
+    if (name == "p3m")
+        return std::unique_ptr<ForceSolver>(new PmSolver(G, softening, 64, true));
+    return nullptr;
+}
+
+// Integrator by name as in a scenario file, nullptr for unknown names
+std::unique_ptr<Integrator> createIntegrator(std::string name) {
+    const SplittingScheme* schemes[] = {&LEAPFROG_KDK, &LEAPFROG_DKD, &FOREST_RUTH, &YOSHIDA6};
+    if (name == "leapfrog")
+        name = LEAPFROG_KDK.name;
+    for (const SplittingScheme* scheme : schemes)
+        if (name == scheme->name)
+            return std::unique_ptr<Integrator>(new SplittingIntegrator(*scheme));
+    if (name == "wisdom-holman")
+        return std::unique_ptr<Integrator>(new WisdomHolmanIntegrator());
+    if (name == "block")
+        return std::unique_ptr<Integrator>(new BlockTimestepIntegrator());
+    if (name == "hermite")
+        return std::unique_ptr<Integrator>(new HermiteIntegrator());
+    if (name == "ias15")
+        return std::unique_ptr<Integrator>(new Ias15Integrator());
+    if (name == "kepler")
+        return std::unique_ptr<Integrator>(new KeplerIntegrator());
+    if (name == "ks")
+        return std::unique_ptr<Integrator>(new KsIntegrator());
+    return nullptr;
+}
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef SCENARIO_MAIN_CPP
+
+int main() {
+    int error = SUCCESS;
+    std::string error_log = "";
+
+    std::istringstream text(
+        "# sun and earth\n"
+        "G 1\n"
+        "softening 0.001   # nearly none\n"
+        "step 0.01\n"
+        "integrator wisdom-holman\n"
+        "time 6.3\n"
+        "body 0 0 0 0 0 0 1\n"
+        "body 1 0 0 0 1 0 0.000003\n"
+        "plummer 1000 2 0.5 7\n"
+        "ring 500 2 3\n"
+        "particle 0 4 0 -0.5 0 0\n"
+        "kepler 0.001\n"
+        "body 5 5 5 0 0 0 1 0.25\n"
+        "density 1000\n"
+        "collisions bounce\n");
+    Scenario scenario;
+    loadScenario(text, &scenario, &error, &error_log);
+    if (error != SUCCESS) {
+        std::cerr << error_log << std::endl;
+        return FAILURE;
+    }
+    if (scenario.bodies.size() != 1003 || scenario.time != 6.3 || scenario.steps != 0 || scenario.step != 0.01f
+        || scenario.integrator != "wisdom-holman" || createIntegrator(scenario.integrator) == nullptr
+        || scenario.bodies.getVelocity(1) != glm::vec3(0.0f, 1.0f, 0.0f) || scenario.particles.size() != 501
+        || scenario.particles.getVelocity(500) != glm::vec3(-0.5f, 0.0f, 0.0f) || scenario.kepler_threshold != 0.001f
+        || scenario.collisions != "bounce" || scenario.bodies.radius[1002] != 0.25f || !(std::fabs(scenario.bodies.radius[0] - 0.0620350f) < 1e-6f)) {
+        std::cerr << "scenario was not read back as written" << std::endl;
+        return FAILURE;
+    }
+
+    // the generated sphere should be close to virial equilibrium, 2K + W = 0
+    double kinetic = 0.0, potential = 0.0;
+    for (size_t i = 2; i < 1002; i++) {
+        kinetic += 0.5 * scenario.bodies.mass[i] * glm::dot(scenario.bodies.getVelocity(i), scenario.bodies.getVelocity(i));
+        for (size_t j = i + 1; j < 1002; j++)
+            potential -= scenario.bodies.mass[i] * scenario.bodies.mass[j] / glm::length(scenario.bodies.getPosition(i) - scenario.bodies.getPosition(j));
+    }
+    std::cout << "plummer sphere virial ratio 2K/|W| = " << 2.0 * kinetic / -potential << std::endl;
+    if (std::fabs(2.0 * kinetic / -potential - 1.0) > 0.15) {
+        std::cerr << "plummer sphere is not in equilibrium" << std::endl;
+        return FAILURE;
+    }
+
+    std::istringstream bad("body 1 2\n");
+    Scenario broken;
+    loadScenario(bad, &broken, &error, &error_log);
+    if (error != FAILURE || error_log.find("line 1") == std::string::npos) {
+        std::cerr << "bad statement was not reported" << std::endl;
+        return FAILURE;
+    }
+
+    const char* names[] = {"auto", "direct", "tree", "fmm", "pm", "p3m"};
+    for (const char* name : names) {
+        if (createSolver(name, 10, 1.0f, 0.1f) == nullptr) {
+            std::cerr << "no solver named " << name << std::endl;
+            return FAILURE;
+        }
+    }
+    if (createSolver("magic", 10, 1.0f, 0.1f) != nullptr) {
+        std::cerr << "unknown solver name accepted" << std::endl;
+        return FAILURE;
+    }
+    const char* integrators[] = {"leapfrog", "leapfrog-kdk", "leapfrog-dkd", "forest-ruth", "yoshida6", "wisdom-holman", "block", "hermite", "ias15", "kepler", "ks"};
+    for (const char* name : integrators) {
+        if (createIntegrator(name) == nullptr) {
+            std::cerr << "no integrator named " << name << std::endl;
+            return FAILURE;
+        }
+    }
+    if (createIntegrator("magic") != nullptr) {
+        std::cerr << "unknown integrator name accepted" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
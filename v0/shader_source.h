@@ -1,5 +1,9 @@
 #ifndef SHADER_SOURCE_H
 #define SHADER_SOURCE_H
-const char* triangle_frag_text = "#version 330 core\nout vec4 FragColor;\n\nin vec2 tex_coord;\n\nuniform sampler2D u_texture1;\nuniform sampler2D u_texture2;\n\nvoid main()\n{\n    FragColor = mix(texture(u_texture1, tex_coord), texture(u_texture2, tex_coord), 0.5);\n    // FragColor = vec4(1.0, 1.0, 1.0, 1.0);\n}";
-const char* triangle_vert_text = "#version 330 core\nlayout (location = 0) in vec3 a_pos;\nlayout (location = 1) in vec2 a_tex_coord;\n\nout vec2 tex_coord;\n\nuniform mat4 u_model;\nuniform mat4 u_view;\nuniform mat4 u_proj;\n\nvoid main()\n{\n    tex_coord = a_tex_coord;\n    gl_Position = u_proj * u_view * u_model * vec4(a_pos, 1.0);\n}";
+const char* sphere_frag_text = "#version 330 core\nout vec4 FragColor;\n\nin vec3 view_pos;\nflat in vec3 center;\nflat in float radius;\nflat in vec4 color;\n\nuniform mat4 u_proj;\n// towards the light in view space, normalized\nuniform vec3 u_light;\n\nvoid main()\n{\n    // the ray from the eye through this fragment against the sphere, in view space\n    vec3 ray = normalize(view_pos);\n    float b = dot(ray, center);\n    float discriminant = b * b - dot(center, center) + radius * radius;\n    if (discriminant < 0.0)\n        discard;\n    float t = b - sqrt(discriminant);\n    if (t <= 0.0)\n        discard;\n    vec3 hit = ray * t;\n    vec3 normal = (hit - center) / radius;\n\n    // depth of the surface instead of the square\n    vec4 clip = u_proj * vec4(hit, 1.0);\n    gl_FragDepth = (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far) * 0.5;\n\n    float diffuse = max(dot(normal, u_light), 0.0);\n    float specular = pow(max(dot(normal, normalize(u_light - ray)), 0.0), 32.0);\n    FragColor = vec4(color.rgb * (0.15 + 0.85 * diffuse) + vec3(0.3 * specular), color.a);\n}";
+const char* sphere_vert_text = "#version 330 core\nlayout (location = 0) in vec2 a_corner;\n// per instance\nlayout (location = 1) in vec3 a_center;\nlayout (location = 2) in float a_radius;\nlayout (location = 3) in vec4 a_color;\n\nout vec3 view_pos;\nflat out vec3 center;\nflat out float radius;\nflat out vec4 color;\n\nuniform mat4 u_view;\nuniform mat4 u_proj;\n\nvoid main()\n{\n    center = (u_view * vec4(a_center, 1.0)).xyz;\n    radius = a_radius;\n    color = a_color;\n\n    // a square facing the eye, just wide enough for the silhouette of the sphere: the cone of rays\n    // touching it cuts a plane square to its axis at the center in a circle of this radius\n    float distance = length(center);\n    vec3 axis = center / max(distance, 1e-6);\n    vec3 side = normalize(cross(axis, abs(axis.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));\n    vec3 up = cross(side, axis);\n    float half_size = radius * distance / sqrt(max(distance * distance - radius * radius, 1e-12));\n    view_pos = center + (side * a_corner.x + up * a_corner.y) * half_size;\n    gl_Position = u_proj * vec4(view_pos, 1.0);\n}";
+const char* triangle_vert_text = "#version 330 core\nlayout (location = 0) in vec3 a_pos;\nlayout (location = 1) in vec2 a_tex_coord;\n// per instance\nlayout (location = 2) in vec3 a_offset;\nlayout (location = 3) in float a_scale;\nlayout (location = 4) in vec4 a_orientation;\nlayout (location = 5) in vec4 a_color;\n\nout vec2 tex_coord;\nout vec4 color;\n\nuniform mat4 u_view;\nuniform mat4 u_proj;\n\n// rotates v by the unit quaternion q\nvec3 rotate(vec4 q, vec3 v)\n{\n    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);\n}\n\nvoid main()\n{\n    tex_coord = a_tex_coord;\n    color = a_color;\n    vec3 world = a_offset + rotate(a_orientation, a_pos * a_scale);\n    gl_Position = u_proj * u_view * vec4(world, 1.0);\n}";
+const char* triangle_frag_text = "#version 330 core\nout vec4 FragColor;\n\nin vec2 tex_coord;\nin vec4 color;\n\nuniform sampler2D u_texture1;\nuniform sampler2D u_texture2;\n\nvoid main()\n{\n    FragColor = mix(texture(u_texture1, tex_coord), texture(u_texture2, tex_coord), 0.5) * color;\n    // FragColor = vec4(1.0, 1.0, 1.0, 1.0);\n}";
+const char* orbit_line_frag_text = "#version 330 core\nout vec4 FragColor;\n\nuniform vec4 u_color;\n\nvoid main()\n{\n    FragColor = u_color;\n}";
+const char* orbit_line_vert_text = "#version 330 core\nlayout (location = 0) in vec3 a_pos;\n\nuniform mat4 u_view;\nuniform mat4 u_proj;\n\nvoid main()\n{\n    gl_Position = u_proj * u_view * vec4(a_pos, 1.0);\n}";
 #endif
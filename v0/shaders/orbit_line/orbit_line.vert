@@ -0,0 +1,10 @@
+#version 330 core
+layout (location = 0) in vec3 a_pos;
+
+uniform mat4 u_view;
+uniform mat4 u_proj;
+
+void main()
+{
+    gl_Position = u_proj * u_view * vec4(a_pos, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec3 view_pos;
+flat in vec3 center;
+flat in float radius;
+flat in vec4 color;
+
+uniform mat4 u_proj;
+// towards the light in view space, normalized
+uniform vec3 u_light;
+
+void main()
+{
+    // the ray from the eye through this fragment against the sphere, in view space
+    vec3 ray = normalize(view_pos);
+    float b = dot(ray, center);
+    float discriminant = b * b - dot(center, center) + radius * radius;
+    if (discriminant < 0.0)
+        discard;
+    float t = b - sqrt(discriminant);
+    if (t <= 0.0)
+        discard;
+    vec3 hit = ray * t;
+    vec3 normal = (hit - center) / radius;
+
+    // depth of the surface instead of the square
+    vec4 clip = u_proj * vec4(hit, 1.0);
+    gl_FragDepth = (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near + gl_DepthRange.far) * 0.5;
+
+    float diffuse = max(dot(normal, u_light), 0.0);
+    float specular = pow(max(dot(normal, normalize(u_light - ray)), 0.0), 32.0);
+    FragColor = vec4(color.rgb * (0.15 + 0.85 * diffuse) + vec3(0.3 * specular), color.a);
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#version 330 core
+layout (location = 0) in vec2 a_corner;
+// per instance
+layout (location = 1) in vec3 a_center;
+layout (location = 2) in float a_radius;
+layout (location = 3) in vec4 a_color;
+
+out vec3 view_pos;
+flat out vec3 center;
+flat out float radius;
+flat out vec4 color;
+
+uniform mat4 u_view;
+uniform mat4 u_proj;
+
+void main()
+{
+    center = (u_view * vec4(a_center, 1.0)).xyz;
+    radius = a_radius;
+    color = a_color;
+
+    // a square facing the eye, just wide enough for the silhouette of the sphere: the cone of rays
+    // touching it cuts a plane square to its axis at the center in a circle of this radius
+    float distance = length(center);
+    vec3 axis = center / max(distance, 1e-6);
+    vec3 side = normalize(cross(axis, abs(axis.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 up = cross(side, axis);
+    float half_size = radius * distance / sqrt(max(distance * distance - radius * radius, 1e-12));
+    view_pos = center + (side * a_corner.x + up * a_corner.y) * half_size;
+    gl_Position = u_proj * vec4(view_pos, 1.0);
+}
\ No newline at end of file
@@ -2,12 +2,13 @@
 out vec4 FragColor;
 
 in vec2 tex_coord;
+in vec4 color;
 
 uniform sampler2D u_texture1;
 uniform sampler2D u_texture2;
 
 void main()
 {
-    FragColor = mix(texture(u_texture1, tex_coord), texture(u_texture2, tex_coord), 0.5);
+    FragColor = mix(texture(u_texture1, tex_coord), texture(u_texture2, tex_coord), 0.5) * color;
     // FragColor = vec4(1.0, 1.0, 1.0, 1.0);
 }
\ No newline at end of file
@@ -1,15 +1,28 @@
 #version 330 core
 layout (location = 0) in vec3 a_pos;
 layout (location = 1) in vec2 a_tex_coord;
+// per instance
+layout (location = 2) in vec3 a_offset;
+layout (location = 3) in float a_scale;
+layout (location = 4) in vec4 a_orientation;
+layout (location = 5) in vec4 a_color;
 
 out vec2 tex_coord;
+out vec4 color;
 
-uniform mat4 u_model;
 uniform mat4 u_view;
 uniform mat4 u_proj;
 
+// rotates v by the unit quaternion q
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
 void main()
 {
     tex_coord = a_tex_coord;
-    gl_Position = u_proj * u_view * u_model * vec4(a_pos, 1.0);
+    color = a_color;
+    vec3 world = a_offset + rotate(a_orientation, a_pos * a_scale);
+    gl_Position = u_proj * u_view * vec4(world, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef SIMD_CPP
+#define SIMD_CPP
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Widest instruction set the cpu running us supports. Kernels are compiled once per level with
+// #pragma GCC target and picked from this at run time, so one binary runs everywhere.
+enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_SSE = 1,
+    SIMD_AVX2 = 2,
+    SIMD_AVX512 = 3
+};
+
+SimdLevel detectSimdLevel() {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE;
+#endif
+    return SIMD_SCALAR;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SIMD_SSE:
+        return "sse";
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+#endif
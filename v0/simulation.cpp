@@ -0,0 +1,364 @@
+#ifndef SIMULATION_CPP
+#define SIMULATION_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define SIMULATION_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "integrators.cpp"
+#include "test_particles.cpp"
+#include "snapshot.cpp"
+#include "ephemeris.cpp"
+#include "prediction.cpp"
+#include "collisions.cpp"
+
+// helpers --------------------------------------------------------------------------------------------
+
+// a body to add before the next step
+class SpawnRequest {
+    public:
+        glm::vec3 pos;
+        glm::vec3 vel;
+        float mass;
+        float radius;
+};
+
+// seconds on the steady clock, the time base snapshots are stamped with
+double wallClockSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// class ----------------------------------------------------------------------------------------------
+
+// Runs the bodies on a thread of their own, independent of the frame rate. Wall clock time times
+// the time warp goes into an accumulator that is paid out in steps of exactly fixed_step, so the
+// integration does not depend on how the thread gets scheduled. After every batch of steps the
+// last two states are published as a snapshot for the renderer to interpolate between.
+// While the thread runs it owns bodies, solver and integrator, set them up before start().
+class Simulation {
+    public:
+        BodyStore bodies;
+        ForceSolver* solver = nullptr;
+        // kick-drift-kick leapfrog unless set otherwise
+        Integrator* integrator = &leapfrog;
+        // massless particles carried along by the bodies, stepped with them
+        TestParticles test_particles;
+        TripleBuffer<Snapshot> snapshots;
+        // records the bodies after every step when set, for lookups at any time already simulated
+        Ephemeris* ephemeris = nullptr;
+        // handed the state of the bodies with every snapshot when set
+        OrbitPredictor* predictor = nullptr;
+        // merges, bounces or breaks up bodies with a radius that touched during a step when set
+        Collisions* collisions = nullptr;
+
+        // simulated seconds per step
+        float fixed_step = 1.0f / 240.0f;
+        // simulated seconds per wall clock second, may be changed while running
+        std::atomic<float> time_warp{1.0f};
+        // The simulation may fall at most this many wall clock seconds behind. Time owed beyond
+        // that is dropped instead of caught up, so a step slower than real time cannot spiral.
+        float max_lag = 0.25f;
+        // a batch is published after this many wall clock seconds even if steps are still owed
+        float max_batch_time = 1.0f / 60.0f;
+
+    private:
+        SplittingIntegrator leapfrog;
+        std::thread thread;
+        std::atomic<bool> stop_requested{false};
+        double time = 0.0;
+        uint64_t step_count = 0;
+        // simulated time owed but not stepped yet
+        double accumulator = 0.0;
+        // simulated time given up to the lag cap
+        std::atomic<double> dropped_time{0.0};
+        // changes to the bodies asked for from other threads, applied before the next step
+        std::mutex requests_mutex;
+        std::vector<SpawnRequest> spawns, spawns_taken;
+        std::vector<BodyStore::BodyID> removals, removals_taken;
+
+    public:
+        Simulation(ForceSolver* solver = nullptr) {
+            this->solver = solver;
+        }
+
+        ~Simulation() {
+            stop();
+        }
+
+        // publishes the initial state, then steps until stop()
+        void start() {
+            if (thread.joinable())
+                return;
+            publish(wallClockSeconds());
+            stop_requested = false;
+            thread = std::thread(&Simulation::run, this);
+        }
+
+        void stop() {
+            stop_requested = true;
+            if (thread.joinable())
+                thread.join();
+        }
+
+        bool running() const { return thread.joinable(); }
+
+        double droppedTime() const { return dropped_time.load(); }
+
+        // Adds a body before the next step, safe to call from any thread while the simulation runs.
+        // It shows up in the snapshots with a handle of its own from then on.
+        void spawn(glm::vec3 pos, glm::vec3 vel = glm::vec3(0.0f), float mass = 1.0f, float radius = 0.0f) {
+            std::lock_guard<std::mutex> lock(requests_mutex);
+            spawns.push_back({pos, vel, mass, radius});
+        }
+
+        // removes the body behind a handle before the next step, stale handles are ignored
+        void remove(BodyStore::BodyID id) {
+            std::lock_guard<std::mutex> lock(requests_mutex);
+            removals.push_back(id);
+        }
+
+        // one step of dt seconds with the integrator, which splits its work across the job system,
+        // the test particles open their step before the bodies move and close it after, once the
+        // collisions are resolved
+        void step(float dt) {
+            applyRequests();
+            // bodies added or removed by the requests, at the time already recorded
+            if (ephemeris != nullptr)
+                ephemeris->record(time, bodies);
+            test_particles.openStep(bodies, *solver, dt);
+            if (collisions != nullptr)
+                collisions->begin(bodies);
+            integrator->step(&bodies, solver, dt);
+            // the integrator keeps forces and state of bodies that may be gone now
+            if (collisions != nullptr && collisions->resolve(&bodies, dt) > 0)
+                integrator->reset();
+            test_particles.closeStep(bodies, *solver, dt);
+            time += dt;
+            step_count++;
+            if (ephemeris != nullptr)
+                ephemeris->record(time, bodies);
+        }
+
+    private:
+        void applyRequests() {
+            {
+                // swapped out under the lock, so callers never wait for a step
+                std::lock_guard<std::mutex> lock(requests_mutex);
+                if (spawns.empty() && removals.empty())
+                    return;
+                spawns_taken.swap(spawns);
+                removals_taken.swap(removals);
+            }
+            for (BodyStore::BodyID id : removals_taken)
+                bodies.removeBody(id);
+            for (const SpawnRequest& request : spawns_taken)
+                bodies.addBody(request.pos, request.vel, request.mass, request.radius);
+            spawns_taken.clear();
+            removals_taken.clear();
+            integrator->reset();
+        }
+
+        void publish(double now) {
+            Snapshot& snapshot = snapshots.writeBuffer();
+            snapshot.capturePrevious(bodies, time);
+            snapshot.capture(bodies, time, step_count);
+            stamp(&snapshot, now);
+            snapshots.publish();
+            if (predictor != nullptr)
+                predictor->observe(bodies, time);
+        }
+
+        void stamp(Snapshot* snapshot, double now) {
+            snapshot->published = now;
+            snapshot->backlog = accumulator;
+            snapshot->time_warp = time_warp.load();
+        }
+
+        void run() {
+            double last = wallClockSeconds();
+            while (!stop_requested.load()) {
+                double now = wallClockSeconds();
+                float warp = time_warp.load();
+                accumulator += (now - last) * warp;
+                last = now;
+                double max_backlog = (double)max_lag * warp;
+                if (accumulator > max_backlog) {
+                    dropped_time.store(dropped_time.load() + accumulator - max_backlog);
+                    accumulator = max_backlog;
+                }
+
+                if (accumulator < fixed_step) {
+                    // nothing owed, sleep until the next step is due
+                    double wait = warp > 0.0f ? (fixed_step - accumulator) / warp : 0.01;
+                    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+                    continue;
+                }
+
+                // pay out whole steps back to back and publish once, the state before the last
+                // step goes into the snapshot as well
+                Snapshot& snapshot = snapshots.writeBuffer();
+                double batch_end = now + max_batch_time;
+                while (accumulator >= fixed_step) {
+                    bool last_step = accumulator < 2.0 * fixed_step || wallClockSeconds() >= batch_end;
+                    if (last_step)
+                        snapshot.capturePrevious(bodies, time);
+                    step(fixed_step);
+                    accumulator -= fixed_step;
+                    if (last_step)
+                        break;
+                }
+                snapshot.capture(bodies, time, step_count);
+                stamp(&snapshot, wallClockSeconds());
+                snapshots.publish();
+                if (predictor != nullptr)
+                    predictor->observe(bodies, time);
+            }
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef SIMULATION_MAIN_CPP
+
+int main() {
+    // a reader racing a writer must only ever see whole snapshots, in order
+    TripleBuffer<std::vector<int>> buffer;
+    const int rounds = 200000;
+    std::thread writer([&]() {
+        for (int r = 1; r <= rounds; r++) {
+            std::vector<int>& values = buffer.writeBuffer();
+            values.assign(16, r);
+            buffer.publish();
+        }
+    });
+    int last = 0;
+    bool torn = false, backwards = false;
+    while (last < rounds) {
+        if (!buffer.update())
+            continue;
+        const std::vector<int>& values = buffer.readBuffer();
+        for (int v : values)
+            torn |= v != values[0];
+        backwards |= values[0] <= last;
+        last = values[0];
+    }
+    writer.join();
+    if (torn || backwards) {
+        std::cerr << "triple buffer handed out a " << (torn ? "torn" : "stale") << " value" << std::endl;
+        return FAILURE;
+    }
+
+    // two bodies falling towards each other on the simulation thread, four times faster than real time
+    DirectSolver solver = DirectSolver(1.0f, 0.01f);
+    Simulation simulation = Simulation(&solver);
+    simulation.time_warp = 4.0f;
+    simulation.bodies.addBody(glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f), 0.1f);
+    simulation.bodies.addBody(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f), 0.1f);
+    simulation.start();
+    if (!simulation.snapshots.update() || simulation.snapshots.readBuffer().step != 0) {
+        std::cerr << "no initial snapshot" << std::endl;
+        return FAILURE;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    simulation.snapshots.update();
+    const Snapshot& snapshot = simulation.snapshots.readBuffer();
+    std::cout << "steps in 200 ms: " << snapshot.step << ", simulated " << snapshot.time << " s, dropped "
+              << simulation.droppedTime() << " s" << std::endl;
+    float gap = snapshot.getPosition(1).x - snapshot.getPosition(0).x;
+    double expected = snapshot.step * (double)simulation.fixed_step;
+    if (snapshot.step == 0 || snapshot.size() != 2 || !(gap < 2.0f) || std::fabs(snapshot.time - expected) > 1e-6
+        || std::fabs(snapshot.time + simulation.droppedTime() - 0.8) > 0.2) {
+        std::cerr << "simulation thread did not advance the bodies in fixed steps" << std::endl;
+        return FAILURE;
+    }
+    // one step apart, interpolation runs from the previous state to the latest one
+    if (std::fabs(snapshot.time - snapshot.previous_time - simulation.fixed_step) > 1e-6
+        || snapshot.getPosition(0, 0.0f) != snapshot.getPreviousPosition(0) || snapshot.getPosition(0, 1.0f) != snapshot.getPosition(0)
+        || snapshot.blendAt(snapshot.published - 1.0) != 0.0f || snapshot.blendAt(snapshot.published + 1.0) != 1.0f) {
+        std::cerr << "snapshot does not interpolate between the last two steps" << std::endl;
+        return FAILURE;
+    }
+
+    // a body removed and another spawned keep the count, the previous state follows the handles
+    {
+        BodyStore bodies;
+        for (int k = 0; k < 3; k++)
+            bodies.addBody(glm::vec3((float)k, 0.0f, 0.0f));
+        Snapshot swapped;
+        swapped.capturePrevious(bodies, 0.0);
+        BodyStore::BodyID kept = bodies.ids[2];
+        bodies.removeBody(bodies.ids[0]);
+        BodyStore::BodyID spawned = bodies.addBody(glm::vec3(5.0f, 0.0f, 0.0f));
+        bodies.setPosition(bodies.indexOf(kept), glm::vec3(2.5f, 0.0f, 0.0f));
+        swapped.capture(bodies, 1.0, 1);
+        size_t i = bodies.indexOf(kept), j = bodies.indexOf(spawned);
+        if (swapped.getPreviousPosition(i) != glm::vec3(2.0f, 0.0f, 0.0f) || swapped.getPreviousPosition(j) != glm::vec3(5.0f, 0.0f, 0.0f)) {
+            std::cerr << "snapshot blends between different bodies after a removal and a spawn" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // a merge moves the star the Kepler particles go around to another index within a step
+    {
+        DirectSolver unsoftened = DirectSolver(1.0f, 0.0f);
+        Collisions collisions;
+        Simulation merging = Simulation(&unsoftened);
+        merging.collisions = &collisions;
+        const glm::vec3 star = glm::vec3(10.0f, 0.0f, 0.0f);
+        merging.bodies.addBody(star - glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(20.0f, 0.0f, 0.0f), 1e-9f, 0.01f);
+        merging.bodies.addBody(star, glm::vec3(0.0f), 1.0f, 0.5f);
+        merging.test_particles.kepler_threshold = 1e-3f;
+        merging.test_particles.addParticle(star + glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(std::sqrt(0.5f), 0.0f, 0.0f));
+        size_t on_kepler = 0;
+        for (int s = 0; s < 20; s++) {
+            merging.step(0.01f);
+            on_kepler = std::max(on_kepler, merging.test_particles.keplerCount());
+        }
+        float orbit = glm::length(merging.test_particles.particles.getPosition(0) - merging.bodies.getPosition(0));
+        std::cout << "after a merge into the central body: " << collisions.merges << " merges, particle " << orbit
+                  << " from the star" << std::endl;
+        if (collisions.merges != 1 || merging.bodies.size() != 1 || on_kepler != 1 || !(std::fabs(orbit - 2.0f) < 1e-3f)) {
+            std::cerr << "Kepler particles lost their central body to a collision" << std::endl;
+            return FAILURE;
+        }
+    }
+
+    // bodies spawned and removed from this thread while the simulation thread steps
+    BodyStore::BodyID first = snapshot.ids[0];
+    simulation.remove(first);
+    for (int k = 0; k < 100; k++)
+        simulation.spawn(glm::vec3(0.1f * k, 5.0f, 0.0f), glm::vec3(0.0f), 0.001f);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    simulation.snapshots.update();
+    const Snapshot& changed = simulation.snapshots.readBuffer();
+    bool first_gone = std::find(changed.ids.begin(), changed.ids.end(), first) == changed.ids.end();
+    if (changed.size() != 101 || !first_gone) {
+        std::cerr << "spawned or removed bodies did not reach the snapshots" << std::endl;
+        return FAILURE;
+    }
+
+    simulation.stop();
+    if (simulation.running()) {
+        std::cerr << "simulation thread did not stop" << std::endl;
+        return FAILURE;
+    }
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif
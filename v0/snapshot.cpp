@@ -0,0 +1,150 @@
+#ifndef SNAPSHOT_CPP
+#define SNAPSHOT_CPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+#include "bodies.cpp"
+
+// helpers --------------------------------------------------------------------------------------------
+
+// Lock-free triple buffer for one writer and one reader thread. The writer fills writeBuffer() and
+// publishes it, the reader calls update() and then reads readBuffer(), which stays untouched until
+// its next update(). Both sides only swap their own slot with the shared one, so neither ever waits
+// and the reader always gets the latest fully published value.
+template <typename T>
+class TripleBuffer {
+    private:
+        static const uint8_t INDEX_MASK = 3;
+        // set in shared while it holds a value the reader has not picked up
+        static const uint8_t FRESH = 4;
+
+        T slots[3];
+        std::atomic<uint8_t> shared{1};
+        uint8_t back = 0;   // owned by the writer
+        uint8_t front = 2;  // owned by the reader
+
+    public:
+        T& writeBuffer() { return slots[back]; }
+
+        void publish() {
+            uint8_t old = shared.exchange(back | FRESH, std::memory_order_acq_rel);
+            back = old & INDEX_MASK;
+        }
+
+        // true when a newer value was published since the last update
+        bool update() {
+            if ((shared.load(std::memory_order_relaxed) & FRESH) == 0)
+                return false;
+            uint8_t old = shared.exchange(front, std::memory_order_acq_rel);
+            front = old & INDEX_MASK;
+            return true;
+        }
+
+        const T& readBuffer() const { return slots[front]; }
+};
+
+// class ----------------------------------------------------------------------------------------------
+
+// Copy of the state of the bodies at the last two simulation steps, which is all the renderer needs.
+// Once published through a TripleBuffer it is never written again until the reader has let go of it.
+class Snapshot {
+    public:
+        // positions at time and at previous_time, one fixed step earlier
+        AlignedArray<float> pos_x, pos_y, pos_z;
+        AlignedArray<float> prev_x, prev_y, prev_z;
+        // physical radius at time, 0 for point masses
+        AlignedArray<float> radius;
+        std::vector<BodyStore::BodyID> ids;
+        double time = 0.0;
+        double previous_time = 0.0;
+        uint64_t step = 0;
+
+        // wall clock seconds at publishing, with the simulated time already owed by then and the
+        // time warp in effect, enough for the renderer to tell where the simulation is right now
+        double published = 0.0;
+        double backlog = 0.0;
+        float time_warp = 1.0f;
+
+    private:
+        // bodies of the previous state, by index
+        std::vector<BodyStore::BodyID> previous_ids;
+        std::unordered_map<BodyStore::BodyID, size_t> previous_index;
+        AlignedArray<float> remapped[3];
+
+    public:
+        size_t size() const { return ids.size(); }
+
+        glm::vec3 getPosition(size_t i) const { return glm::vec3(pos_x[i], pos_y[i], pos_z[i]); }
+        glm::vec3 getPreviousPosition(size_t i) const { return glm::vec3(prev_x[i], prev_y[i], prev_z[i]); }
+        // blend 0 is the previous step, 1 the latest
+        glm::vec3 getPosition(size_t i, float blend) const { return glm::mix(getPreviousPosition(i), getPosition(i), blend); }
+
+        // Where between the two steps to draw at wall clock time now. The estimated simulated time
+        // is held back by one step, so it normally lies between the two states and moves smoothly.
+        float blendAt(double now) const {
+            double step_length = time - previous_time;
+            if (step_length <= 0.0)
+                return 1.0f;
+            double estimate = time + backlog + (now - published) * time_warp - step_length;
+            double blend = (estimate - previous_time) / step_length;
+            return (float)(blend < 0.0 ? 0.0 : (blend > 1.0 ? 1.0 : blend));
+        }
+
+        // the state about to be stepped away from, every capture needs one in the same slot first
+        void capturePrevious(const BodyStore& bodies, double time) {
+            copyPositions(bodies, &prev_x, &prev_y, &prev_z);
+            previous_ids.assign(bodies.ids.begin(), bodies.ids.end());
+            previous_time = time;
+        }
+
+        // reuses the arrays of the slot, so a steady body count allocates nothing
+        void capture(const BodyStore& bodies, double time, uint64_t step) {
+            copyPositions(bodies, &pos_x, &pos_y, &pos_z);
+            radius.resize(bodies.size());
+            if (bodies.size() > 0)
+                std::memcpy(radius.data(), bodies.radius.data(), bodies.size() * sizeof(float));
+            ids.assign(bodies.ids.begin(), bodies.ids.end());
+            if (ids != previous_ids)
+                remapPrevious();
+            this->time = time;
+            this->step = step;
+        }
+
+    private:
+        // Bodies were added, removed or reordered in between, so the same index may hold another
+        // body in each state. Bodies in both keep their previous position, new ones start where
+        // they are now.
+        void remapPrevious() {
+            previous_index.clear();
+            for (size_t j = 0; j < previous_ids.size(); j++)
+                previous_index[previous_ids[j]] = j;
+            AlignedArray<float>* previous[] = {&prev_x, &prev_y, &prev_z};
+            const AlignedArray<float>* current[] = {&pos_x, &pos_y, &pos_z};
+            for (int a = 0; a < 3; a++) {
+                remapped[a].resize(ids.size());
+                for (size_t i = 0; i < ids.size(); i++) {
+                    auto found = previous_index.find(ids[i]);
+                    remapped[a][i] = found != previous_index.end() ? (*previous[a])[found->second] : (*current[a])[i];
+                }
+                *previous[a] = remapped[a];
+            }
+            previous_ids = ids;
+        }
+
+        static void copyPositions(const BodyStore& bodies, AlignedArray<float>* x, AlignedArray<float>* y, AlignedArray<float>* z) {
+            size_t n = bodies.size();
+            AlignedArray<float>* arrays[] = {x, y, z};
+            const AlignedArray<float>* sources[] = {&bodies.pos_x, &bodies.pos_y, &bodies.pos_z};
+            for (int a = 0; a < 3; a++) {
+                arrays[a]->resize(n);
+                if (n > 0)
+                    std::memcpy(arrays[a]->data(), sources[a]->data(), n * sizeof(float));
+            }
+        }
+};
+
+#endif
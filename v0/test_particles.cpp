@@ -0,0 +1,372 @@
+#ifndef TEST_PARTICLES_CPP
+#define TEST_PARTICLES_CPP
+
+#ifndef MAIN_CPP
+#define MAIN_CPP
+#define TEST_PARTICLES_MAIN_CPP
+#endif
+
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "bodies.cpp"
+#include "parallel.cpp"
+#include "gravity.cpp"
+#include "kepler.cpp"
+
+// class ----------------------------------------------------------------------------------------------
+
+// Massless test particles, such as belt asteroids, ring particles or debris: they feel the massive
+// bodies of a simulation but neither each other nor pull on anything, so a step costs
+// O(N_massive * N_test) instead of O(N^2) and a handful of planets can carry millions of them.
+//
+// The particles live in a BodyStore of their own, whose masses are ignored, and their forces come
+// from the tiled gravity kernel with the particles as targets and the massive store as sources, in
+// chunks of BODY_PADDING particles spread over the job system. They move by kick-drift-kick leapfrog
+// around the step of the massive bodies: openStep() before it kicks with the forces of the last
+// step and drifts, closeStep() after it evaluates the forces of the new positions and kicks again.
+//
+// With kepler_threshold set, particles whose acceleration strays from the pull of the heaviest body
+// by less than that fraction leave the leapfrog and follow their Kepler orbit around it instead,
+// solved for all of them at once by keplerDriftBatch. Their step is then exact whatever its length,
+// so satellites or asteroids far from everything else cost one Kepler solve each under any time
+// warp. They return to the leapfrog once the perturbation passes the threshold and come back when
+// it drops below half of it again, which keeps particles near the limit from switching every step.
+class TestParticles {
+    public:
+        BodyStore particles;
+        SimdLevel simd_level;
+        // largest relative perturbation for Kepler orbits, 0 keeps every particle on the leapfrog
+        float kepler_threshold = 0.0f;
+
+    private:
+        // the accelerations in the store belong to the current positions
+        bool forces_current = false;
+        // per particle, whether it follows its Kepler orbit
+        std::vector<uint8_t> on_kepler;
+        // the Kepler particles of the step under way with their state relative to the central body
+        std::vector<size_t> kepler_index;
+        std::vector<double> kepler_state[6];
+        std::vector<double> kepler_mu;
+        // 1 for the orbits keplerDriftBatch gave up on
+        std::vector<uint8_t> kepler_failed;
+        // the body the Kepler orbits go around, by handle since collisions and spawns between
+        // classify() and the end of a step move bodies around the store
+        BodyStore::BodyID central_id = BodyStore::NO_BODY;
+
+    public:
+        TestParticles() {
+            simd_level = detectSimdLevel();
+        }
+
+        size_t size() const { return particles.size(); }
+
+        BodyStore::BodyID addParticle(glm::vec3 pos, glm::vec3 vel = glm::vec3(0.0f)) {
+            forces_current = false;
+            return particles.addBody(pos, vel, 0.0f);
+        }
+
+        void reset() { forces_current = false; }
+
+        // particles currently on Kepler orbits
+        size_t keplerCount() const {
+            size_t count = 0;
+            for (size_t i = 0; i < size() && i < on_kepler.size(); i++)
+                count += on_kepler[i];
+            return count;
+        }
+
+        // acc_x/y/z of the particles from the gravity of every body in massive
+        void computeAccelerations(const BodyStore& massive, float G, float softening) {
+            GravityKernels kernels = selectGravityKernels(simd_level);
+            size_t n = massive.paddedSize();
+            float eps2 = softening * softening;
+            parallelFor(particles.paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                size_t first = begin * BODY_PADDING, last = end * BODY_PADDING;
+                float* ax = particles.acc_x.data();
+                float* ay = particles.acc_y.data();
+                float* az = particles.acc_z.data();
+                std::memset((void*)(ax + first), 0, (last - first) * sizeof(float));
+                std::memset((void*)(ay + first), 0, (last - first) * sizeof(float));
+                std::memset((void*)(az + first), 0, (last - first) * sizeof(float));
+                kernels.tiled(particles.pos_x.data(), particles.pos_y.data(), particles.pos_z.data(), first, last,
+                              massive.pos_x.data(), massive.pos_y.data(), massive.pos_z.data(), massive.mass.data(), n,
+                              eps2, ax, ay, az);
+                for (size_t i = first; i < last; i++) {
+                    ax[i] *= G;
+                    ay[i] *= G;
+                    az[i] *= G;
+                }
+            }, 64);
+            forces_current = true;
+        }
+
+        // first half of a step of dt, with massive still where the step starts
+        void openStep(const BodyStore& massive, const ForceSolver& solver, float dt) {
+            if (size() == 0)
+                return;
+            if (!forces_current) {
+                computeAccelerations(massive, solver.G, solver.softening);
+                classify(massive, solver.G);
+            }
+            gatherKepler(massive, solver.G);
+            // Kepler particles go through the leapfrog as well, closeStep() overwrites them
+            parallelFor(particles.paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                particles.kick(0.5f * dt, begin * BODY_PADDING, end * BODY_PADDING);
+                particles.drift(dt, begin * BODY_PADDING, end * BODY_PADDING);
+            }, 256);
+            forces_current = false;
+        }
+
+        // second half, with massive moved to the end of the step
+        void closeStep(const BodyStore& massive, const ForceSolver& solver, float dt) {
+            if (size() == 0)
+                return;
+            size_t count = kepler_index.size();
+            size_t central = massive.indexOf(central_id);
+            if (count > 0 && central == BodyStore::NO_INDEX) {
+                // the central body is gone, its orbits keep the leapfrog step they took
+                for (size_t i : kepler_index)
+                    on_kepler[i] = 0;
+                count = 0;
+            }
+            if (count > 0) {
+                kepler_failed.resize(count);
+                parallelFor(count, [&](size_t begin, size_t end, unsigned int) {
+                    double* pieces[6];
+                    for (int d = 0; d < 6; d++)
+                        pieces[d] = kepler_state[d].data() + begin;
+                    keplerDriftBatch(kepler_mu.data() + begin, pieces, end - begin, dt, kepler_failed.data() + begin);
+                    glm::dvec3 center = glm::dvec3(massive.getPosition(central));
+                    for (size_t k = begin; k < end; k++) {
+                        // an orbit the solver gave up on is left as it was and keeps its leapfrog step
+                        if (kepler_failed[k]) {
+                            on_kepler[kepler_index[k]] = 0;
+                            continue;
+                        }
+                        particles.setPosition(kepler_index[k], glm::vec3(center + glm::dvec3(kepler_state[0][k], kepler_state[1][k], kepler_state[2][k])));
+                    }
+                }, 1024);
+            }
+            computeAccelerations(massive, solver.G, solver.softening);
+            parallelFor(particles.paddedSize() / BODY_PADDING, [&](size_t begin, size_t end, unsigned int) {
+                particles.kick(0.5f * dt, begin * BODY_PADDING, end * BODY_PADDING);
+            }, 256);
+            if (count > 0) {
+                glm::dvec3 center = glm::dvec3(massive.getVelocity(central));
+                parallelFor(count, [&](size_t begin, size_t end, unsigned int) {
+                    for (size_t k = begin; k < end; k++)
+                        if (on_kepler[kepler_index[k]])
+                            particles.setVelocity(kepler_index[k], glm::vec3(center + glm::dvec3(kepler_state[3][k], kepler_state[4][k], kepler_state[5][k])));
+                }, 1024);
+            }
+            classify(massive, solver.G);
+        }
+
+    private:
+        // moves particles between the leapfrog and their Kepler orbits by the perturbation of the
+        // accelerations in the store relative to the unsoftened pull of the heaviest body
+        void classify(const BodyStore& massive, double G) {
+            on_kepler.resize(size(), 0);
+            if (kepler_threshold <= 0.0f || massive.size() == 0) {
+                std::fill(on_kepler.begin(), on_kepler.end(), 0);
+                return;
+            }
+            size_t central = 0;
+            for (size_t j = 1; j < massive.size(); j++)
+                if (massive.mass[j] > massive.mass[central])
+                    central = j;
+            central_id = massive.ids[central];
+            // the central body feels the others too, and the particles with it
+            glm::dvec3 center = glm::dvec3(massive.getPosition(central)), center_acc = glm::dvec3(0.0);
+            for (size_t j = 0; j < massive.size(); j++) {
+                if (j == central)
+                    continue;
+                glm::dvec3 d = glm::dvec3(massive.getPosition(j)) - center;
+                double r2 = glm::dot(d, d);
+                center_acc += G * massive.mass[j] * d / (r2 * std::sqrt(r2));
+            }
+            double mu = G * massive.mass[central], threshold = kepler_threshold;
+            parallelFor(size(), [&](size_t begin, size_t end, unsigned int) {
+                for (size_t i = begin; i < end; i++) {
+                    glm::dvec3 d = glm::dvec3(particles.getPosition(i)) - center;
+                    double r2 = glm::dot(d, d);
+                    glm::dvec3 two_body = -mu * d / (r2 * std::sqrt(r2));
+                    glm::dvec3 relative = glm::dvec3(particles.getAcceleration(i)) - center_acc;
+                    double perturbation = glm::length(relative - two_body) / glm::length(two_body);
+                    // nan, from a particle on the central body, fails both comparisons and leaves it as it is
+                    if (on_kepler[i] && perturbation > threshold)
+                        on_kepler[i] = 0;
+                    else if (!on_kepler[i] && perturbation < 0.5 * threshold)
+                        on_kepler[i] = 1;
+                }
+            }, 4096);
+        }
+
+        // records the state of the Kepler particles relative to the central body at the start of a step
+        void gatherKepler(const BodyStore& massive, double G) {
+            kepler_index.clear();
+            if (kepler_threshold <= 0.0f)
+                return;
+            size_t central = massive.indexOf(central_id);
+            if (central == BodyStore::NO_INDEX) {
+                // removed since the last classify(), the next one picks a new central body
+                std::fill(on_kepler.begin(), on_kepler.end(), 0);
+                return;
+            }
+            for (size_t i = 0; i < size(); i++)
+                if (on_kepler[i])
+                    kepler_index.push_back(i);
+            size_t count = kepler_index.size();
+            for (std::vector<double>& array : kepler_state)
+                array.resize(count);
+            kepler_mu.assign(count, G * massive.mass[central]);
+            glm::dvec3 center = glm::dvec3(massive.getPosition(central)), center_vel = glm::dvec3(massive.getVelocity(central));
+            parallelFor(count, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t k = begin; k < end; k++) {
+                    glm::dvec3 x = glm::dvec3(particles.getPosition(kepler_index[k])) - center;
+                    glm::dvec3 v = glm::dvec3(particles.getVelocity(kepler_index[k])) - center_vel;
+                    for (int d = 0; d < 3; d++) {
+                        kepler_state[d][k] = x[d];
+                        kepler_state[3 + d][k] = v[d];
+                    }
+                }
+            }, 4096);
+        }
+};
+
+// test -----------------------------------------------------------------------------------------------
+#ifdef TEST_PARTICLES_MAIN_CPP
+#include <chrono>
+#include <random>
+
+#include "integrators.cpp"
+
+int main() {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    // the same accelerations as zero mass bodies summed with everything else, for every kernel
+    BodyStore planets;
+    planets.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    planets.addBody(glm::vec3(5.2f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f / std::sqrt(5.2f), 0.0f), 1e-3f);
+    planets.addBody(glm::vec3(0.0f, -9.5f, 0.0f), glm::vec3(1.0f / std::sqrt(9.5f), 0.0f, 0.0f), 3e-4f);
+    BodyStore combined = planets;
+    TestParticles belt;
+    for (size_t i = 0; i < 1000; i++) {
+        float r = 2.1f + 1.2f * uniform(rng), phi = 6.2831853f * uniform(rng);
+        glm::vec3 pos = glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.05f * (uniform(rng) - 0.5f));
+        glm::vec3 vel = glm::vec3(-std::sin(phi), std::cos(phi), 0.0f) / std::sqrt(r);
+        belt.addParticle(pos, vel);
+        combined.addBody(pos, vel, 0.0f);
+    }
+    DirectSolver direct = DirectSolver(1.0f, 0.0f);
+    direct.computeAccelerations(&combined);
+    SimdLevel levels[] = {SIMD_SCALAR, SIMD_SSE, SIMD_AVX2, SIMD_AVX512};
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        belt.simd_level = level;
+        belt.computeAccelerations(planets, 1.0f, 0.0f);
+        double worst = 0.0;
+        for (size_t i = 0; i < belt.size(); i++) {
+            glm::vec3 expected = combined.getAcceleration(planets.size() + i);
+            worst = std::fmax(worst, glm::length(belt.particles.getAcceleration(i) - expected) / glm::length(expected));
+        }
+        std::cout << simdLevelName(level) << ": max relative error " << worst << std::endl;
+        if (worst > 1e-5) {
+            std::cerr << simdLevelName(level) << " test particle accelerations differ from direct summation" << std::endl;
+            return FAILURE;
+        }
+    }
+    belt.simd_level = detectSimdLevel();
+
+    auto start = std::chrono::steady_clock::now();
+
+    // a ring stays a ring over an orbit of the planets, with the particles stepped around them
+    SplittingIntegrator leapfrog;
+    const float dt = 0.01f;
+    for (int s = 0; s < 1200; s++) {
+        belt.openStep(planets, direct, dt);
+        leapfrog.step(&planets, &direct, dt);
+        belt.closeStep(planets, direct, dt);
+    }
+    double worst_drift = 0.0;
+    for (size_t i = 0; i < belt.size(); i++) {
+        glm::vec3 p = belt.particles.getPosition(i), v = belt.particles.getVelocity(i);
+        // specific orbital energy around the sun, nearly conserved this far inside the planet
+        double energy = 0.5 * glm::dot(v, v) - 1.0 / glm::length(p);
+        worst_drift = std::fmax(worst_drift, std::fabs(energy * 2.0 * glm::length(p) + 1.0));
+    }
+    std::cout << "belt after 12 time units: worst relative change of orbital energy " << worst_drift << std::endl;
+    if (worst_drift > 0.05) {
+        std::cerr << "test particles were thrown off their orbits" << std::endl;
+        return FAILURE;
+    }
+
+    // satellites far from the planet follow their Kepler orbits under any time warp, one solve each
+    // per step, while those passing close to it stay on the leapfrog
+    BodyStore star;
+    star.addBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0f);
+    star.addBody(glm::vec3(30.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f / std::sqrt(30.0f), 0.0f), 1e-9f);
+    TestParticles satellites;
+    satellites.kepler_threshold = 1e-3f;
+    const size_t satellite_count = 100000;
+    satellites.particles.reserve(satellite_count + 1);
+    for (size_t i = 0; i < satellite_count; i++) {
+        float r = 1.0f + uniform(rng), phi = 6.2831853f * uniform(rng), boost = 1.0f + 0.2f * uniform(rng);
+        satellites.addParticle(glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.1f * (uniform(rng) - 0.5f)),
+                               boost * glm::vec3(-std::sin(phi), std::cos(phi), 0.0f) / std::sqrt(r));
+    }
+    satellites.addParticle(glm::vec3(30.001f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f / std::sqrt(30.0f), 0.0f));
+    std::vector<glm::dvec3> expected_pos(satellite_count), expected_vel(satellite_count);
+    const float warp = 1000.0f;
+    for (size_t i = 0; i < satellite_count; i++) {
+        expected_pos[i] = glm::dvec3(satellites.particles.getPosition(i));
+        expected_vel[i] = glm::dvec3(satellites.particles.getVelocity(i));
+        keplerDrift(1.0, &expected_pos[i], &expected_vel[i], warp);
+    }
+    DirectSolver unsoftened = DirectSolver(1.0f, 0.0f);
+    start = std::chrono::steady_clock::now();
+    satellites.openStep(star, unsoftened, warp);
+    size_t on_kepler = satellites.keplerCount();
+    // the star stays put, the planet would be stepped here
+    satellites.closeStep(star, unsoftened, warp);
+    double warp_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    double worst_miss = 0.0;
+    for (size_t i = 0; i < satellite_count; i++)
+        worst_miss = std::fmax(worst_miss, glm::length(glm::dvec3(satellites.particles.getPosition(i)) - expected_pos[i]));
+    std::cout << on_kepler << " of " << satellites.size() << " satellites on Kepler orbits, " << warp
+              << " time units in one step of " << warp_ms << " ms, worst miss " << worst_miss << std::endl;
+    if (on_kepler != satellite_count || !(worst_miss < 1e-4)) {
+        std::cerr << "satellites do not follow their Kepler orbits" << std::endl;
+        return FAILURE;
+    }
+
+    // a million particles around three bodies cost about as much as a few thousand full bodies
+    TestParticles ring;
+    ring.particles.reserve(1 << 20);
+    for (size_t i = 0; i < (1 << 20); i++) {
+        float r = 2.0f + uniform(rng), phi = 6.2831853f * uniform(rng);
+        ring.addParticle(glm::vec3(r * std::cos(phi), r * std::sin(phi), 0.0f), glm::vec3(-std::sin(phi), std::cos(phi), 0.0f) / std::sqrt(r));
+    }
+    start = std::chrono::steady_clock::now();
+    const int steps = 10;
+    for (int s = 0; s < steps; s++) {
+        ring.openStep(planets, direct, dt);
+        ring.closeStep(planets, direct, dt);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / steps;
+    std::cout << ring.size() << " particles around " << planets.size() << " bodies: " << ms << " ms per step, "
+              << ring.size() / ms * 1e-3 << " million particle-steps/s on " << workerCount() << " workers" << std::endl;
+
+    std::cout << "The program completed successfully!" << std::endl;
+    return SUCCESS;
+}
+#endif
+
+#endif